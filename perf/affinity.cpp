@@ -0,0 +1,130 @@
+/*
+    Copyright (c) 2013 Contributors as noted in the AUTHORS file
+
+    This file is part of StreamQ-Proxy.
+
+    StreamQ-Proxy is free software; you can redistribute it and/or modify it
+    under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    StreamQ-Proxy is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+//  Warm restart of the affinity store (config.affinity_path): how long the
+//  proxy takes to load it, and how many of the clients find their worker
+//  host again.
+//
+//  Usage: affinity [path] [entries] [slots] [worker-hosts]
+//
+//  A new store gets one client host per entry, each with a worker host
+//  among worker-hosts, as the proxy would write them. The store is then
+//  closed, its pages dropped from the page cache, and opened again like a
+//  restarted proxy does; every client is looked up, and a hit is a client
+//  that gets the worker host it was given.
+
+#include "../src/affinity.hpp"
+#include "../src/clock.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+
+static uint64_t
+host_key (const char *prefix_, uint32_t host_)
+{
+    char address [32];
+    int size = sprintf (address, "%s%u.%u.%u", prefix_,
+        (host_ >> 16) & 0xff, (host_ >> 8) & 0xff, host_ & 0xff);
+    return affinity_key (address, size);
+}
+
+//  Write the dirty pages out and drop them, so that the restart is cold
+static void
+drop_cache (const char *path_)
+{
+    int fd = open (path_, O_RDONLY);
+    assert (fd >= 0);
+    int rc = fdatasync (fd);
+    assert (rc == 0);
+    rc = posix_fadvise (fd, 0, 0, POSIX_FADV_DONTNEED);
+    if (rc != 0)
+        fprintf (stderr, "Warning : cannot drop the cache of %s\n", path_);
+    close (fd);
+}
+
+int main (int argc, char *argv [])
+{
+    const char *path = argc > 1 ? argv [1] : "/tmp/streamq-proxy.affinity";
+    long qt_entries = argc > 2 ? atol (argv [2]) : 1000000;
+    long qt_slots = argc > 3 ? atol (argv [3]) : 2 * qt_entries;
+    int qt_worker_hosts = argc > 4 ? atoi (argv [4]) : 256;
+    if (qt_entries < 1 || qt_entries > 0xffffff || qt_slots < qt_entries || qt_worker_hosts < 1) {
+        fprintf (stderr, "usage: affinity [path] [entries] [slots] [worker-hosts]\n");
+        return 1;
+    }
+
+    std::vector <uint64_t> workers (qt_worker_hosts);
+    for (int w = 0; w < qt_worker_hosts; w++)
+        workers [w] = host_key ("192.", w);
+    std::vector <uint64_t> clients (qt_entries);
+    std::vector <uint64_t> assigned (qt_entries);
+
+    //  First run
+    unlink (path);
+    affinity_t affinity;
+    uint64_t start = now_nsec ();
+    int rc = affinity.open (path, qt_slots);
+    assert (rc == 0);
+    uint64_t create = now_nsec () - start;
+    srand (1);
+    start = now_nsec ();
+    for (long i = 0; i < qt_entries; i++) {
+        clients [i] = host_key ("10.", (uint32_t) i);
+        assigned [i] = workers [rand () % qt_worker_hosts];
+        affinity.update (clients [i], assigned [i]);
+    }
+    uint64_t updates = now_nsec () - start;
+    affinity.close ();
+    drop_cache (path);
+
+    //  Restart
+    start = now_nsec ();
+    rc = affinity.open (path, qt_slots);
+    assert (rc == 0);
+    uint64_t startup = now_nsec () - start;
+    long qt_hits = 0;
+    start = now_nsec ();
+    for (long i = 0; i < qt_entries; i++)
+        qt_hits += affinity.find (clients [i]) == assigned [i];
+    uint64_t lookups = now_nsec () - start;
+    //  Then with the pages in memory, as once the proxy has run a while
+    start = now_nsec ();
+    long qt_warm_hits = 0;
+    for (long i = 0; i < qt_entries; i++)
+        qt_warm_hits += affinity.find (clients [i]) == assigned [i];
+    uint64_t warm_lookups = now_nsec () - start;
+
+    struct stat st;
+    rc = stat (path, &st);
+    assert (rc == 0);
+    printf ("store: %llu slots, %llu entries, %llu bytes\n",
+        (unsigned long long) affinity.capacity (), (unsigned long long) affinity.entries (),
+        (unsigned long long) st.st_size);
+    printf ("create: %.1f usec, update: %.1f nsec/client\n",
+        create / 1e3, (double) updates / qt_entries);
+    printf ("restart: open %.1f usec, hit rate %.4f%% (%ld of %ld)\n",
+        startup / 1e3, 100.0 * qt_hits / qt_entries, qt_hits, qt_entries);
+    printf ("lookup: %.1f nsec/client cold, %.1f nsec/client warm\n",
+        (double) lookups / qt_entries, (double) warm_lookups / qt_entries);
+    assert (qt_warm_hits == qt_hits);
+    affinity.close ();
+    unlink (path);
+    return 0;
+}
@@ -0,0 +1,302 @@
+/*
+    Copyright (c) 2013 Contributors as noted in the AUTHORS file
+
+    This file is part of StreamQ-Proxy.
+
+    StreamQ-Proxy is free software; you can redistribute it and/or modify it
+    under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    StreamQ-Proxy is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+//  Tail latency behind heterogeneous workers, the new sessions balanced
+//  over the worker hosts by oldest idle connection, by least sessions, and
+//  by power of two choices over the host load.
+//
+//  Usage: balance [oldest|least|two|all] [clients] [seconds] [slow-hosts] [slow-factor] [think-usec]
+//
+//  There are QT_HOSTS worker hosts. Each one connects QT_HOST_CONNECTIONS
+//  CURVE server_worker sockets from its own loopback address (127.0.0.2,
+//  127.0.0.3... which Linux routes to lo), so that the proxy sees distinct
+//  hosts, and serves them from one thread, a request at a time, as a host
+//  with one core would: SERVICE_TIME usec per request, slow-factor times
+//  more on the slow hosts. The clients open CURVE sessions of REQUESTS
+//  round trips, thinking between two of them, and wait in the waiting room
+//  when no worker connection is idle; the round trips are recorded after a
+//  warmup second. Without thinking, every host that has a session is busy
+//  all the time whatever the balancing, and it only decides who waits.
+
+#include "../include/zmq.h"
+#include "../include/zmq_utils.h"
+#include "../src/proxy.hpp"
+#include "../src/clock.hpp"
+#include "../src/histogram.hpp"
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <vector>
+
+#define KEY_SIZE 40
+#define QT_HOSTS 4
+#define QT_HOST_CONNECTIONS 16
+#define SERVICE_TIME 500            //  usec per request on a fast host
+#define REQUESTS 10                 //  round trips per session
+#define REQUEST_SIZE 64
+#define WARMUP 1000000              //  usec
+
+static char client_pub [KEY_SIZE + 1], client_sec [KEY_SIZE + 1];
+static char worker_pub [KEY_SIZE + 1], worker_sec [KEY_SIZE + 1];
+
+static const char *frontend_endpoint = "tcp://127.0.0.1:9999";
+
+static int qt_clients = 32;
+static int seconds = 10;
+static int qt_slow_hosts = 1;
+static int slow_factor = 8;
+static int think_time = 5000;       //  usec
+static int stop;
+static uint64_t measure_from;       //  usec
+
+typedef struct {
+    void *ctx;
+    int host;                       //  0 for 127.0.0.2
+    int service_time;               //  usec
+    uint64_t served;                //  requests after warmup
+} host_args_t;
+
+typedef struct {
+    void *ctx;
+    histogram_t rtt;                //  usec
+    uint64_t sessions;
+    uint64_t failed;                //  round trips with no reply
+} client_args_t;
+
+static void
+proxy_task (void *proxy)
+{
+    int rc = ((proxy_t *) proxy)->run ();
+    assert (rc == 0);
+}
+
+static void
+service (int usec)
+{
+    struct timespec ts = { 0, (long) usec * 1000 };
+    while (nanosleep (&ts, &ts) < 0)
+        ;
+}
+
+//  The server_worker of tests/test_curve_proxying, on all the connections
+//  of a host
+static void
+host_task (void *arg)
+{
+    host_args_t *args = (host_args_t *) arg;
+    char endpoint [64];
+    sprintf (endpoint, "tcp://127.0.0.%d:0;127.0.0.1:9998", args->host + 2);
+    zmq_pollitem_t items [QT_HOST_CONNECTIONS];
+    for (int i = 0; i < QT_HOST_CONNECTIONS; i++) {
+        void *worker = zmq_socket (args->ctx, ZMQ_DEALER);
+        assert (worker);
+        int as_server = 1;
+        int rc = zmq_setsockopt (worker, ZMQ_CURVE_SERVER, &as_server, sizeof (int));
+        assert (rc == 0);
+        rc = zmq_setsockopt (worker, ZMQ_CURVE_SECRETKEY, worker_sec, KEY_SIZE);
+        assert (rc == 0);
+        int linger = 0;
+        rc = zmq_setsockopt (worker, ZMQ_LINGER, &linger, sizeof (int));
+        assert (rc == 0);
+        int reconnect = 10;
+        rc = zmq_setsockopt (worker, ZMQ_RECONNECT_IVL, &reconnect, sizeof (int));
+        assert (rc == 0);
+        rc = zmq_connect (worker, endpoint);
+        assert (rc == 0);
+        items [i].socket = worker;
+        items [i].fd = 0;
+        items [i].events = ZMQ_POLLIN;
+        items [i].revents = 0;
+    }
+
+    char content [REQUEST_SIZE];
+    while (!__atomic_load_n (&stop, __ATOMIC_RELAXED)) {
+        int rc = zmq_poll (items, QT_HOST_CONNECTIONS, 100);
+        if (rc < 0)
+            break;
+        //  One request per connection and per pass, the host serving them
+        //  one after the other
+        for (int i = 0; i < QT_HOST_CONNECTIONS; i++) {
+            if (!(items [i].revents & ZMQ_POLLIN))
+                continue;
+            int size = zmq_recv (items [i].socket, content, sizeof content, ZMQ_DONTWAIT);
+            if (size < 0)
+                continue;
+            service (args->service_time);
+            zmq_send (items [i].socket, content, size, 0);
+            if (now_usec () >= measure_from)
+                args->served++;
+        }
+    }
+    for (int i = 0; i < QT_HOST_CONNECTIONS; i++)
+        zmq_close (items [i].socket);
+}
+
+static void
+client_task (void *arg)
+{
+    client_args_t *args = (client_args_t *) arg;
+    char content [REQUEST_SIZE];
+    memset (content, 'r', sizeof content);
+    while (!__atomic_load_n (&stop, __ATOMIC_RELAXED)) {
+        void *client = zmq_socket (args->ctx, ZMQ_DEALER);
+        assert (client);
+        int rc = zmq_setsockopt (client, ZMQ_CURVE_SERVERKEY, worker_pub, KEY_SIZE);
+        assert (rc == 0);
+        rc = zmq_setsockopt (client, ZMQ_CURVE_PUBLICKEY, client_pub, KEY_SIZE);
+        assert (rc == 0);
+        rc = zmq_setsockopt (client, ZMQ_CURVE_SECRETKEY, client_sec, KEY_SIZE);
+        assert (rc == 0);
+        int linger = 0;
+        rc = zmq_setsockopt (client, ZMQ_LINGER, &linger, sizeof (int));
+        assert (rc == 0);
+        int timeout = 5000;
+        rc = zmq_setsockopt (client, ZMQ_RCVTIMEO, &timeout, sizeof (int));
+        assert (rc == 0);
+        rc = zmq_connect (client, frontend_endpoint);
+        assert (rc == 0);
+
+        for (int i = 0; i < REQUESTS && !__atomic_load_n (&stop, __ATOMIC_RELAXED); i++) {
+            uint64_t start = now_usec ();
+            rc = zmq_send (client, content, sizeof content, 0);
+            assert (rc == (int) sizeof content);
+            rc = zmq_recv (client, content, sizeof content, 0);
+            if (rc < 0) {
+                args->failed++;
+                break;
+            }
+            if (start >= measure_from)
+                histogram_record (&args->rtt, now_usec () - start);
+            if (think_time)
+                usleep (think_time);
+        }
+        args->sessions++;
+        zmq_close (client);
+    }
+}
+
+static void
+run_case (const char *mode, int balance)
+{
+    void *ctx = zmq_ctx_new ();
+    assert (ctx);
+    void *control = zmq_socket (ctx, ZMQ_PUB);
+    assert (control);
+    int rc = zmq_bind (control, "inproc://control");
+    assert (rc == 0);
+
+    proxy_config_t config;
+    proxy_config_init (&config);
+    config.balance = balance;
+    config.waiting_room = qt_clients;
+    config.waiting_deadline = 0;
+    __atomic_store_n (&stop, 0, __ATOMIC_RELAXED);
+    measure_from = UINT64_MAX;
+    proxy_t *proxy = new proxy_t (ctx, config);
+    void *proxy_thread = zmq_threadstart (&proxy_task, proxy);
+
+    //  The slow hosts first, so that the oldest idle connections are theirs
+    host_args_t hosts [QT_HOSTS];
+    void *host_threads [QT_HOSTS];
+    for (int i = 0; i < QT_HOSTS; i++) {
+        hosts [i].ctx = ctx;
+        hosts [i].host = i;
+        hosts [i].service_time = i < qt_slow_hosts ? SERVICE_TIME * slow_factor : SERVICE_TIME;
+        hosts [i].served = 0;
+        host_threads [i] = zmq_threadstart (&host_task, &hosts [i]);
+        while (metrics_get (&proxy->metrics ()->workers) < (uint64_t) (i + 1) * QT_HOST_CONNECTIONS)
+            usleep (1000);
+    }
+
+    std::vector <client_args_t> clients (qt_clients);
+    std::vector <void *> client_threads (qt_clients);
+    measure_from = now_usec () + WARMUP;
+    for (int i = 0; i < qt_clients; i++) {
+        clients [i].ctx = ctx;
+        histogram_init (&clients [i].rtt);
+        clients [i].sessions = 0;
+        clients [i].failed = 0;
+        client_threads [i] = zmq_threadstart (&client_task, &clients [i]);
+    }
+    usleep ((useconds_t) seconds * 1000000 + WARMUP);
+    __atomic_store_n (&stop, 1, __ATOMIC_RELAXED);
+    uint64_t elapsed = now_usec () - measure_from;
+
+    histogram_t rtt;
+    histogram_init (&rtt);
+    uint64_t sessions = 0, failed = 0;
+    for (int i = 0; i < qt_clients; i++) {
+        zmq_threadclose (client_threads [i]);
+        histogram_merge (&rtt, &clients [i].rtt);
+        sessions += clients [i].sessions;
+        failed += clients [i].failed;
+    }
+    uint64_t served = 0, slow_served = 0;
+    for (int i = 0; i < QT_HOSTS; i++) {
+        zmq_threadclose (host_threads [i]);
+        served += hosts [i].served;
+        if (i < qt_slow_hosts)
+            slow_served += hosts [i].served;
+    }
+    rc = zmq_send (control, "TERMINATE", 10, 0);
+    assert (rc == 10);
+    zmq_threadclose (proxy_thread);
+    delete proxy;
+    zmq_close (control);
+    rc = zmq_ctx_term (ctx);
+    assert (rc == 0);
+
+    printf ("%-6s %llu sessions, %.0f requests/s, %.1f%% of them on the slow hosts, %llu failed\n",
+        mode, (unsigned long long) sessions, served * 1e6 / elapsed,
+        served ? 100.0 * slow_served / served : 0, (unsigned long long) failed);
+    printf ("%-6s ", mode);
+    histogram_print (&rtt, "round trip", "usec");
+}
+
+int main (int argc, char *argv [])
+{
+    const char *mode = argc > 1 ? argv [1] : "all";
+    if (strcmp (mode, "oldest") && strcmp (mode, "least") && strcmp (mode, "two")
+    &&  strcmp (mode, "all")) {
+        fprintf (stderr, "usage: balance [oldest|least|two|all] [clients] [seconds] [slow-hosts] [slow-factor] [think-usec]\n");
+        return 1;
+    }
+    if (argc > 2) qt_clients = atoi (argv [2]);
+    if (argc > 3) seconds = atoi (argv [3]);
+    if (argc > 4) qt_slow_hosts = atoi (argv [4]);
+    if (argc > 5) slow_factor = atoi (argv [5]);
+    if (argc > 6) think_time = atoi (argv [6]);
+    assert (qt_clients > 0 && seconds > 0 && think_time >= 0);
+    assert (qt_slow_hosts >= 0 && qt_slow_hosts < QT_HOSTS && slow_factor > 0);
+
+    int rc = zmq_curve_keypair (client_pub, client_sec);
+    assert (rc == 0);
+    rc = zmq_curve_keypair (worker_pub, worker_sec);
+    assert (rc == 0);
+
+    bool is_all = !strcmp (mode, "all");
+    if (is_all || !strcmp (mode, "oldest"))
+        run_case ("oldest", balance_oldest);
+    if (is_all || !strcmp (mode, "least"))
+        run_case ("least", balance_least_sessions);
+    if (is_all || !strcmp (mode, "two"))
+        run_case ("two", balance_two_choices);
+    return 0;
+}
@@ -0,0 +1,463 @@
+/*
+    Copyright (c) 2013 Contributors as noted in the AUTHORS file
+
+    This file is part of StreamQ-Proxy.
+
+    StreamQ-Proxy is free software; you can redistribute it and/or modify it
+    under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    StreamQ-Proxy is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+//  Connection storm: thousands of CURVE DEALER clients connecting at once,
+//  as after a network blip, all in one process.
+//
+//  Usage: connection_storm [proxy|direct] [clients] [threads] [wave-size] [wave-interval-ms]
+//
+//  The clients are spread over a few threads and connected in waves of
+//  wave-size clients every wave-interval-ms. Each client sends one message
+//  right after zmq_connect, and its handshake latency is the time from
+//  zmq_connect to the reply: TCP connection, CURVE handshake through the
+//  proxy, and one round trip.
+//
+//  In proxy mode the clients go through the proxy to a pool of worker
+//  connections (one per client, the proxy pairs connections one to one).
+//  In direct mode they connect to a single CURVE ROUTER echo worker, as a
+//  baseline. The CPU reported for the proxy covers its thread and the I/O
+//  threads of its context.
+
+#include "../include/zmq.h"
+#include "../include/zmq_utils.h"
+#include "../src/proxy.hpp"
+#include "../src/clock.hpp"
+#include "../src/histogram.hpp"
+
+#include <dirent.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <set>
+#include <vector>
+
+#define KEY_SIZE 40
+#define WORKERS_PER_THREAD 2048
+
+static char client_pub [KEY_SIZE + 1], client_sec [KEY_SIZE + 1];
+static char worker_pub [KEY_SIZE + 1], worker_sec [KEY_SIZE + 1];
+
+static const char *frontend_endpoint = "tcp://127.0.0.1:9999";
+static const char *backend_endpoint = "tcp://127.0.0.1:9998";
+
+static int qt_clients = 1000;
+static int qt_threads = 4;
+static int wave_size = 1000;
+static int wave_interval = 100;             //  msec
+static int timeout = 60000;                 //  msec
+static uint64_t start_time;                 //  usec, first wave
+static int stop;                            //  set to end the workers
+
+//  Thread ids of the process, to find the threads libzmq starts
+static std::set <int>
+task_list ()
+{
+    std::set <int> tasks;
+    DIR *dir = opendir ("/proc/self/task");
+    if (!dir)
+        return tasks;
+    struct dirent *entry;
+    while ((entry = readdir (dir)) != NULL)
+        if (entry->d_name [0] != '.')
+            tasks.insert (atoi (entry->d_name));
+    closedir (dir);
+    return tasks;
+}
+
+//  User and system time of a thread, in usec
+static uint64_t
+task_cpu_usec (int tid)
+{
+    char path [64];
+    sprintf (path, "/proc/self/task/%d/stat", tid);
+    FILE *file = fopen (path, "r");
+    if (!file)
+        return 0;
+    char line [1024];
+    char *rc = fgets (line, sizeof line, file);
+    fclose (file);
+    if (!rc)
+        return 0;
+    //  The command name may contain spaces: fields restart after ')'
+    char *fields = strrchr (line, ')');
+    if (!fields)
+        return 0;
+    unsigned long utime = 0, stime = 0;
+    sscanf (fields + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+        &utime, &stime);
+    return (uint64_t) (utime + stime) * 1000000 / sysconf (_SC_CLK_TCK);
+}
+
+static uint64_t
+tasks_cpu_usec (const std::set <int> &tasks)
+{
+    uint64_t usec = 0;
+    for (std::set <int>::const_iterator it = tasks.begin (); it != tasks.end (); ++it)
+        usec += task_cpu_usec (*it);
+    return usec;
+}
+
+static uint64_t
+process_cpu_usec ()
+{
+    struct rusage usage;
+    getrusage (RUSAGE_SELF, &usage);
+    return (uint64_t) (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000
+        + usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+
+static void
+proxy_task (void *proxy)
+{
+    int rc = ((proxy_t *) proxy)->run ();
+    assert (rc == 0);
+}
+
+//  A worker thread owns many DEALER connections to the proxy backend, and
+//  echoes whatever it receives on each of them.
+typedef struct {
+    void *ctx;
+    int count;
+} worker_args_t;
+
+static void
+worker_task (void *arg)
+{
+    worker_args_t *args = (worker_args_t *) arg;
+    std::vector <zmq_pollitem_t> items (args->count);
+    int as_server = 1;
+    int linger = 0;
+    for (int i = 0; i < args->count; i++) {
+        void *worker = zmq_socket (args->ctx, ZMQ_DEALER);
+        assert (worker);
+        int rc = zmq_setsockopt (worker, ZMQ_CURVE_SERVER, &as_server, sizeof (int));
+        assert (rc == 0);
+        rc = zmq_setsockopt (worker, ZMQ_CURVE_SECRETKEY, worker_sec, KEY_SIZE);
+        assert (rc == 0);
+        rc = zmq_setsockopt (worker, ZMQ_LINGER, &linger, sizeof (int));
+        assert (rc == 0);
+        rc = zmq_connect (worker, backend_endpoint);
+        assert (rc == 0);
+        zmq_pollitem_t item = { worker, 0, ZMQ_POLLIN, 0 };
+        items [i] = item;
+    }
+
+    char content [256];
+    while (!__atomic_load_n (&stop, __ATOMIC_RELAXED)) {
+        int rc = zmq_poll (&items [0], (int) items.size (), 100);
+        if (rc < 0)
+            break;
+        for (size_t i = 0; i < items.size () && rc > 0; i++) {
+            if (!(items [i].revents & ZMQ_POLLIN))
+                continue;
+            rc--;
+            int size = zmq_recv (items [i].socket, content, sizeof content, ZMQ_DONTWAIT);
+            if (size >= 0)
+                zmq_send (items [i].socket, content, size, ZMQ_DONTWAIT);
+        }
+    }
+    for (size_t i = 0; i < items.size (); i++)
+        zmq_close (items [i].socket);
+}
+
+//  The direct baseline: a single CURVE ROUTER serving every client
+static void
+router_task (void *ctx)
+{
+    void *router = zmq_socket (ctx, ZMQ_ROUTER);
+    assert (router);
+    int as_server = 1;
+    int rc = zmq_setsockopt (router, ZMQ_CURVE_SERVER, &as_server, sizeof (int));
+    assert (rc == 0);
+    rc = zmq_setsockopt (router, ZMQ_CURVE_SECRETKEY, worker_sec, KEY_SIZE);
+    assert (rc == 0);
+    int backlog = 4096;
+    rc = zmq_setsockopt (router, ZMQ_BACKLOG, &backlog, sizeof (int));
+    assert (rc == 0);
+    rc = zmq_bind (router, frontend_endpoint);
+    assert (rc == 0);
+
+    zmq_pollitem_t items [] = { { router, 0, ZMQ_POLLIN, 0 } };
+    char identity [256];
+    char content [256];
+    while (!__atomic_load_n (&stop, __ATOMIC_RELAXED)) {
+        rc = zmq_poll (items, 1, 100);
+        if (rc < 0)
+            break;
+        if (!(items [0].revents & ZMQ_POLLIN))
+            continue;
+        int id_size = zmq_recv (router, identity, sizeof identity, 0);
+        int size = zmq_recv (router, content, sizeof content, 0);
+        if (id_size > 0 && size >= 0) {
+            zmq_send (router, identity, id_size, ZMQ_SNDMORE);
+            zmq_send (router, content, size, 0);
+        }
+    }
+    int linger = 0;
+    zmq_setsockopt (router, ZMQ_LINGER, &linger, sizeof (int));
+    zmq_close (router);
+}
+
+//  A client thread connects its share of each wave and waits for the replies
+typedef struct {
+    void *ctx;
+    int index;
+    std::vector <void *> sockets;
+    histogram_t latency;        //  usec
+    int completed;
+    uint64_t last_reply;        //  usec
+} client_args_t;
+
+static void
+client_task (void *arg)
+{
+    client_args_t *args = (client_args_t *) arg;
+    histogram_init (&args->latency);
+    args->completed = 0;
+    args->last_reply = 0;
+
+    std::vector <zmq_pollitem_t> items;
+    std::vector <uint64_t> connected_at;
+    int qt_waves = (qt_clients + wave_size - 1) / wave_size;
+    int wave = 0;
+    int linger = 0;
+
+    while (true) {
+        uint64_t now = now_usec ();
+        //  Connect the waves that are due
+        while (wave < qt_waves && now >= start_time + (uint64_t) wave * wave_interval * 1000) {
+            int first = wave * wave_size;
+            int last = first + wave_size < qt_clients ? first + wave_size : qt_clients;
+            for (int i = first; i < last; i++) {
+                if (i % qt_threads != args->index)
+                    continue;
+                void *client = zmq_socket (args->ctx, ZMQ_DEALER);
+                assert (client);
+                int rc = zmq_setsockopt (client, ZMQ_CURVE_SERVERKEY, worker_pub, KEY_SIZE);
+                assert (rc == 0);
+                rc = zmq_setsockopt (client, ZMQ_CURVE_PUBLICKEY, client_pub, KEY_SIZE);
+                assert (rc == 0);
+                rc = zmq_setsockopt (client, ZMQ_CURVE_SECRETKEY, client_sec, KEY_SIZE);
+                assert (rc == 0);
+                rc = zmq_setsockopt (client, ZMQ_LINGER, &linger, sizeof (int));
+                assert (rc == 0);
+                connected_at.push_back (now_usec ());
+                rc = zmq_connect (client, frontend_endpoint);
+                assert (rc == 0);
+                //  Queued until the handshake is done
+                rc = zmq_send (client, &i, sizeof i, 0);
+                assert (rc == sizeof i);
+                args->sockets.push_back (client);
+                zmq_pollitem_t item = { client, 0, ZMQ_POLLIN, 0 };
+                items.push_back (item);
+            }
+            wave++;
+        }
+        if (wave == qt_waves && items.empty ())
+            break;
+        if (now > start_time + (uint64_t) wave * wave_interval * 1000 + timeout * 1000ULL)
+            break;
+
+        int rc = zmq_poll (items.empty () ? NULL : &items [0], (int) items.size (), 1);
+        if (rc < 0)
+            break;
+        for (size_t i = 0; i < items.size () && rc > 0; ) {
+            if (!(items [i].revents & ZMQ_POLLIN)) {
+                i++;
+                continue;
+            }
+            rc--;
+            int index;
+            int size = zmq_recv (items [i].socket, &index, sizeof index, ZMQ_DONTWAIT);
+            if (size != sizeof index) {
+                i++;
+                continue;
+            }
+            uint64_t replied = now_usec ();
+            histogram_record (&args->latency, replied - connected_at [i]);
+            args->completed++;
+            args->last_reply = replied;
+            //  Done with that one, poll the others
+            items [i] = items.back ();
+            items.pop_back ();
+            connected_at [i] = connected_at.back ();
+            connected_at.pop_back ();
+        }
+    }
+}
+
+int main (int argc, char *argv [])
+{
+    if (argc > 1 && strcmp (argv [1], "proxy") && strcmp (argv [1], "direct")) {
+        fprintf (stderr, "usage: connection_storm [proxy|direct] [clients] "
+            "[threads] [wave-size] [wave-interval-ms]\n");
+        return 1;
+    }
+    bool is_direct = argc > 1 && !strcmp (argv [1], "direct");
+    if (argc > 2) qt_clients = atoi (argv [2]);
+    if (argc > 3) qt_threads = atoi (argv [3]);
+    if (argc > 4) wave_size = atoi (argv [4]);
+    if (argc > 5) wave_interval = atoi (argv [5]);
+    assert (qt_clients > 0 && qt_threads > 0 && wave_size > 0 && wave_interval >= 0);
+
+    //  Each session costs two sockets on each side of each TCP hop
+    struct rlimit limit;
+    getrlimit (RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit (RLIMIT_NOFILE, &limit);
+    rlim_t needed = (rlim_t) qt_clients * (is_direct ? 3 : 6) + 1024;
+    if (limit.rlim_cur < needed)
+        fprintf (stderr, "Warning : %llu file descriptors allowed, %llu needed\n",
+            (unsigned long long) limit.rlim_cur, (unsigned long long) needed);
+
+    int rc = zmq_curve_keypair (client_pub, client_sec);
+    assert (rc == 0);
+    rc = zmq_curve_keypair (worker_pub, worker_sec);
+    assert (rc == 0);
+
+    //  Proxy, in its own context so that its I/O threads can be measured
+    std::set <int> tasks_before = task_list ();
+    void *proxy_ctx = NULL;
+    void *control = NULL;
+    proxy_t *proxy = NULL;
+    void *proxy_thread = NULL;
+    if (!is_direct) {
+        proxy_ctx = zmq_ctx_new ();
+        assert (proxy_ctx);
+        rc = zmq_ctx_set (proxy_ctx, ZMQ_MAX_SOCKETS, 16);
+        assert (rc == 0);
+        control = zmq_socket (proxy_ctx, ZMQ_PUB);
+        assert (control);
+        rc = zmq_bind (control, "inproc://control");
+        assert (rc == 0);
+        proxy_config_t config;
+        proxy_config_init (&config);
+        config.frontend = frontend_endpoint;
+        config.backend = backend_endpoint;
+        config.backlog = 4096;
+        proxy = new proxy_t (proxy_ctx, config);
+        proxy_thread = zmq_threadstart (&proxy_task, proxy);
+    }
+
+    //  The proxy thread and the threads of the proxy context
+    std::set <int> proxy_tasks;
+    std::set <int> tasks_after = task_list ();
+    for (std::set <int>::iterator it = tasks_after.begin (); it != tasks_after.end (); ++it)
+        if (!tasks_before.count (*it))
+            proxy_tasks.insert (*it);
+
+    //  Workers
+    void *worker_ctx = zmq_ctx_new ();
+    assert (worker_ctx);
+    rc = zmq_ctx_set (worker_ctx, ZMQ_MAX_SOCKETS, qt_clients + 16);
+    assert (rc == 0);
+    std::vector <void *> worker_threads;
+    std::vector <worker_args_t> worker_args ((qt_clients + WORKERS_PER_THREAD - 1) / WORKERS_PER_THREAD);
+    if (is_direct)
+        worker_threads.push_back (zmq_threadstart (&router_task, worker_ctx));
+    else {
+        for (size_t i = 0; i < worker_args.size (); i++) {
+            worker_args [i].ctx = worker_ctx;
+            worker_args [i].count = i + 1 < worker_args.size ()
+                ? WORKERS_PER_THREAD : qt_clients - (int) i * WORKERS_PER_THREAD;
+            worker_threads.push_back (zmq_threadstart (&worker_task, &worker_args [i]));
+        }
+        //  All the worker connections have to wait at the proxy first
+        uint64_t deadline = now_usec () + timeout * 1000ULL;
+        while (metrics_get (&proxy->metrics ()->workers) < (uint64_t) qt_clients) {
+            if (now_usec () > deadline) {
+                fprintf (stderr, "connection_storm: only %llu worker connections registered\n",
+                    (unsigned long long) metrics_get (&proxy->metrics ()->workers));
+                break;
+            }
+            usleep (10000);
+        }
+    }
+    usleep (100000);
+
+    //  Clients
+    void *client_ctx = zmq_ctx_new ();
+    assert (client_ctx);
+    rc = zmq_ctx_set (client_ctx, ZMQ_MAX_SOCKETS, qt_clients + 16);
+    assert (rc == 0);
+    rc = zmq_ctx_set (client_ctx, ZMQ_IO_THREADS, qt_threads);
+    assert (rc == 0);
+    std::vector <client_args_t> client_args (qt_threads);
+    std::vector <void *> client_threads (qt_threads);
+
+    uint64_t proxy_cpu = tasks_cpu_usec (proxy_tasks);
+    uint64_t process_cpu = process_cpu_usec ();
+    start_time = now_usec () + 10000;
+    for (int i = 0; i < qt_threads; i++) {
+        client_args [i].ctx = client_ctx;
+        client_args [i].index = i;
+        client_threads [i] = zmq_threadstart (&client_task, &client_args [i]);
+    }
+    for (int i = 0; i < qt_threads; i++)
+        zmq_threadclose (client_threads [i]);
+    proxy_cpu = tasks_cpu_usec (proxy_tasks) - proxy_cpu;
+    process_cpu = process_cpu_usec () - process_cpu;
+
+    //  Results
+    histogram_t latency;
+    histogram_init (&latency);
+    int completed = 0;
+    uint64_t last_reply = start_time;
+    for (int i = 0; i < qt_threads; i++) {
+        histogram_merge (&latency, &client_args [i].latency);
+        completed += client_args [i].completed;
+        if (client_args [i].last_reply > last_reply)
+            last_reply = client_args [i].last_reply;
+    }
+    double seconds = (double) (last_reply - start_time) / 1000000;
+    printf ("%s: %d clients, %d threads, waves of %d every %d ms\n",
+        is_direct ? "direct" : "proxy", qt_clients, qt_threads, wave_size, wave_interval);
+    printf ("completed %d, failed %d, in %.3f s: %.0f handshakes/s\n",
+        completed, qt_clients - completed, seconds, seconds > 0 ? completed / seconds : 0);
+    histogram_print (&latency, "handshake latency", "usec");
+    if (!is_direct)
+        printf ("proxy cpu %.3f s (%.0f%% of one core), ", (double) proxy_cpu / 1000000,
+            seconds > 0 ? (double) proxy_cpu / 10000 / seconds : 0);
+    printf ("process cpu %.3f s\n", (double) process_cpu / 1000000);
+
+    //  Clean up
+    __atomic_store_n (&stop, 1, __ATOMIC_RELAXED);
+    if (!is_direct) {
+        rc = zmq_send (control, "TERMINATE", 10, 0);
+        assert (rc == 10);
+        zmq_threadclose (proxy_thread);
+    }
+    for (size_t i = 0; i < worker_threads.size (); i++)
+        zmq_threadclose (worker_threads [i]);
+    for (int i = 0; i < qt_threads; i++)
+        for (size_t j = 0; j < client_args [i].sockets.size (); j++)
+            zmq_close (client_args [i].sockets [j]);
+    rc = zmq_ctx_term (client_ctx);
+    assert (rc == 0);
+    rc = zmq_ctx_term (worker_ctx);
+    assert (rc == 0);
+    if (!is_direct) {
+        delete proxy;
+        rc = zmq_close (control);
+        assert (rc == 0);
+        rc = zmq_ctx_term (proxy_ctx);
+        assert (rc == 0);
+    }
+    return completed == qt_clients ? 0 : 1;
+}
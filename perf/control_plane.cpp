@@ -0,0 +1,252 @@
+/*
+    Copyright (c) 2013 Contributors as noted in the AUTHORS file
+
+    This file is part of StreamQ-Proxy.
+
+    StreamQ-Proxy is free software; you can redistribute it and/or modify it
+    under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    StreamQ-Proxy is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+//  Data path latency under a control heavy load, with the control work in
+//  the forwarding thread (inline) and in a control plane thread (split).
+//
+//  Usage: control_plane [inline|split|all] [seconds] [churn-threads] [topk-interval-usec]
+//
+//  One client plays ping-pong with its worker, and its round trips are
+//  recorded, while churn threads open short sessions, one round trip each,
+//  so that workers register and clients get paired all the time, and the
+//  control socket asks for the TOPK 256 rankings every interval. The NULL
+//  mechanism is used, so that only the proxy is measured.
+
+#include "../include/zmq.h"
+#include "../include/zmq_utils.h"
+#include "../src/proxy.hpp"
+#include "../src/clock.hpp"
+#include "../src/histogram.hpp"
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <vector>
+
+#define QT_CHURN_WORKERS 64
+#define MESSAGE_SIZE 64
+#define WARMUP 1000                 //  round trips not recorded
+
+static const char *frontend_endpoint = "tcp://127.0.0.1:9999";
+static const char *backend_endpoint = "tcp://127.0.0.1:9998";
+
+static int seconds = 5;
+static int qt_churn_threads = 4;
+static int topk_interval = 1000;    //  usec
+static int stop;
+static uint64_t qt_churned;         //  sessions done by the churn threads
+static uint64_t qt_refused;         //  churn sessions with no reply
+
+static void
+proxy_task (void *proxy)
+{
+    int rc = ((proxy_t *) proxy)->run ();
+    assert (rc == 0);
+}
+
+static void *
+peer_socket (void *ctx, const char *endpoint, int timeout)
+{
+    void *socket = zmq_socket (ctx, ZMQ_DEALER);
+    assert (socket);
+    int linger = 0;
+    int rc = zmq_setsockopt (socket, ZMQ_LINGER, &linger, sizeof (int));
+    assert (rc == 0);
+    int reconnect = 10;
+    rc = zmq_setsockopt (socket, ZMQ_RECONNECT_IVL, &reconnect, sizeof (int));
+    assert (rc == 0);
+    rc = zmq_setsockopt (socket, ZMQ_RCVTIMEO, &timeout, sizeof (int));
+    assert (rc == 0);
+    rc = zmq_connect (socket, endpoint);
+    assert (rc == 0);
+    return socket;
+}
+
+//  Echoes on all its worker connections; they reconnect when the proxy
+//  closes them at the end of their session
+static void
+echo_task (void *arg)
+{
+    std::vector <zmq_pollitem_t> *items = (std::vector <zmq_pollitem_t> *) arg;
+    zmq_msg_t msg;
+    int rc = zmq_msg_init (&msg);
+    assert (rc == 0);
+    while (!__atomic_load_n (&stop, __ATOMIC_RELAXED)) {
+        rc = zmq_poll (&(*items) [0], (int) items->size (), 100);
+        if (rc < 0)
+            break;
+        for (size_t i = 0; i < items->size (); i++)
+            if ((*items) [i].revents & ZMQ_POLLIN)
+                while (zmq_msg_recv (&msg, (*items) [i].socket, ZMQ_DONTWAIT) >= 0)
+                    zmq_msg_send (&msg, (*items) [i].socket, 0);
+    }
+    zmq_msg_close (&msg);
+}
+
+static void
+churn_task (void *ctx)
+{
+    char content [MESSAGE_SIZE];
+    memset (content, 'c', sizeof content);
+    while (!__atomic_load_n (&stop, __ATOMIC_RELAXED)) {
+        void *client = peer_socket (ctx, frontend_endpoint, 1000);
+        int rc = zmq_send (client, content, sizeof content, 0);
+        assert (rc == (int) sizeof content);
+        rc = zmq_recv (client, content, sizeof content, 0);
+        __atomic_fetch_add (rc < 0 ? &qt_refused : &qt_churned, 1, __ATOMIC_RELAXED);
+        zmq_close (client);
+    }
+}
+
+typedef struct {
+    void *control;
+    void *report;
+} topk_args_t;
+
+//  Asks for the rankings, and swallows them
+static void
+topk_task (void *arg)
+{
+    topk_args_t *args = (topk_args_t *) arg;
+    char reply [256];
+    while (!__atomic_load_n (&stop, __ATOMIC_RELAXED)) {
+        int rc = zmq_send (args->control, "TOPK 256", 9, 0);
+        assert (rc == 9);
+        while (zmq_recv (args->report, reply, sizeof reply, ZMQ_DONTWAIT) >= 0)
+            ;
+        usleep (topk_interval);
+    }
+}
+
+static void
+run_case (const char *mode)
+{
+    void *ctx = zmq_ctx_new ();
+    assert (ctx);
+    void *control = zmq_socket (ctx, ZMQ_PUB);
+    assert (control);
+    int rc = zmq_bind (control, "inproc://control");
+    assert (rc == 0);
+    void *report = zmq_socket (ctx, ZMQ_SUB);
+    assert (report);
+    rc = zmq_setsockopt (report, ZMQ_SUBSCRIBE, "", 0);
+    assert (rc == 0);
+    rc = zmq_bind (report, "inproc://report");
+    assert (rc == 0);
+
+    proxy_config_t config;
+    proxy_config_init (&config);
+    config.frontend = frontend_endpoint;
+    config.backend = backend_endpoint;
+    config.report = "inproc://report";
+    config.topk = 256;
+    config.control_thread = !strcmp (mode, "split");
+    __atomic_store_n (&stop, 0, __ATOMIC_RELAXED);
+    __atomic_store_n (&qt_churned, 0, __ATOMIC_RELAXED);
+    __atomic_store_n (&qt_refused, 0, __ATOMIC_RELAXED);
+    proxy_t *proxy = new proxy_t (ctx, config);
+    void *proxy_thread = zmq_threadstart (&proxy_task, proxy);
+
+    //  The measured pair first, so that they get each other
+    void *worker = peer_socket (ctx, backend_endpoint, -1);
+    std::vector <zmq_pollitem_t> items (1);
+    items [0].socket = worker;
+    items [0].events = ZMQ_POLLIN;
+    void *worker_thread = zmq_threadstart (&echo_task, &items);
+    while (metrics_get (&proxy->metrics ()->workers) < 1)
+        usleep (1000);
+    void *client = peer_socket (ctx, frontend_endpoint, 2000);
+    char content [MESSAGE_SIZE];
+    memset (content, 'x', sizeof content);
+    rc = zmq_send (client, content, sizeof content, 0);
+    assert (rc == (int) sizeof content);
+    rc = zmq_recv (client, content, sizeof content, 0);
+    assert (rc == (int) sizeof content);
+
+    //  Then the churn
+    std::vector <zmq_pollitem_t> churn_items (QT_CHURN_WORKERS);
+    for (int i = 0; i < QT_CHURN_WORKERS; i++) {
+        churn_items [i].socket = peer_socket (ctx, backend_endpoint, -1);
+        churn_items [i].events = ZMQ_POLLIN;
+    }
+    void *churn_worker_thread = zmq_threadstart (&echo_task, &churn_items);
+    topk_args_t topk_args = { control, report };
+    void *topk_thread = zmq_threadstart (&topk_task, &topk_args);
+    std::vector <void *> churn_threads (qt_churn_threads);
+    for (int i = 0; i < qt_churn_threads; i++)
+        churn_threads [i] = zmq_threadstart (&churn_task, ctx);
+
+    histogram_t rtt;                //  nsec
+    histogram_init (&rtt);
+    uint64_t end = now_usec () + (uint64_t) seconds * 1000000;
+    for (int i = 0; now_usec () < end; i++) {
+        uint64_t start = now_nsec ();
+        rc = zmq_send (client, content, sizeof content, 0);
+        assert (rc == (int) sizeof content);
+        rc = zmq_recv (client, content, sizeof content, 0);
+        assert (rc == (int) sizeof content);
+        if (i >= WARMUP)
+            histogram_record (&rtt, now_nsec () - start);
+    }
+    uint64_t commands = metrics_get (&proxy->metrics ()->commands);
+
+    __atomic_store_n (&stop, 1, __ATOMIC_RELAXED);
+    for (int i = 0; i < qt_churn_threads; i++)
+        zmq_threadclose (churn_threads [i]);
+    zmq_threadclose (churn_worker_thread);
+    zmq_threadclose (worker_thread);
+    zmq_threadclose (topk_thread);
+    zmq_close (client);
+    zmq_close (worker);
+    for (int i = 0; i < QT_CHURN_WORKERS; i++)
+        zmq_close (churn_items [i].socket);
+    rc = zmq_send (control, "TERMINATE", 10, 0);
+    assert (rc == 10);
+    zmq_threadclose (proxy_thread);
+    delete proxy;
+    zmq_close (report);
+    zmq_close (control);
+    rc = zmq_ctx_term (ctx);
+    assert (rc == 0);
+
+    printf ("%-7s %llu churn sessions (%llu refused), %llu commands\n", mode,
+        (unsigned long long) qt_churned, (unsigned long long) qt_refused,
+        (unsigned long long) commands);
+    printf ("%-7s", mode);
+    histogram_print (&rtt, "round trip", "nsec");
+}
+
+int main (int argc, char *argv [])
+{
+    const char *mode = argc > 1 ? argv [1] : "all";
+    if (strcmp (mode, "inline") && strcmp (mode, "split") && strcmp (mode, "all")) {
+        fprintf (stderr, "usage: control_plane [inline|split|all] [seconds] [churn-threads] [topk-interval-usec]\n");
+        return 1;
+    }
+    if (argc > 2) seconds = atoi (argv [2]);
+    if (argc > 3) qt_churn_threads = atoi (argv [3]);
+    if (argc > 4) topk_interval = atoi (argv [4]);
+    assert (seconds > 0 && qt_churn_threads >= 0 && topk_interval > 0);
+
+    bool is_all = !strcmp (mode, "all");
+    if (is_all || !strcmp (mode, "inline"))
+        run_case ("inline");
+    if (is_all || !strcmp (mode, "split"))
+        run_case ("split");
+    return 0;
+}
@@ -0,0 +1,346 @@
+/*
+    Copyright (c) 2013 Contributors as noted in the AUTHORS file
+
+    This file is part of StreamQ-Proxy.
+
+    StreamQ-Proxy is free software; you can redistribute it and/or modify it
+    under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    StreamQ-Proxy is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+//  Microbenchmarks of the pieces of the forwarding path, for comparing
+//  commits: the output is CSV or JSON, one record per benchmark.
+//
+//  Usage: micro [csv|json] [repetitions] [name-filter]
+//
+//  Each benchmark runs once to warm up, then repetitions times; the median,
+//  min and max ns per operation of the repetitions are reported, with the
+//  operations per second of the median. The forward benchmark runs a proxy
+//  in the process, over loopback TCP since ZMQ_STREAM has no inproc
+//  transport; the others do not touch the network.
+
+#include "../include/zmq.h"
+#include "../include/zmq_utils.h"
+#include "../src/proxy.hpp"
+#include "../src/clock.hpp"
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <algorithm>
+#include <functional>
+#include <vector>
+
+#define QT_REPETITIONS 5
+#define QT_SESSIONS 10000           //  in the lookup tables
+#define ID_SIZE 5                   //  as libzmq makes them
+#define FORWARD_SIZE 64
+#define FORWARD_WINDOW 16
+
+typedef struct {
+    const char *name;
+    const char *unit;               //  what an operation is
+    long qt_ops;                    //  per repetition
+    void (*setup) ();               //  or NULL
+    void (*run) (long qt_ops_);
+    void (*teardown) ();            //  or NULL
+} bench_t;
+
+static volatile uint64_t sink;      //  keeps the results alive
+
+//  Greeting and mechanism detection
+
+static zmtp_greeting_t greeting;
+static byte handshake [sizeof (zmtp_greeting_t) + 32];
+
+static void
+greeting_setup ()
+{
+    memset (&greeting, 0, sizeof greeting);
+    greeting.signature [0] = 0xFF;
+    greeting.signature [9] = 0x7F;
+    greeting.version [0] = 3;
+    memcpy (greeting.mechanism, "CURVE", 5);
+    memcpy (handshake, &greeting, sizeof greeting);
+    //  A READY command follows the greeting
+    byte *command = handshake + sizeof greeting;
+    command [0] = 0x04;
+    command [1] = 30;
+    command [2] = 5;
+    memcpy (command + 3, "READY", 5);
+}
+
+static void
+greeting_whole (long qt_ops_)
+{
+    zmtp_handshake_t::state_t state;
+    for (long i = 0; i < qt_ops_; i++) {
+        zmtp_handshake_t::init (state);
+        int events = zmtp_handshake_t::watch (state, handshake, sizeof handshake);
+        sink += events + zmtp_handshake_t::mechanism (state) [0];
+    }
+}
+
+//  The greeting cut by TCP in chunks of 8 bytes
+static void
+greeting_split (long qt_ops_)
+{
+    zmtp_handshake_t::state_t state;
+    for (long i = 0; i < qt_ops_; i++) {
+        zmtp_handshake_t::init (state);
+        int events = 0;
+        for (size_t at = 0; at < sizeof greeting; at += 8)
+            events |= zmtp_handshake_t::watch (state, handshake + at, 8);
+        sink += events + zmtp_handshake_t::mechanism (state) [0];
+    }
+}
+
+//  Identity hashing and session lookup
+
+static std::vector <std::string> identities;
+static std::unordered_map <std::string, void *> sessions;
+
+static void
+identity_setup ()
+{
+    identities.resize (QT_SESSIONS);
+    for (int i = 0; i < QT_SESSIONS; i++) {
+        char identity [ID_SIZE] = { 0 };
+        uint32_t peer_id = 0x1000 + i * 7919;
+        memcpy (identity + 1, &peer_id, sizeof peer_id);
+        identities [i].assign (identity, ID_SIZE);
+        sessions [identities [i]] = &identities [i];
+    }
+}
+
+static void
+identity_teardown ()
+{
+    sessions.clear ();
+    identities.clear ();
+}
+
+static void
+identity_hash (long qt_ops_)
+{
+    std::hash <std::string> hash;
+    for (long i = 0; i < qt_ops_; i++)
+        sink += hash (identities [i % QT_SESSIONS]);
+}
+
+//  As frontend_in does: the identity is received in a buffer
+static void
+pair_lookup (long qt_ops_)
+{
+    for (long i = 0; i < qt_ops_; i++) {
+        const std::string &identity = identities [(i * 31) % QT_SESSIONS];
+        char buffer [PROXY_ID_SIZE_MAX];
+        memcpy (buffer, identity.data (), ID_SIZE);
+        std::unordered_map <std::string, void *>::iterator it =
+            sessions.find (std::string (buffer, ID_SIZE));
+        sink += it != sessions.end ();
+    }
+}
+
+//  Control commands
+
+static const char *commands [] = {
+    "SUSPEND", "RESUME", "TOPK 10", "CLASS 0000101a2b 3", "TERMINATE", "BOGUS"
+};
+#define QT_COMMANDS (int) (sizeof commands / sizeof commands [0])
+
+static void
+command_parse (long qt_ops_)
+{
+    int sizes [QT_COMMANDS];
+    for (int c = 0; c < QT_COMMANDS; c++)
+        sizes [c] = (int) strlen (commands [c]) + 1;    //  sent with their '\0'
+    for (long i = 0; i < qt_ops_; i++) {
+        const char *args;
+        int c = (int) (i % QT_COMMANDS);
+        proxy_command_t command = proxy_parse_command (commands [c], sizes [c], &args);
+        if (command == proxy_class) {
+            char identity [PROXY_ID_SIZE_MAX];
+            size_t size;
+            int cls;
+            if (proxy_parse_class (args, identity, &size, &cls) == 0)
+                sink += cls;
+        }
+        sink += command;
+    }
+}
+
+//  Chunk forwarding through a proxy: an operation is a message relayed to
+//  the worker and back, so two chunks
+
+static void *ctx;
+static void *control;
+static void *client;
+static void *worker;
+static proxy_t *proxy;
+static void *proxy_thread;
+static void *worker_thread;
+
+static void
+proxy_task (void *proxy_)
+{
+    int rc = ((proxy_t *) proxy_)->run ();
+    assert (rc == 0);
+}
+
+//  An empty message ends the echo
+static void
+echo_task (void *worker_)
+{
+    zmq_msg_t msg;
+    int rc = zmq_msg_init (&msg);
+    assert (rc == 0);
+    while (true) {
+        rc = zmq_msg_recv (&msg, worker_, 0);
+        assert (rc >= 0);
+        if (rc == 0)
+            break;
+        rc = zmq_msg_send (&msg, worker_, 0);
+        assert (rc >= 0);
+    }
+    zmq_msg_close (&msg);
+}
+
+static void *
+dealer (const char *endpoint_)
+{
+    void *socket = zmq_socket (ctx, ZMQ_DEALER);
+    assert (socket);
+    int linger = 0;
+    int rc = zmq_setsockopt (socket, ZMQ_LINGER, &linger, sizeof (int));
+    assert (rc == 0);
+    rc = zmq_connect (socket, endpoint_);
+    assert (rc == 0);
+    return socket;
+}
+
+static void
+forward_setup ()
+{
+    ctx = zmq_ctx_new ();
+    assert (ctx);
+    control = zmq_socket (ctx, ZMQ_PUB);
+    assert (control);
+    int rc = zmq_bind (control, "inproc://control");
+    assert (rc == 0);
+
+    proxy_config_t config;
+    proxy_config_init (&config);
+    proxy = new proxy_t (ctx, config);
+    proxy_thread = zmq_threadstart (&proxy_task, proxy);
+    worker = dealer (config.backend);
+    while (metrics_get (&proxy->metrics ()->workers) < 1)
+        usleep (1000);
+    client = dealer (config.frontend);
+    worker_thread = zmq_threadstart (&echo_task, worker);
+}
+
+static void
+forward_teardown ()
+{
+    int rc = zmq_send (client, "", 0, 0);
+    assert (rc == 0);
+    zmq_threadclose (worker_thread);
+    zmq_close (client);
+    zmq_close (worker);
+    rc = zmq_send (control, "TERMINATE", 10, 0);
+    assert (rc == 10);
+    zmq_threadclose (proxy_thread);
+    delete proxy;
+    zmq_close (control);
+    rc = zmq_ctx_term (ctx);
+    assert (rc == 0);
+}
+
+static void
+forward (long qt_ops_)
+{
+    char content [FORWARD_SIZE];
+    memset (content, 'x', sizeof content);
+    long sent = 0, received = 0;
+    while (received < qt_ops_) {
+        while (sent < qt_ops_ && sent - received < FORWARD_WINDOW) {
+            int rc = zmq_send (client, content, sizeof content, 0);
+            assert (rc == (int) sizeof content);
+            sent++;
+        }
+        int rc = zmq_recv (client, content, sizeof content, 0);
+        assert (rc == (int) sizeof content);
+        received++;
+    }
+}
+
+static bench_t benches [] = {
+    { "greeting_whole", "greeting+READY in one chunk", 2000000, greeting_setup, greeting_whole, NULL },
+    { "greeting_split", "greeting in 8 byte chunks", 2000000, greeting_setup, greeting_split, NULL },
+    { "identity_hash", "hash", 10000000, identity_setup, identity_hash, identity_teardown },
+    { "pair_lookup", "lookup among 10000 sessions", 10000000, identity_setup, pair_lookup, identity_teardown },
+    { "command_parse", "command", 2000000, NULL, command_parse, NULL },
+    { "forward", "64 byte message relayed both ways", 100000, forward_setup, forward, forward_teardown }
+};
+#define QT_BENCHES (int) (sizeof benches / sizeof benches [0])
+
+int main (int argc, char *argv [])
+{
+    const char *format = argc > 1 ? argv [1] : "csv";
+    int qt_repetitions = argc > 2 ? atoi (argv [2]) : QT_REPETITIONS;
+    const char *filter = argc > 3 ? argv [3] : NULL;
+    bool is_json = !strcmp (format, "json");
+    if ((!is_json && strcmp (format, "csv")) || qt_repetitions < 1) {
+        fprintf (stderr, "usage: micro [csv|json] [repetitions] [name-filter]\n");
+        return 1;
+    }
+
+    if (is_json)
+        printf ("[");
+    else
+        printf ("name,unit,ops,repetitions,ns_per_op,ns_per_op_min,ns_per_op_max,ops_per_s\n");
+    bool is_first = true;
+    for (int b = 0; b < QT_BENCHES; b++) {
+        const bench_t &bench = benches [b];
+        if (filter && !strstr (bench.name, filter))
+            continue;
+        if (bench.setup)
+            bench.setup ();
+        bench.run (bench.qt_ops);   //  warmup
+        std::vector <double> ns_per_op;
+        for (int r = 0; r < qt_repetitions; r++) {
+            uint64_t start = now_nsec ();
+            bench.run (bench.qt_ops);
+            ns_per_op.push_back ((double) (now_nsec () - start) / bench.qt_ops);
+        }
+        if (bench.teardown)
+            bench.teardown ();
+
+        std::sort (ns_per_op.begin (), ns_per_op.end ());
+        double median = ns_per_op [ns_per_op.size () / 2];
+        if (is_json)
+            printf ("%s\n  {\"name\": \"%s\", \"unit\": \"%s\", \"ops\": %ld, "
+                "\"repetitions\": %d, \"ns_per_op\": %.3f, \"ns_per_op_min\": %.3f, "
+                "\"ns_per_op_max\": %.3f, \"ops_per_s\": %.0f}",
+                is_first ? "" : ",", bench.name, bench.unit, bench.qt_ops,
+                qt_repetitions, median, ns_per_op.front (), ns_per_op.back (), 1e9 / median);
+        else
+            printf ("%s,%s,%ld,%d,%.3f,%.3f,%.3f,%.0f\n", bench.name, bench.unit,
+                bench.qt_ops, qt_repetitions, median, ns_per_op.front (),
+                ns_per_op.back (), 1e9 / median);
+        fflush (stdout);
+        is_first = false;
+    }
+    if (is_json)
+        printf ("\n]\n");
+    return 0;
+}
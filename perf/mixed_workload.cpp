@@ -0,0 +1,276 @@
+/*
+    Copyright (c) 2013 Contributors as noted in the AUTHORS file
+
+    This file is part of StreamQ-Proxy.
+
+    StreamQ-Proxy is free software; you can redistribute it and/or modify it
+    under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    StreamQ-Proxy is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+//  Mixed workload: one bulk upload client beside many latency sensitive
+//  clients, all CURVE, through the proxy.
+//
+//  Usage: mixed_workload [fifo|drr] [interactive-clients] [seconds] [cap-MB/s]
+//
+//  fifo forwards the chunks in arrival order, drr runs the deficit round
+//  robin scheduler, with an optional byte rate cap per client (0: none).
+//  The interactive clients send a small ping every PING_INTERVAL msec and
+//  the round trip times are recorded after a warmup second. The bulk client
+//  sends BULK_SIZE messages as fast as it can, and the workers swallow them.
+
+#include "../include/zmq.h"
+#include "../include/zmq_utils.h"
+#include "../src/proxy.hpp"
+#include "../src/clock.hpp"
+#include "../src/histogram.hpp"
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <vector>
+
+#define KEY_SIZE 40
+#define BULK_SIZE 65536
+#define PING_SIZE 16
+#define PING_INTERVAL 10            //  msec
+#define WARMUP 1000000              //  usec
+
+static char client_pub [KEY_SIZE + 1], client_sec [KEY_SIZE + 1];
+static char worker_pub [KEY_SIZE + 1], worker_sec [KEY_SIZE + 1];
+
+static const char *frontend_endpoint = "tcp://127.0.0.1:9999";
+static const char *backend_endpoint = "tcp://127.0.0.1:9998";
+
+static int qt_interactive = 50;
+static int stop;
+static uint64_t measure_from;       //  usec
+static uint64_t bulk_bytes;         //  received by the workers after warmup
+
+static void
+proxy_task (void *proxy)
+{
+    int rc = ((proxy_t *) proxy)->run ();
+    assert (rc == 0);
+}
+
+static void *
+curve_client (void *ctx)
+{
+    void *client = zmq_socket (ctx, ZMQ_DEALER);
+    assert (client);
+    int rc = zmq_setsockopt (client, ZMQ_CURVE_SERVERKEY, worker_pub, KEY_SIZE);
+    assert (rc == 0);
+    rc = zmq_setsockopt (client, ZMQ_CURVE_PUBLICKEY, client_pub, KEY_SIZE);
+    assert (rc == 0);
+    rc = zmq_setsockopt (client, ZMQ_CURVE_SECRETKEY, client_sec, KEY_SIZE);
+    assert (rc == 0);
+    int linger = 0;
+    rc = zmq_setsockopt (client, ZMQ_LINGER, &linger, sizeof (int));
+    assert (rc == 0);
+    rc = zmq_connect (client, frontend_endpoint);
+    assert (rc == 0);
+    return client;
+}
+
+//  Echoes the pings, swallows the bulk messages
+static void
+worker_task (void *ctx)
+{
+    std::vector <zmq_pollitem_t> items (qt_interactive + 1);
+    int as_server = 1;
+    int linger = 0;
+    for (size_t i = 0; i < items.size (); i++) {
+        void *worker = zmq_socket (ctx, ZMQ_DEALER);
+        assert (worker);
+        int rc = zmq_setsockopt (worker, ZMQ_CURVE_SERVER, &as_server, sizeof (int));
+        assert (rc == 0);
+        rc = zmq_setsockopt (worker, ZMQ_CURVE_SECRETKEY, worker_sec, KEY_SIZE);
+        assert (rc == 0);
+        rc = zmq_setsockopt (worker, ZMQ_LINGER, &linger, sizeof (int));
+        assert (rc == 0);
+        rc = zmq_connect (worker, backend_endpoint);
+        assert (rc == 0);
+        zmq_pollitem_t item = { worker, 0, ZMQ_POLLIN, 0 };
+        items [i] = item;
+    }
+
+    zmq_msg_t msg;
+    int rc = zmq_msg_init (&msg);
+    assert (rc == 0);
+    while (!__atomic_load_n (&stop, __ATOMIC_RELAXED)) {
+        rc = zmq_poll (&items [0], (int) items.size (), 100);
+        if (rc < 0)
+            break;
+        for (size_t i = 0; i < items.size (); i++) {
+            if (!(items [i].revents & ZMQ_POLLIN))
+                continue;
+            while (zmq_msg_recv (&msg, items [i].socket, ZMQ_DONTWAIT) >= 0) {
+                if (zmq_msg_size (&msg) == PING_SIZE)
+                    zmq_msg_send (&msg, items [i].socket, ZMQ_DONTWAIT);
+                else
+                if (now_usec () >= measure_from)
+                    __atomic_fetch_add (&bulk_bytes, zmq_msg_size (&msg), __ATOMIC_RELAXED);
+            }
+        }
+    }
+    zmq_msg_close (&msg);
+    for (size_t i = 0; i < items.size (); i++)
+        zmq_close (items [i].socket);
+}
+
+static void
+bulk_task (void *ctx)
+{
+    void *client = curve_client (ctx);
+    char *content = (char *) calloc (1, BULK_SIZE);
+    assert (content);
+    zmq_pollitem_t items [] = { { client, 0, ZMQ_POLLOUT, 0 } };
+    while (!__atomic_load_n (&stop, __ATOMIC_RELAXED)) {
+        if (zmq_send (client, content, BULK_SIZE, ZMQ_DONTWAIT) < 0)
+            zmq_poll (items, 1, 10);
+    }
+    free (content);
+    zmq_close (client);
+}
+
+typedef struct {
+    void *ctx;
+    histogram_t rtt;                //  usec
+    uint64_t lost;
+} interactive_args_t;
+
+static void
+interactive_task (void *arg)
+{
+    interactive_args_t *args = (interactive_args_t *) arg;
+    histogram_init (&args->rtt);
+    args->lost = 0;
+
+    std::vector <zmq_pollitem_t> items (qt_interactive);
+    for (int i = 0; i < qt_interactive; i++) {
+        zmq_pollitem_t item = { curve_client (args->ctx), 0, ZMQ_POLLIN, 0 };
+        items [i] = item;
+    }
+
+    //  Pings are spread over the interval, one client after the other
+    uint64_t step = (uint64_t) PING_INTERVAL * 1000 / qt_interactive;
+    uint64_t next_ping = now_usec ();
+    int next_client = 0;
+    uint64_t sent = 0, received = 0;
+    while (!__atomic_load_n (&stop, __ATOMIC_RELAXED)) {
+        uint64_t now = now_usec ();
+        while (now >= next_ping) {
+            uint64_t ping [2] = { now, 0 };
+            if (zmq_send (items [next_client].socket, ping, PING_SIZE, ZMQ_DONTWAIT) == PING_SIZE
+            &&  now >= measure_from)
+                sent++;
+            next_client = (next_client + 1) % qt_interactive;
+            next_ping += step;
+        }
+        long timeout = (long) ((next_ping - now) / 1000);
+        int rc = zmq_poll (&items [0], qt_interactive, timeout);
+        if (rc < 0)
+            break;
+        for (int i = 0; i < qt_interactive; i++) {
+            if (!(items [i].revents & ZMQ_POLLIN))
+                continue;
+            uint64_t ping [2];
+            while (zmq_recv (items [i].socket, ping, PING_SIZE, ZMQ_DONTWAIT) == PING_SIZE) {
+                if (ping [0] >= measure_from) {
+                    histogram_record (&args->rtt, now_usec () - ping [0]);
+                    received++;
+                }
+            }
+        }
+    }
+    args->lost = sent > received ? sent - received : 0;
+    for (int i = 0; i < qt_interactive; i++)
+        zmq_close (items [i].socket);
+}
+
+int main (int argc, char *argv [])
+{
+    if (argc > 1 && strcmp (argv [1], "fifo") && strcmp (argv [1], "drr")) {
+        fprintf (stderr, "usage: mixed_workload [fifo|drr] [interactive-clients] [seconds] [cap-MB/s]\n");
+        return 1;
+    }
+    bool is_drr = argc > 1 && !strcmp (argv [1], "drr");
+    if (argc > 2) qt_interactive = atoi (argv [2]);
+    int seconds = argc > 3 ? atoi (argv [3]) : 10;
+    double cap = argc > 4 ? atof (argv [4]) : 0;
+    assert (qt_interactive > 0 && seconds > 0 && cap >= 0);
+
+    int rc = zmq_curve_keypair (client_pub, client_sec);
+    assert (rc == 0);
+    rc = zmq_curve_keypair (worker_pub, worker_sec);
+    assert (rc == 0);
+
+    void *ctx = zmq_ctx_new ();
+    assert (ctx);
+    rc = zmq_ctx_set (ctx, ZMQ_IO_THREADS, 2);
+    assert (rc == 0);
+    void *control = zmq_socket (ctx, ZMQ_PUB);
+    assert (control);
+    rc = zmq_bind (control, "inproc://control");
+    assert (rc == 0);
+
+    //  One class for every client: the cap binds the bulk client only
+    sched_class_t classes [1];
+    classes [0].weight = 1;
+    classes [0].rate = (uint64_t) (cap * 1000000);
+    classes [0].burst = 0;
+    proxy_config_t config;
+    proxy_config_init (&config);
+    config.frontend = frontend_endpoint;
+    config.backend = backend_endpoint;
+    config.scheduler = is_drr;
+    config.classes = classes;
+    config.qt_classes = 1;
+    proxy_t *proxy = new proxy_t (ctx, config);
+    void *proxy_thread = zmq_threadstart (&proxy_task, proxy);
+
+    measure_from = UINT64_MAX;
+    void *worker_thread = zmq_threadstart (&worker_task, ctx);
+    while (metrics_get (&proxy->metrics ()->workers) < (uint64_t) qt_interactive + 1)
+        usleep (10000);
+
+    void *bulk_thread = zmq_threadstart (&bulk_task, ctx);
+    usleep (100000);
+    interactive_args_t args;
+    args.ctx = ctx;
+    measure_from = now_usec () + WARMUP;
+    void *interactive_thread = zmq_threadstart (&interactive_task, &args);
+
+    usleep (WARMUP + seconds * 1000000ULL);
+    __atomic_store_n (&stop, 1, __ATOMIC_RELAXED);
+    zmq_threadclose (interactive_thread);
+    zmq_threadclose (bulk_thread);
+    zmq_threadclose (worker_thread);
+
+    printf ("%s%s: %d interactive clients, 1 bulk client, %d s\n",
+        is_drr ? "drr" : "fifo", cap > 0 && is_drr ? " with cap" : "",
+        qt_interactive, seconds);
+    histogram_print (&args.rtt, "interactive rtt", "usec");
+    printf ("interactive lost or late %llu, bulk %.1f MB/s\n",
+        (unsigned long long) args.lost,
+        (double) bulk_bytes / seconds / 1000000);
+
+    rc = zmq_send (control, "TERMINATE", 10, 0);
+    assert (rc == 10);
+    zmq_threadclose (proxy_thread);
+    delete proxy;
+    rc = zmq_close (control);
+    assert (rc == 0);
+    rc = zmq_ctx_term (ctx);
+    assert (rc == 0);
+    return 0;
+}
@@ -0,0 +1,351 @@
+/*
+    Copyright (c) 2013 Contributors as noted in the AUTHORS file
+
+    This file is part of StreamQ-Proxy.
+
+    StreamQ-Proxy is free software; you can redistribute it and/or modify it
+    under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    StreamQ-Proxy is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+//  Latency against throughput, open loop: the clients send on a schedule,
+//  fixed rate or Poisson arrivals, whether the replies have come or not,
+//  and the latency of a request is counted from when it was meant to be
+//  sent. A closed loop client, as the one of tests/test_curve_proxying,
+//  stops sending when the proxy slows down, and the requests it did not
+//  send are never measured: coordinated omission. The latency from the
+//  actual send is recorded beside, to show what it hides.
+//
+//  Usage: open_loop [fixed|poisson] [connections] [step-seconds] [start-rate] [step-rate] [max-rate] [size] [service-usec]
+//
+//  The offered load, in requests/s over all the CURVE connections, goes up
+//  by steps; each step reports the throughput, and the latency from the
+//  intended send and from the actual one. The knee is the last step before
+//  the throughput falls behind the offered load, or the p99 grows tenfold.
+//  The echo workers take service-usec per request, spinning.
+
+#include "../include/zmq.h"
+#include "../include/zmq_utils.h"
+#include "../src/proxy.hpp"
+#include "../src/clock.hpp"
+#include "../src/histogram.hpp"
+
+#include <math.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <vector>
+
+#define KEY_SIZE 40
+#define WARMUP 500000               //  usec of each step not recorded
+#define DRAIN 1000000               //  usec for the last replies of a step
+#define KNEE_THROUGHPUT 0.95        //  of the offered load
+#define KNEE_P99 10                 //  times the p99 of the first step
+
+static char client_pub [KEY_SIZE + 1], client_sec [KEY_SIZE + 1];
+static char worker_pub [KEY_SIZE + 1], worker_sec [KEY_SIZE + 1];
+
+static bool is_poisson = true;
+static int qt_connections = 16;
+static int step_seconds = 5;
+static int start_rate = 10000;
+static int step_rate = 10000;
+static int max_rate = 100000;
+static int message_size = 64;
+static int service_time = 0;        //  usec
+
+//  What a request carries, the rest is padding
+typedef struct {
+    uint64_t intended;              //  nsec
+    uint64_t sent;                  //  nsec
+} stamp_t;
+
+typedef struct {
+    void *socket;
+    double rate;                    //  requests/s on this connection
+    uint64_t seed;
+    uint64_t start;                 //  nsec
+    uint64_t measure_from;          //  nsec
+    uint64_t end;                   //  nsec, of the sends
+    histogram_t intended;           //  usec, from the intended send
+    histogram_t sent;               //  usec, from the actual send
+    uint64_t requests;              //  measured, sent
+    uint64_t replies;               //  measured, received
+} connection_args_t;
+
+static void
+proxy_task (void *proxy)
+{
+    int rc = ((proxy_t *) proxy)->run ();
+    assert (rc == 0);
+}
+
+static void
+worker_task (void *worker)
+{
+    zmq_msg_t msg;
+    int rc = zmq_msg_init (&msg);
+    assert (rc == 0);
+    //  An empty message ends it
+    while (true) {
+        rc = zmq_msg_recv (&msg, worker, 0);
+        assert (rc >= 0);
+        if (rc == 0)
+            break;
+        if (service_time) {
+            uint64_t until = now_nsec () + (uint64_t) service_time * 1000;
+            while (now_nsec () < until)
+                ;
+        }
+        rc = zmq_msg_send (&msg, worker, 0);
+        assert (rc >= 0);
+    }
+    zmq_msg_close (&msg);
+}
+
+static void *
+dealer (void *ctx, bool is_worker)
+{
+    void *socket = zmq_socket (ctx, ZMQ_DEALER);
+    assert (socket);
+    int linger = 0;
+    int rc = zmq_setsockopt (socket, ZMQ_LINGER, &linger, sizeof (int));
+    assert (rc == 0);
+    //  A full pipe would block the sender, and close the loop again
+    int hwm = 0;
+    rc = zmq_setsockopt (socket, ZMQ_SNDHWM, &hwm, sizeof (int));
+    assert (rc == 0);
+    rc = zmq_setsockopt (socket, ZMQ_RCVHWM, &hwm, sizeof (int));
+    assert (rc == 0);
+    if (is_worker) {
+        int as_server = 1;
+        rc = zmq_setsockopt (socket, ZMQ_CURVE_SERVER, &as_server, sizeof (int));
+        assert (rc == 0);
+        rc = zmq_setsockopt (socket, ZMQ_CURVE_SECRETKEY, worker_sec, KEY_SIZE);
+        assert (rc == 0);
+        rc = zmq_connect (socket, "tcp://127.0.0.1:9998");
+    }
+    else {
+        rc = zmq_setsockopt (socket, ZMQ_CURVE_SERVERKEY, worker_pub, KEY_SIZE);
+        assert (rc == 0);
+        rc = zmq_setsockopt (socket, ZMQ_CURVE_PUBLICKEY, client_pub, KEY_SIZE);
+        assert (rc == 0);
+        rc = zmq_setsockopt (socket, ZMQ_CURVE_SECRETKEY, client_sec, KEY_SIZE);
+        assert (rc == 0);
+        rc = zmq_connect (socket, "tcp://127.0.0.1:9999");
+    }
+    assert (rc == 0);
+    return socket;
+}
+
+//  xorshift64*, uniform in (0, 1]
+static double
+uniform (uint64_t *seed)
+{
+    *seed ^= *seed >> 12;
+    *seed ^= *seed << 25;
+    *seed ^= *seed >> 27;
+    return ((*seed * 0x2545f4914f6cdd1dull >> 11) + 1) * (1.0 / 9007199254740992.0);
+}
+
+//  nsec to the next request
+static uint64_t
+interval (connection_args_t *args)
+{
+    double mean = 1e9 / args->rate;
+    return (uint64_t) (is_poisson ? -log (uniform (&args->seed)) * mean : mean);
+}
+
+//  Sends on schedule, and takes the replies in between. When it is late,
+//  it sends what it owes at once, each request still stamped with when it
+//  should have gone.
+static void
+connection_task (void *arg)
+{
+    connection_args_t *args = (connection_args_t *) arg;
+    std::vector <char> content (message_size, 'r');
+    stamp_t stamp;
+    uint64_t next = args->start + interval (args);
+    uint64_t outstanding = 0;
+    zmq_pollitem_t items [] = { { args->socket, 0, ZMQ_POLLIN, 0 } };
+    while (true) {
+        uint64_t now = now_nsec ();
+        if (next < args->end && now >= next) {
+            stamp.intended = next;
+            stamp.sent = now;
+            memcpy (&content [0], &stamp, sizeof stamp);
+            int rc = zmq_send (args->socket, &content [0], message_size, 0);
+            assert (rc == message_size);
+            outstanding++;
+            if (next >= args->measure_from)
+                args->requests++;
+            next += interval (args);
+            continue;
+        }
+        if (now >= args->end + (uint64_t) DRAIN * 1000 || (next >= args->end && !outstanding))
+            break;
+        //  Spin the last millisecond before a send, the poll is not finer
+        long timeout = next < args->end
+            ? (long) ((next - now) / 1000000) : (long) ((args->end + (uint64_t) DRAIN * 1000 - now) / 1000000);
+        int rc = zmq_poll (items, 1, timeout);
+        assert (rc >= 0);
+        while (zmq_recv (args->socket, &content [0], message_size, ZMQ_DONTWAIT) == message_size) {
+            now = now_nsec ();
+            memcpy (&stamp, &content [0], sizeof stamp);
+            //  A straggler of the step before
+            if (stamp.intended < args->start)
+                continue;
+            outstanding--;
+            if (stamp.intended < args->measure_from)
+                continue;
+            histogram_record (&args->intended, (now - stamp.intended) / 1000);
+            histogram_record (&args->sent, (now - stamp.sent) / 1000);
+            args->replies++;
+        }
+    }
+    //  The replies that did not make it in time would be taken for the
+    //  next step's
+    while (outstanding && zmq_poll (items, 1, DRAIN / 1000) > 0)
+        while (zmq_recv (args->socket, &content [0], message_size, ZMQ_DONTWAIT) == message_size)
+            outstanding--;
+}
+
+int main (int argc, char *argv [])
+{
+    if (argc > 1 && strcmp (argv [1], "fixed") && strcmp (argv [1], "poisson")) {
+        fprintf (stderr, "usage: open_loop [fixed|poisson] [connections] [step-seconds] [start-rate] [step-rate] [max-rate] [size] [service-usec]\n");
+        return 1;
+    }
+    if (argc > 1) is_poisson = !strcmp (argv [1], "poisson");
+    if (argc > 2) qt_connections = atoi (argv [2]);
+    if (argc > 3) step_seconds = atoi (argv [3]);
+    if (argc > 4) start_rate = atoi (argv [4]);
+    if (argc > 5) step_rate = atoi (argv [5]);
+    if (argc > 6) max_rate = atoi (argv [6]);
+    if (argc > 7) message_size = atoi (argv [7]);
+    if (argc > 8) service_time = atoi (argv [8]);
+    assert (qt_connections > 0 && step_seconds > 0 && start_rate > 0 && step_rate > 0);
+    assert (max_rate >= start_rate && message_size >= (int) sizeof (stamp_t) && service_time >= 0);
+
+    int rc = zmq_curve_keypair (client_pub, client_sec);
+    assert (rc == 0);
+    rc = zmq_curve_keypair (worker_pub, worker_sec);
+    assert (rc == 0);
+    void *ctx = zmq_ctx_new ();
+    assert (ctx);
+    void *control = zmq_socket (ctx, ZMQ_PUB);
+    assert (control);
+    rc = zmq_bind (control, "inproc://control");
+    assert (rc == 0);
+
+    proxy_config_t config;
+    proxy_config_init (&config);
+    proxy_t *proxy = new proxy_t (ctx, config);
+    void *proxy_thread = zmq_threadstart (&proxy_task, proxy);
+
+    //  A worker connection per client connection, which the sessions keep
+    //  from one step to the next
+    std::vector <void *> workers (qt_connections), worker_threads (qt_connections);
+    for (int i = 0; i < qt_connections; i++)
+        workers [i] = dealer (ctx, true);
+    while (metrics_get (&proxy->metrics ()->workers) < (uint64_t) qt_connections)
+        usleep (1000);
+    for (int i = 0; i < qt_connections; i++)
+        worker_threads [i] = zmq_threadstart (&worker_task, workers [i]);
+    std::vector <void *> clients (qt_connections);
+    for (int i = 0; i < qt_connections; i++) {
+        clients [i] = dealer (ctx, false);
+        //  Through the handshake before the clock starts
+        stamp_t stamp = { 0, 0 };
+        std::vector <char> content (message_size, 'r');
+        memcpy (&content [0], &stamp, sizeof stamp);
+        rc = zmq_send (clients [i], &content [0], message_size, 0);
+        assert (rc == message_size);
+        rc = zmq_recv (clients [i], &content [0], message_size, 0);
+        assert (rc == message_size);
+    }
+
+    printf ("%s arrivals, %d connections, %d bytes, %d usec of service\n",
+        is_poisson ? "poisson" : "fixed rate", qt_connections, message_size, service_time);
+    printf ("offered/s  achieved/s  p50 p90 p99 p99.9 max (usec from intended)  p50 p99 p99.9 (usec from sent)\n");
+    std::vector <connection_args_t> connections (qt_connections);
+    std::vector <void *> connection_threads (qt_connections);
+    uint64_t first_p99 = 0;
+    int knee = 0;
+    for (int rate = start_rate; rate <= max_rate; rate += step_rate) {
+        uint64_t start = now_nsec () + 10000000;
+        for (int i = 0; i < qt_connections; i++) {
+            connection_args_t *args = &connections [i];
+            args->socket = clients [i];
+            args->rate = (double) rate / qt_connections;
+            args->seed = 0x9e3779b97f4a7c15ull * (i + 1) + rate;
+            args->start = start;
+            args->measure_from = start + (uint64_t) WARMUP * 1000;
+            args->end = start + (uint64_t) step_seconds * 1000000000;
+            histogram_init (&args->intended);
+            histogram_init (&args->sent);
+            args->requests = 0;
+            args->replies = 0;
+            connection_threads [i] = zmq_threadstart (&connection_task, args);
+        }
+        histogram_t intended, sent;
+        histogram_init (&intended);
+        histogram_init (&sent);
+        uint64_t requests = 0, replies = 0;
+        for (int i = 0; i < qt_connections; i++) {
+            zmq_threadclose (connection_threads [i]);
+            histogram_merge (&intended, &connections [i].intended);
+            histogram_merge (&sent, &connections [i].sent);
+            requests += connections [i].requests;
+            replies += connections [i].replies;
+        }
+        double measured = step_seconds - WARMUP / 1e6;
+        double achieved = replies / measured;
+        uint64_t p99 = histogram_percentile (&intended, 99);
+        printf ("%9d  %10.0f  %llu %llu %llu %llu %llu  %llu %llu %llu%s\n", rate, achieved,
+            (unsigned long long) histogram_percentile (&intended, 50),
+            (unsigned long long) histogram_percentile (&intended, 90),
+            (unsigned long long) p99,
+            (unsigned long long) histogram_percentile (&intended, 99.9),
+            (unsigned long long) intended.max,
+            (unsigned long long) histogram_percentile (&sent, 50),
+            (unsigned long long) histogram_percentile (&sent, 99),
+            (unsigned long long) histogram_percentile (&sent, 99.9),
+            replies < requests ? "  (replies missing)" : "");
+        if (!first_p99)
+            first_p99 = p99 ? p99 : 1;
+        if (achieved < KNEE_THROUGHPUT * requests / measured || p99 > KNEE_P99 * first_p99)
+            break;
+        knee = rate;
+    }
+    if (knee)
+        printf ("knee: %d requests/s\n", knee);
+    else
+        printf ("knee: below %d requests/s\n", start_rate);
+
+    for (int i = 0; i < qt_connections; i++) {
+        rc = zmq_send (clients [i], "", 0, 0);
+        assert (rc == 0);
+    }
+    for (int i = 0; i < qt_connections; i++) {
+        zmq_threadclose (worker_threads [i]);
+        zmq_close (workers [i]);
+        zmq_close (clients [i]);
+    }
+    rc = zmq_send (control, "TERMINATE", 10, 0);
+    assert (rc == 10);
+    zmq_threadclose (proxy_thread);
+    delete proxy;
+    zmq_close (control);
+    rc = zmq_ctx_term (ctx);
+    assert (rc == 0);
+    return 0;
+}
@@ -0,0 +1,174 @@
+/*
+    Copyright (c) 2013 Contributors as noted in the AUTHORS file
+
+    This file is part of StreamQ-Proxy.
+
+    StreamQ-Proxy is free software; you can redistribute it and/or modify it
+    under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    StreamQ-Proxy is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+//  Latency added by the proxy: one client and one worker play ping-pong,
+//  directly, through the proxy blocking in zmq_poll, and through the proxy
+//  busy polling.
+//
+//  Usage: ping_pong [direct|blocking|busy|all] [round-trips] [size] [busy-usec] [cpu]
+//
+//  The NULL mechanism is used, so that only the transport is measured. The
+//  proxy is pinned to cpu in busy mode if one is given (-1: none); pick an
+//  isolated core, or at least one that the peers do not use.
+
+#include "../include/zmq.h"
+#include "../include/zmq_utils.h"
+#include "../src/proxy.hpp"
+#include "../src/clock.hpp"
+#include "../src/histogram.hpp"
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <vector>
+
+#define WARMUP 1000                 //  round trips not recorded
+
+static int qt_round_trips = 100000;
+static int message_size = 64;
+static uint64_t busy_usec = 1000;
+static int cpu = -1;
+
+static void
+proxy_task (void *proxy)
+{
+    int rc = ((proxy_t *) proxy)->run ();
+    assert (rc == 0);
+}
+
+static void
+worker_task (void *worker)
+{
+    zmq_msg_t msg;
+    int rc = zmq_msg_init (&msg);
+    assert (rc == 0);
+    //  An empty message ends the game
+    while (true) {
+        rc = zmq_msg_recv (&msg, worker, 0);
+        assert (rc >= 0);
+        if (rc == 0)
+            break;
+        rc = zmq_msg_send (&msg, worker, 0);
+        assert (rc >= 0);
+    }
+    zmq_msg_close (&msg);
+}
+
+static void *
+dealer (void *ctx, const char *endpoint, bool is_bind)
+{
+    void *socket = zmq_socket (ctx, ZMQ_DEALER);
+    assert (socket);
+    int linger = 0;
+    int rc = zmq_setsockopt (socket, ZMQ_LINGER, &linger, sizeof (int));
+    assert (rc == 0);
+    rc = is_bind ? zmq_bind (socket, endpoint) : zmq_connect (socket, endpoint);
+    assert (rc == 0);
+    return socket;
+}
+
+static void
+run_case (const char *mode)
+{
+    void *ctx = zmq_ctx_new ();
+    assert (ctx);
+    void *control = zmq_socket (ctx, ZMQ_PUB);
+    assert (control);
+    int rc = zmq_bind (control, "inproc://control");
+    assert (rc == 0);
+
+    bool is_direct = !strcmp (mode, "direct");
+    proxy_t *proxy = NULL;
+    void *proxy_thread = NULL;
+    void *worker, *client;
+    if (is_direct) {
+        worker = dealer (ctx, "tcp://127.0.0.1:9998", true);
+        client = dealer (ctx, "tcp://127.0.0.1:9998", false);
+    }
+    else {
+        proxy_config_t config;
+        proxy_config_init (&config);
+        if (!strcmp (mode, "busy")) {
+            config.busy_poll = busy_usec;
+            config.cpu = cpu;
+        }
+        proxy = new proxy_t (ctx, config);
+        proxy_thread = zmq_threadstart (&proxy_task, proxy);
+        worker = dealer (ctx, "tcp://127.0.0.1:9998", false);
+        while (metrics_get (&proxy->metrics ()->workers) < 1)
+            usleep (1000);
+        client = dealer (ctx, "tcp://127.0.0.1:9999", false);
+    }
+    void *worker_thread = zmq_threadstart (&worker_task, worker);
+
+    histogram_t rtt;                //  nsec
+    histogram_init (&rtt);
+    std::vector <char> content (message_size, 'x');
+    for (int i = 0; i < WARMUP + qt_round_trips; i++) {
+        uint64_t start = now_nsec ();
+        rc = zmq_send (client, &content [0], message_size, 0);
+        assert (rc == message_size);
+        rc = zmq_recv (client, &content [0], message_size, 0);
+        assert (rc == message_size);
+        if (i >= WARMUP)
+            histogram_record (&rtt, now_nsec () - start);
+    }
+    rc = zmq_send (client, "", 0, 0);
+    assert (rc == 0);
+    zmq_threadclose (worker_thread);
+
+    printf ("%-9s", mode);
+    histogram_print (&rtt, "round trip", "nsec");
+
+    zmq_close (client);
+    zmq_close (worker);
+    if (proxy) {
+        rc = zmq_send (control, "TERMINATE", 10, 0);
+        assert (rc == 10);
+        zmq_threadclose (proxy_thread);
+        delete proxy;
+    }
+    zmq_close (control);
+    rc = zmq_ctx_term (ctx);
+    assert (rc == 0);
+}
+
+int main (int argc, char *argv [])
+{
+    const char *mode = argc > 1 ? argv [1] : "all";
+    if (strcmp (mode, "direct") && strcmp (mode, "blocking")
+    &&  strcmp (mode, "busy") && strcmp (mode, "all")) {
+        fprintf (stderr, "usage: ping_pong [direct|blocking|busy|all] [round-trips] [size] [busy-usec] [cpu]\n");
+        return 1;
+    }
+    if (argc > 2) qt_round_trips = atoi (argv [2]);
+    if (argc > 3) message_size = atoi (argv [3]);
+    if (argc > 4) busy_usec = atoi (argv [4]);
+    if (argc > 5) cpu = atoi (argv [5]);
+    assert (qt_round_trips > 0 && message_size > 0 && busy_usec > 0);
+
+    printf ("%d round trips of %d bytes\n", qt_round_trips, message_size);
+    bool is_all = !strcmp (mode, "all");
+    if (is_all || !strcmp (mode, "direct"))
+        run_case ("direct");
+    if (is_all || !strcmp (mode, "blocking"))
+        run_case ("blocking");
+    if (is_all || !strcmp (mode, "busy"))
+        run_case ("busy");
+    return 0;
+}
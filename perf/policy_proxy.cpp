@@ -0,0 +1,223 @@
+/*
+    Copyright (c) 2013 Contributors as noted in the AUTHORS file
+
+    This file is part of StreamQ-Proxy.
+
+    StreamQ-Proxy is free software; you can redistribute it and/or modify it
+    under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    StreamQ-Proxy is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+//  Forwarding cost of the proxy builds: the generic proxy_t, configured at
+//  runtime, against builds with their policies fixed at compile time.
+//
+//  Usage: policy_proxy [generic|lean|blind|all] [pairs] [messages] [size] [window]
+//
+//  generic is proxy_t with tracing and scheduling off in its configuration,
+//  lean has null_trace_t and fifo_balance_t, blind also has
+//  blind_handshake_t. Each client sends messages of size bytes to its
+//  worker, which echoes them, keeping window of them in flight. The NULL
+//  mechanism keeps the peers cheap, so that the proxy is the bottleneck.
+//  Reported: round trips per second, and CPU of the proxy thread per chunk
+//  it forwarded.
+
+#include "../include/zmq.h"
+#include "../include/zmq_utils.h"
+#include "../src/proxy.hpp"
+#include "../src/clock.hpp"
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <vector>
+
+typedef basic_proxy <zmtp_handshake_t, null_trace_t, fifo_balance_t> lean_proxy_t;
+typedef basic_proxy <blind_handshake_t, null_trace_t, fifo_balance_t> blind_proxy_t;
+
+static const char *frontend_endpoint = "tcp://127.0.0.1:9999";
+static const char *backend_endpoint = "tcp://127.0.0.1:9998";
+
+static int qt_pairs = 16;
+static int qt_messages = 100000;    //  per pair
+static int message_size = 64;
+static int window = 16;
+static int stop;
+
+template <class P>
+struct proxy_args_t {
+    P *proxy;
+    uint64_t cpu;                   //  usec
+};
+
+template <class P>
+static void
+proxy_task (void *arg)
+{
+    proxy_args_t <P> *args = (proxy_args_t <P> *) arg;
+    uint64_t start = thread_cpu_usec ();
+    int rc = args->proxy->run ();
+    assert (rc == 0);
+    args->cpu = thread_cpu_usec () - start;
+}
+
+static void *
+peer_socket (void *ctx, const char *endpoint)
+{
+    void *socket = zmq_socket (ctx, ZMQ_DEALER);
+    assert (socket);
+    int linger = 0;
+    int rc = zmq_setsockopt (socket, ZMQ_LINGER, &linger, sizeof (int));
+    assert (rc == 0);
+    rc = zmq_connect (socket, endpoint);
+    assert (rc == 0);
+    return socket;
+}
+
+static void
+worker_task (void *ctx)
+{
+    std::vector <zmq_pollitem_t> items (qt_pairs);
+    for (int i = 0; i < qt_pairs; i++) {
+        zmq_pollitem_t item = { peer_socket (ctx, backend_endpoint), 0, ZMQ_POLLIN, 0 };
+        items [i] = item;
+    }
+    zmq_msg_t msg;
+    int rc = zmq_msg_init (&msg);
+    assert (rc == 0);
+    while (!__atomic_load_n (&stop, __ATOMIC_RELAXED)) {
+        rc = zmq_poll (&items [0], qt_pairs, 100);
+        if (rc < 0)
+            break;
+        for (int i = 0; i < qt_pairs; i++)
+            if (items [i].revents & ZMQ_POLLIN)
+                while (zmq_msg_recv (&msg, items [i].socket, ZMQ_DONTWAIT) >= 0)
+                    zmq_msg_send (&msg, items [i].socket, 0);
+    }
+    zmq_msg_close (&msg);
+    for (int i = 0; i < qt_pairs; i++)
+        zmq_close (items [i].socket);
+}
+
+//  Returns the number of round trips done
+static uint64_t
+clients_run (void *ctx)
+{
+    std::vector <zmq_pollitem_t> items (qt_pairs);
+    std::vector <int> sent (qt_pairs), received (qt_pairs);
+    std::vector <char> content (message_size, 'x');
+    for (int i = 0; i < qt_pairs; i++) {
+        zmq_pollitem_t item = { peer_socket (ctx, frontend_endpoint), 0, ZMQ_POLLIN, 0 };
+        items [i] = item;
+        for (; sent [i] < window && sent [i] < qt_messages; sent [i]++) {
+            int rc = zmq_send (item.socket, &content [0], message_size, 0);
+            assert (rc == message_size);
+        }
+    }
+
+    uint64_t done = 0;
+    while (done < (uint64_t) qt_pairs * qt_messages) {
+        int rc = zmq_poll (&items [0], qt_pairs, 2000);
+        if (rc <= 0) {
+            fprintf (stderr, "policy_proxy: stalled after %llu round trips\n",
+                (unsigned long long) done);
+            break;
+        }
+        for (int i = 0; i < qt_pairs; i++) {
+            if (!(items [i].revents & ZMQ_POLLIN))
+                continue;
+            while (zmq_recv (items [i].socket, &content [0], message_size, ZMQ_DONTWAIT) >= 0) {
+                received [i]++;
+                done++;
+                if (sent [i] < qt_messages) {
+                    rc = zmq_send (items [i].socket, &content [0], message_size, 0);
+                    assert (rc == message_size);
+                    sent [i]++;
+                }
+            }
+        }
+    }
+    for (int i = 0; i < qt_pairs; i++)
+        zmq_close (items [i].socket);
+    return done;
+}
+
+template <class P>
+static void
+run_case (const char *name)
+{
+    void *ctx = zmq_ctx_new ();
+    assert (ctx);
+    void *control = zmq_socket (ctx, ZMQ_PUB);
+    assert (control);
+    int rc = zmq_bind (control, "inproc://control");
+    assert (rc == 0);
+
+    proxy_config_t config;
+    proxy_config_init (&config);
+    config.frontend = frontend_endpoint;
+    config.backend = backend_endpoint;
+    proxy_args_t <P> args;
+    args.proxy = new P (ctx, config);
+    void *proxy_thread = zmq_threadstart (&proxy_task <P>, &args);
+
+    __atomic_store_n (&stop, 0, __ATOMIC_RELAXED);
+    void *worker_thread = zmq_threadstart (&worker_task, ctx);
+    while (metrics_get (&args.proxy->metrics ()->workers) < (uint64_t) qt_pairs)
+        usleep (10000);
+
+    uint64_t start = now_usec ();
+    uint64_t done = clients_run (ctx);
+    uint64_t elapsed = now_usec () - start;
+    uint64_t chunks = metrics_get (&args.proxy->metrics ()->msgs_c2w)
+                    + metrics_get (&args.proxy->metrics ()->msgs_w2c);
+
+    __atomic_store_n (&stop, 1, __ATOMIC_RELAXED);
+    zmq_threadclose (worker_thread);
+    rc = zmq_send (control, "TERMINATE", 10, 0);
+    assert (rc == 10);
+    zmq_threadclose (proxy_thread);
+    delete args.proxy;
+    rc = zmq_close (control);
+    assert (rc == 0);
+    rc = zmq_ctx_term (ctx);
+    assert (rc == 0);
+
+    printf ("%-8s %10.0f round trips/s  %8llu chunks  %6.3f usec CPU/chunk\n",
+        name, (double) done * 1000000 / (elapsed ? elapsed : 1),
+        (unsigned long long) chunks,
+        chunks ? (double) args.cpu / chunks : 0.0);
+}
+
+int main (int argc, char *argv [])
+{
+    const char *mode = argc > 1 ? argv [1] : "all";
+    if (strcmp (mode, "generic") && strcmp (mode, "lean")
+    &&  strcmp (mode, "blind") && strcmp (mode, "all")) {
+        fprintf (stderr, "usage: policy_proxy [generic|lean|blind|all] [pairs] [messages] [size] [window]\n");
+        return 1;
+    }
+    if (argc > 2) qt_pairs = atoi (argv [2]);
+    if (argc > 3) qt_messages = atoi (argv [3]);
+    if (argc > 4) message_size = atoi (argv [4]);
+    if (argc > 5) window = atoi (argv [5]);
+    assert (qt_pairs > 0 && qt_messages > 0 && message_size > 0 && window > 0);
+
+    printf ("%d pairs, %d messages of %d bytes each, window %d\n",
+        qt_pairs, qt_messages, message_size, window);
+    bool is_all = !strcmp (mode, "all");
+    if (is_all || !strcmp (mode, "generic"))
+        run_case <proxy_t> ("generic");
+    if (is_all || !strcmp (mode, "lean"))
+        run_case <lean_proxy_t> ("lean");
+    if (is_all || !strcmp (mode, "blind"))
+        run_case <blind_proxy_t> ("blind");
+    return 0;
+}
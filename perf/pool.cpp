@@ -0,0 +1,230 @@
+/*
+    Copyright (c) 2013 Contributors as noted in the AUTHORS file
+
+    This file is part of StreamQ-Proxy.
+
+    StreamQ-Proxy is free software; you can redistribute it and/or modify it
+    under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    StreamQ-Proxy is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+//  Bursts of CURVE clients served by the worker pool (config.pool): an
+//  elastic pool, which starts with one thread and grows as the clients
+//  come, against a fixed one, started with all the threads it needs.
+//
+//  Usage: pool [elastic|fixed|all] [clients] [bursts] [cooldown-msec]
+//
+//  Each burst opens the clients at once, and each of them sends a request;
+//  the time from the start of the burst to the reply of each client is
+//  recorded. The clients then leave, and the elastic pool is left to
+//  retire its surplus after the cooldown before the next burst, so that
+//  every burst pays for its growth; both pools have all their connections
+//  idle again before the next burst. Reported: the reply times, the threads
+//  started and retired, and how long the elastic pool took to shrink back
+//  once the clients had gone.
+
+#include "../include/zmq.h"
+#include "../include/zmq_utils.h"
+#include "../src/proxy.hpp"
+#include "../src/clock.hpp"
+#include "../src/histogram.hpp"
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <vector>
+
+#define KEY_SIZE 40
+#define MAX_CLIENTS 256
+#define BURST_TIMEOUT 10000         //  msec for the replies of a burst
+
+static char client_pub [KEY_SIZE + 1], client_sec [KEY_SIZE + 1];
+static char worker_pub [KEY_SIZE + 1], worker_sec [KEY_SIZE + 1];
+
+static const char *frontend_endpoint = "tcp://127.0.0.1:9999";
+static const char *backend_endpoint = "tcp://127.0.0.1:9998";
+
+static int qt_clients = 32;
+static int qt_bursts = 10;
+static int cooldown = 200;          //  msec
+
+static void
+proxy_task (void *proxy)
+{
+    int rc = ((proxy_t *) proxy)->run ();
+    assert (rc == 0);
+}
+
+static void
+echo (void *socket_, zmq_msg_t *msg_, void *)
+{
+    int rc = zmq_msg_send (msg_, socket_, zmq_msg_more (msg_) ? ZMQ_SNDMORE : 0);
+    assert (rc >= 0);
+}
+
+static void *
+client_socket (void *ctx)
+{
+    void *client = zmq_socket (ctx, ZMQ_DEALER);
+    assert (client);
+    int rc = zmq_setsockopt (client, ZMQ_CURVE_SERVERKEY, worker_pub, KEY_SIZE);
+    assert (rc == 0);
+    rc = zmq_setsockopt (client, ZMQ_CURVE_PUBLICKEY, client_pub, KEY_SIZE);
+    assert (rc == 0);
+    rc = zmq_setsockopt (client, ZMQ_CURVE_SECRETKEY, client_sec, KEY_SIZE);
+    assert (rc == 0);
+    int linger = 0;
+    rc = zmq_setsockopt (client, ZMQ_LINGER, &linger, sizeof (int));
+    assert (rc == 0);
+    rc = zmq_connect (client, frontend_endpoint);
+    assert (rc == 0);
+    return client;
+}
+
+//  Wait until the metric is value_, for timeout_ msec at most
+static bool
+wait_for (const uint64_t *field_, uint64_t value_, int timeout_)
+{
+    for (int i = 0; i < timeout_; i++) {
+        if (metrics_get (field_) == value_)
+            return true;
+        usleep (1000);
+    }
+    return metrics_get (field_) == value_;
+}
+
+static void
+run_case (const char *name_, bool is_elastic_)
+{
+    void *ctx = zmq_ctx_new ();
+    assert (ctx);
+    void *control = zmq_socket (ctx, ZMQ_PUB);
+    assert (control);
+    int rc = zmq_bind (control, "inproc://control");
+    assert (rc == 0);
+
+    pool_config_t pool;
+    pool_config_init (&pool);
+    pool.endpoint = backend_endpoint;
+    pool.secret_key = worker_sec;
+    pool.min = is_elastic_ ? 1 : qt_clients + 1;
+    pool.max = qt_clients + 1;
+    pool.target_idle = 1;
+    pool.cooldown = (uint64_t) cooldown * 1000;
+    pool.serve = echo;
+    proxy_config_t config;
+    proxy_config_init (&config);
+    config.frontend = frontend_endpoint;
+    config.backend = backend_endpoint;
+    config.waiting_room = qt_clients;
+    config.pool = &pool;
+    proxy_t *proxy = new proxy_t (ctx, config);
+    const metrics_t *metrics = proxy->metrics ();
+    void *proxy_thread = zmq_threadstart (&proxy_task, proxy);
+    bool is_up = wait_for (&metrics->workers, pool.min, BURST_TIMEOUT);
+    assert (is_up);
+
+    histogram_t reply;              //  usec
+    histogram_init (&reply);
+    histogram_t shrink;             //  usec, from the last client gone
+    histogram_init (&shrink);
+    uint64_t timeouts = 0;
+    void *clients [MAX_CLIENTS];
+    zmq_pollitem_t items [MAX_CLIENTS];
+    for (int burst = 0; burst < qt_bursts; burst++) {
+        uint64_t start = now_usec ();
+        for (int i = 0; i < qt_clients; i++) {
+            clients [i] = client_socket (ctx);
+            rc = zmq_send (clients [i], "hello", 5, 0);
+            assert (rc == 5);
+            items [i].socket = clients [i];
+            items [i].events = ZMQ_POLLIN;
+        }
+        int qt_replied = 0;
+        uint64_t deadline = start + BURST_TIMEOUT * 1000;
+        while (qt_replied < qt_clients && now_usec () < deadline) {
+            rc = zmq_poll (items, qt_clients, (long) ((deadline - now_usec ()) / 1000) + 1);
+            assert (rc >= 0);
+            uint64_t now = now_usec ();
+            for (int i = 0; i < qt_clients; i++) {
+                if (!(items [i].revents & ZMQ_POLLIN))
+                    continue;
+                char content [16];
+                rc = zmq_recv (clients [i], content, sizeof content, 0);
+                assert (rc == 5);
+                histogram_record (&reply, now - start);
+                items [i].events = 0;
+                qt_replied++;
+            }
+        }
+        timeouts += qt_clients - qt_replied;
+        for (int i = 0; i < qt_clients; i++) {
+            rc = zmq_close (clients [i]);
+            assert (rc == 0);
+        }
+        uint64_t gone = now_usec ();
+        is_up = wait_for (&metrics->sessions, 0, BURST_TIMEOUT);
+        assert (is_up);
+        if (is_elastic_) {
+            bool is_shrunk = wait_for (&metrics->pool_threads, pool.min, cooldown * 10 + BURST_TIMEOUT);
+            assert (is_shrunk);
+            histogram_record (&shrink, now_usec () - gone);
+        }
+        //  The worker connections of the sessions come back idle
+        is_up = wait_for (&metrics->workers, pool.min, BURST_TIMEOUT);
+        assert (is_up);
+    }
+
+    printf ("%-8s ", name_);
+    histogram_print (&reply, "reply", "usec");
+    printf ("%-8s %llu threads started, %llu retired, %llu clients with no reply\n", name_,
+        (unsigned long long) metrics_get (&metrics->pool_started),
+        (unsigned long long) metrics_get (&metrics->pool_retired),
+        (unsigned long long) timeouts);
+    if (is_elastic_) {
+        printf ("%-8s ", name_);
+        histogram_print (&shrink, "back to one thread", "usec");
+    }
+
+    rc = zmq_send (control, "TERMINATE", 10, 0);
+    assert (rc == 10);
+    zmq_threadclose (proxy_thread);
+    delete proxy;
+    zmq_close (control);
+    rc = zmq_ctx_term (ctx);
+    assert (rc == 0);
+}
+
+int main (int argc, char *argv [])
+{
+    const char *mode = argc > 1 ? argv [1] : "all";
+    if (argc > 2) qt_clients = atoi (argv [2]);
+    if (argc > 3) qt_bursts = atoi (argv [3]);
+    if (argc > 4) cooldown = atoi (argv [4]);
+    if ((strcmp (mode, "elastic") && strcmp (mode, "fixed") && strcmp (mode, "all"))
+    ||  qt_clients <= 0 || qt_clients >= MAX_CLIENTS || qt_bursts <= 0 || cooldown < 0) {
+        fprintf (stderr, "usage: pool [elastic|fixed|all] [clients] [bursts] [cooldown-msec]\n");
+        return 1;
+    }
+
+    int rc = zmq_curve_keypair (client_pub, client_sec);
+    assert (rc == 0);
+    rc = zmq_curve_keypair (worker_pub, worker_sec);
+    assert (rc == 0);
+
+    printf ("%d bursts of %d clients, cooldown %d msec\n", qt_bursts, qt_clients, cooldown);
+    bool is_all = !strcmp (mode, "all");
+    if (is_all || !strcmp (mode, "fixed"))
+        run_case ("fixed", false);
+    if (is_all || !strcmp (mode, "elastic"))
+        run_case ("elastic", true);
+    return 0;
+}
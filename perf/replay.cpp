@@ -0,0 +1,403 @@
+/*
+    Copyright (c) 2013 Contributors as noted in the AUTHORS file
+
+    This file is part of StreamQ-Proxy.
+
+    StreamQ-Proxy is free software; you can redistribute it and/or modify it
+    under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    StreamQ-Proxy is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+//  Replays the client side of sessions recorded by the proxy
+//  (config.record_path) against a running proxy and its workers.
+//
+//  Usage: replay <recording> [host:port] [speed|max] [copies]
+//
+//  Each recorded session is played copies times concurrently, over plain
+//  TCP connections: a NULL mechanism session is only bytes, the greeting
+//  and the READY command included. A client chunk is sent at its recorded
+//  time divided by speed (at once with max), and never before the worker
+//  has sent back as many bytes as it had in the recording, so that requests
+//  do not overtake the replies they depend on. The latency of a chunk is
+//  the time until the worker has sent all the bytes that followed it in
+//  the recording.
+
+#include "../src/recorder.hpp"
+#include "../src/clock.hpp"
+#include "../src/histogram.hpp"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <map>
+#include <queue>
+#include <vector>
+
+#define STALL_TIMEOUT 5000000       //  usec without progress before giving up
+
+typedef struct {
+    uint64_t usec;                  //  since the session opened
+    const unsigned char *data;
+    size_t size;
+    uint64_t replied_before;        //  worker bytes to wait for before sending
+    uint64_t reply_until;           //  worker bytes that end its reply, 0 if none
+} replay_op_t;
+
+typedef struct {
+    uint64_t open_usec;             //  since the recording started
+    std::vector <replay_op_t> ops;
+    uint64_t worker_bytes;
+} replay_script_t;
+
+typedef struct {
+    const replay_script_t *script;
+    enum {waiting, connecting, running, done, failed} state;
+    int fd;
+    uint64_t start;                 //  usec, when the session opens
+    size_t next_op;
+    size_t written;                 //  bytes of the next op already sent
+    uint64_t received;
+    uint64_t measure_from;          //  usec, 0 when no reply is awaited
+    uint64_t measure_until;         //  worker bytes
+    uint64_t timer;                 //  due time of its timer, 0 if none
+} replay_session_t;
+
+typedef std::pair <uint64_t, size_t> replay_timer_t;
+typedef std::priority_queue <replay_timer_t, std::vector <replay_timer_t>, std::greater <replay_timer_t> > timers_t;
+
+static double speed = 1;            //  0 for max
+static struct sockaddr_in address;
+static int epoll_fd;
+static timers_t timers;
+static histogram_t latency;         //  usec
+static uint64_t chunks_sent, bytes_sent, bytes_received;
+static size_t qt_over;              //  sessions done or failed
+
+static int
+load (const char *path, std::vector <unsigned char> &content,
+    std::map <uint32_t, replay_script_t> &scripts)
+{
+    FILE *file = fopen (path, "rb");
+    if (!file)
+        return -1;
+    struct stat st;
+    if (fstat (fileno (file), &st) < 0 || st.st_size < RECORD_MAGIC_SIZE) {
+        fclose (file);
+        return -1;
+    }
+    content.resize (st.st_size);
+    size_t size = fread (&content [0], 1, content.size (), file);
+    fclose (file);
+    if (size != content.size () || memcmp (&content [0], RECORD_MAGIC, RECORD_MAGIC_SIZE))
+        return -1;
+
+    const unsigned char *at = &content [0] + RECORD_MAGIC_SIZE;
+    const unsigned char *end = &content [0] + content.size ();
+    record_t record;
+    int rc;
+    while ((rc = record_next (at, end, &record)) > 0) {
+        if (record.type == RECORD_OPEN) {
+            replay_script_t &script = scripts [record.session];
+            script.open_usec = record.usec;
+            script.worker_bytes = 0;
+            continue;
+        }
+        //  A session opened before the recording was truncated at the front
+        std::map <uint32_t, replay_script_t>::iterator it = scripts.find (record.session);
+        if (it == scripts.end ())
+            continue;
+        replay_script_t &script = it->second;
+        if (record.type == RECORD_CLIENT) {
+            replay_op_t op;
+            op.usec = record.usec - script.open_usec;
+            op.data = record.data;
+            op.size = record.size;
+            op.replied_before = script.worker_bytes;
+            op.reply_until = 0;
+            script.ops.push_back (op);
+        }
+        else
+        if (record.type == RECORD_WORKER) {
+            script.worker_bytes += record.size;
+            if (!script.ops.empty ())
+                script.ops.back ().reply_until = script.worker_bytes;
+        }
+    }
+    return rc;
+}
+
+static void
+set_timer (replay_session_t &session, size_t index, uint64_t due)
+{
+    session.timer = due;
+    timers.push (replay_timer_t (due, index));
+}
+
+static void
+watch_output (replay_session_t &session, size_t index, bool is_on)
+{
+    struct epoll_event event;
+    event.events = is_on ? EPOLLIN | EPOLLOUT : EPOLLIN;
+    event.data.u64 = index;
+    epoll_ctl (epoll_fd, EPOLL_CTL_MOD, session.fd, &event);
+}
+
+static void
+fail (replay_session_t &session)
+{
+    if (session.fd >= 0)
+        close (session.fd);
+    session.fd = -1;
+    session.state = replay_session_t::failed;
+    qt_over++;
+}
+
+static void
+start (replay_session_t &session, size_t index)
+{
+    session.fd = socket (AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (session.fd < 0) {
+        fail (session);
+        return;
+    }
+    int flag = 1;
+    setsockopt (session.fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof flag);
+    int rc = connect (session.fd, (struct sockaddr *) &address, sizeof address);
+    if (rc < 0 && errno != EINPROGRESS) {
+        fail (session);
+        return;
+    }
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLOUT;
+    event.data.u64 = index;
+    epoll_ctl (epoll_fd, EPOLL_CTL_ADD, session.fd, &event);
+    session.state = replay_session_t::connecting;
+}
+
+//  Send what is due, and arm the timer of the next op
+static void
+advance (replay_session_t &session, size_t index, uint64_t now)
+{
+    const std::vector <replay_op_t> &ops = session.script->ops;
+    while (session.next_op < ops.size ()) {
+        const replay_op_t &op = ops [session.next_op];
+        if (session.received < op.replied_before)
+            return;
+        uint64_t due = speed ? session.start + (uint64_t) (op.usec / speed) : now;
+        if (due > now) {
+            if (session.timer != due)
+                set_timer (session, index, due);
+            return;
+        }
+        ssize_t rc = write (session.fd, op.data + session.written, op.size - session.written);
+        if (rc < 0 && errno != EAGAIN) {
+            fail (session);
+            return;
+        }
+        if (rc > 0) {
+            session.written += rc;
+            bytes_sent += rc;
+        }
+        if (session.written < op.size) {
+            watch_output (session, index, true);
+            return;
+        }
+        chunks_sent++;
+        if (op.reply_until) {
+            session.measure_from = now;
+            session.measure_until = op.reply_until;
+        }
+        session.written = 0;
+        session.next_op++;
+    }
+    if (session.received >= session.script->worker_bytes) {
+        close (session.fd);
+        session.fd = -1;
+        session.state = replay_session_t::done;
+        qt_over++;
+    }
+}
+
+static void
+input (replay_session_t &session, size_t index, uint64_t now)
+{
+    char buffer [65536];
+    while (true) {
+        ssize_t rc = read (session.fd, buffer, sizeof buffer);
+        if (rc > 0) {
+            session.received += rc;
+            bytes_received += rc;
+            continue;
+        }
+        if (rc < 0 && errno == EAGAIN)
+            break;
+        //  Closed by the proxy before the end of the script
+        fail (session);
+        return;
+    }
+    if (session.measure_from && session.received >= session.measure_until) {
+        histogram_record (&latency, now - session.measure_from);
+        session.measure_from = 0;
+    }
+    advance (session, index, now);
+}
+
+int main (int argc, char *argv [])
+{
+    if (argc < 2) {
+        fprintf (stderr, "usage: replay <recording> [host:port] [speed|max] [copies]\n");
+        return 1;
+    }
+    const char *endpoint = argc > 2 ? argv [2] : "127.0.0.1:9999";
+    if (!strncmp (endpoint, "tcp://", 6))
+        endpoint += 6;
+    if (argc > 3)
+        speed = strcmp (argv [3], "max") ? atof (argv [3]) : 0;
+    int copies = argc > 4 ? atoi (argv [4]) : 1;
+    std::string host (endpoint, strchr (endpoint, ':') ? strchr (endpoint, ':') - endpoint : strlen (endpoint));
+    memset (&address, 0, sizeof address);
+    address.sin_family = AF_INET;
+    address.sin_port = htons (strchr (endpoint, ':') ? atoi (strchr (endpoint, ':') + 1) : 9999);
+    if (inet_pton (AF_INET, host.c_str (), &address.sin_addr) != 1 || speed < 0 || copies < 1) {
+        fprintf (stderr, "usage: replay <recording> [host:port] [speed|max] [copies]\n");
+        return 1;
+    }
+
+    std::vector <unsigned char> content;
+    std::map <uint32_t, replay_script_t> scripts;
+    if (load (argv [1], content, scripts) < 0) {
+        fprintf (stderr, "replay: %s is not a readable recording\n", argv [1]);
+        return 1;
+    }
+    if (scripts.empty ()) {
+        fprintf (stderr, "replay: no NULL session in %s\n", argv [1]);
+        return 1;
+    }
+
+    struct rlimit limit;
+    getrlimit (RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit (RLIMIT_NOFILE, &limit);
+
+    //  The sessions open at their recorded time, from the first one
+    uint64_t first_open = scripts.begin ()->second.open_usec;
+    for (std::map <uint32_t, replay_script_t>::iterator it = scripts.begin (); it != scripts.end (); ++it)
+        if (it->second.open_usec < first_open)
+            first_open = it->second.open_usec;
+
+    epoll_fd = epoll_create1 (0);
+    assert (epoll_fd >= 0);
+    histogram_init (&latency);
+    uint64_t begin = now_usec ();
+    std::vector <replay_session_t> sessions;
+    for (int copy = 0; copy < copies; copy++)
+        for (std::map <uint32_t, replay_script_t>::iterator it = scripts.begin (); it != scripts.end (); ++it) {
+            replay_session_t session;
+            memset (&session, 0, sizeof session);
+            session.script = &it->second;
+            session.state = replay_session_t::waiting;
+            session.fd = -1;
+            session.start = begin + (speed ? (uint64_t) ((it->second.open_usec - first_open) / speed) : 0);
+            sessions.push_back (session);
+        }
+    for (size_t i = 0; i < sessions.size (); i++)
+        set_timer (sessions [i], i, sessions [i].start);
+
+    uint64_t progress = begin;
+    std::vector <struct epoll_event> events (1024);
+    while (qt_over < sessions.size ()) {
+        uint64_t now = now_usec ();
+        int timeout = 100;
+        if (!timers.empty ())
+            timeout = timers.top ().first > now ? (int) ((timers.top ().first - now) / 1000) : 0;
+        int rc = epoll_wait (epoll_fd, &events [0], (int) events.size (), timeout);
+        assert (rc >= 0 || errno == EINTR);
+        now = now_usec ();
+
+        for (int i = 0; i < rc; i++) {
+            size_t index = events [i].data.u64;
+            replay_session_t &session = sessions [index];
+            if (session.state == replay_session_t::connecting) {
+                int err = 0;
+                socklen_t len = sizeof err;
+                getsockopt (session.fd, SOL_SOCKET, SO_ERROR, &err, &len);
+                if (err) {
+                    fail (session);
+                    continue;
+                }
+                session.state = replay_session_t::running;
+                watch_output (session, index, false);
+                advance (session, index, now);
+                continue;
+            }
+            if (session.state != replay_session_t::running)
+                continue;
+            if (events [i].events & EPOLLOUT) {
+                watch_output (session, index, false);
+                advance (session, index, now);
+            }
+            if (session.state == replay_session_t::running
+            &&  events [i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+                input (session, index, now);
+        }
+
+        while (!timers.empty () && timers.top ().first <= now) {
+            size_t index = timers.top ().second;
+            uint64_t due = timers.top ().first;
+            timers.pop ();
+            replay_session_t &session = sessions [index];
+            if (session.timer != due)
+                continue;
+            session.timer = 0;
+            if (session.state == replay_session_t::waiting)
+                start (session, index);
+            else
+            if (session.state == replay_session_t::running)
+                advance (session, index, now);
+        }
+
+        if (rc > 0)
+            progress = now;
+        if (now - progress > STALL_TIMEOUT && timers.empty ())
+            break;
+    }
+    uint64_t elapsed = now_usec () - begin;
+
+    size_t qt_done = 0, qt_failed = 0;
+    for (size_t i = 0; i < sessions.size (); i++) {
+        if (sessions [i].state == replay_session_t::done)
+            qt_done++;
+        else
+        if (sessions [i].state == replay_session_t::failed)
+            qt_failed++;
+        if (sessions [i].fd >= 0)
+            close (sessions [i].fd);
+    }
+    printf ("%d recorded sessions x %d, speed %s: %d done, %d failed, %d stalled in %.3f s\n",
+        (int) scripts.size (), copies, speed ? argv [3] : "max",
+        (int) qt_done, (int) qt_failed, (int) (sessions.size () - qt_done - qt_failed),
+        (double) elapsed / 1000000);
+    printf ("%.0f chunks/s, %.2f MB/s sent, %.2f MB/s received\n",
+        (double) chunks_sent * 1000000 / elapsed,
+        (double) bytes_sent / elapsed, (double) bytes_received / elapsed);
+    histogram_print (&latency, "reply latency", "usec");
+    close (epoll_fd);
+    return qt_done == sessions.size () ? 0 : 1;
+}
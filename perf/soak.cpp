@@ -0,0 +1,403 @@
+/*
+    Copyright (c) 2013 Contributors as noted in the AUTHORS file
+
+    This file is part of StreamQ-Proxy.
+
+    StreamQ-Proxy is free software; you can redistribute it and/or modify it
+    under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    StreamQ-Proxy is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+//  Churn soak: CURVE clients connect, go through the handshake, play a few
+//  round trips and leave, at a steady rate, while worker connections come
+//  and go, for hours and millions of sessions. Every second it samples the
+//  resident memory, the heap the allocator has handed out and kept, the
+//  open descriptors, and the tables of the proxy: worker connections,
+//  sessions, waiting clients and bytes held.
+//
+//  Usage: soak [seconds] [sessions/s] [client-threads] [worker-threads] [worker-churn/s] [requests]
+//
+//  It fails, exit status 1, when a resource grows steadily: the samples
+//  are taken by windows of WINDOW seconds after a warmup, and a resource
+//  whose minimum went up over the last GROWTH_WINDOWS windows in a row, by
+//  more than its tolerance, is reported. The minimum of a window is what
+//  is left once the load has come and gone, a leak shows there first. The
+//  clients and workers are in the process with the proxy, and weigh on the
+//  memory the same from one window to the next.
+
+#include "../include/zmq.h"
+#include "../include/zmq_utils.h"
+#include "../src/proxy.hpp"
+#include "../src/clock.hpp"
+
+#include <dirent.h>
+#include <malloc.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <vector>
+
+#define KEY_SIZE 40
+#define REQUEST_SIZE 64
+#define CONNECTIONS_PER_WORKER 64
+#define WARMUP 60                   //  seconds not judged
+#define WINDOW 60                   //  seconds
+#define GROWTH_WINDOWS 5
+
+static char client_pub [KEY_SIZE + 1], client_sec [KEY_SIZE + 1];
+static char worker_pub [KEY_SIZE + 1], worker_sec [KEY_SIZE + 1];
+
+static int seconds = 3600;
+static int session_rate = 1000;     //  sessions/s over all the client threads
+static int qt_client_threads = 16;
+static int qt_worker_threads = 4;
+static int churn_rate = 10;         //  worker connections closed and reopened per second
+static int qt_requests = 4;         //  round trips per session
+static int stop;
+
+typedef struct {
+    void *ctx;
+    uint64_t sessions;
+    uint64_t failed;                //  with a round trip not answered
+} client_args_t;
+
+typedef struct {
+    void *ctx;
+    uint64_t seed;
+    uint64_t churned;
+} worker_args_t;
+
+//  A resource, by window minima
+typedef struct {
+    const char *name;
+    const char *unit;
+    uint64_t tolerance;             //  growth over the windows let go
+    uint64_t window_min;
+    std::vector <uint64_t> *minima;
+} series_t;
+
+static void
+proxy_task (void *proxy)
+{
+    int rc = ((proxy_t *) proxy)->run ();
+    assert (rc == 0);
+}
+
+static void *
+worker_socket (void *ctx)
+{
+    void *worker = zmq_socket (ctx, ZMQ_DEALER);
+    assert (worker);
+    int as_server = 1;
+    int rc = zmq_setsockopt (worker, ZMQ_CURVE_SERVER, &as_server, sizeof (int));
+    assert (rc == 0);
+    rc = zmq_setsockopt (worker, ZMQ_CURVE_SECRETKEY, worker_sec, KEY_SIZE);
+    assert (rc == 0);
+    int linger = 0;
+    rc = zmq_setsockopt (worker, ZMQ_LINGER, &linger, sizeof (int));
+    assert (rc == 0);
+    rc = zmq_connect (worker, "tcp://127.0.0.1:9998");
+    assert (rc == 0);
+    return worker;
+}
+
+//  Echoes on its connections, and every so often closes one of them, idle
+//  or not, and opens another
+static void
+worker_task (void *arg)
+{
+    worker_args_t *args = (worker_args_t *) arg;
+    zmq_pollitem_t items [CONNECTIONS_PER_WORKER];
+    for (int i = 0; i < CONNECTIONS_PER_WORKER; i++) {
+        items [i].socket = worker_socket (args->ctx);
+        items [i].fd = 0;
+        items [i].events = ZMQ_POLLIN;
+        items [i].revents = 0;
+    }
+    double rate = (double) churn_rate / qt_worker_threads;
+    uint64_t period = rate > 0 ? (uint64_t) (1e6 / rate) : 0;
+    uint64_t next_churn = now_usec () + period;
+    char content [REQUEST_SIZE];
+    while (!__atomic_load_n (&stop, __ATOMIC_RELAXED)) {
+        int rc = zmq_poll (items, CONNECTIONS_PER_WORKER, 10);
+        if (rc < 0)
+            break;
+        for (int i = 0; i < CONNECTIONS_PER_WORKER; i++)
+            if (items [i].revents & ZMQ_POLLIN) {
+                int size = zmq_recv (items [i].socket, content, sizeof content, ZMQ_DONTWAIT);
+                if (size > 0)
+                    zmq_send (items [i].socket, content, size, 0);
+            }
+        if (period && now_usec () >= next_churn) {
+            args->seed = args->seed * 6364136223846793005ull + 1442695040888963407ull;
+            int i = (int) ((args->seed >> 33) % CONNECTIONS_PER_WORKER);
+            zmq_close (items [i].socket);
+            items [i].socket = worker_socket (args->ctx);
+            args->churned++;
+            next_churn += period;
+        }
+    }
+    for (int i = 0; i < CONNECTIONS_PER_WORKER; i++)
+        zmq_close (items [i].socket);
+}
+
+//  One session at a time, on schedule; a thread that is late starts the
+//  next one at once, without catching up more than a second
+static void
+client_task (void *arg)
+{
+    client_args_t *args = (client_args_t *) arg;
+    uint64_t period = (uint64_t) (1e6 * qt_client_threads / session_rate);
+    uint64_t next = now_usec ();
+    char content [REQUEST_SIZE];
+    memset (content, 'r', sizeof content);
+    while (!__atomic_load_n (&stop, __ATOMIC_RELAXED)) {
+        uint64_t now = now_usec ();
+        if (now < next) {
+            usleep ((useconds_t) (next - now));
+            continue;
+        }
+        next = (now - next > 1000000 ? now : next) + period;
+
+        void *client = zmq_socket (args->ctx, ZMQ_DEALER);
+        assert (client);
+        int rc = zmq_setsockopt (client, ZMQ_CURVE_SERVERKEY, worker_pub, KEY_SIZE);
+        assert (rc == 0);
+        rc = zmq_setsockopt (client, ZMQ_CURVE_PUBLICKEY, client_pub, KEY_SIZE);
+        assert (rc == 0);
+        rc = zmq_setsockopt (client, ZMQ_CURVE_SECRETKEY, client_sec, KEY_SIZE);
+        assert (rc == 0);
+        int linger = 0;
+        rc = zmq_setsockopt (client, ZMQ_LINGER, &linger, sizeof (int));
+        assert (rc == 0);
+        int timeout = 2000;
+        rc = zmq_setsockopt (client, ZMQ_RCVTIMEO, &timeout, sizeof (int));
+        assert (rc == 0);
+        rc = zmq_connect (client, "tcp://127.0.0.1:9999");
+        assert (rc == 0);
+        for (int i = 0; i < qt_requests; i++) {
+            rc = zmq_send (client, content, sizeof content, 0);
+            assert (rc == (int) sizeof content);
+            //  Its worker connection may have been churned
+            if (zmq_recv (client, content, sizeof content, 0) != (int) sizeof content) {
+                args->failed++;
+                break;
+            }
+        }
+        zmq_close (client);
+        args->sessions++;
+    }
+}
+
+static uint64_t
+rss_bytes ()
+{
+    FILE *file = fopen ("/proc/self/statm", "r");
+    if (!file)
+        return 0;
+    unsigned long long size = 0, resident = 0;
+    if (fscanf (file, "%llu %llu", &size, &resident) != 2)
+        resident = 0;
+    fclose (file);
+    return resident * (uint64_t) sysconf (_SC_PAGESIZE);
+}
+
+static uint64_t
+open_fds ()
+{
+    DIR *dir = opendir ("/proc/self/fd");
+    if (!dir)
+        return 0;
+    uint64_t count = 0;
+    struct dirent *entry;
+    while ((entry = readdir (dir)) != NULL)
+        if (entry->d_name [0] != '.')
+            count++;
+    closedir (dir);
+    return count - 1;               //  the one of the listing
+}
+
+//  Heap handed out, and kept by the allocator without being in use
+static void
+heap_bytes (uint64_t *in_use, uint64_t *kept)
+{
+#if defined __GLIBC__ && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+    struct mallinfo2 info = mallinfo2 ();
+#else
+    struct mallinfo info = mallinfo ();
+#endif
+    *in_use = (uint64_t) info.uordblks + (uint64_t) info.hblkhd;
+    *kept = (uint64_t) info.fordblks;
+}
+
+static void
+series_add (series_t *series, uint64_t value, bool is_window_end)
+{
+    if (value < series->window_min)
+        series->window_min = value;
+    if (is_window_end) {
+        series->minima->push_back (series->window_min);
+        series->window_min = UINT64_MAX;
+    }
+}
+
+//  True if the minima went up GROWTH_WINDOWS times in a row, by more than
+//  the tolerance over them
+static bool
+series_grows (const series_t *series)
+{
+    const std::vector <uint64_t> &minima = *series->minima;
+    if (minima.size () < GROWTH_WINDOWS + 1)
+        return false;
+    size_t first = minima.size () - GROWTH_WINDOWS - 1;
+    for (size_t i = first + 1; i < minima.size (); i++)
+        if (minima [i] <= minima [i - 1])
+            return false;
+    return minima.back () - minima [first] > series->tolerance;
+}
+
+int main (int argc, char *argv [])
+{
+    if (argc > 1) seconds = atoi (argv [1]);
+    if (argc > 2) session_rate = atoi (argv [2]);
+    if (argc > 3) qt_client_threads = atoi (argv [3]);
+    if (argc > 4) qt_worker_threads = atoi (argv [4]);
+    if (argc > 5) churn_rate = atoi (argv [5]);
+    if (argc > 6) qt_requests = atoi (argv [6]);
+    if (seconds <= 0 || session_rate <= 0 || qt_client_threads <= 0
+    ||  qt_worker_threads <= 0 || churn_rate < 0 || qt_requests <= 0) {
+        fprintf (stderr, "usage: soak [seconds] [sessions/s] [client-threads] [worker-threads] [worker-churn/s] [requests]\n");
+        return 1;
+    }
+
+    int rc = zmq_curve_keypair (client_pub, client_sec);
+    assert (rc == 0);
+    rc = zmq_curve_keypair (worker_pub, worker_sec);
+    assert (rc == 0);
+    void *ctx = zmq_ctx_new ();
+    assert (ctx);
+    void *control = zmq_socket (ctx, ZMQ_PUB);
+    assert (control);
+    rc = zmq_bind (control, "inproc://control");
+    assert (rc == 0);
+
+    //  The clients wait a little when the churn has taken their worker
+    proxy_config_t config;
+    proxy_config_init (&config);
+    config.waiting_room = qt_client_threads;
+    config.waiting_deadline = 1000000;
+    proxy_t *proxy = new proxy_t (ctx, config);
+    const metrics_t *metrics = proxy->metrics ();
+    void *proxy_thread = zmq_threadstart (&proxy_task, proxy);
+
+    std::vector <worker_args_t> workers (qt_worker_threads);
+    std::vector <void *> worker_threads (qt_worker_threads);
+    for (int i = 0; i < qt_worker_threads; i++) {
+        workers [i].ctx = ctx;
+        workers [i].seed = 0x9e3779b97f4a7c15ull * (i + 1);
+        workers [i].churned = 0;
+        worker_threads [i] = zmq_threadstart (&worker_task, &workers [i]);
+    }
+    std::vector <client_args_t> clients (qt_client_threads);
+    std::vector <void *> client_threads (qt_client_threads);
+    for (int i = 0; i < qt_client_threads; i++) {
+        clients [i].ctx = ctx;
+        clients [i].sessions = 0;
+        clients [i].failed = 0;
+        client_threads [i] = zmq_threadstart (&client_task, &clients [i]);
+    }
+
+    //  The tables of the proxy move with the load, up to what the clients
+    //  and workers can hold; a leak takes them past that
+    uint64_t qt_connections = (uint64_t) qt_worker_threads * CONNECTIONS_PER_WORKER;
+    std::vector <uint64_t> minima [8];
+    series_t series [8] = {
+        { "rss", "bytes", 4 << 20, UINT64_MAX, &minima [0] },
+        { "heap in use", "bytes", 1 << 20, UINT64_MAX, &minima [1] },
+        { "heap kept", "bytes", 4 << 20, UINT64_MAX, &minima [2] },
+        { "fds", "", 8, UINT64_MAX, &minima [3] },
+        { "workers", "", qt_connections, UINT64_MAX, &minima [4] },
+        { "sessions", "", (uint64_t) qt_client_threads, UINT64_MAX, &minima [5] },
+        { "waiting", "", (uint64_t) qt_client_threads, UINT64_MAX, &minima [6] },
+        { "queue bytes", "bytes", (uint64_t) qt_client_threads * REQUEST_SIZE * qt_requests, UINT64_MAX, &minima [7] }
+    };
+    printf ("%d sessions/s, %d client threads, %d worker connections, %d churned/s, %d round trips per session\n",
+        session_rate, qt_client_threads, qt_worker_threads * CONNECTIONS_PER_WORKER, churn_rate, qt_requests);
+    printf ("sec  sessions  failed  rss(KB)  heap-used(KB)  heap-kept(KB)  fds  workers  sessions  waiting  queue-bytes\n");
+
+    bool is_growing = false;
+    uint64_t start = now_usec ();
+    for (int second = 1; second <= seconds && !is_growing; second++) {
+        uint64_t until = start + (uint64_t) second * 1000000;
+        uint64_t now = now_usec ();
+        if (until > now)
+            usleep ((useconds_t) (until - now));
+
+        uint64_t sessions = 0, failed = 0;
+        for (int i = 0; i < qt_client_threads; i++) {
+            sessions += __atomic_load_n (&clients [i].sessions, __ATOMIC_RELAXED);
+            failed += __atomic_load_n (&clients [i].failed, __ATOMIC_RELAXED);
+        }
+        uint64_t values [8];
+        values [0] = rss_bytes ();
+        heap_bytes (&values [1], &values [2]);
+        values [3] = open_fds ();
+        values [4] = metrics_get (&metrics->workers);
+        values [5] = metrics_get (&metrics->sessions);
+        values [6] = metrics_get (&metrics->waiting);
+        values [7] = metrics_get (&metrics->queue_bytes);
+        printf ("%d  %llu  %llu  %llu  %llu  %llu  %llu  %llu  %llu  %llu  %llu\n", second,
+            (unsigned long long) sessions, (unsigned long long) failed,
+            (unsigned long long) values [0] / 1024, (unsigned long long) values [1] / 1024,
+            (unsigned long long) values [2] / 1024, (unsigned long long) values [3],
+            (unsigned long long) values [4], (unsigned long long) values [5],
+            (unsigned long long) values [6], (unsigned long long) values [7]);
+        fflush (stdout);
+
+        if (second <= WARMUP)
+            continue;
+        bool is_window_end = (second - WARMUP) % WINDOW == 0;
+        for (int i = 0; i < 8; i++) {
+            series_add (&series [i], values [i], is_window_end);
+            if (is_window_end && series_grows (&series [i])) {
+                const std::vector <uint64_t> &m = *series [i].minima;
+                fprintf (stderr, "soak: %s grows, minimum %llu %s %d windows ago, %llu %s now\n",
+                    series [i].name, (unsigned long long) m [m.size () - GROWTH_WINDOWS - 1],
+                    series [i].unit, GROWTH_WINDOWS, (unsigned long long) m.back (), series [i].unit);
+                is_growing = true;
+            }
+        }
+    }
+
+    __atomic_store_n (&stop, 1, __ATOMIC_RELAXED);
+    uint64_t sessions = 0, failed = 0, churned = 0;
+    for (int i = 0; i < qt_client_threads; i++) {
+        zmq_threadclose (client_threads [i]);
+        sessions += clients [i].sessions;
+        failed += clients [i].failed;
+    }
+    for (int i = 0; i < qt_worker_threads; i++) {
+        zmq_threadclose (worker_threads [i]);
+        churned += workers [i].churned;
+    }
+    rc = zmq_send (control, "TERMINATE", 10, 0);
+    assert (rc == 10);
+    zmq_threadclose (proxy_thread);
+    printf ("%llu sessions, %llu failed, %llu worker connections churned, %llu sessions seen by the proxy\n",
+        (unsigned long long) sessions, (unsigned long long) failed, (unsigned long long) churned,
+        (unsigned long long) metrics_get (&metrics->sessions_total));
+    delete proxy;
+    zmq_close (control);
+    rc = zmq_ctx_term (ctx);
+    assert (rc == 0);
+    printf (is_growing ? "soak: FAILED\n" : "soak: passed\n");
+    return is_growing ? 1 : 0;
+}
@@ -0,0 +1,204 @@
+/*
+    Copyright (c) 2013 Contributors as noted in the AUTHORS file
+
+    This file is part of StreamQ-Proxy.
+
+    StreamQ-Proxy is free software; you can redistribute it and/or modify it
+    under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    StreamQ-Proxy is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+//  Latency added per proxy tier: one CURVE client and one CURVE worker play
+//  ping-pong directly, then through a chain of 1 to max-tiers proxies, the
+//  worker connecting to the last one, each tier uplinked to the backend of
+//  the tier before it.
+//
+//  Usage: tiers [max-tiers] [round-trips] [size]
+//
+//  The edge proxy listens on 9999 and 9998, tier i on 9998 - i. The first
+//  round trips are not recorded, so that the handshake through the chain
+//  is not in the distribution; it is timed on its own.
+
+#include "../include/zmq.h"
+#include "../include/zmq_utils.h"
+#include "../src/proxy.hpp"
+#include "../src/clock.hpp"
+#include "../src/histogram.hpp"
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <vector>
+
+#define KEY_SIZE 40
+#define MAX_TIERS 8
+#define WARMUP 1000                 //  round trips not recorded
+
+static char client_pub [KEY_SIZE + 1], client_sec [KEY_SIZE + 1];
+static char worker_pub [KEY_SIZE + 1], worker_sec [KEY_SIZE + 1];
+
+static int max_tiers = 3;
+static int qt_round_trips = 100000;
+static int message_size = 64;
+
+static void
+proxy_task (void *proxy)
+{
+    int rc = ((proxy_t *) proxy)->run ();
+    assert (rc == 0);
+}
+
+static void
+worker_task (void *worker)
+{
+    zmq_msg_t msg;
+    int rc = zmq_msg_init (&msg);
+    assert (rc == 0);
+    //  An empty message ends the game
+    while (true) {
+        rc = zmq_msg_recv (&msg, worker, 0);
+        assert (rc >= 0);
+        if (rc == 0)
+            break;
+        rc = zmq_msg_send (&msg, worker, 0);
+        assert (rc >= 0);
+    }
+    zmq_msg_close (&msg);
+}
+
+static void *
+dealer (void *ctx, const char *endpoint, bool is_worker, bool is_bind)
+{
+    void *socket = zmq_socket (ctx, ZMQ_DEALER);
+    assert (socket);
+    int linger = 0;
+    int rc = zmq_setsockopt (socket, ZMQ_LINGER, &linger, sizeof (int));
+    assert (rc == 0);
+    if (is_worker) {
+        int as_server = 1;
+        rc = zmq_setsockopt (socket, ZMQ_CURVE_SERVER, &as_server, sizeof (int));
+        assert (rc == 0);
+        rc = zmq_setsockopt (socket, ZMQ_CURVE_SECRETKEY, worker_sec, KEY_SIZE);
+        assert (rc == 0);
+    }
+    else {
+        rc = zmq_setsockopt (socket, ZMQ_CURVE_SERVERKEY, worker_pub, KEY_SIZE);
+        assert (rc == 0);
+        rc = zmq_setsockopt (socket, ZMQ_CURVE_PUBLICKEY, client_pub, KEY_SIZE);
+        assert (rc == 0);
+        rc = zmq_setsockopt (socket, ZMQ_CURVE_SECRETKEY, client_sec, KEY_SIZE);
+        assert (rc == 0);
+    }
+    rc = is_bind ? zmq_bind (socket, endpoint) : zmq_connect (socket, endpoint);
+    assert (rc == 0);
+    return socket;
+}
+
+//  The median round trip, in nsec
+static uint64_t
+run_case (int qt_tiers)
+{
+    void *ctx = zmq_ctx_new ();
+    assert (ctx);
+    void *control = zmq_socket (ctx, ZMQ_PUB);
+    assert (control);
+    int rc = zmq_bind (control, "inproc://control");
+    assert (rc == 0);
+
+    char backends [MAX_TIERS][32];
+    proxy_t *proxies [MAX_TIERS];
+    void *proxy_threads [MAX_TIERS];
+    for (int i = 0; i < qt_tiers; i++) {
+        proxy_config_t config;
+        proxy_config_init (&config);
+        sprintf (backends [i], "tcp://127.0.0.1:%d", 9998 - i);
+        config.backend = backends [i];
+        if (i > 0)
+            config.uplink = backends [i - 1];
+        proxies [i] = new proxy_t (ctx, config);
+        proxy_threads [i] = zmq_threadstart (&proxy_task, proxies [i]);
+    }
+    //  Directly, the worker binds the port of the edge
+    void *worker = qt_tiers
+        ? dealer (ctx, backends [qt_tiers - 1], true, false)
+        : dealer (ctx, "tcp://127.0.0.1:9999", true, true);
+    //  Registered at the edge through all the tiers
+    if (qt_tiers)
+        while (metrics_get (&proxies [0]->metrics ()->workers) < 1)
+            usleep (1000);
+    void *worker_thread = zmq_threadstart (&worker_task, worker);
+
+    uint64_t start = now_nsec ();
+    void *client = dealer (ctx, "tcp://127.0.0.1:9999", false, false);
+    histogram_t rtt;                //  nsec
+    histogram_init (&rtt);
+    std::vector <char> content (message_size, 'x');
+    uint64_t first = 0;
+    for (int i = 0; i < WARMUP + qt_round_trips; i++) {
+        if (i > 0)
+            start = now_nsec ();
+        rc = zmq_send (client, &content [0], message_size, 0);
+        assert (rc == message_size);
+        rc = zmq_recv (client, &content [0], message_size, 0);
+        assert (rc == message_size);
+        if (i == 0)
+            first = now_nsec () - start;
+        if (i >= WARMUP)
+            histogram_record (&rtt, now_nsec () - start);
+    }
+    rc = zmq_send (client, "", 0, 0);
+    assert (rc == 0);
+    zmq_threadclose (worker_thread);
+
+    printf ("%d tiers: first round trip with the handshake %llu usec\n",
+        qt_tiers, (unsigned long long) (first / 1000));
+    printf ("%d tiers: ", qt_tiers);
+    histogram_print (&rtt, "round trip", "nsec");
+
+    zmq_close (client);
+    zmq_close (worker);
+    rc = zmq_send (control, "TERMINATE", 10, 0);
+    assert (rc == 10);
+    for (int i = 0; i < qt_tiers; i++) {
+        zmq_threadclose (proxy_threads [i]);
+        delete proxies [i];
+    }
+    zmq_close (control);
+    rc = zmq_ctx_term (ctx);
+    assert (rc == 0);
+    return histogram_percentile (&rtt, 50);
+}
+
+int main (int argc, char *argv [])
+{
+    if (argc > 1) max_tiers = atoi (argv [1]);
+    if (argc > 2) qt_round_trips = atoi (argv [2]);
+    if (argc > 3) message_size = atoi (argv [3]);
+    if (max_tiers < 1 || max_tiers > MAX_TIERS || qt_round_trips <= 0 || message_size <= 0) {
+        fprintf (stderr, "usage: tiers [max-tiers] [round-trips] [size]\n");
+        return 1;
+    }
+
+    int rc = zmq_curve_keypair (client_pub, client_sec);
+    assert (rc == 0);
+    rc = zmq_curve_keypair (worker_pub, worker_sec);
+    assert (rc == 0);
+
+    printf ("%d round trips of %d bytes\n", qt_round_trips, message_size);
+    uint64_t previous = run_case (0);
+    for (int tiers = 1; tiers <= max_tiers; tiers++) {
+        uint64_t median = run_case (tiers);
+        printf ("%d tiers: median %+lld nsec for this tier\n",
+            tiers, (long long) median - (long long) previous);
+        previous = median;
+    }
+    return 0;
+}
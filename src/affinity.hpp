@@ -0,0 +1,301 @@
+/*
+    Copyright (c) 2013 Contributors as noted in the AUTHORS file
+
+    This file is part of StreamQ-Proxy.
+
+    StreamQ-Proxy is free software; you can redistribute it and/or modify it
+    under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    StreamQ-Proxy is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __STREAMQ_AFFINITY_HPP_INCLUDED__
+#define __STREAMQ_AFFINITY_HPP_INCLUDED__
+
+//  Client to worker affinity (SRD 160), kept in a memory mapped file so
+//  that it survives a restart of the proxy: a client that comes back gets
+//  the worker it had last time, if that worker is idle.
+//
+//  ZMQ_STREAM identities only live as long as their connection, so the
+//  keys are those of the hosts, from the Peer-Address of the connections:
+//  a client key is a client host, and a worker key a worker host, any of
+//  whose idle connections will do.
+//
+//  The file is an AFFINITY_MAGIC header, then a power of 2 of slots, an
+//  open addressing table. Opening it maps it and checks the header, with
+//  no parse step whatever its size. A key lives in the AFFINITY_PROBES
+//  slots from its hash; when they are all taken, the least recently
+//  updated one is reused. The slots are written so that the proxy may die
+//  between any two stores: the client key of a slot is stored last, and
+//  cleared first when the slot is reused, so that a slot never pairs a
+//  client with a worker it did not have. Lookups look at all the probes,
+//  and never stop at a free slot.
+//
+//  affinity_idle_t keeps the idle workers of each worker key, so that the
+//  one a client had is found without walking all the idle workers.
+
+#include "../include/zmq.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <list>
+#include <unordered_map>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define AFFINITY_MAGIC "SQAFFIN"    //  7 chars + '\0'
+#define AFFINITY_VERSION 1
+#define AFFINITY_PROBES 16
+
+//  libzmq 4.1 has it, the zmq.h copied here predates it
+extern "C" const char *zmq_msg_gets (zmq_msg_t *msg_, const char *property_);
+
+typedef struct {
+    char magic [8];
+    uint32_t version;
+    uint32_t slot_size;
+    uint64_t qt_slots;              //  a power of 2
+    uint64_t qt_entries;            //  slots in use
+    uint64_t clock;                 //  stamp of the last update
+    uint64_t reserved [3];          //  up to 64 bytes
+} affinity_header_t;
+
+typedef struct {
+    uint64_t client_key;            //  0 for a free slot
+    uint64_t worker_key;
+    uint64_t stamp;
+} affinity_slot_t;
+
+//  The key of a host address, never 0
+static inline uint64_t
+affinity_key (const char *address_, size_t size_)
+{
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < size_; i++) {
+        hash ^= (unsigned char) address_ [i];
+        hash *= 1099511628211ull;
+    }
+    return hash ? hash : 1;
+}
+
+//  The key of the host a message comes from, 0 if libzmq does not tell
+static inline uint64_t
+affinity_peer_key (zmq_msg_t *msg_)
+{
+    const char *address = zmq_msg_gets (msg_, "Peer-Address");
+    return address ? affinity_key (address, strlen (address)) : 0;
+}
+
+class affinity_t
+{
+public:
+
+    affinity_t () :
+        header (NULL),
+        slots (NULL),
+        size (0)
+    {
+    }
+
+    ~affinity_t ()
+    {
+        close ();
+    }
+
+    //  Maps the file, or creates it with qt_slots_ slots, rounded up to a
+    //  power of 2. An existing file keeps its own number of slots; one that
+    //  is not a valid store is started again. Returns -1 with errno set if
+    //  the file cannot be opened or mapped.
+    int open (const char *path_, uint64_t qt_slots_)
+    {
+        assert (!header);
+        int fd = ::open (path_, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (fd < 0)
+            return -1;
+        affinity_header_t existing;
+        struct stat st;
+        bool is_valid = fstat (fd, &st) == 0
+            && pread (fd, &existing, sizeof existing, 0) == (ssize_t) sizeof existing
+            && !memcmp (existing.magic, AFFINITY_MAGIC, sizeof existing.magic)
+            && existing.version == AFFINITY_VERSION
+            && existing.slot_size == sizeof (affinity_slot_t)
+            && existing.qt_slots && !(existing.qt_slots & (existing.qt_slots - 1))
+            && (uint64_t) st.st_size == sizeof existing + existing.qt_slots * sizeof (affinity_slot_t);
+
+        uint64_t qt_slots = 1;
+        if (is_valid)
+            qt_slots = existing.qt_slots;
+        else
+            while (qt_slots < qt_slots_ || qt_slots < AFFINITY_PROBES)
+                qt_slots <<= 1;
+        size = sizeof (affinity_header_t) + qt_slots * sizeof (affinity_slot_t);
+        if (!is_valid && (ftruncate (fd, 0) < 0 || ftruncate (fd, size) < 0)) {
+            int err = errno;
+            ::close (fd);
+            errno = err;
+            return -1;
+        }
+        void *map = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        int err = errno;
+        ::close (fd);
+        if (map == MAP_FAILED) {
+            errno = err;
+            return -1;
+        }
+        header = (affinity_header_t *) map;
+        slots = (affinity_slot_t *) (header + 1);
+        if (!is_valid) {
+            //  The magic goes last: a store whose header was not complete
+            //  is started again
+            header->version = AFFINITY_VERSION;
+            header->slot_size = sizeof (affinity_slot_t);
+            header->qt_slots = qt_slots;
+            __atomic_thread_fence (__ATOMIC_RELEASE);
+            memcpy (header->magic, AFFINITY_MAGIC, sizeof header->magic);
+        }
+        return 0;
+    }
+
+    void close ()
+    {
+        if (!header)
+            return;
+        munmap (header, size);
+        header = NULL;
+        slots = NULL;
+    }
+
+    bool is_open () const { return header != NULL; }
+    uint64_t entries () const { return header ? header->qt_entries : 0; }
+    uint64_t capacity () const { return header ? header->qt_slots : 0; }
+
+    //  The worker key of a client, 0 if it has none
+    uint64_t find (uint64_t client_key_) const
+    {
+        uint64_t mask = header->qt_slots - 1;
+        uint64_t pos = mix (client_key_);
+        for (int i = 0; i < AFFINITY_PROBES; i++) {
+            const affinity_slot_t &slot = slots [(pos + i) & mask];
+            if (__atomic_load_n (&slot.client_key, __ATOMIC_ACQUIRE) == client_key_)
+                return slot.worker_key;
+        }
+        return 0;
+    }
+
+    void update (uint64_t client_key_, uint64_t worker_key_)
+    {
+        assert (client_key_ && worker_key_);
+        uint64_t mask = header->qt_slots - 1;
+        uint64_t pos = mix (client_key_);
+        uint64_t stamp = ++header->clock;
+        affinity_slot_t *victim = NULL;
+        for (int i = 0; i < AFFINITY_PROBES; i++) {
+            affinity_slot_t *slot = &slots [(pos + i) & mask];
+            if (slot->client_key == client_key_) {
+                __atomic_store_n (&slot->worker_key, worker_key_, __ATOMIC_RELAXED);
+                __atomic_store_n (&slot->stamp, stamp, __ATOMIC_RELAXED);
+                return;
+            }
+            //  The first free slot, or else the least recently updated
+            if (!victim || (victim->client_key && (!slot->client_key || slot->stamp < victim->stamp)))
+                victim = slot;
+        }
+        if (victim->client_key)
+            __atomic_store_n (&victim->client_key, 0, __ATOMIC_RELEASE);
+        else
+            header->qt_entries++;
+        __atomic_store_n (&victim->worker_key, worker_key_, __ATOMIC_RELAXED);
+        __atomic_store_n (&victim->stamp, stamp, __ATOMIC_RELAXED);
+        __atomic_store_n (&victim->client_key, client_key_, __ATOMIC_RELEASE);
+    }
+
+private:
+
+    //  The keys are FNV hashes, whose low bits are poor
+    static uint64_t mix (uint64_t key_)
+    {
+        key_ ^= key_ >> 33;
+        key_ *= 0xff51afd7ed558ccdull;
+        key_ ^= key_ >> 33;
+        key_ *= 0xc4ceb9fe1a85ec53ull;
+        key_ ^= key_ >> 33;
+        return key_;
+    }
+
+    affinity_header_t *header;
+    affinity_slot_t *slots;
+    size_t size;
+
+    affinity_t (const affinity_t&);
+    const affinity_t &operator = (const affinity_t&);
+};
+
+//  The idle workers by worker key, in the order of the idle list: T has a
+//  worker_key, its idle_it in that list, and its key_it here. A worker
+//  with no key is not kept.
+template <class T>
+class affinity_idle_t
+{
+public:
+
+    affinity_idle_t () {}
+
+    //  A worker goes at the end of the idle list, or back at its front
+    //  with is_front_
+    void add (T *worker_, bool is_front_)
+    {
+        if (!worker_->worker_key)
+            return;
+        std::list <T *> &workers = keys [worker_->worker_key];
+        worker_->key_it = workers.insert (is_front_ ? workers.begin () : workers.end (), worker_);
+    }
+
+    //  A worker leaves the idle list other than by pick ()
+    void remove (T *worker_)
+    {
+        if (!worker_->worker_key)
+            return;
+        typename keys_t::iterator it = keys.find (worker_->worker_key);
+        assert (it != keys.end ());
+        it->second.erase (worker_->key_it);
+        if (it->second.empty ())
+            keys.erase (it);
+    }
+
+    //  The oldest idle worker of that key, taken out of idle_ and of the
+    //  index; NULL if none
+    T *pick (std::list <T *> &idle_, uint64_t worker_key_)
+    {
+        typename keys_t::iterator it = keys.find (worker_key_);
+        if (it == keys.end ())
+            return NULL;
+        T *worker = it->second.front ();
+        it->second.pop_front ();
+        if (it->second.empty ())
+            keys.erase (it);
+        idle_.erase (worker->idle_it);
+        return worker;
+    }
+
+private:
+
+    typedef std::unordered_map <uint64_t, std::list <T *> > keys_t;
+    keys_t keys;
+
+    affinity_idle_t (const affinity_idle_t&);
+    const affinity_idle_t &operator = (const affinity_idle_t&);
+};
+
+#endif
@@ -0,0 +1,87 @@
+/*
+    Copyright (c) 2013 Contributors as noted in the AUTHORS file
+
+    This file is part of StreamQ-Proxy.
+
+    StreamQ-Proxy is free software; you can redistribute it and/or modify it
+    under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    StreamQ-Proxy is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __STREAMQ_COMMAND_HPP_INCLUDED__
+#define __STREAMQ_COMMAND_HPP_INCLUDED__
+
+//  The commands the proxy takes on its control socket, as text:
+//  SUSPEND, RESUME, TERMINATE, DRAIN, CLASS and TOPK.
+
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+#define PROXY_ID_SIZE_MAX 32
+#define PROXY_COMMAND_SIZE_MAX 512
+
+typedef enum {
+    proxy_bad_command,
+    proxy_suspend,
+    proxy_resume,
+    proxy_terminate,
+    proxy_drain,                //  DRAIN [deadline in msec]
+    proxy_class,                //  CLASS <client identity in hexadecimal> <class>
+    proxy_topk                  //  TOPK [n]
+} proxy_command_t;
+
+//  Tells which command content_ is; *args_ points past its keyword
+static inline proxy_command_t
+proxy_parse_command (const char *content_, int size_, const char **args_)
+{
+    *args_ = content_ + size_;
+    if (size_ == 8 && !memcmp (content_, "SUSPEND", 8))
+        return proxy_suspend;
+    if (size_ == 7 && !memcmp (content_, "RESUME", 7))
+        return proxy_resume;
+    if (size_ == 10 && !memcmp (content_, "TERMINATE", 10))
+        return proxy_terminate;
+    if (size_ >= 5 && !memcmp (content_, "DRAIN", 5)) {
+        *args_ = content_ + 5;
+        return proxy_drain;
+    }
+    if (size_ > 6 && !memcmp (content_, "CLASS ", 6)) {
+        *args_ = content_ + 6;
+        return proxy_class;
+    }
+    if (size_ >= 4 && !memcmp (content_, "TOPK", 4)) {
+        *args_ = content_ + 4;
+        return proxy_topk;
+    }
+    return proxy_bad_command;
+}
+
+//  Reads the arguments of CLASS; identity_ holds PROXY_ID_SIZE_MAX bytes
+static inline int
+proxy_parse_class (const char *args_, char *identity_, size_t *size_, int *cls_)
+{
+    size_t size = 0;
+    unsigned int byte_value;
+    while (size < PROXY_ID_SIZE_MAX && sscanf (args_, "%2x", &byte_value) == 1) {
+        identity_ [size++] = (char) byte_value;
+        args_ += 2;
+        if (*args_ == ' ')
+            break;
+    }
+    if (!size || *args_ != ' ' || sscanf (args_ + 1, "%d", cls_) != 1)
+        return -1;
+    *size_ = size;
+    return 0;
+}
+
+#endif
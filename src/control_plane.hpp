@@ -0,0 +1,559 @@
+/*
+    Copyright (c) 2013 Contributors as noted in the AUTHORS file
+
+    This file is part of StreamQ-Proxy.
+
+    StreamQ-Proxy is free software; you can redistribute it and/or modify it
+    under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    StreamQ-Proxy is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __STREAMQ_CONTROL_PLANE_HPP_INCLUDED__
+#define __STREAMQ_CONTROL_PLANE_HPP_INCLUDED__
+
+//  The control plane of the proxy, in a thread of its own: it reads the
+//  control socket, keeps the idle worker connections and picks the one a
+//  new client gets, and keeps the heavy hitter rankings, so that none of
+//  that work delays the chunks.
+//
+//  The forwarding thread (the data plane) owns the sockets of the peers
+//  and the sessions. It posts the connections that come and go to the
+//  control plane, and the size of the chunks it forwards, and carries out
+//  the decisions it gets back: pair this client with that worker, refuse
+//  that client, apply that command. Each direction is a bounded lock-free
+//  ring with a single producer and a single consumer (spsc.hpp), and an
+//  eventfd to wake the other side when it sleeps.
+//
+//  Neither side ever blocks on the other. The data plane keeps the events
+//  that do not fit in the ring until there is room, and drops the chunk
+//  sizes that do not fit: the rankings are approximate anyway. The control
+//  plane reads an event only when there is room for the decision it makes.
+
+#include "../include/zmq.h"
+#include "affinity.hpp"
+#include "command.hpp"
+#include "spsc.hpp"
+#include "topk.hpp"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <deque>
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#define PLANE_EVENTS 4096           //  ring sizes, powers of 2
+#define PLANE_CHUNKS 16384
+#define PLANE_DECISIONS 1024
+#define PLANE_TICK 10               //  msec between two looks at the rings
+
+//  The heavy hitters by connection identity, both directions counted
+class rankings_t
+{
+public:
+
+    void configure (int capacity_)
+    {
+        client_bytes.configure (capacity_);
+        client_msgs.configure (capacity_);
+        worker_bytes.configure (capacity_);
+        worker_msgs.configure (capacity_);
+    }
+
+    void add (const void *client_, size_t client_size_,
+        const void *worker_, size_t worker_size_, uint64_t bytes_)
+    {
+        client_bytes.add (client_, client_size_, bytes_);
+        client_msgs.add (client_, client_size_, 1);
+        worker_bytes.add (worker_, worker_size_, bytes_);
+        worker_msgs.add (worker_, worker_size_, 1);
+    }
+
+    //  The reply to "TOPK n": the n heaviest of each ranking, one per line,
+    //  "<ranking> <identity in hexadecimal> <count> <error>"
+    void report (int n_, std::string *reply_) const
+    {
+        const topk_t *rankings [] = {
+            &client_bytes, &client_msgs, &worker_bytes, &worker_msgs
+        };
+        const char *names [] = { "client-bytes", "client-msgs", "worker-bytes", "worker-msgs" };
+        topk_item_t items [TOPK_MAX];
+        for (int r = 0; r < 4; r++) {
+            int qt_items = rankings [r]->top (items, n_);
+            for (int i = 0; i < qt_items; i++) {
+                char line [2 * TOPK_ID_SIZE_MAX + 64];
+                int at = sprintf (line, "%s ", names [r]);
+                for (int b = 0; b < items [i].id_size; b++)
+                    at += sprintf (line + at, "%02x", items [i].id [b]);
+                sprintf (line + at, " %llu %llu\n", (unsigned long long) items [i].count,
+                    (unsigned long long) items [i].error);
+                *reply_ += line;
+            }
+        }
+    }
+
+private:
+
+    topk_t client_bytes;
+    topk_t client_msgs;
+    topk_t worker_bytes;
+    topk_t worker_msgs;
+};
+
+//  Data plane to control plane
+struct plane_event_t {
+    enum type_t {
+        worker_joined,              //  a new idle worker connection
+        worker_returned,            //  paired with a client that had gone
+        worker_left,
+        client_joined,              //  the first chunk of a new client
+        client_left                 //  gone or closed while waiting
+    } type;
+    uint8_t id_size;
+    char id [PROXY_ID_SIZE_MAX];
+    uint64_t key;                   //  affinity key of the host, or 0
+};
+
+typedef struct {
+    uint8_t client_size;
+    uint8_t worker_size;
+    uint32_t bytes;
+    char client [PROXY_ID_SIZE_MAX];
+    char worker [PROXY_ID_SIZE_MAX];
+} plane_chunk_t;
+
+//  Control plane to data plane
+typedef struct {
+    enum {pair_client, refuse_client, apply_command} type;
+    uint8_t client_size;
+    uint8_t worker_size;
+    char client [PROXY_ID_SIZE_MAX];
+    char worker [PROXY_ID_SIZE_MAX];
+    int affinity;                   //  pair: 1 warm worker, 0 cold one, -1 no key
+    int status;                     //  command: -1 if the control plane failed it
+    int size;                       //  of the command
+    char command [PROXY_COMMAND_SIZE_MAX];
+} plane_decision_t;
+
+//  Wakes the consumer of a ring up through an eventfd, with one write per
+//  wait rather than per item: raise () after pushing, and lower () before
+//  draining the ring, all of it.
+class plane_signal_t
+{
+public:
+
+    plane_signal_t () :
+        is_raised (0)
+    {
+        fd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+        assert (fd >= 0);
+    }
+
+    ~plane_signal_t ()
+    {
+        close (fd);
+    }
+
+    void raise ()
+    {
+        __atomic_thread_fence (__ATOMIC_SEQ_CST);
+        if (!__atomic_exchange_n (&is_raised, 1, __ATOMIC_SEQ_CST)) {
+            uint64_t one = 1;
+            ssize_t rc = write (fd, &one, sizeof one);
+            assert (rc == sizeof one);
+        }
+    }
+
+    //  Returns true if raised since the last call
+    bool lower ()
+    {
+        if (!__atomic_load_n (&is_raised, __ATOMIC_RELAXED))
+            return false;
+        __atomic_store_n (&is_raised, 0, __ATOMIC_SEQ_CST);
+        __atomic_thread_fence (__ATOMIC_SEQ_CST);
+        uint64_t count;
+        ssize_t rc = read (fd, &count, sizeof count);
+        assert (rc == sizeof count || errno == EAGAIN);
+        return true;
+    }
+
+    int fd;
+
+private:
+
+    int is_raised;
+
+    plane_signal_t (const plane_signal_t&);
+    const plane_signal_t &operator = (const plane_signal_t&);
+};
+
+template <class BalancePolicy>
+class control_plane_t
+{
+public:
+
+    //  Connects the control socket, and the report socket if any, and
+    //  opens the affinity store if any; with is_queuing_, the clients that
+    //  find no idle worker wait for one rather than being refused. The
+    //  thread starts with start ().
+    control_plane_t (void *ctx_, const char *control_, const char *report_, int topk_,
+        const char *affinity_path_, uint64_t affinity_slots_, bool is_queuing_);
+    ~control_plane_t ();
+    void start ();
+
+    //  Data plane side. fd () is readable when decisions are waiting:
+    //  call lower () then next () until it returns false.
+    int fd () const { return decisions_signal.fd; }
+    bool lower () { return decisions_signal.lower (); }
+    bool next (plane_decision_t *decision_) { return decisions.pop (decision_); }
+    void post (plane_event_t::type_t type_, const std::string &identity_, uint64_t key_);
+    void flush ();
+    bool is_flushed () const { return overflow.empty (); }
+    void account (const std::string &client_, const std::string &worker_, size_t bytes_);
+
+private:
+
+    struct idle_worker_t {
+        std::string identity;
+        uint64_t worker_key;
+        typename std::list <idle_worker_t *>::iterator idle_it;
+        typename std::list <idle_worker_t *>::iterator key_it;
+    };
+    struct waiting_client_t {
+        std::string identity;
+        uint64_t key;
+    };
+    typedef std::list <waiting_client_t> waiting_t;
+
+    static void *main (void *self_);
+    int loop ();
+    int control_in ();
+    void event_in (const plane_event_t &event_);
+    void decide_pair (const std::string &client_, const std::string &worker_, int affinity_);
+    void decide (const plane_decision_t &decision_);
+
+    void *control;
+    void *report;
+    pthread_t thread;
+    bool is_started;
+    int is_stopping;
+
+    //  Owned by the control plane thread
+    std::list <idle_worker_t *> idle;   //  oldest first
+    std::unordered_map <std::string, idle_worker_t *> idle_workers;
+    bool is_queuing;
+    waiting_t waiting;              //  clients with no worker yet, oldest first
+    std::unordered_map <std::string, typename waiting_t::iterator> waiting_clients;
+    rankings_t rankings;
+    affinity_t affinity;
+    affinity_idle_t <idle_worker_t> idle_keys;
+    plane_decision_t decision;      //  being built
+
+    //  Data plane to control plane
+    spsc_ring_t <plane_event_t, PLANE_EVENTS> events;
+    std::deque <plane_event_t> overflow;    //  events waiting for room
+    spsc_ring_t <plane_chunk_t, PLANE_CHUNKS> chunks;
+    plane_signal_t events_signal;
+
+    //  Control plane to data plane
+    spsc_ring_t <plane_decision_t, PLANE_DECISIONS> decisions;
+    plane_signal_t decisions_signal;
+
+    control_plane_t (const control_plane_t&);
+    const control_plane_t &operator = (const control_plane_t&);
+};
+
+template <class BalancePolicy>
+inline control_plane_t <BalancePolicy>::control_plane_t (void *ctx_, const char *control_, const char *report_, int topk_,
+    const char *affinity_path_, uint64_t affinity_slots_, bool is_queuing_) :
+    is_started (false),
+    is_stopping (0),
+    is_queuing (is_queuing_)
+{
+    control = zmq_socket (ctx_, ZMQ_SUB);
+    assert (control);
+    int rc = zmq_setsockopt (control, ZMQ_SUBSCRIBE, "", 0);
+    assert (rc == 0);
+    rc = zmq_connect (control, control_);
+    assert (rc == 0);
+
+    report = NULL;
+    if (report_) {
+        report = zmq_socket (ctx_, ZMQ_PUB);
+        assert (report);
+        int linger = 0;
+        rc = zmq_setsockopt (report, ZMQ_LINGER, &linger, sizeof (int));
+        assert (rc == 0);
+        rc = zmq_connect (report, report_);
+        assert (rc == 0);
+    }
+    rankings.configure (topk_);
+
+    if (affinity_path_) {
+        rc = affinity.open (affinity_path_, affinity_slots_);
+        assert (rc == 0);
+    }
+}
+
+template <class BalancePolicy>
+inline control_plane_t <BalancePolicy>::~control_plane_t ()
+{
+    if (is_started) {
+        __atomic_store_n (&is_stopping, 1, __ATOMIC_RELAXED);
+        events_signal.raise ();
+        int rc = pthread_join (thread, NULL);
+        assert (rc == 0);
+    }
+    for (typename std::list <idle_worker_t *>::iterator it = idle.begin (); it != idle.end (); ++it)
+        delete *it;
+
+    int rc = zmq_close (control);
+    assert (rc == 0);
+    if (report) {
+        rc = zmq_close (report);
+        assert (rc == 0);
+    }
+}
+
+//  The sockets move to the new thread; creating it is a full barrier
+template <class BalancePolicy>
+inline void control_plane_t <BalancePolicy>::start ()
+{
+    int rc = pthread_create (&thread, NULL, main, this);
+    assert (rc == 0);
+    is_started = true;
+}
+
+template <class BalancePolicy>
+inline void control_plane_t <BalancePolicy>::post (plane_event_t::type_t type_, const std::string &identity_, uint64_t key_)
+{
+    plane_event_t event;
+    event.type = type_;
+    event.key = key_;
+    event.id_size = (uint8_t) identity_.size ();
+    memcpy (event.id, identity_.data (), identity_.size ());
+    if (!overflow.empty () || !events.push (event))
+        overflow.push_back (event);
+    events_signal.raise ();
+}
+
+//  Move the events that did not fit to the ring, as far as there is room
+template <class BalancePolicy>
+inline void control_plane_t <BalancePolicy>::flush ()
+{
+    if (overflow.empty ())
+        return;
+    while (!overflow.empty () && events.push (overflow.front ()))
+        overflow.pop_front ();
+    events_signal.raise ();
+}
+
+template <class BalancePolicy>
+inline void control_plane_t <BalancePolicy>::account (const std::string &client_, const std::string &worker_, size_t bytes_)
+{
+    plane_chunk_t chunk;
+    chunk.client_size = (uint8_t) client_.size ();
+    chunk.worker_size = (uint8_t) worker_.size ();
+    chunk.bytes = (uint32_t) bytes_;
+    memcpy (chunk.client, client_.data (), client_.size ());
+    memcpy (chunk.worker, worker_.data (), worker_.size ());
+    chunks.push (chunk);
+}
+
+template <class BalancePolicy>
+inline void *control_plane_t <BalancePolicy>::main (void *self_)
+{
+    ((control_plane_t *) self_)->loop ();
+    return NULL;
+}
+
+//  Until TERMINATE, the destruction of the plane, or the termination of
+//  the context
+template <class BalancePolicy>
+inline int control_plane_t <BalancePolicy>::loop ()
+{
+    zmq_pollitem_t items [] = {
+        { control, 0, ZMQ_POLLIN, 0 },
+        { NULL, events_signal.fd, ZMQ_POLLIN, 0 }
+    };
+    while (!__atomic_load_n (&is_stopping, __ATOMIC_RELAXED)) {
+        int rc = zmq_poll (items, 2, PLANE_TICK);
+        if (rc < 0)
+            return -1;
+        if (items [0].revents & ZMQ_POLLIN && decisions.room () > 0) {
+            rc = control_in ();
+            if (rc != 0)
+                return rc;
+        }
+        events_signal.lower ();
+        plane_event_t event;
+        while (decisions.room () > 0 && events.pop (&event))
+            event_in (event);
+        plane_chunk_t chunk;
+        while (chunks.pop (&chunk))
+            rankings.add (chunk.client, chunk.client_size,
+                chunk.worker, chunk.worker_size, chunk.bytes);
+    }
+    return 0;
+}
+
+//  TOPK is answered here, from the rankings; all the commands go on to the
+//  data plane, which counts them and applies the others. Returns 1 once
+//  TERMINATE has gone, -1 if the context was terminated.
+template <class BalancePolicy>
+inline int control_plane_t <BalancePolicy>::control_in ()
+{
+    char *content = decision.command;
+    int size = zmq_recv (control, content, PROXY_COMMAND_SIZE_MAX - 1, 0);
+    if (size < 0)
+        return -1;
+    if (size > PROXY_COMMAND_SIZE_MAX - 1)
+        size = PROXY_COMMAND_SIZE_MAX - 1;
+    int more;
+    size_t moresz = sizeof more;
+    int rc = zmq_getsockopt (control, ZMQ_RCVMORE, &more, &moresz);
+    if (rc < 0 || more)
+        return -1;
+    content [size] = '\0';
+
+    decision.type = plane_decision_t::apply_command;
+    decision.size = size;
+    decision.status = 0;
+    const char *args;
+    proxy_command_t command = proxy_parse_command (content, size, &args);
+    if (command == proxy_topk) {
+        int n = 10;
+        if ((*args && (sscanf (args, " %d", &n) != 1 || n < 1)) || !report)
+            decision.status = -1;
+        else {
+            std::string reply;
+            rankings.report (n < TOPK_MAX ? n : TOPK_MAX, &reply);
+            zmq_send (report, reply.data (), reply.size (), ZMQ_DONTWAIT);
+        }
+    }
+    decide (decision);
+    return command == proxy_terminate ? 1 : 0;
+}
+
+template <class BalancePolicy>
+inline void control_plane_t <BalancePolicy>::event_in (const plane_event_t &event_)
+{
+    std::string identity (event_.id, event_.id_size);
+    switch (event_.type) {
+        case plane_event_t::worker_joined:
+        case plane_event_t::worker_returned: {
+            //  For the client that has waited longest, if any
+            if (!waiting.empty ()) {
+                waiting_client_t &client = waiting.front ();
+                if (client.key && event_.key && affinity.is_open ())
+                    affinity.update (client.key, event_.key);
+                decide_pair (client.identity, identity, -1);
+                waiting_clients.erase (client.identity);
+                waiting.pop_front ();
+                break;
+            }
+            idle_worker_t *worker = new idle_worker_t;
+            worker->identity = identity;
+            worker->worker_key = event_.key;
+            worker->idle_it = event_.type == plane_event_t::worker_joined
+                ? idle.insert (idle.end (), worker)
+                : idle.insert (idle.begin (), worker);
+            idle_keys.add (worker, event_.type == plane_event_t::worker_returned);
+            idle_workers [identity] = worker;
+            break;
+        }
+        case plane_event_t::worker_left: {
+            typename std::unordered_map <std::string, idle_worker_t *>::iterator it =
+                idle_workers.find (identity);
+            if (it != idle_workers.end ()) {
+                idle.erase (it->second->idle_it);
+                idle_keys.remove (it->second);
+                delete it->second;
+                idle_workers.erase (it);
+            }
+            break;
+        }
+        case plane_event_t::client_joined: {
+            if (idle.empty () && is_queuing) {
+                if (!waiting_clients.count (identity)) {
+                    waiting_client_t client = { identity, event_.key };
+                    waiting_clients [identity] = waiting.insert (waiting.end (), client);
+                }
+                break;
+            }
+            if (idle.empty ()) {
+                decision.type = plane_decision_t::refuse_client;
+                decision.client_size = event_.id_size;
+                memcpy (decision.client, event_.id, event_.id_size);
+                decide (decision);
+                break;
+            }
+            //  The worker host the client had last time, as in the pair ()
+            //  of the proxy
+            idle_worker_t *worker = NULL;
+            decision.affinity = -1;
+            if (event_.key && affinity.is_open ()) {
+                uint64_t worker_key = affinity.find (event_.key);
+                if (worker_key)
+                    worker = idle_keys.pick (idle, worker_key);
+                decision.affinity = worker != NULL;
+            }
+            if (!worker) {
+                worker = BalancePolicy::pick (idle);
+                idle_keys.remove (worker);
+            }
+            if (decision.affinity >= 0 && worker->worker_key)
+                affinity.update (event_.key, worker->worker_key);
+            idle_workers.erase (worker->identity);
+            decide_pair (identity, worker->identity, decision.affinity);
+            delete worker;
+            break;
+        }
+        case plane_event_t::client_left: {
+            typename std::unordered_map <std::string, typename waiting_t::iterator>::iterator it =
+                waiting_clients.find (identity);
+            if (it != waiting_clients.end ()) {
+                waiting.erase (it->second);
+                waiting_clients.erase (it);
+            }
+            break;
+        }
+    }
+}
+
+template <class BalancePolicy>
+inline void control_plane_t <BalancePolicy>::decide_pair (const std::string &client_, const std::string &worker_, int affinity_)
+{
+    decision.type = plane_decision_t::pair_client;
+    decision.client_size = (uint8_t) client_.size ();
+    memcpy (decision.client, client_.data (), client_.size ());
+    decision.worker_size = (uint8_t) worker_.size ();
+    memcpy (decision.worker, worker_.data (), worker_.size ());
+    decision.affinity = affinity_;
+    decide (decision);
+}
+
+//  The caller has checked that there is room
+template <class BalancePolicy>
+inline void control_plane_t <BalancePolicy>::decide (const plane_decision_t &decision_)
+{
+    bool is_pushed = decisions.push (decision_);
+    assert (is_pushed);
+    decisions_signal.raise ();
+}
+
+#endif
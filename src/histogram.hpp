@@ -0,0 +1,140 @@
+/*
+    Copyright (c) 2013 Contributors as noted in the AUTHORS file
+
+    This file is part of StreamQ-Proxy.
+
+    StreamQ-Proxy is free software; you can redistribute it and/or modify it
+    under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    StreamQ-Proxy is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __STREAMQ_HISTOGRAM_HPP_INCLUDED__
+#define __STREAMQ_HISTOGRAM_HPP_INCLUDED__
+
+//  Log-linear histogram in the manner of HdrHistogram: values below
+//  HISTOGRAM_SUB_COUNT are exact, above that each power of two is split in
+//  HISTOGRAM_SUB_COUNT buckets, i.e. a relative error below 1/32. Recording
+//  is a few instructions and never allocates; histograms of the same shape
+//  are merged by adding their buckets.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#define HISTOGRAM_SUB_BITS 5
+#define HISTOGRAM_SUB_COUNT (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_COUNT)
+
+typedef struct {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+    uint64_t counts [HISTOGRAM_BUCKETS];
+} histogram_t;
+
+static inline void
+histogram_init (histogram_t *h_)
+{
+    memset (h_, 0, sizeof *h_);
+    h_->min = UINT64_MAX;
+}
+
+static inline int
+histogram_index (uint64_t value_)
+{
+    if (value_ < HISTOGRAM_SUB_COUNT)
+        return (int) value_;
+    int msb = 63 - __builtin_clzll (value_);
+    int shift = msb - HISTOGRAM_SUB_BITS;
+    return (shift + 1) * HISTOGRAM_SUB_COUNT
+        + (int) ((value_ >> shift) - HISTOGRAM_SUB_COUNT);
+}
+
+//  Highest value recorded in a bucket
+static inline uint64_t
+histogram_value (int index_)
+{
+    if (index_ < HISTOGRAM_SUB_COUNT)
+        return index_;
+    int shift = index_ / HISTOGRAM_SUB_COUNT - 1;
+    uint64_t sub = index_ % HISTOGRAM_SUB_COUNT + HISTOGRAM_SUB_COUNT;
+    return (sub << shift) + ((uint64_t) 1 << shift) - 1;
+}
+
+static inline void
+histogram_record (histogram_t *h_, uint64_t value_)
+{
+    h_->counts [histogram_index (value_)]++;
+    h_->count++;
+    h_->sum += value_;
+    if (value_ < h_->min)
+        h_->min = value_;
+    if (value_ > h_->max)
+        h_->max = value_;
+}
+
+static inline void
+histogram_merge (histogram_t *to_, const histogram_t *from_)
+{
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+        to_->counts [i] += from_->counts [i];
+    to_->count += from_->count;
+    to_->sum += from_->sum;
+    if (from_->min < to_->min)
+        to_->min = from_->min;
+    if (from_->max > to_->max)
+        to_->max = from_->max;
+}
+
+//  Value at the given percentile (0 to 100), 0 if the histogram is empty
+static inline uint64_t
+histogram_percentile (const histogram_t *h_, double percentile_)
+{
+    if (!h_->count)
+        return 0;
+    uint64_t rank = (uint64_t) (percentile_ / 100 * h_->count + 0.5);
+    if (rank < 1)
+        rank = 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += h_->counts [i];
+        if (seen >= rank) {
+            uint64_t value = histogram_value (i);
+            return value < h_->max ? value : h_->max;
+        }
+    }
+    return h_->max;
+}
+
+static inline double
+histogram_mean (const histogram_t *h_)
+{
+    return h_->count ? (double) h_->sum / h_->count : 0;
+}
+
+//  One line summary: count, min, p50, p90, p99, p99.9, max and mean
+static inline void
+histogram_print (const histogram_t *h_, const char *name_, const char *unit_)
+{
+    printf ("%s: count %llu, min %llu, p50 %llu, p90 %llu, p99 %llu, "
+        "p99.9 %llu, max %llu, mean %.1f (%s)\n", name_,
+        (unsigned long long) h_->count,
+        (unsigned long long) (h_->count ? h_->min : 0),
+        (unsigned long long) histogram_percentile (h_, 50),
+        (unsigned long long) histogram_percentile (h_, 90),
+        (unsigned long long) histogram_percentile (h_, 99),
+        (unsigned long long) histogram_percentile (h_, 99.9),
+        (unsigned long long) h_->max, histogram_mean (h_), unit_);
+}
+
+#endif
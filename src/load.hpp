@@ -0,0 +1,326 @@
+/*
+    Copyright (c) 2013 Contributors as noted in the AUTHORS file
+
+    This file is part of StreamQ-Proxy.
+
+    StreamQ-Proxy is free software; you can redistribute it and/or modify it
+    under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    StreamQ-Proxy is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __STREAMQ_LOAD_HPP_INCLUDED__
+#define __STREAMQ_LOAD_HPP_INCLUDED__
+
+//  The load of the worker hosts, from what the proxy sees on the backend.
+//  A worker connection serves one client at a time, so the connections of
+//  a host share its CPU: the load is kept per host, the Peer-Address of
+//  its connections, as the affinity store does.
+//
+//  For each established session, the proxy times a request from the first
+//  chunk it sends to the worker to the first chunk the worker sends back,
+//  and keeps the bytes and the chunks not answered yet. A host costs its
+//  response time EWMA times what it has on its hands. A new client goes to
+//  the cheaper of two hosts drawn at random (power of two choices), which
+//  keeps away from the slow hosts without sending everybody to the one that
+//  looked best at the last sample. The idle connections of the tracked
+//  hosts are also kept in an array, for the draws to cost the same
+//  whatever their number, and in a list per host, oldest first. To give a
+//  client to the host with the fewest sessions, the hosts with idle
+//  connections are ranked by their sessions, then by their oldest idle
+//  connection: the pick does not walk the connections either.
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <list>
+#include <map>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#define LOAD_EWMA_WEIGHT 8          //  a new sample weighs 1/8
+#define LOAD_BYTES_UNIT 65536       //  bytes in flight counted as one more request
+#define LOAD_HALF_LIFE 1000000      //  usec, of the EWMA of a host not heard of
+#define LOAD_DRAWS 8                //  for a second host, before going with the first one
+#define LOAD_NOT_IDLE ((size_t) -1)
+
+typedef struct load_probe_t load_probe_t;
+
+typedef struct {
+    uint32_t connections;           //  idle or paired, the entry goes with the last one
+    uint32_t sessions;              //  paired connections
+    uint32_t outstanding;           //  requests sent and not answered yet
+    uint32_t queued;                //  client chunks in the scheduler for this host
+    uint64_t in_flight;             //  bytes of the outstanding requests
+    uint64_t ewma;                  //  usec, request to response, 0 until measured
+    uint64_t measured;              //  usec of the last sample
+    load_probe_t *idle_first;       //  the oldest idle connection, NULL if none
+    load_probe_t *idle_last;
+    bool is_ranked;                 //  by the rank below, with is_ranking
+    uint32_t rank_sessions;
+    uint64_t rank_seq;
+} worker_load_t;
+
+//  What a session has in flight, towards the load of its host
+struct load_probe_t {
+    worker_load_t *host;            //  NULL when the load is not tracked
+    uint64_t key;                   //  of the host
+    uint64_t since;                 //  usec of the unanswered request, 0 if none
+    uint64_t bytes;                 //  sent since then
+    void *owner;                    //  the connection, while idle
+    size_t idle_at;                 //  in the idle array, LOAD_NOT_IDLE if not there
+    uint64_t idle_seq;              //  when it became idle, lower is older
+    load_probe_t *idle_prev;        //  in the idle list of the host
+    load_probe_t *idle_next;
+};
+
+class load_table_t
+{
+public:
+
+    load_table_t () :
+        is_ranking (false),
+        qt_idled (0),
+        seed (0x9e3779b97f4a7c15ull)
+    {
+    }
+
+    //  Whether the hosts are ranked for pick_least_sessions (); before
+    //  the first join
+    void configure (bool is_ranking_)
+    {
+        assert (hosts.empty ());
+        is_ranking = is_ranking_;
+    }
+
+    //  A new worker connection of that host
+    void join (load_probe_t *probe_, uint64_t key_)
+    {
+        probe_->host = &hosts [key_];
+        probe_->host->connections++;
+        probe_->key = key_;
+        probe_->since = 0;
+        probe_->bytes = 0;
+        probe_->owner = NULL;
+        probe_->idle_at = LOAD_NOT_IDLE;
+    }
+
+    //  The connection owner_ of a tracked host waits for a client, or does
+    //  not any more; no-ops for the others
+    void idle_in (load_probe_t *probe_, void *owner_)
+    {
+        if (!probe_->host)
+            return;
+        probe_->owner = owner_;
+        probe_->idle_at = idle.size ();
+        probe_->idle_seq = qt_idled++;
+        idle.push_back (probe_);
+        worker_load_t *host = probe_->host;
+        probe_->idle_prev = host->idle_last;
+        probe_->idle_next = NULL;
+        if (host->idle_last)
+            host->idle_last->idle_next = probe_;
+        else {
+            host->idle_first = probe_;
+            rank (host);
+        }
+        host->idle_last = probe_;
+    }
+
+    void idle_out (load_probe_t *probe_)
+    {
+        if (!probe_->host || probe_->idle_at == LOAD_NOT_IDLE)
+            return;
+        load_probe_t *last = idle.back ();
+        idle [probe_->idle_at] = last;
+        last->idle_at = probe_->idle_at;
+        idle.pop_back ();
+        probe_->idle_at = LOAD_NOT_IDLE;
+        worker_load_t *host = probe_->host;
+        if (probe_->idle_next)
+            probe_->idle_next->idle_prev = probe_->idle_prev;
+        else
+            host->idle_last = probe_->idle_prev;
+        if (probe_->idle_prev)
+            probe_->idle_prev->idle_next = probe_->idle_next;
+        else {
+            unrank (host);
+            host->idle_first = probe_->idle_next;
+            rank (host);
+        }
+    }
+
+    //  The connection has a client now; no-op if the host is not tracked
+    void paired (load_probe_t *probe_)
+    {
+        worker_load_t *host = probe_->host;
+        if (!host)
+            return;
+        unrank (host);
+        host->sessions++;
+        rank (host);
+    }
+
+    //  The connection is gone; is_paired_ if it had a client
+    void leave (load_probe_t *probe_, bool is_paired_)
+    {
+        worker_load_t *host = probe_->host;
+        assert (probe_->idle_at == LOAD_NOT_IDLE);
+        if (is_paired_) {
+            unrank (host);
+            host->sessions--;
+            rank (host);
+        }
+        if (probe_->since) {
+            host->outstanding--;
+            host->in_flight -= probe_->bytes;
+        }
+        if (--host->connections == 0) {
+            assert (!host->is_ranked);
+            hosts.erase (probe_->key);
+        }
+        probe_->host = NULL;
+    }
+
+    //  The first chunk of a request goes to the worker, then each of them
+    //  is sent, until the first chunk of the reply
+    static void request (load_probe_t *probe_, uint64_t now_)
+    {
+        probe_->since = now_;
+        probe_->host->outstanding++;
+    }
+
+    static void sent (load_probe_t *probe_, size_t size_)
+    {
+        probe_->bytes += size_;
+        probe_->host->in_flight += size_;
+    }
+
+    static void replied (load_probe_t *probe_, uint64_t now_)
+    {
+        worker_load_t *host = probe_->host;
+        uint64_t sample = now_ > probe_->since ? now_ - probe_->since : 0;
+        if (host->ewma)
+            host->ewma = (uint64_t) ((int64_t) host->ewma
+                + ((int64_t) sample - (int64_t) host->ewma) / LOAD_EWMA_WEIGHT);
+        else
+            host->ewma = sample ? sample : 1;
+        host->measured = now_;
+        host->outstanding--;
+        host->in_flight -= probe_->bytes;
+        probe_->since = 0;
+        probe_->bytes = 0;
+    }
+
+    //  A host that is not given clients any more because it was slow
+    //  gets a chance again as its EWMA fades, and is measured again
+    static uint64_t cost (const worker_load_t *host_, uint64_t now_)
+    {
+        uint64_t requests = host_->outstanding + host_->queued
+            + host_->in_flight / LOAD_BYTES_UNIT;
+        uint64_t halvings = now_ > host_->measured ? (now_ - host_->measured) / LOAD_HALF_LIFE : 0;
+        uint64_t ewma = halvings < 64 ? host_->ewma >> halvings : 0;
+        return (ewma + 1) * (requests + 1);
+    }
+
+    //  The oldest idle connection of the host with the fewest sessions,
+    //  the oldest one of these hosts on a tie, taken out of idle_; T has
+    //  its idle_it in idle_
+    template <class T>
+    T *pick_least_sessions (std::list <T *> &idle_)
+    {
+        assert (is_ranking && !ranks.empty () && idle.size () == idle_.size ());
+        load_probe_t *best = ranks.begin ()->second->idle_first;
+        T *worker = (T *) best->owner;
+        idle_.erase (worker->idle_it);
+        idle_out (best);
+        return worker;
+    }
+
+    //  The cheaper of two idle connections of different hosts drawn at
+    //  random, the older one on a tie, taken out of idle_; T has its
+    //  idle_it in idle_. Drawing the hosts of the same one would leave a
+    //  slow host nothing to compare with, and with a few hosts it would
+    //  happen often: the second one is drawn again, LOAD_DRAWS times at
+    //  most, which is what keeps the pick from walking the connections.
+    template <class T>
+    T *pick_two_choices (std::list <T *> &idle_, uint64_t now_)
+    {
+        assert (!idle_.empty () && idle.size () == idle_.size ());
+        load_probe_t *first = idle [random () % idle.size ()];
+        load_probe_t *second = NULL;
+        for (int i = 0; i < LOAD_DRAWS && !second; i++) {
+            load_probe_t *drawn = idle [random () % idle.size ()];
+            if (drawn->host != first->host)
+                second = drawn;
+        }
+        load_probe_t *best = first;
+        if (second) {
+            uint64_t first_cost = cost (first->host, now_);
+            uint64_t second_cost = cost (second->host, now_);
+            if (second_cost < first_cost
+            ||  (second_cost == first_cost && second->idle_seq < first->idle_seq))
+                best = second;
+        }
+        T *worker = (T *) best->owner;
+        idle_.erase (worker->idle_it);
+        idle_out (best);
+        return worker;
+    }
+
+    size_t qt_hosts () const { return hosts.size (); }
+
+private:
+
+    //  sessions, then the idle_seq of the oldest idle connection
+    typedef std::pair <uint32_t, uint64_t> rank_t;
+
+    //  A host is ranked while it has idle connections
+    void rank (worker_load_t *host_)
+    {
+        if (!is_ranking || !host_->idle_first)
+            return;
+        host_->rank_sessions = host_->sessions;
+        host_->rank_seq = host_->idle_first->idle_seq;
+        ranks [rank_t (host_->rank_sessions, host_->rank_seq)] = host_;
+        host_->is_ranked = true;
+    }
+
+    void unrank (worker_load_t *host_)
+    {
+        if (!host_->is_ranked)
+            return;
+        ranks.erase (rank_t (host_->rank_sessions, host_->rank_seq));
+        host_->is_ranked = false;
+    }
+
+    //  xorshift64*
+    uint64_t random ()
+    {
+        seed ^= seed >> 12;
+        seed ^= seed << 25;
+        seed ^= seed >> 27;
+        return seed * 0x2545f4914f6cdd1dull;
+    }
+
+    std::unordered_map <uint64_t, worker_load_t> hosts;
+    std::vector <load_probe_t *> idle;  //  of the tracked hosts, in no order
+    bool is_ranking;
+    std::map <rank_t, worker_load_t *> ranks;   //  the hosts with idle connections
+    uint64_t qt_idled;
+    uint64_t seed;
+
+    load_table_t (const load_table_t&);
+    const load_table_t &operator = (const load_table_t&);
+};
+
+#endif
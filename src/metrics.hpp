@@ -0,0 +1,378 @@
+/*
+    Copyright (c) 2013 Contributors as noted in the AUTHORS file
+
+    This file is part of StreamQ-Proxy.
+
+    StreamQ-Proxy is free software; you can redistribute it and/or modify it
+    under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    StreamQ-Proxy is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __STREAMQ_METRICS_HPP_INCLUDED__
+#define __STREAMQ_METRICS_HPP_INCLUDED__
+
+//  Proxy metrics published in a memory mapped file.
+//
+//  The proxy thread is the only writer. Every field is a naturally aligned
+//  64 bits word updated with relaxed atomic loads and stores: no lock, no
+//  read-modify-write instruction, no system call. Readers map the same file
+//  read-only (tools/proxy_stat) and never talk to the proxy, so scraping
+//  costs nothing to the data plane.
+//
+//  The layout is versioned: any change to metrics_t or metrics_worker_t
+//  bumps METRICS_VERSION, and readers refuse a segment whose magic, version
+//  or structure sizes do not match their own.
+
+#include "histogram.hpp"
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define METRICS_PATH "/dev/shm/streamq-proxy.metrics"
+#define METRICS_MAGIC "SQPROXY"         //  7 chars + '\0'
+#define METRICS_VERSION 10
+#define METRICS_MAX_WORKERS 64
+#define METRICS_ID_SIZE_MAX 32
+#define METRICS_PHASES 8
+#define METRICS_LEGS 2
+
+//  The phases of a session handshake, each timed from the last one seen
+//  before it: a NULL session has no HELLO, WELCOME nor INITIATE
+enum {
+    metrics_phase_paired,           //  first client chunk to a worker found
+    metrics_phase_greeting,         //  to the worker greeting relayed
+    metrics_phase_hello,            //  to the HELLO of the client
+    metrics_phase_welcome,          //  to the WELCOME of the worker
+    metrics_phase_initiate,         //  to the INITIATE of the client
+    metrics_phase_ready,            //  to the READY of the worker
+    metrics_phase_message,          //  to the first client message
+    metrics_phase_total             //  first client chunk to first message
+};
+
+static const char *const metrics_phase_names [METRICS_PHASES] = {
+    "paired", "greeting", "hello", "welcome", "initiate", "ready", "message", "total"
+};
+
+//  The two TCP connections of a session
+enum {
+    metrics_leg_client,             //  client to proxy
+    metrics_leg_worker              //  proxy to worker
+};
+
+static const char *const metrics_leg_names [METRICS_LEGS] = { "client", "worker" };
+
+//  The last TCP_INFO sample of a connection
+typedef struct {
+    uint64_t rtt;               //  usec, smoothed
+    uint64_t rttvar;            //  usec
+    uint64_t unacked;           //  segments in flight
+    uint64_t notsent;           //  bytes in the send buffer, not sent yet
+    uint64_t retrans;           //  segments retransmitted since the slot was opened
+} metrics_tcp_t;
+
+//  Per worker slot. The identity is rewritten under a seqlock when a slot
+//  is (re)assigned; counters are plain relaxed words.
+typedef struct {
+    uint64_t seq;               //  odd while identity is being rewritten
+    uint64_t in_use;
+    uint64_t id_size;
+    char identity [METRICS_ID_SIZE_MAX];
+    uint64_t sessions;          //  gauge: clients currently paired
+    uint64_t sessions_total;
+    uint64_t msgs_in;           //  from the worker
+    uint64_t bytes_in;
+    uint64_t msgs_out;          //  to the worker
+    uint64_t bytes_out;
+    metrics_tcp_t tcp [METRICS_LEGS];   //  by metrics_leg_*
+} metrics_worker_t;
+
+typedef struct {
+    //  Header, written once at creation
+    char magic [8];
+    uint32_t version;
+    uint32_t header_size;       //  sizeof (metrics_t) without worker slots
+    uint32_t worker_size;       //  sizeof (metrics_worker_t)
+    uint32_t worker_slots;
+    uint64_t pid;
+    uint64_t start_time;        //  seconds since epoch
+
+    //  Gauges
+    uint64_t sessions;          //  client/worker pairs alive
+    uint64_t handshakes;        //  pairs not yet through the handshake
+    uint64_t workers;           //  registered workers
+    uint64_t queue_depth;       //  frames held by the proxy
+    uint64_t queue_bytes;
+    uint64_t waiting;           //  clients waiting for a worker
+    uint64_t uplinks;           //  connections to the upstream proxy
+    uint64_t pool_threads;      //  worker threads of the pool
+    uint64_t workers_unslotted; //  workers beyond the METRICS_MAX_WORKERS slots
+
+    //  Counters
+    uint64_t sessions_total;
+    uint64_t handshakes_total;
+    uint64_t msgs_c2w;          //  client to worker
+    uint64_t bytes_c2w;
+    uint64_t msgs_w2c;          //  worker to client
+    uint64_t bytes_w2c;
+    uint64_t drops;             //  frames the proxy could not forward
+    uint64_t commands;          //  control commands processed
+    uint64_t bad_commands;
+    uint64_t affinity_hits;     //  clients paired with their last worker host
+    uint64_t affinity_misses;   //  clients with a host key, but not paired so
+    uint64_t waiting_total;     //  clients that had to wait for a worker
+    uint64_t waiting_expired;   //  closed at their waiting deadline
+    uint64_t waiting_refused;   //  closed as the waiting room was full
+    uint64_t drain_closed;      //  sessions closed by DRAIN once replied to
+    uint64_t drain_cut;         //  sessions closed by DRAIN at its deadline
+    uint64_t queue_overflows;   //  clients closed as their scheduler queue was full
+    uint64_t tcp_samples;       //  TCP_INFO samples taken
+    uint64_t tcp_retrans [METRICS_LEGS];    //  segments retransmitted, by metrics_leg_*
+    uint64_t uplinks_expired;   //  closed as they did not connect in time
+    uint64_t pool_started;      //  worker threads the pool started
+    uint64_t pool_retired;      //  and retired
+
+    //  Handshake latencies, in usec, by metrics_phase_*
+    histogram_t handshake [METRICS_PHASES];
+
+    //  Time spent waiting for a worker, in usec, by the clients that got one
+    histogram_t wait;
+
+    //  Sampled round trip times, in usec, by metrics_leg_*
+    histogram_t rtt [METRICS_LEGS];
+
+    metrics_worker_t worker [METRICS_MAX_WORKERS];
+} metrics_t;
+
+//  Single writer helpers. A plain load/store pair is enough because nobody
+//  else writes, and keeps the hot path free of locked instructions.
+static inline void
+metrics_add (uint64_t *counter_, uint64_t value_)
+{
+    __atomic_store_n (counter_,
+        __atomic_load_n (counter_, __ATOMIC_RELAXED) + value_, __ATOMIC_RELAXED);
+}
+
+static inline void
+metrics_sub (uint64_t *gauge_, uint64_t value_)
+{
+    __atomic_store_n (gauge_,
+        __atomic_load_n (gauge_, __ATOMIC_RELAXED) - value_, __ATOMIC_RELAXED);
+}
+
+static inline void
+metrics_set (uint64_t *gauge_, uint64_t value_)
+{
+    __atomic_store_n (gauge_, value_, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t
+metrics_get (const uint64_t *field_)
+{
+    return __atomic_load_n (field_, __ATOMIC_RELAXED);
+}
+
+//  The reader copies the histogram with metrics_get () before reading it;
+//  min is meaningless while count is 0
+static inline void
+metrics_record (histogram_t *h_, uint64_t value_)
+{
+    metrics_add (&h_->counts [histogram_index (value_)], 1);
+    if (!metrics_get (&h_->count) || value_ < metrics_get (&h_->min))
+        metrics_set (&h_->min, value_);
+    if (value_ > metrics_get (&h_->max))
+        metrics_set (&h_->max, value_);
+    metrics_add (&h_->sum, value_);
+    metrics_add (&h_->count, 1);
+}
+
+static inline void
+metrics_histogram (const histogram_t *h_, histogram_t *copy_)
+{
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+        copy_->counts [i] = metrics_get (&h_->counts [i]);
+    copy_->count = metrics_get (&h_->count);
+    copy_->sum = metrics_get (&h_->sum);
+    copy_->min = metrics_get (&h_->min);
+    copy_->max = metrics_get (&h_->max);
+}
+
+static inline void
+metrics_header_init (metrics_t *metrics_)
+{
+    memcpy (metrics_->magic, METRICS_MAGIC, sizeof metrics_->magic);
+    metrics_->version = METRICS_VERSION;
+    metrics_->header_size = offsetof (metrics_t, worker);
+    metrics_->worker_size = sizeof (metrics_worker_t);
+    metrics_->worker_slots = METRICS_MAX_WORKERS;
+    metrics_->pid = getpid ();
+    metrics_->start_time = time (NULL);
+}
+
+//  Create the segment. The file is prepared under a temporary name and
+//  renamed, so readers never observe a partially initialized header.
+//  With a NULL path, an anonymous mapping is returned: the proxy then
+//  updates its metrics unconditionally, without testing for a segment.
+//  Returns NULL on error, with errno set.
+static inline metrics_t *
+metrics_create (const char *path_)
+{
+    if (!path_) {
+        void *addr = mmap (NULL, sizeof (metrics_t), PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (addr == MAP_FAILED)
+            return NULL;
+        metrics_header_init ((metrics_t *) addr);
+        return (metrics_t *) addr;
+    }
+
+    char tmp_path [256];
+    int rc = snprintf (tmp_path, sizeof tmp_path, "%s.%d", path_, (int) getpid ());
+    if (rc < 0 || rc >= (int) sizeof tmp_path) {
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+    int fd = open (tmp_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return NULL;
+    if (ftruncate (fd, sizeof (metrics_t)) < 0) {
+        close (fd);
+        unlink (tmp_path);
+        return NULL;
+    }
+    void *addr = mmap (NULL, sizeof (metrics_t), PROT_READ | PROT_WRITE,
+        MAP_SHARED, fd, 0);
+    close (fd);
+    if (addr == MAP_FAILED) {
+        unlink (tmp_path);
+        return NULL;
+    }
+    metrics_header_init ((metrics_t *) addr);
+    if (rename (tmp_path, path_) < 0) {
+        munmap (addr, sizeof (metrics_t));
+        unlink (tmp_path);
+        return NULL;
+    }
+    return (metrics_t *) addr;
+}
+
+//  Map an existing segment read-only. Returns NULL with errno set to
+//  EPROTO if the file is not a segment of a compatible version.
+static inline const metrics_t *
+metrics_attach (const char *path_)
+{
+    int fd = open (path_, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    struct stat st;
+    if (fstat (fd, &st) < 0 || st.st_size < (off_t) sizeof (metrics_t)) {
+        close (fd);
+        errno = EPROTO;
+        return NULL;
+    }
+    void *addr = mmap (NULL, sizeof (metrics_t), PROT_READ, MAP_SHARED, fd, 0);
+    close (fd);
+    if (addr == MAP_FAILED)
+        return NULL;
+    const metrics_t *metrics = (const metrics_t *) addr;
+    if (memcmp (metrics->magic, METRICS_MAGIC, sizeof metrics->magic)
+    ||  metrics->version != METRICS_VERSION
+    ||  metrics->header_size != offsetof (metrics_t, worker)
+    ||  metrics->worker_size != sizeof (metrics_worker_t)) {
+        munmap (addr, sizeof (metrics_t));
+        errno = EPROTO;
+        return NULL;
+    }
+    return metrics;
+}
+
+static inline void
+metrics_close (const metrics_t *metrics_)
+{
+    if (metrics_)
+        munmap ((void *) metrics_, sizeof (metrics_t));
+}
+
+//  Assign a worker slot and publish its identity. Returns the slot, or
+//  NULL if all slots are taken (the worker is then only counted globally).
+static inline metrics_worker_t *
+metrics_worker_open (metrics_t *metrics_, const char *identity_, size_t size_)
+{
+    for (int i = 0; i < METRICS_MAX_WORKERS; i++) {
+        metrics_worker_t *slot = &metrics_->worker [i];
+        if (metrics_get (&slot->in_use))
+            continue;
+        if (size_ > METRICS_ID_SIZE_MAX)
+            size_ = METRICS_ID_SIZE_MAX;
+        metrics_add (&slot->seq, 1);
+        __atomic_thread_fence (__ATOMIC_RELEASE);
+        memcpy (slot->identity, identity_, size_);
+        metrics_set (&slot->id_size, size_);
+        metrics_set (&slot->sessions, 0);
+        metrics_set (&slot->sessions_total, 0);
+        metrics_set (&slot->msgs_in, 0);
+        metrics_set (&slot->bytes_in, 0);
+        metrics_set (&slot->msgs_out, 0);
+        metrics_set (&slot->bytes_out, 0);
+        for (int leg = 0; leg < METRICS_LEGS; leg++) {
+            metrics_tcp_t *tcp = &slot->tcp [leg];
+            metrics_set (&tcp->rtt, 0);
+            metrics_set (&tcp->rttvar, 0);
+            metrics_set (&tcp->unacked, 0);
+            metrics_set (&tcp->notsent, 0);
+            metrics_set (&tcp->retrans, 0);
+        }
+        metrics_set (&slot->in_use, 1);
+        __atomic_thread_fence (__ATOMIC_RELEASE);
+        metrics_add (&slot->seq, 1);
+        return slot;
+    }
+    return NULL;
+}
+
+static inline void
+metrics_worker_close (metrics_worker_t *slot_)
+{
+    if (slot_)
+        metrics_set (&slot_->in_use, 0);
+}
+
+//  Reader side copy of a worker identity, consistent thanks to the seqlock.
+//  Returns the identity size, 0 if the slot is free.
+static inline size_t
+metrics_worker_identity (const metrics_worker_t *slot_, char *identity_)
+{
+    while (true) {
+        uint64_t seq = __atomic_load_n (&slot_->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1)
+            continue;
+        size_t size = 0;
+        if (__atomic_load_n (&slot_->in_use, __ATOMIC_RELAXED)) {
+            size = (size_t) __atomic_load_n (&slot_->id_size, __ATOMIC_RELAXED);
+            if (size > METRICS_ID_SIZE_MAX)
+                size = METRICS_ID_SIZE_MAX;
+            memcpy (identity_, (const char *) slot_->identity, size);
+        }
+        __atomic_thread_fence (__ATOMIC_ACQUIRE);
+        if (__atomic_load_n (&slot_->seq, __ATOMIC_RELAXED) == seq)
+            return size;
+    }
+}
+
+#endif
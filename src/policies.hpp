@@ -0,0 +1,253 @@
+/*
+    Copyright (c) 2013 Contributors as noted in the AUTHORS file
+
+    This file is part of StreamQ-Proxy.
+
+    StreamQ-Proxy is free software; you can redistribute it and/or modify it
+    under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    StreamQ-Proxy is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __STREAMQ_POLICIES_HPP_INCLUDED__
+#define __STREAMQ_POLICIES_HPP_INCLUDED__
+
+//  The policies basic_proxy is made of. They only have static members, so
+//  that a policy answering a constant lets the compiler drop the code it
+//  guards: a proxy built with null_trace_t and fifo_balance_t has no
+//  tracing nor scheduling test left in its forwarding path.
+//
+//  The runtime_* policies read the matching field of the configuration,
+//  which is what proxy_t does.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <list>
+
+//  ZMTP protocol greeting structure
+typedef unsigned char byte;
+typedef struct {
+    byte signature [10];    //  0xFF 8*0x00 0x7F
+    byte version [2];       //  0x03 0x00 for ZMTP/3.0
+    byte mechanism [20];    //  "NULL"
+    byte as_server;
+    byte filler [31];
+} zmtp_greeting_t;
+
+//  Whether a chunk starts with the ZMTP command of that name; the proxy
+//  only looks at the start of the chunks, as a peer sends each command of
+//  the handshake once it has the reply to the one before
+static inline bool
+zmtp_command_is (const byte *data_, size_t size_, const char *name_)
+{
+    if (size_ < 2 || !(data_ [0] & 0x04))
+        return false;
+    size_t at = data_ [0] & 0x02 ? 9 : 2;   //  after a long or a short size
+    size_t name_size = strlen (name_);
+    return size_ > at + name_size && data_ [at] == name_size
+        && !memcmp (data_ + at + 1, name_, name_size);
+}
+
+//  Where a ZMTP stream is in its frames, whose headers are in clear
+//  whatever the mechanism: a drained pair is closed at the end of a reply,
+//  not after its first chunk. With CURVE, the MORE flag of a message is
+//  sealed in it, and each of its frames looks like the last one.
+typedef struct {
+    uint64_t left;          //  bytes of the greeting or of a frame body to come
+    uint8_t header_seen;    //  bytes of the next frame header seen
+    byte header [9];        //  flags, then a short or a long size
+    bool is_more;           //  the last frame has more to come in its message
+} zmtp_frames_t;
+
+static inline void
+zmtp_frames_init (zmtp_frames_t *frames_)
+{
+    frames_->left = sizeof (zmtp_greeting_t);
+    frames_->header_seen = 0;
+    frames_->is_more = true;
+}
+
+//  Follows the stream over the chunk, a step per frame
+static inline void
+zmtp_frames_feed (zmtp_frames_t *frames_, const byte *data_, size_t size_)
+{
+    while (size_) {
+        if (frames_->left) {
+            size_t used = size_ < frames_->left ? size_ : (size_t) frames_->left;
+            frames_->left -= used;
+            data_ += used;
+            size_ -= used;
+            continue;
+        }
+        frames_->header [frames_->header_seen++] = *data_++;
+        size_--;
+        size_t header_size = frames_->header [0] & 0x02 ? 9 : 2;
+        if (frames_->header_seen < header_size)
+            continue;
+        uint64_t body = 0;
+        for (size_t i = 1; i < header_size; i++)
+            body = body << 8 | frames_->header [i];
+        frames_->left = body;
+        frames_->header_seen = 0;
+        //  MORE on a message frame, a command stands alone
+        frames_->is_more = (frames_->header [0] & 0x05) == 0x01;
+    }
+}
+
+//  Whether the stream ends with a whole message or command
+static inline bool
+zmtp_frames_is_whole (const zmtp_frames_t *frames_)
+{
+    return !frames_->left && !frames_->header_seen && !frames_->is_more;
+}
+
+//  Handshake policies follow what a worker sends until its handshake is
+//  over. The proxy keeps a state_t per session, and gives watch () the
+//  worker chunks while the session is not ready; watch () returns a mask
+//  of the events below.
+
+enum {
+    handshake_mechanism = 1,    //  the greeting of the worker is complete
+    handshake_ready = 2         //  the worker has sent its READY command
+};
+
+//  Reads the mechanism in the greeting, then waits for READY: the
+//  handshake gauges and traces are exact, whatever the mechanism
+struct zmtp_handshake_t
+{
+    static const bool is_watching = true;
+
+    struct state_t {
+        size_t greeting_seen;       //  greeting bytes relayed to the client
+        char mechanism [sizeof ((zmtp_greeting_t *) 0)->mechanism + 1];
+    };
+
+    static void init (state_t &state_)
+    {
+        state_.greeting_seen = 0;
+        memset (state_.mechanism, 0, sizeof state_.mechanism);
+    }
+
+    static const char *mechanism (const state_t &state_)
+    {
+        return state_.mechanism;
+    }
+
+    static int watch (state_t &state_, const byte *data_, size_t size_)
+    {
+        int events = 0;
+        if (state_.greeting_seen < sizeof (zmtp_greeting_t)) {
+            //  The greeting may come in several chunks, whatever the way
+            //  the TCP stacks have cut it
+            const size_t mechanism_at = offsetof (zmtp_greeting_t, mechanism);
+            const size_t mechanism_size = sizeof state_.mechanism - 1;
+            size_t used = 0;
+            while (used < size_ && state_.greeting_seen < sizeof (zmtp_greeting_t)) {
+                size_t pos = state_.greeting_seen++;
+                if (pos >= mechanism_at && pos < mechanism_at + mechanism_size)
+                    state_.mechanism [pos - mechanism_at] = data_ [used];
+                used++;
+            }
+            if (state_.greeting_seen < sizeof (zmtp_greeting_t))
+                return events;
+            events |= handshake_mechanism;
+            data_ += used;
+            size_ -= used;
+        }
+        if (size_ >= 8 && !memcmp (data_ + 3, "READY", 5)) // From the RFC, SHOULD be content + 1
+            events |= handshake_ready;
+        return events;
+    }
+};
+
+//  Does not look into the chunks: a session is ready as soon as it is
+//  paired, and the handshake gauges stay at 0
+struct blind_handshake_t
+{
+    static const bool is_watching = false;
+
+    struct state_t {};
+
+    static void init (state_t &) {}
+    static const char *mechanism (const state_t &) { return ""; }
+    static int watch (state_t &, const byte *, size_t) { return handshake_ready; }
+};
+
+//  Trace policies tell whether to print the events (verbose) and to dump
+//  the chunks relayed to the clients (hc_dump), given the configuration.
+
+struct runtime_trace_t
+{
+    static bool verbose (bool configured_) { return configured_; }
+    static bool dump (bool configured_) { return configured_; }
+};
+
+struct null_trace_t
+{
+    static bool verbose (bool) { return false; }
+    static bool dump (bool) { return false; }
+};
+
+struct full_trace_t
+{
+    static bool verbose (bool) { return true; }
+    static bool dump (bool) { return true; }
+};
+
+//  Balance policies pick the worker connection of a new client among the
+//  idle ones, and tell whether the client chunks go through the scheduler
+//  or are forwarded in arrival order, given the configuration. balance ()
+//  tells whether the proxy tracks the load of the worker hosts (load.hpp)
+//  to pick instead.
+
+enum {
+    balance_oldest,             //  the connection idle for the longest time
+    balance_least_sessions,     //  one of the host with the fewest sessions
+    balance_two_choices         //  power of two choices over the host load
+};
+
+struct oldest_idle_t
+{
+    template <class T>
+    static T *pick (std::list <T *> &idle_)
+    {
+        T *session = idle_.front ();
+        idle_.pop_front ();
+        return session;
+    }
+};
+
+struct runtime_balance_t : oldest_idle_t
+{
+    static bool is_scheduled (bool configured_) { return configured_; }
+    static int balance (int configured_) { return configured_; }
+};
+
+struct fifo_balance_t : oldest_idle_t
+{
+    static bool is_scheduled (bool) { return false; }
+    static int balance (int) { return balance_oldest; }
+};
+
+struct drr_balance_t : oldest_idle_t
+{
+    static bool is_scheduled (bool) { return true; }
+    static int balance (int) { return balance_oldest; }
+};
+
+struct two_choices_balance_t : oldest_idle_t
+{
+    static bool is_scheduled (bool) { return false; }
+    static int balance (int) { return balance_two_choices; }
+};
+
+#endif
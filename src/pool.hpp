@@ -0,0 +1,346 @@
+/*
+    Copyright (c) 2013 Contributors as noted in the AUTHORS file
+
+    This file is part of StreamQ-Proxy.
+
+    StreamQ-Proxy is free software; you can redistribute it and/or modify it
+    under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    StreamQ-Proxy is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __STREAMQ_POOL_HPP_INCLUDED__
+#define __STREAMQ_POOL_HPP_INCLUDED__
+
+//  An elastic pool of worker threads in the process of the proxy, for the
+//  deployments in a single binary. Each thread connects a DEALER to the
+//  backend, a CURVE server when it has a secret key, and hands what it
+//  receives to serve (), which replies on the socket.
+//
+//  The proxy tells the pool how many worker connections are idle, and how
+//  many clients are waiting or found none. The pool starts threads so that
+//  target_idle connections stay idle beyond the waiting clients, up to max;
+//  when more than that have been idle for cooldown usec, the proxy closes
+//  the surplus down to min, and the pool stops the threads behind. A pool
+//  connection is known by its TCP address: the thread learns its local one
+//  from the connect event of a socket monitor, the proxy the peer one of
+//  the descriptor a chunk came from. Both come in either order: a thread
+//  counts as a connection to come until the two agree.
+
+#include "../include/zmq.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <list>
+#include <set>
+#include <pthread.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+//  libzmq 4.1 has it, the zmq.h copied here predates it
+#ifndef ZMQ_SRCFD
+#define ZMQ_SRCFD 2
+#endif
+
+//  Serves a frame from a client, zmq_msg_more () telling if others
+//  follow, and replies on socket_ with any number of messages
+typedef void (*pool_serve_t) (void *socket_, zmq_msg_t *msg_, void *hint_);
+
+typedef struct {
+    const char *endpoint;       //  the backend of the proxy, to connect to
+    const char *secret_key;     //  CURVE server key, Z85, or NULL for NULL
+    int min;                    //  threads kept whatever the load
+    int max;
+    int target_idle;            //  connections kept idle beyond the waiting clients
+    uint64_t cooldown;          //  usec of surplus before it is retired
+    pool_serve_t serve;
+    void *hint;                 //  passed to serve
+} pool_config_t;
+
+static inline void
+pool_config_init (pool_config_t *config_)
+{
+    config_->endpoint = "tcp://127.0.0.1:9998";
+    config_->secret_key = NULL;
+    config_->min = 1;
+    config_->max = 64;
+    config_->target_idle = 2;
+    config_->cooldown = 30000000;
+    config_->serve = NULL;
+    config_->hint = NULL;
+}
+
+//  A TCP address as a key, 0 if none
+static inline uint64_t
+pool_address_key (const struct sockaddr_storage *address_)
+{
+    if (address_->ss_family == AF_INET) {
+        const struct sockaddr_in *in = (const struct sockaddr_in *) address_;
+        return (uint64_t) ntohl (in->sin_addr.s_addr) << 16 | ntohs (in->sin_port);
+    }
+    if (address_->ss_family == AF_INET6) {
+        const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *) address_;
+        //  FNV-1a of the address, the port beside
+        uint64_t hash = 0xcbf29ce484222325ull;
+        for (int i = 0; i < 16; i++)
+            hash = (hash ^ in6->sin6_addr.s6_addr [i]) * 0x100000001b3ull;
+        return (hash << 16 | ntohs (in6->sin6_port)) | 1ull << 63;
+    }
+    return 0;
+}
+
+class worker_pool_t
+{
+public:
+
+    worker_pool_t (void *ctx_, const pool_config_t &config_) :
+        ctx (ctx_),
+        config (config_),
+        surplus_since (0),
+        qt_started (0),
+        qt_retired (0)
+    {
+        assert (config.serve);
+        assert (config.min >= 0 && config.max >= config.min && config.target_idle >= 0);
+    }
+
+    ~worker_pool_t ()
+    {
+        for (std::list <thread_t *>::iterator it = threads.begin (); it != threads.end (); ++it)
+            stop (*it);
+        retired.splice (retired.end (), threads);
+        for (std::list <thread_t *>::iterator it = retired.begin (); it != retired.end (); ++it)
+            join (*it);
+    }
+
+    //  Starts threads for idle_ idle connections and wanted_ clients that
+    //  want one. Returns how many idle connections of the pool the caller
+    //  is to retire.
+    int adjust (size_t idle_, size_t wanted_, uint64_t now_)
+    {
+        reap ();
+        //  The threads not connected yet, or reconnecting after a session,
+        //  or whose connection the proxy has not registered yet, are idle
+        //  connections to come
+        int pending = 0;
+        for (std::list <thread_t *>::iterator it = threads.begin (); it != threads.end (); ++it) {
+            uint64_t key = __atomic_load_n (&(*it)->key, __ATOMIC_ACQUIRE);
+            if (!key || !registered.count (key))
+                pending++;
+        }
+        int deficit = (int) wanted_ + config.target_idle - (int) idle_ - pending;
+        int size = (int) threads.size ();
+        for (; size < config.min || (deficit > 0 && size < config.max); size++, deficit--)
+            start ();
+
+        int surplus = (int) idle_ - config.target_idle - (int) wanted_;
+        if (surplus <= 0 || size <= config.min) {
+            surplus_since = 0;
+            return 0;
+        }
+        if (!surplus_since)
+            surplus_since = now_;
+        if (now_ - surplus_since < config.cooldown)
+            return 0;
+        surplus_since = 0;
+        return surplus < size - config.min ? surplus : size - config.min;
+    }
+
+    //  The proxy has registered a worker connection from key_, of the pool
+    //  or not, or it has gone
+    void join (uint64_t key_) { registered.insert (key_); }
+    void leave (uint64_t key_) { registered.erase (key_); }
+
+    //  Stops the thread of the connection at key_; false if it is not one
+    //  of the pool, or not yet known as such
+    bool retire (uint64_t key_)
+    {
+        for (std::list <thread_t *>::iterator it = threads.begin (); it != threads.end (); ++it)
+            if (__atomic_load_n (&(*it)->key, __ATOMIC_ACQUIRE) == key_) {
+                stop (*it);
+                retired.splice (retired.end (), threads, it);
+                qt_retired++;
+                return true;
+            }
+        return false;
+    }
+
+    //  The key of the peer of the connection a chunk came from, on the
+    //  proxy side: 0 if libzmq does not tell its descriptor
+    static uint64_t peer_key (zmq_msg_t *msg_)
+    {
+        int fd = zmq_msg_get (msg_, ZMQ_SRCFD);
+        struct sockaddr_storage address;
+        socklen_t size = sizeof address;
+        if (fd < 0 || getpeername (fd, (struct sockaddr *) &address, &size) < 0)
+            return 0;
+        return pool_address_key (&address);
+    }
+
+    int size () const { return (int) threads.size (); }
+    uint64_t started () const { return qt_started; }
+    uint64_t retired_total () const { return qt_retired; }
+
+private:
+
+    struct thread_t {
+        worker_pool_t *pool;
+        pthread_t thread;
+        int stop_fd;                //  eventfd, readable when it is to stop
+        uint64_t key;               //  local address of its connection, 0 while not connected
+        int is_done;
+    };
+
+    void start ()
+    {
+        thread_t *thread = new thread_t;
+        thread->pool = this;
+        thread->stop_fd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+        assert (thread->stop_fd >= 0);
+        thread->key = 0;
+        thread->is_done = 0;
+        int rc = pthread_create (&thread->thread, NULL, main, thread);
+        assert (rc == 0);
+        threads.push_back (thread);
+        qt_started++;
+    }
+
+    static void stop (thread_t *thread_)
+    {
+        uint64_t one = 1;
+        ssize_t rc = write (thread_->stop_fd, &one, sizeof one);
+        assert (rc == sizeof one);
+    }
+
+    static void join (thread_t *thread_)
+    {
+        int rc = pthread_join (thread_->thread, NULL);
+        assert (rc == 0);
+        close (thread_->stop_fd);
+        delete thread_;
+    }
+
+    //  Joins the retired threads that are done, without waiting
+    void reap ()
+    {
+        for (std::list <thread_t *>::iterator it = retired.begin (); it != retired.end (); )
+            if (__atomic_load_n (&(*it)->is_done, __ATOMIC_ACQUIRE)) {
+                join (*it);
+                it = retired.erase (it);
+            }
+            else
+                ++it;
+    }
+
+    static void *main (void *self_)
+    {
+        thread_t *self = (thread_t *) self_;
+        const pool_config_t &config = self->pool->config;
+        void *worker = zmq_socket (self->pool->ctx, ZMQ_DEALER);
+        assert (worker);
+        int linger = 0;
+        int rc = zmq_setsockopt (worker, ZMQ_LINGER, &linger, sizeof (int));
+        assert (rc == 0);
+        if (config.secret_key) {
+            int as_server = 1;
+            rc = zmq_setsockopt (worker, ZMQ_CURVE_SERVER, &as_server, sizeof (int));
+            assert (rc == 0);
+            rc = zmq_setsockopt (worker, ZMQ_CURVE_SECRETKEY, config.secret_key, strlen (config.secret_key));
+            assert (rc == 0);
+        }
+        //  Its connections come and go: one per session
+        char endpoint [48];
+        sprintf (endpoint, "inproc://pool-%p", (void *) self);
+        rc = zmq_socket_monitor (worker, endpoint, ZMQ_EVENT_CONNECTED | ZMQ_EVENT_DISCONNECTED);
+        assert (rc == 0);
+        void *monitor = zmq_socket (self->pool->ctx, ZMQ_PAIR);
+        assert (monitor);
+        rc = zmq_connect (monitor, endpoint);
+        assert (rc == 0);
+        rc = zmq_connect (worker, config.endpoint);
+        assert (rc == 0);
+
+        zmq_pollitem_t items [] = {
+            { worker, 0, ZMQ_POLLIN, 0 },
+            { monitor, 0, ZMQ_POLLIN, 0 },
+            { NULL, self->stop_fd, ZMQ_POLLIN, 0 }
+        };
+        zmq_msg_t msg;
+        rc = zmq_msg_init (&msg);
+        assert (rc == 0);
+        while (true) {
+            rc = zmq_poll (items, 3, -1);
+            if (rc < 0 && zmq_errno () == EINTR)
+                continue;
+            if (rc < 0 || items [2].revents & ZMQ_POLLIN)
+                break;
+            if (items [1].revents & ZMQ_POLLIN)
+                event_in (self, monitor);
+            if (items [0].revents & ZMQ_POLLIN)
+                while (zmq_msg_recv (&msg, worker, ZMQ_DONTWAIT) >= 0)
+                    config.serve (worker, &msg, config.hint);
+        }
+        zmq_msg_close (&msg);
+        zmq_socket_monitor (worker, NULL, 0);
+        zmq_close (monitor);
+        zmq_close (worker);
+        __atomic_store_n (&self->is_done, 1, __ATOMIC_RELEASE);
+        return NULL;
+    }
+
+    //  A monitor event is the 16-bit event and a 32-bit value, the
+    //  descriptor when connected, then the endpoint
+    static void event_in (thread_t *self_, void *monitor_)
+    {
+        uint8_t event [6];
+        int rc = zmq_recv (monitor_, event, sizeof event, 0);
+        int more = 0;
+        size_t more_size = sizeof more;
+        zmq_getsockopt (monitor_, ZMQ_RCVMORE, &more, &more_size);
+        if (more) {
+            char endpoint [256];
+            zmq_recv (monitor_, endpoint, sizeof endpoint, 0);
+        }
+        if (rc != sizeof event)
+            return;
+        uint16_t type;
+        int32_t value;
+        memcpy (&type, event, sizeof type);
+        memcpy (&value, event + 2, sizeof value);
+        uint64_t key = 0;
+        if (type == ZMQ_EVENT_CONNECTED) {
+            struct sockaddr_storage address;
+            socklen_t size = sizeof address;
+            if (getsockname (value, (struct sockaddr *) &address, &size) == 0)
+                key = pool_address_key (&address);
+        }
+        __atomic_store_n (&self_->key, key, __ATOMIC_RELEASE);
+    }
+
+    void *ctx;
+    pool_config_t config;
+    std::list <thread_t *> threads;     //  running
+    std::list <thread_t *> retired;     //  told to stop, not joined yet
+    std::set <uint64_t> registered;     //  keys of the worker connections of the proxy
+    uint64_t surplus_since;         //  usec, 0 while idle is not above target
+    uint64_t qt_started;
+    uint64_t qt_retired;
+
+    worker_pool_t (const worker_pool_t&);
+    const worker_pool_t &operator = (const worker_pool_t&);
+};
+
+#endif
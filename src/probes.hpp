@@ -0,0 +1,59 @@
+/*
+    Copyright (c) 2013 Contributors as noted in the AUTHORS file
+
+    This file is part of StreamQ-Proxy.
+
+    StreamQ-Proxy is free software; you can redistribute it and/or modify it
+    under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    StreamQ-Proxy is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __STREAMQ_PROBES_HPP_INCLUDED__
+#define __STREAMQ_PROBES_HPP_INCLUDED__
+
+//  USDT probes of the provider streamq, for perf and bpftrace. Built with
+//  -DSTREAMQ_PROBES, and <sys/sdt.h> (systemtap-sdt-dev), each probe is a
+//  nop in the code and a note in the ELF file, which a tracer turns into a
+//  breakpoint when it attaches; the arguments are in registers already,
+//  or a load away. Built without, the probes are not there at all.
+//
+//  The sessions are told by the address of their session_t, which is the
+//  same from the pairing to the end. The probes and their arguments:
+//
+//    chunk_received (direction, session, size)     session 0 if not paired yet
+//    chunk_forwarded (direction, session, size)
+//    handshake_phase (session, phase, usec)        metrics_phase_*, since the last one
+//    pair_created (session, usec)                  since the first chunk of the client
+//    pair_destroyed (session, is_ready)            is_ready: past the handshake
+//    command (type, is_valid)                      proxy_command_t
+//    stall_begin (direction, session)              a send failed, the pipe is full
+//    stall_end (direction, session, usec)          the next send went through
+//
+//  A direction is probe_c2w or probe_w2c.
+
+#ifdef STREAMQ_PROBES
+#include <sys/sdt.h>
+#define PROXY_PROBES 1
+#define PROXY_PROBE2(name_, a_, b_) DTRACE_PROBE2 (streamq, name_, a_, b_)
+#define PROXY_PROBE3(name_, a_, b_, c_) DTRACE_PROBE3 (streamq, name_, a_, b_, c_)
+#else
+#define PROXY_PROBES 0
+#define PROXY_PROBE2(name_, a_, b_) ((void) 0)
+#define PROXY_PROBE3(name_, a_, b_, c_) ((void) 0)
+#endif
+
+enum {
+    probe_c2w,                      //  client to worker
+    probe_w2c                       //  worker to client
+};
+
+#endif
@@ -0,0 +1,1814 @@
+/*
+    Copyright (c) 2013 Contributors as noted in the AUTHORS file
+
+    This file is part of StreamQ-Proxy.
+
+    StreamQ-Proxy is free software; you can redistribute it and/or modify it
+    under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    StreamQ-Proxy is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __STREAMQ_PROXY_HPP_INCLUDED__
+#define __STREAMQ_PROXY_HPP_INCLUDED__
+
+//  The proxy: a ZMQ_STREAM frontend for the clients, a ZMQ_STREAM backend
+//  for the workers, and a SUB control socket.
+//
+//  Each worker connection is paired with one client connection for their
+//  whole life (SRD 150), so that the security handshake and the encoded
+//  messages go end to end untouched. A worker connection that comes in is
+//  kept idle with the beginning of its greeting (SRD 140), the first chunk
+//  of a new client pairs it with the longest idle worker connection, the
+//  stored greeting is relayed (SRD 170) and from then on the chunks are
+//  forwarded both ways (SRD 180, 190). Identities are looked up in hash
+//  tables (SRD 200).
+//
+//  Disconnections (SRD 230) rely on the ZMQ_STREAM notifications of libzmq
+//  4.1: a zero-length frame when a peer connects or disconnects, and a
+//  zero-length frame sent to close a connection. When a client goes, its
+//  worker connection is closed, and the worker reconnects for a new client.
+//
+//  basic_proxy takes the way it follows the handshakes, traces, and
+//  balances the clients as policies (policies.hpp), so that a build can
+//  fix them at compile time; proxy_t decides them all from its config.
+
+#include "../include/zmq.h"
+#include "metrics.hpp"
+#include "scheduler.hpp"
+#include "clock.hpp"
+#include "policies.hpp"
+#include "recorder.hpp"
+#include "topk.hpp"
+#include "command.hpp"
+#include "control_plane.hpp"
+#include "affinity.hpp"
+#include "tcp_info.hpp"
+#include "load.hpp"
+#include "pool.hpp"
+#include "probes.hpp"
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <list>
+#include <vector>
+#include <string>
+#include <unordered_map>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+
+#define BACKEND 0
+#define CONTROL 1
+#define FRONTEND 2
+#define PROXY_SPIN_BUDGET 64        //  messages per step while busy polling
+#define PROXY_DRAIN_DEADLINE 5000   //  msec, when DRAIN does not tell
+#define PROXY_POOL_TICK 100         //  msec between two looks at the worker pool
+#define PROXY_UPLINK_RECONNECT 3600000  //  msec, never due: a lost uplink is closed
+
+//  libzmq 4.1 has it, the zmq.h copied here predates it
+#ifndef ZMQ_CONNECT_RID
+#define ZMQ_CONNECT_RID 61
+#endif
+
+typedef struct {
+    const char *frontend;       //  endpoint the clients connect to, unless uplink
+    const char *backend;        //  endpoint the workers connect to
+    const char *control;        //  PUB endpoint sending the commands
+    const char *report;         //  SUB endpoint the replies are published to, or NULL
+    const char *metrics_path;   //  NULL for no published metrics
+    const char *record_path;    //  NULL for no recording of the NULL sessions
+    int backlog;                //  pending connections on each endpoint
+    int topk;                   //  heavy hitters tracked per ranking, 0 for none
+    bool verbose;
+    bool hc_dump;               //  dump the chunks relayed to the clients
+
+    //  Fair queueing of the client chunks towards the workers
+    bool scheduler;             //  false: forward in arrival order
+    const sched_class_t *classes;   //  class 0 is the default one
+    int qt_classes;
+    uint32_t queue_chunks;      //  per client, closed beyond
+    uint64_t queue_bytes;       //  per client, closed beyond
+    int read_batch;             //  chunks read before dispatching
+    uint64_t dispatch_budget;   //  bytes dispatched before reading again
+
+    //  Low latency: spin on the sockets while there is traffic
+    uint64_t busy_poll;         //  usec of idleness before blocking, 0: never spin
+    int cpu;                    //  core run () pins its thread to, -1 for none
+
+    //  Commands, pairing decisions and rankings in a thread of their own
+    bool control_thread;
+
+    //  Warm restarts: the worker host each client host had last time
+    const char *affinity_path;  //  NULL for no affinity
+    uint64_t affinity_slots;    //  when the store is created
+
+    //  usec: log the handshakes that take longer, 0 for none
+    uint64_t slow_handshake;
+
+    //  Clients held while no worker is idle, oldest first, rather than
+    //  closed at once
+    int waiting_room;           //  clients, 0 for no waiting room
+    uint64_t waiting_deadline;  //  usec before a waiting client is closed, 0: never
+
+    //  TCP_INFO of both connections of the sessions, a few at a time
+    uint64_t tcp_sample;        //  usec between two rounds, 0 for no sampling
+    int tcp_sample_batch;       //  sessions sampled per round
+
+    //  How a new client is given a worker connection: balance_oldest,
+    //  balance_least_sessions or balance_two_choices (policies.hpp). The
+    //  control plane of control_thread pairs with balance_oldest.
+    int balance;
+
+    //  Tiers: the clients come from an upstream proxy instead, through a
+    //  connection to its backend for each worker connection of this one
+    const char *uplink;         //  backend endpoint of the upstream proxy, or NULL
+    uint64_t uplink_deadline;   //  usec for an uplink to connect before it is retried
+
+    //  Worker threads in the process, as many as the clients want
+    //  (pool.hpp). With control_thread or uplink, the pool keeps the
+    //  threads it starts with.
+    const pool_config_t *pool;  //  NULL for no pool
+} proxy_config_t;
+
+static inline void
+proxy_config_init (proxy_config_t *config_)
+{
+    config_->frontend = "tcp://127.0.0.1:9999";
+    config_->backend = "tcp://127.0.0.1:9998";
+    config_->control = "inproc://control";
+    config_->report = NULL;
+    config_->metrics_path = NULL;
+    config_->record_path = NULL;
+    config_->backlog = 100;
+    config_->topk = 32;
+    config_->verbose = false;
+    config_->hc_dump = false;
+    config_->scheduler = false;
+    config_->classes = NULL;
+    config_->qt_classes = 0;
+    config_->queue_chunks = 256;
+    config_->queue_bytes = 1024 * 1024;
+    config_->read_batch = 64;
+    config_->dispatch_budget = 256 * 1024;
+    config_->busy_poll = 0;
+    config_->cpu = -1;
+    config_->control_thread = false;
+    config_->affinity_path = NULL;
+    config_->affinity_slots = 1 << 20;
+    config_->slow_handshake = 0;
+    config_->waiting_room = 0;
+    config_->waiting_deadline = 10000000;
+    config_->tcp_sample = 0;
+    config_->tcp_sample_batch = 16;
+    config_->balance = balance_oldest;
+    config_->uplink = NULL;
+    config_->uplink_deadline = 5000000;
+    config_->pool = NULL;
+}
+
+static inline char
+printc (char c)
+{
+    if (c < 32 || c == 127) return 254;
+    return c;
+}
+
+template <class HandshakePolicy, class TracePolicy, class BalancePolicy>
+class basic_proxy
+{
+public:
+
+    //  Creates and binds the sockets, asserts on failure
+    basic_proxy (void *ctx_, const proxy_config_t &config_);
+    ~basic_proxy ();
+
+    //  Forward until TERMINATE is received on the control socket.
+    //  Returns 0, or -1 if the context was terminated.
+    int run ();
+
+    //  To run the proxy inside the event loop of the application instead:
+    //  watch fd () for input, and call process_events () when it is ready.
+    //
+    //  The descriptor is edge triggered: it tells that something may have
+    //  changed on the sockets, not that there is something to read, and it
+    //  does not fire again for messages that were already there. So after
+    //  each wakeup, call process_events () until it returns less than its
+    //  budget; the proxy has then read everything, and the application may
+    //  wait again. Call it as well when timeout () msec have elapsed, for
+    //  the rate capped clients of the scheduler.
+    //
+    //  process_events () never blocks. It handles up to budget_ messages
+    //  and returns how many, or -1 if the context was terminated. Once
+    //  TERMINATE is received, is_terminated () is true and it returns 0.
+    int fd ();
+    int process_events (int budget_);
+    long timeout ();
+    bool is_terminated () const { return control_state == terminate; }
+
+    //  Live metrics, safe to read from any thread
+    const metrics_t *metrics () const { return stats; }
+
+private:
+
+    struct session_t {
+        std::string client;         //  frontend identity, empty while idle
+        std::string worker;         //  backend identity
+        std::string greeting;       //  worker bytes received while idle
+        enum {waiting_client, handcheck, ready} state;
+        typename HandshakePolicy::state_t handshake;
+        typename std::list <session_t *>::iterator idle_it;
+        typename std::list <session_t *>::iterator key_it;  //  in idle_keys
+        metrics_worker_t *slot;
+        sched_queue_t queue;        //  chunks waiting for the worker
+        uint32_t record_id;         //  0 when not recorded
+        uint64_t worker_key;        //  affinity key of the worker host, or 0
+        bool is_replied;            //  the worker has sent whole messages since the last client chunk
+        zmtp_frames_t reply;        //  where the worker stream is, towards is_replied
+        tcp_conn_t tcp [METRICS_LEGS];  //  by metrics_leg_*, with config.tcp_sample
+        typename std::list <session_t *>::iterator sample_it;
+        load_probe_t load;          //  towards the load of its host, with config.balance
+        bool is_uplinked;           //  its uplink is connected, with config.uplink
+        typename std::list <session_t *>::iterator uplink_it;
+        uint64_t peer_key;          //  TCP address of the worker, with config.pool
+        uint64_t stalled [2];       //  usec sends by probe_* direction fail since, with the probes
+
+        //  Handshake timing, in usec, until the first client message
+        bool is_timed;
+        uint32_t client_greeting;   //  greeting bytes seen from the client
+        uint64_t started;           //  first client chunk
+        uint64_t last;              //  last phase seen
+        uint64_t phases [METRICS_PHASES];   //  0 until seen
+    };
+    struct waiting_client_t {
+        std::string bytes;          //  sent while waiting
+        uint64_t key;               //  affinity key of the client host, or 0
+        uint64_t since;             //  usec of the first chunk
+        std::list <std::string>::iterator room_it;
+    };
+    typedef std::unordered_map <std::string, session_t *> sessions_t;
+    typedef std::unordered_map <std::string, waiting_client_t> waiting_t;
+
+    int control_in ();
+    void command (const char *content_, int size_, int status_);
+    void decisions_in ();
+    bool frontend_in (int flags_);
+    void backend_in ();
+    void dispatch ();
+    int set_class (const char *args_);
+    int report_top (const char *args_);
+    int start_drain (const char *args_);
+    void drain_session (session_t *session_, bool is_cut_);
+    void check_drain (uint64_t now_);
+    void sample_tcp (uint64_t now_);
+    bool is_running () const { return control_state == resume || control_state == drain; }
+    void account (session_t *session_, size_t size_);
+    int spin ();
+
+    void worker_in (const std::string &identity_, zmq_msg_t *msg_);
+    session_t *pair (const std::string &client_, uint64_t key_, uint64_t since_);
+    void open_session (session_t *session_, const std::string &client_, uint64_t since_);
+    void wait_worker (const std::string &client_, uint64_t key_, zmq_msg_t *msg_);
+    void admit ();
+    void leave_room (typename waiting_t::iterator it_, session_t *session_);
+    void drop_waiting (typename waiting_t::iterator it_);
+    void expire_room (uint64_t now_);
+    int open_uplink (session_t *session_);
+    void expire_uplinks (uint64_t now_);
+    void scale_pool ();
+    void client_chunk (session_t *session_, zmq_msg_t *msg_);
+    void to_worker (session_t *session_, zmq_msg_t *msg_);
+    void to_client (session_t *session_, zmq_msg_t *msg_);
+    void watch_handshake (session_t *session_, const byte *data_, size_t size_);
+    void watch_client (session_t *session_, const byte *data_, size_t size_);
+    void phase (session_t *session_, int phase_, uint64_t now_);
+    void log_handshake (session_t *session_, uint64_t now_, bool is_complete_);
+    void stall (session_t *session_, int direction_, bool is_failed_);
+    void close_peer (void *socket_, const std::string &identity_);
+    void close_session (session_t *session_);
+    void dump (const char *prefix_, const void *data_, size_t size_);
+    const char *hex (const std::string &identity_);
+
+    bool is_verbose () const { return TracePolicy::verbose (config.verbose); }
+    bool is_dumping () const { return TracePolicy::dump (config.hc_dump); }
+    bool is_scheduled () const { return BalancePolicy::is_scheduled (config.scheduler); }
+    int balance () const { return plane ? balance_oldest : BalancePolicy::balance (config.balance); }
+
+    proxy_config_t config;
+    void *frontend;
+    void *backend;
+    void *control;
+    void *report;
+    int event_fd;                   //  epoll set of the ZMQ_FD, -1 until fd ()
+
+    enum {suspend, resume, drain, terminate} control_state;
+    uint64_t drain_started;         //  usec
+    uint64_t drain_deadline;        //  usec, 0 while not draining
+    sessions_t clients;             //  paired sessions by client identity
+    sessions_t workers;             //  all the sessions by worker identity
+    std::list <session_t *> idle;   //  workers waiting for a client, oldest first
+    scheduler_t scheduler;
+    recorder_t recorder;
+    bool is_recording;
+    rankings_t rankings;
+    affinity_t affinity;            //  the control plane's with control_thread
+    affinity_idle_t <session_t> idle_keys;  //  the idle workers by affinity key
+
+    //  With config.control_thread, the idle workers and the rankings are
+    //  the control plane's, and the clients wait here for its decision
+    control_plane_t <BalancePolicy> *plane;
+    waiting_t waiting;              //  the clients waiting for a worker
+    std::list <std::string> room;   //  the same, oldest first
+
+    std::list <session_t *> sampled;    //  paired sessions, next to sample first
+    uint64_t next_sample;           //  usec
+
+    load_table_t loads;             //  of the worker hosts, unless balance_oldest
+
+    std::list <session_t *> uplinking;  //  uplinks not connected yet, oldest first
+    uint32_t next_uplink;           //  numbers the uplink identities
+
+    worker_pool_t *pool;            //  with config.pool
+    uint32_t pool_misses;           //  new clients with no idle worker since the last look
+    uint64_t pool_next;             //  usec of the next look
+
+    metrics_t *stats;
+    metrics_worker_t spare_slot;    //  shared by the workers beyond the slots, not published
+    char hex_buffer [PROXY_ID_SIZE_MAX * 2 + 1];
+
+    basic_proxy (const basic_proxy&);
+    const basic_proxy &operator = (const basic_proxy&);
+};
+
+//  The proxy configured at runtime
+typedef basic_proxy <zmtp_handshake_t, runtime_trace_t, runtime_balance_t> proxy_t;
+
+template <class HandshakePolicy, class TracePolicy, class BalancePolicy>
+inline basic_proxy <HandshakePolicy, TracePolicy, BalancePolicy>::basic_proxy (void *ctx_, const proxy_config_t &config_) :
+    config (config_),
+    event_fd (-1),
+    control_state (resume),
+    drain_started (0),
+    drain_deadline (0),
+    is_recording (false),
+    plane (NULL),
+    next_sample (0),
+    next_uplink (0),
+    pool (NULL),
+    pool_misses (0),
+    pool_next (0)
+{
+    // Frontend socket talks to clients over TCP, or to the upstream proxy.
+    // An uplink that is lost is not reconnected: its worker connection is
+    // closed, and a new one brings a new uplink. Not with a reconnect
+    // interval of -1, which since libzmq 4.2 drops every connection to the
+    // endpoint as soon as one is lost; the proxy closes a lost uplink
+    // before its reconnect is due.
+    frontend = zmq_socket (ctx_, ZMQ_STREAM);
+    assert (frontend);
+    int rc = zmq_setsockopt (frontend, ZMQ_BACKLOG, &config.backlog, sizeof (int));
+    assert (rc == 0);
+    if (config.uplink) {
+        int reconnect = PROXY_UPLINK_RECONNECT;
+        rc = zmq_setsockopt (frontend, ZMQ_RECONNECT_IVL, &reconnect, sizeof (int));
+        assert (rc == 0);
+    }
+    else {
+        rc = zmq_bind (frontend, config.frontend);
+        assert (rc == 0);
+    }
+
+    // Backend socket talks to workers over TCP
+    backend = zmq_socket (ctx_, ZMQ_STREAM);
+    assert (backend);
+    rc = zmq_setsockopt (backend, ZMQ_BACKLOG, &config.backlog, sizeof (int));
+    assert (rc == 0);
+    rc = zmq_bind (backend, config.backend);
+    assert (rc == 0);
+
+    // Control socket receives commands from the application, unless the
+    // control plane does
+    control = NULL;
+    report = NULL;
+    if (config.control_thread) {
+        plane = new control_plane_t <BalancePolicy> (ctx_, config.control,
+            config.report, config.topk, config.affinity_path, config.affinity_slots,
+            config.waiting_room > 0);
+        plane->start ();
+    }
+    else {
+        control = zmq_socket (ctx_, ZMQ_SUB);
+        assert (control);
+        rc = zmq_setsockopt (control, ZMQ_SUBSCRIBE, "", 0);
+        assert (rc == 0);
+        rc = zmq_connect (control, config.control);
+        assert (rc == 0);
+    }
+
+    // Report socket publishes the replies to the commands that have one
+    if (config.report && !plane) {
+        report = zmq_socket (ctx_, ZMQ_PUB);
+        assert (report);
+        int linger = 0;
+        rc = zmq_setsockopt (report, ZMQ_LINGER, &linger, sizeof (int));
+        assert (rc == 0);
+        rc = zmq_connect (report, config.report);
+        assert (rc == 0);
+    }
+
+    // Metrics segment, an anonymous mapping when not published
+    stats = metrics_create (config.metrics_path);
+    assert (stats);
+    memset (&spare_slot, 0, sizeof spare_slot);
+
+    scheduler.configure (config.classes, is_scheduled () ? config.qt_classes : 0,
+        config.queue_chunks, config.queue_bytes);
+
+    rankings.configure (plane ? 0 : config.topk);
+
+    loads.configure (balance () == balance_least_sessions);
+
+    if (config.record_path) {
+        rc = recorder.open (config.record_path, now_usec ());
+        assert (rc == 0);
+        is_recording = true;
+    }
+
+    if (config.affinity_path && !plane) {
+        rc = affinity.open (config.affinity_path, config.affinity_slots);
+        assert (rc == 0);
+    }
+
+    //  The pool starts its threads at once, the backend is bound
+    if (config.pool) {
+        pool = new worker_pool_t (ctx_, *config.pool);
+        pool->adjust (0, 0, now_usec ());
+        metrics_set (&stats->pool_threads, pool->size ());
+        metrics_set (&stats->pool_started, pool->started ());
+    }
+}
+
+template <class HandshakePolicy, class TracePolicy, class BalancePolicy>
+inline basic_proxy <HandshakePolicy, TracePolicy, BalancePolicy>::~basic_proxy ()
+{
+    for (typename sessions_t::iterator it = workers.begin (); it != workers.end (); ++it) {
+        if (is_scheduled () && it->second->state != session_t::waiting_client)
+            scheduler.close (&it->second->queue);
+        if (it->second->slot != &spare_slot)
+            metrics_worker_close (it->second->slot);
+        delete it->second;
+    }
+
+    delete plane;
+    delete pool;
+    //  After a drain, the last replies may still be in the pipes: they
+    //  have what is left of its deadline to go
+    if (drain_deadline) {
+        uint64_t now = now_usec ();
+        int linger = drain_deadline > now ? (int) ((drain_deadline - now) / 1000) : 0;
+        zmq_setsockopt (frontend, ZMQ_LINGER, &linger, sizeof (int));
+        zmq_setsockopt (backend, ZMQ_LINGER, &linger, sizeof (int));
+    }
+    int rc = zmq_close (frontend);
+    assert (rc == 0);
+    rc = zmq_close (backend);
+    assert (rc == 0);
+    if (control) {
+        rc = zmq_close (control);
+        assert (rc == 0);
+    }
+    if (report) {
+        rc = zmq_close (report);
+        assert (rc == 0);
+    }
+    if (event_fd >= 0)
+        close (event_fd);
+    metrics_close (stats);
+}
+
+template <class HandshakePolicy, class TracePolicy, class BalancePolicy>
+inline int basic_proxy <HandshakePolicy, TracePolicy, BalancePolicy>::run ()
+{
+    zmq_pollitem_t items [] = {
+        { backend, 0, ZMQ_POLLIN, 0 }, // BACKEND = 0
+        { control, 0, ZMQ_POLLIN, 0 }, // CONTROL = 1
+        { frontend, 0, ZMQ_POLLIN, 0 } // FRONTEND = 2
+    };
+    //  The decisions of the control plane come instead of the commands
+    if (plane) {
+        items [CONTROL].socket = NULL;
+        items [CONTROL].fd = plane->fd ();
+    }
+
+    if (config.cpu >= 0) {
+        cpu_set_t cpus;
+        CPU_ZERO (&cpus);
+        CPU_SET (config.cpu, &cpus);
+        if (pthread_setaffinity_np (pthread_self (), sizeof cpus, &cpus))
+            fprintf (stderr, "Warning : proxy cannot run on cpu %d\n", config.cpu);
+    }
+
+    while (control_state != terminate) {
+        //  Busy poll until the traffic stops, then block as usual
+        if (config.busy_poll) {
+            if (spin () < 0)
+                return -1;
+            if (control_state == terminate)
+                break;
+        }
+
+        //  Don't poll the clients while no worker can serve them, unless
+        //  some of them are already paired or they may wait
+        int qt_poll_items = !plane && !config.waiting_room && idle.empty () && clients.empty () ? 2 : 3;
+        long timeout = this->timeout ();
+        items [FRONTEND].revents = 0;
+        int rc = zmq_poll (&items [0], qt_poll_items, timeout);
+        if (rc < 0)
+            return -1;
+
+        //  Process a control command if any
+        if (plane)
+            decisions_in ();
+        else
+        if (items [CONTROL].revents & ZMQ_POLLIN)
+            if (control_in () < 0)
+                return -1;
+        if (config.waiting_deadline && !room.empty ())
+            expire_room (now_usec ());
+        if (!uplinking.empty ())
+            expire_uplinks (now_usec ());
+        if (pool)
+            scale_pool ();
+        //  Process requests, a batch of them when they are scheduled
+        if (is_running () && items [FRONTEND].revents & ZMQ_POLLIN) {
+            if (!is_scheduled ())
+                frontend_in (0);
+            else
+                for (int i = 0; i < config.read_batch; i++)
+                    if (!frontend_in (i ? ZMQ_DONTWAIT : 0))
+                        break;
+        }
+        //  Process a reply
+        if (is_running () && items [BACKEND].revents & ZMQ_POLLIN)
+            backend_in ();
+        //  Send the requests in fair order
+        if (is_scheduled () && is_running ())
+            dispatch ();
+        if (control_state == drain)
+            check_drain (now_usec ());
+        if (config.tcp_sample && !sampled.empty ()) {
+            uint64_t now = now_usec ();
+            if (now >= next_sample)
+                sample_tcp (now);
+        }
+    }
+    return 0;
+}
+
+template <class HandshakePolicy, class TracePolicy, class BalancePolicy>
+inline int basic_proxy <HandshakePolicy, TracePolicy, BalancePolicy>::fd ()
+{
+    if (event_fd >= 0)
+        return event_fd;
+    event_fd = epoll_create1 (EPOLL_CLOEXEC);
+    assert (event_fd >= 0);
+    void *sockets [] = { backend, control, frontend };
+    for (int i = 0; i < 3; i++) {
+        int socket_fd;
+        size_t size = sizeof socket_fd;
+        if (!sockets [i])
+            socket_fd = plane->fd ();
+        else {
+            int rc = zmq_getsockopt (sockets [i], ZMQ_FD, &socket_fd, &size);
+            assert (rc == 0);
+        }
+        struct epoll_event event;
+        event.events = EPOLLIN | EPOLLET;
+        event.data.ptr = sockets [i];
+        int rc = epoll_ctl (event_fd, EPOLL_CTL_ADD, socket_fd, &event);
+        assert (rc == 0);
+    }
+    return event_fd;
+}
+
+//  The same steps as run (), one message per socket in turn, as long as
+//  ZMQ_EVENTS tells there are some: that also rearms the ZMQ_FD
+template <class HandshakePolicy, class TracePolicy, class BalancePolicy>
+inline int basic_proxy <HandshakePolicy, TracePolicy, BalancePolicy>::process_events (int budget_)
+{
+    //  Consume the readiness of the epoll set itself
+    if (event_fd >= 0) {
+        struct epoll_event events [3];
+        while (epoll_wait (event_fd, events, 3, 0) > 0)
+            ;
+    }
+
+    int handled = 0;
+    while (handled < budget_ && control_state != terminate) {
+        int progress = handled;
+        int events;
+        size_t size = sizeof events;
+        if (plane)
+            decisions_in ();
+        else {
+            if (zmq_getsockopt (control, ZMQ_EVENTS, &events, &size) < 0)
+                return -1;
+            if (events & ZMQ_POLLIN) {
+                if (control_in () < 0)
+                    return -1;
+                handled++;
+            }
+        }
+        if (!is_running ())
+            break;
+        if (config.waiting_deadline && !room.empty ())
+            expire_room (now_usec ());
+        if (!uplinking.empty ())
+            expire_uplinks (now_usec ());
+        if (pool)
+            scale_pool ();
+
+        //  Don't read the clients while no worker can serve them, unless
+        //  some of them are already paired or they may wait
+        bool is_frontend = plane || config.waiting_room || !idle.empty () || !clients.empty ();
+        if (is_frontend) {
+            if (zmq_getsockopt (frontend, ZMQ_EVENTS, &events, &size) < 0)
+                return -1;
+            if (events & ZMQ_POLLIN && frontend_in (ZMQ_DONTWAIT))
+                handled++;
+        }
+        if (zmq_getsockopt (backend, ZMQ_EVENTS, &events, &size) < 0)
+            return -1;
+        if (events & ZMQ_POLLIN) {
+            backend_in ();
+            handled++;
+        }
+        if (is_scheduled ())
+            dispatch ();
+        if (control_state == drain)
+            check_drain (now_usec ());
+        if (config.tcp_sample && !sampled.empty ()) {
+            uint64_t now = now_usec ();
+            if (now >= next_sample)
+                sample_tcp (now);
+        }
+        if (handled == progress)
+            break;
+    }
+    return handled;
+}
+
+//  Take the messages as they come without ever sleeping, until nothing has
+//  come for config.busy_poll usec. Returns -1 if the context was terminated.
+template <class HandshakePolicy, class TracePolicy, class BalancePolicy>
+inline int basic_proxy <HandshakePolicy, TracePolicy, BalancePolicy>::spin ()
+{
+    uint64_t active = now_usec ();
+    while (control_state != terminate) {
+        int rc = process_events (PROXY_SPIN_BUDGET);
+        if (rc < 0)
+            return -1;
+        uint64_t now = now_usec ();
+        if (rc > 0)
+            active = now;
+        else
+        if (now - active >= config.busy_poll)
+            break;
+    }
+    return 0;
+}
+
+template <class HandshakePolicy, class TracePolicy, class BalancePolicy>
+inline long basic_proxy <HandshakePolicy, TracePolicy, BalancePolicy>::timeout ()
+{
+    long timeout = is_scheduled () && is_running ()
+        ? scheduler.timeout (now_usec ()) : -1;
+    //  Come back for the end of a drain
+    if (control_state == drain) {
+        uint64_t now = now_usec ();
+        long wait = drain_deadline > now ? (long) ((drain_deadline - now + 999) / 1000) : 0;
+        if (timeout < 0 || wait < timeout)
+            timeout = wait;
+    }
+    //  Come back for the next round of TCP_INFO samples
+    if (config.tcp_sample && !sampled.empty ()) {
+        uint64_t now = now_usec ();
+        long wait = next_sample > now ? (long) ((next_sample - now + 999) / 1000) : 0;
+        if (timeout < 0 || wait < timeout)
+            timeout = wait;
+    }
+    //  Come back for the events that did not fit in the ring
+    if (plane && !plane->is_flushed () && (timeout < 0 || timeout > PLANE_TICK))
+        timeout = PLANE_TICK;
+    //  And for the deadline of the oldest waiting client
+    if (config.waiting_deadline && !room.empty ()) {
+        uint64_t deadline = waiting.find (room.front ())->second.since + config.waiting_deadline;
+        uint64_t now = now_usec ();
+        long wait = deadline > now ? (long) ((deadline - now + 999) / 1000) : 0;
+        if (timeout < 0 || wait < timeout)
+            timeout = wait;
+    }
+    //  And of the oldest uplink still connecting
+    if (!uplinking.empty ()) {
+        uint64_t deadline = uplinking.front ()->started + config.uplink_deadline;
+        uint64_t now = now_usec ();
+        long wait = deadline > now ? (long) ((deadline - now + 999) / 1000) : 0;
+        if (timeout < 0 || wait < timeout)
+            timeout = wait;
+    }
+    //  And for the next look at the worker pool
+    if (pool && (timeout < 0 || timeout > PROXY_POOL_TICK))
+        timeout = PROXY_POOL_TICK;
+    return timeout;
+}
+
+template <class HandshakePolicy, class TracePolicy, class BalancePolicy>
+inline int basic_proxy <HandshakePolicy, TracePolicy, BalancePolicy>::control_in ()
+{
+    char content [PROXY_COMMAND_SIZE_MAX];
+    int size = zmq_recv (control, content, sizeof content - 1, 0);
+    if (size < 0)
+        return -1;
+    if (size > (int) sizeof content - 1)
+        size = sizeof content - 1;
+
+    int more;
+    size_t moresz = sizeof more;
+    int rc = zmq_getsockopt (control, ZMQ_RCVMORE, &more, &moresz);
+    if (rc < 0 || more)
+        return -1;
+
+    content [size] = '\0';
+    command (content, size, 0);
+    return 0;
+}
+
+//  Apply a command; status_ is the outcome of TOPK in the control plane
+template <class HandshakePolicy, class TracePolicy, class BalancePolicy>
+inline void basic_proxy <HandshakePolicy, TracePolicy, BalancePolicy>::command (const char *content_, int size_, int status_)
+{
+    metrics_add (&stats->commands, 1);
+    bool is_valid = true;
+    const char *args;
+    proxy_command_t type = proxy_parse_command (content_, size_, &args);
+    switch (type) {
+        case proxy_suspend:
+            if (control_state != drain)
+                control_state = suspend;
+            break;
+        case proxy_resume:
+            if (control_state != drain)
+                control_state = resume;
+            break;
+        case proxy_terminate:
+            control_state = terminate;
+            break;
+        case proxy_drain:
+            is_valid = start_drain (args) == 0;
+            break;
+        case proxy_class:
+            is_valid = set_class (args) == 0;
+            break;
+        case proxy_topk:
+            is_valid = (plane ? status_ : report_top (args)) == 0;
+            break;
+        default:
+            is_valid = false;
+    }
+    PROXY_PROBE2 (command, (int) type, is_valid);
+    if (!is_valid) {
+        metrics_add (&stats->bad_commands, 1);
+        fprintf (stderr, "Warning : \"%s\" bad command received by proxy\n", content_); // prefered compared to "return -1"
+    }
+}
+
+//  Carry out what the control plane has decided
+template <class HandshakePolicy, class TracePolicy, class BalancePolicy>
+inline void basic_proxy <HandshakePolicy, TracePolicy, BalancePolicy>::decisions_in ()
+{
+    plane->flush ();
+    if (!plane->lower ())
+        return;
+    plane_decision_t decision;
+    while (plane->next (&decision)) {
+        if (decision.type == plane_decision_t::apply_command) {
+            command (decision.command, decision.size, decision.status);
+            continue;
+        }
+        std::string client (decision.client, decision.client_size);
+        typename waiting_t::iterator it = waiting.find (client);
+        if (decision.type == plane_decision_t::refuse_client) {
+            //  No worker to serve it, as in frontend_in ()
+            if (it != waiting.end ()) {
+                metrics_add (&stats->drops, 1);
+                close_peer (frontend, client);
+                drop_waiting (it);
+            }
+            continue;
+        }
+
+        //  Either peer may have left since
+        std::string worker (decision.worker, decision.worker_size);
+        typename sessions_t::iterator worker_it = workers.find (worker);
+        if (worker_it == workers.end ()) {
+            if (it != waiting.end ())
+                plane->post (plane_event_t::client_joined, client, it->second.key);
+            continue;
+        }
+        if (it == waiting.end ()) {
+            plane->post (plane_event_t::worker_returned, worker, worker_it->second->worker_key);
+            continue;
+        }
+        session_t *session = worker_it->second;
+        if (decision.affinity >= 0)
+            metrics_add (decision.affinity ? &stats->affinity_hits : &stats->affinity_misses, 1);
+        open_session (session, client, it->second.since);
+        leave_room (it, session);
+    }
+}
+
+//  "CLASS <client identity in hexadecimal> <class>" moves a client to
+//  another scheduling class. Returns -1 if the command is malformed.
+template <class HandshakePolicy, class TracePolicy, class BalancePolicy>
+inline int basic_proxy <HandshakePolicy, TracePolicy, BalancePolicy>::set_class (const char *args_)
+{
+    char identity [PROXY_ID_SIZE_MAX];
+    size_t size;
+    int cls;
+    if (proxy_parse_class (args_, identity, &size, &cls) < 0
+    ||  cls < 0 || cls >= (config.qt_classes > 0 ? config.qt_classes : 1))
+        return -1;
+    typename sessions_t::iterator it = clients.find (std::string (identity, size));
+    if (it != clients.end () && is_scheduled ())
+        scheduler.set_class (&it->second->queue, cls);
+    return 0;
+}
+
+//  "TOPK [<n>]" publishes the n heaviest clients and workers, by bytes and
+//  by chunks, on the report socket, one per line:
+//  "<ranking> <identity in hexadecimal> <count> <error>", where ranking is
+//  client-bytes, client-msgs, worker-bytes or worker-msgs. The count is
+//  over by at most the error. Returns -1 if there is no report socket.
+template <class HandshakePolicy, class TracePolicy, class BalancePolicy>
+inline int basic_proxy <HandshakePolicy, TracePolicy, BalancePolicy>::report_top (const char *args_)
+{
+    int n = 10;
+    if (*args_ && (sscanf (args_, " %d", &n) != 1 || n < 1))
+        return -1;
+    if (!report)
+        return -1;
+    if (n > TOPK_MAX)
+        n = TOPK_MAX;
+
+    std::string reply;
+    rankings.report (n, &reply);
+    zmq_send (report, reply.data (), reply.size (), ZMQ_DONTWAIT);
+    return 0;
+}
+
+//  "DRAIN [<deadline in msec>]" stops the proxy gracefully: no new client
+//  nor worker is taken, the waiting clients and the idle workers are
+//  closed, and each pair is closed once the worker has answered the last
+//  request of its client, with the last frame of a message. The proxy terminates when no pair is left, or at
+//  the deadline, where the remaining pairs are cut. Returns -1 if the
+//  command is malformed.
+template <class HandshakePolicy, class TracePolicy, class BalancePolicy>
+inline int basic_proxy <HandshakePolicy, TracePolicy, BalancePolicy>::start_drain (const char *args_)
+{
+    int deadline = PROXY_DRAIN_DEADLINE;
+    if (*args_ && (sscanf (args_, " %d", &deadline) != 1 || deadline < 0))
+        return -1;
+    if (control_state == drain)
+        return 0;
+    control_state = drain;
+    drain_started = now_usec ();
+    drain_deadline = drain_started + (uint64_t) deadline * 1000;
+    if (is_verbose ()) printf ("proxy: draining, for %d msec at most\n", deadline);
+
+    while (!room.empty ()) {
+        typename waiting_t::iterator it = waiting.find (room.front ());
+        metrics_add (&stats->drops, 1);
+        close_peer (frontend, it->first);
+        drop_waiting (it);
+    }
+    std::vector <session_t *> sessions;
+    for (typename sessions_t::iterator it = workers.begin (); it != workers.end (); ++it)
+        sessions.push_back (it->second);
+    for (size_t i = 0; i < sessions.size (); i++) {
+        session_t *session = sessions [i];
+        if (session->state == session_t::waiting_client) {
+            close_peer (backend, session->worker);
+            close_session (session);
+        }
+        else
+        if (session->is_replied && (!is_scheduled () || !session->queue.count))
+            drain_session (session, false);
+    }
+    check_drain (drain_started);
+    return 0;
+}
+
+//  Close a pair; is_cut_ when its reply had not come. A replied client is
+//  left to the closing of the frontend, which flushes what it still has
+//  to receive: closing its connection here could drop the reply, still in
+//  the pipe.
+template <class HandshakePolicy, class TracePolicy, class BalancePolicy>
+inline void basic_proxy <HandshakePolicy, TracePolicy, BalancePolicy>::drain_session (session_t *session_, bool is_cut_)
+{
+    metrics_add (is_cut_ ? &stats->drain_cut : &stats->drain_closed, 1);
+    if (is_cut_)
+        close_peer (frontend, session_->client);
+    close_peer (backend, session_->worker);
+    close_session (session_);
+}
+
+//  Cut the pairs left at the deadline, and terminate once none is left
+template <class HandshakePolicy, class TracePolicy, class BalancePolicy>
+inline void basic_proxy <HandshakePolicy, TracePolicy, BalancePolicy>::check_drain (uint64_t now_)
+{
+    if (now_ >= drain_deadline)
+        while (!clients.empty ())
+            drain_session (clients.begin ()->second, true);
+    if (!clients.empty ())
+        return;
+    control_state = terminate;
+    uint64_t cut = metrics_get (&stats->drain_cut);
+    if (cut)
+        fprintf (stderr, "Warning : drain cut %llu sessions at its deadline\n",
+            (unsigned long long) cut);
+    if (is_verbose ())
+        printf ("proxy: drained in %llu usec, %llu sessions closed, %llu cut\n",
+            (unsigned long long) (now_ - drain_started),
+            (unsigned long long) metrics_get (&stats->drain_closed),
+            (unsigned long long) cut);
+}
+
+//  Sample both connections of config.tcp_sample_batch sessions, those that
+//  have waited longest, so that a round costs the same whatever the number
+//  of sessions: each one is sampled every config.tcp_sample usec times the
+//  number of rounds it takes to go through them all
+template <class HandshakePolicy, class TracePolicy, class BalancePolicy>
+inline void basic_proxy <HandshakePolicy, TracePolicy, BalancePolicy>::sample_tcp (uint64_t now_)
+{
+    next_sample = now_ + config.tcp_sample;
+    for (int i = 0; i < config.tcp_sample_batch && i < (int) sampled.size (); i++) {
+        session_t *session = sampled.front ();
+        sampled.splice (sampled.end (), sampled, sampled.begin ());
+        for (int leg = 0; leg < METRICS_LEGS; leg++) {
+            tcp_conn_t *conn = &session->tcp [leg];
+            tcp_sample_t sample;
+            if (tcp_conn_sample (conn, &sample) < 0)
+                continue;
+            metrics_tcp_t *tcp = &session->slot->tcp [leg];
+            metrics_set (&tcp->rtt, sample.rtt);
+            metrics_set (&tcp->rttvar, sample.rttvar);
+            metrics_set (&tcp->unacked, sample.unacked);
+            metrics_set (&tcp->notsent, sample.notsent);
+            if (sample.total_retrans > conn->retrans) {
+                uint32_t retrans = sample.total_retrans - conn->retrans;
+                metrics_add (&tcp->retrans, retrans);
+                metrics_add (&stats->tcp_retrans [leg], retrans);
+                conn->retrans = sample.total_retrans;
+            }
+            metrics_record (&stats->rtt [leg], sample.rtt);
+            metrics_add (&stats->tcp_samples, 1);
+        }
+    }
+}
+
+//  Returns false if there was nothing to read (with ZMQ_DONTWAIT)
+template <class HandshakePolicy, class TracePolicy, class BalancePolicy>
+inline bool basic_proxy <HandshakePolicy, TracePolicy, BalancePolicy>::frontend_in (int flags_)
+{
+    //  First frame is identity
+    char identity [PROXY_ID_SIZE_MAX];
+    int size = zmq_recv (frontend, identity, sizeof identity, flags_);
+    if (size < 0 && zmq_errno () == EAGAIN)
+        return false;
+    assert (size > 0 && size <= PROXY_ID_SIZE_MAX);
+    int more;
+    size_t moresz = sizeof more;
+    int rc = zmq_getsockopt (frontend, ZMQ_RCVMORE, &more, &moresz);
+    assert (rc == 0 && more); // we expect a chunk after the identifier
+
+    //  Second frame is the chunk as delivered by TCP
+    zmq_msg_t msg;
+    rc = zmq_msg_init (&msg);
+    assert (rc == 0);
+    rc = zmq_msg_recv (&msg, frontend, 0);
+    assert (rc >= 0);
+    assert (!zmq_msg_more (&msg));
+
+    std::string client (identity, size);
+    typename sessions_t::iterator it = clients.find (client);
+    session_t *session = it == clients.end () ? NULL : it->second;
+
+    if (zmq_msg_size (&msg) == 0) {
+        //  A client connects, or disconnects. We wait for its first chunk
+        //  to pair it, so that a worker is not reserved for nothing.
+        //  An uplink is paired already, and this may tell it is connected.
+        if (session && config.uplink && !session->is_uplinked) {
+            session->is_uplinked = true;
+            uplinking.erase (session->uplink_it);
+        }
+        else
+        if (session) {
+            if (is_verbose ()) printf ("proxy: client %s has left\n", hex (client));
+            //  A lost uplink would be reconnected, in the end
+            if (config.uplink)
+                close_peer (frontend, client);
+            close_peer (backend, session->worker);
+            close_session (session);
+        }
+        else
+        if (!waiting.empty ()) {
+            typename waiting_t::iterator it = waiting.find (client);
+            if (it != waiting.end ())
+                drop_waiting (it);
+        }
+        zmq_msg_close (&msg);
+        return true;
+    }
+
+    PROXY_PROBE3 (chunk_received, probe_c2w, (uintptr_t) session, zmq_msg_size (&msg));
+    if (!session && control_state == drain) {
+        //  No new client while draining
+        metrics_add (&stats->drops, 1);
+        close_peer (frontend, client);
+        zmq_msg_close (&msg);
+        return true;
+    }
+    if (!session) {
+        bool is_waiting = !waiting.empty () && waiting.count (client);
+        //  The host of a new client, for its affinity
+        uint64_t key = 0;
+        if (!is_waiting && config.affinity_path)
+            key = affinity_peer_key (&msg);
+        if (!is_waiting && !plane)
+            session = pair (client, key, now_usec ());
+        if (!session && !is_waiting)
+            pool_misses++;
+        if (!session) {
+            if (is_waiting || waiting.size () < (size_t) config.waiting_room
+            ||  (plane && !config.waiting_room)) {
+                wait_worker (client, key, &msg);
+                return true;
+            }
+            //  No worker to serve it, nor room to wait: close the
+            //  connection so that the client retries later rather than
+            //  waiting on a dead end
+            metrics_add (&stats->drops, 1);
+            if (config.waiting_room)
+                metrics_add (&stats->waiting_refused, 1);
+            close_peer (frontend, client);
+            zmq_msg_close (&msg);
+            return true;
+        }
+    }
+    //  The connect notification does not tell the descriptor, a chunk does
+    if (config.tcp_sample && session->tcp [metrics_leg_client].fd < 0)
+        tcp_conn_open (&session->tcp [metrics_leg_client], &msg);
+    client_chunk (session, &msg);
+    return true;
+}
+
+//  Keep what a new client sends until it has a worker: until the control
+//  plane has found it one, whose first chunk asks for, or until a worker
+//  comes when it waits in the room
+template <class HandshakePolicy, class TracePolicy, class BalancePolicy>
+inline void basic_proxy <HandshakePolicy, TracePolicy, BalancePolicy>::wait_worker (const std::string &client_, uint64_t key_, zmq_msg_t *msg_)
+{
+    std::pair <typename waiting_t::iterator, bool> inserted =
+        waiting.insert (std::make_pair (client_, waiting_client_t ()));
+    if (inserted.second) {
+        waiting_client_t &waiting_client = inserted.first->second;
+        waiting_client.key = key_;
+        waiting_client.since = now_usec ();
+        waiting_client.room_it = room.insert (room.end (), client_);
+        if (plane)
+            plane->post (plane_event_t::client_joined, client_, key_);
+        else
+        if (is_verbose ()) printf ("proxy: client %s waits for a worker\n", hex (client_));
+        metrics_add (&stats->queue_depth, 1);
+        metrics_add (&stats->waiting, 1);
+        metrics_add (&stats->waiting_total, 1);
+    }
+    inserted.first->second.bytes.append ((const char *) zmq_msg_data (msg_), zmq_msg_size (msg_));
+    metrics_add (&stats->queue_bytes, zmq_msg_size (msg_));
+    zmq_msg_close (msg_);
+}
+
+//  Pair the client that has waited longest with the worker that has just
+//  come
+template <class HandshakePolicy, class TracePolicy, class BalancePolicy>
+inline void basic_proxy <HandshakePolicy, TracePolicy, BalancePolicy>::admit ()
+{
+    typename waiting_t::iterator it = waiting.find (room.front ());
+    session_t *session = pair (it->first, it->second.key, it->second.since);
+    assert (session);
+    leave_room (it, session);
+}
+
+//  Forward what the client sent while waiting to its new worker
+template <class HandshakePolicy, class TracePolicy, class BalancePolicy>
+inline void basic_proxy <HandshakePolicy, TracePolicy, BalancePolicy>::leave_room (typename waiting_t::iterator it_, session_t *session_)
+{
+    const std::string &bytes = it_->second.bytes;
+    metrics_sub (&stats->queue_depth, 1);
+    metrics_sub (&stats->queue_bytes, bytes.size ());
+    metrics_sub (&stats->waiting, 1);
+    metrics_record (&stats->wait, now_usec () - it_->second.since);
+    zmq_msg_t msg;
+    int rc = zmq_msg_init_size (&msg, bytes.size ());
+    assert (rc == 0);
+    memcpy (zmq_msg_data (&msg), bytes.data (), bytes.size ());
+    room.erase (it_->second.room_it);
+    waiting.erase (it_);
+    client_chunk (session_, &msg);
+}
+
+//  Forget a waiting client; the caller has closed it if needed
+template <class HandshakePolicy, class TracePolicy, class BalancePolicy>
+inline void basic_proxy <HandshakePolicy, TracePolicy, BalancePolicy>::drop_waiting (typename waiting_t::iterator it_)
+{
+    metrics_sub (&stats->queue_depth, 1);
+    metrics_sub (&stats->queue_bytes, it_->second.bytes.size ());
+    metrics_sub (&stats->waiting, 1);
+    if (plane)
+        plane->post (plane_event_t::client_left, it_->first, 0);
+    room.erase (it_->second.room_it);
+    waiting.erase (it_);
+}
+
+//  Close the clients that have waited past config.waiting_deadline, so
+//  that they back off and retry
+template <class HandshakePolicy, class TracePolicy, class BalancePolicy>
+inline void basic_proxy <HandshakePolicy, TracePolicy, BalancePolicy>::expire_room (uint64_t now_)
+{
+    while (!room.empty ()) {
+        typename waiting_t::iterator it = waiting.find (room.front ());
+        if (now_ - it->second.since < config.waiting_deadline)
+            break;
+        if (is_verbose ()) printf ("proxy: client %s has waited too long\n", hex (it->first));
+        metrics_add (&stats->drops, 1);
+        metrics_add (&stats->waiting_expired, 1);
+        close_peer (frontend, it->first);
+        drop_waiting (it);
+    }
+}
+
+//  Connect to the upstream proxy for a new worker connection, and pair
+//  them: the upstream proxy sees a worker, whose greeting comes through at
+//  once. Returns -1 if the endpoint is refused; the worker connection is
+//  closed then.
+template <class HandshakePolicy, class TracePolicy, class BalancePolicy>
+inline int basic_proxy <HandshakePolicy, TracePolicy, BalancePolicy>::open_uplink (session_t *session_)
+{
+    char identity [5] = { 'U' };
+    next_uplink++;
+    memcpy (identity + 1, &next_uplink, sizeof next_uplink);
+    int rc = zmq_setsockopt (frontend, ZMQ_CONNECT_RID, identity, sizeof identity);
+    if (rc == 0)
+        rc = zmq_connect (frontend, config.uplink);
+    if (rc < 0) {
+        fprintf (stderr, "Warning : proxy cannot connect to %s: %s\n", config.uplink, zmq_strerror (zmq_errno ()));
+        close_peer (backend, session_->worker);
+        close_session (session_);
+        return -1;
+    }
+    //  The handshake is not timed behind an uplink, started tells when the
+    //  uplink was opened
+    session_->is_uplinked = false;
+    session_->started = now_usec ();
+    session_->uplink_it = uplinking.insert (uplinking.end (), session_);
+    metrics_add (&stats->uplinks, 1);
+    open_session (session_, std::string (identity, sizeof identity), now_usec ());
+    return 0;
+}
+
+//  Close the uplinks that could not connect, and their worker connections:
+//  the workers reconnect, and bring new uplinks
+template <class HandshakePolicy, class TracePolicy, class BalancePolicy>
+inline void basic_proxy <HandshakePolicy, TracePolicy, BalancePolicy>::expire_uplinks (uint64_t now_)
+{
+    while (!uplinking.empty ()) {
+        session_t *session = uplinking.front ();
+        if (now_ - session->started < config.uplink_deadline)
+            break;
+        if (is_verbose ()) printf ("proxy: uplink %s has not connected\n", hex (session->client));
+        metrics_add (&stats->uplinks_expired, 1);
+        close_peer (frontend, session->client);
+        close_peer (backend, session->worker);
+        close_session (session);
+    }
+}
+
+//  Size the worker pool for the idle connections and the clients that
+//  found none, and close the idle connections of the pool it has too many
+//  of, the youngest first: their threads stop
+template <class HandshakePolicy, class TracePolicy, class BalancePolicy>
+inline void basic_proxy <HandshakePolicy, TracePolicy, BalancePolicy>::scale_pool ()
+{
+    uint64_t now = now_usec ();
+    if (!pool_misses && now < pool_next)
+        return;
+    pool_next = now + PROXY_POOL_TICK * 1000;
+    if (plane || config.uplink)
+        return;
+    //  The waiting clients are among the misses, the others were closed
+    size_t wanted = config.waiting_room ? room.size () : pool_misses;
+    int surplus = pool->adjust (idle.size (), wanted, now);
+    pool_misses = 0;
+    typename std::list <session_t *>::iterator it = idle.end ();
+    while (surplus > 0 && it != idle.begin ()) {
+        session_t *session = *--it;
+        if (!session->peer_key || !pool->retire (session->peer_key))
+            continue;
+        //  Closing it erases it from idle, the next one stays valid
+        ++it;
+        if (is_verbose ()) printf ("proxy: pool retires worker %s\n", hex (session->worker));
+        close_peer (backend, session->worker);
+        close_session (session);
+        surplus--;
+    }
+    metrics_set (&stats->pool_threads, pool->size ());
+    metrics_set (&stats->pool_started, pool->started ());
+    metrics_set (&stats->pool_retired, pool->retired_total ());
+}
+
+template <class HandshakePolicy, class TracePolicy, class BalancePolicy>
+inline void basic_proxy <HandshakePolicy, TracePolicy, BalancePolicy>::client_chunk (session_t *session_, zmq_msg_t *msg_)
+{
+    if (is_scheduled ()) {
+        //  A STREAM socket cannot stop reading one connection: rather than
+        //  stopping them all, the client whose queue is full is closed
+        if (scheduler.is_full (&session_->queue)) {
+            if (is_verbose ()) printf ("proxy: client %s overflows its queue\n", hex (session_->client));
+            metrics_add (&stats->queue_overflows, 1);
+            metrics_add (&stats->drops, 1);
+            zmq_msg_close (msg_);
+            close_peer (frontend, session_->client);
+            close_peer (backend, session_->worker);
+            close_session (session_);
+            return;
+        }
+        metrics_add (&stats->queue_depth, 1);
+        metrics_add (&stats->queue_bytes, zmq_msg_size (msg_));
+        scheduler.push (&session_->queue, msg_);
+        zmq_msg_close (msg_);
+        if (session_->load.host)
+            session_->load.host->queued++;
+    }
+    else
+        to_worker (session_, msg_);
+}
+
+template <class HandshakePolicy, class TracePolicy, class BalancePolicy>
+inline void basic_proxy <HandshakePolicy, TracePolicy, BalancePolicy>::backend_in ()
+{
+    //  First frame is identity
+    char identity [PROXY_ID_SIZE_MAX];
+    int size = zmq_recv (backend, identity, sizeof identity, 0);
+    assert (size > 0 && size <= PROXY_ID_SIZE_MAX);
+    int more;
+    size_t moresz = sizeof more;
+    int rc = zmq_getsockopt (backend, ZMQ_RCVMORE, &more, &moresz);
+    assert (rc == 0 && more); // we expect a chunk after the identifier
+
+    zmq_msg_t msg;
+    rc = zmq_msg_init (&msg);
+    assert (rc == 0);
+    rc = zmq_msg_recv (&msg, backend, 0);
+    assert (rc >= 0);
+    assert (!zmq_msg_more (&msg));
+
+    worker_in (std::string (identity, size), &msg);
+}
+
+template <class HandshakePolicy, class TracePolicy, class BalancePolicy>
+inline void basic_proxy <HandshakePolicy, TracePolicy, BalancePolicy>::worker_in (const std::string &identity_, zmq_msg_t *msg_)
+{
+    size_t size = zmq_msg_size (msg_);
+    typename sessions_t::iterator it = workers.find (identity_);
+
+    if (it == workers.end () && size == 0) {
+        //  A worker connection registers with its greeting: a zero-length
+        //  frame of an identity not known is its connect notification, or
+        //  the disconnect one of a connection the proxy has closed already
+        zmq_msg_close (msg_);
+        return;
+    }
+    if (it == workers.end () && control_state == drain) {
+        //  No new worker while draining
+        close_peer (backend, identity_);
+        zmq_msg_close (msg_);
+        return;
+    }
+    if (it == workers.end ()) {
+        //  A new worker connection, kept idle until a client comes
+        session_t *session = new session_t;
+        session->worker = identity_;
+        session->state = session_t::waiting_client;
+        session->is_timed = false;
+        session->worker_key = config.affinity_path ? affinity_peer_key (msg_) : 0;
+        session->load.host = NULL;
+        session->peer_key = 0;
+        session->stalled [probe_c2w] = session->stalled [probe_w2c] = 0;
+        if (balance () != balance_oldest)
+            loads.join (&session->load, session->worker_key ? session->worker_key : affinity_peer_key (msg_));
+        for (int leg = 0; leg < METRICS_LEGS; leg++)
+            tcp_conn_init (&session->tcp [leg]);
+        HandshakePolicy::init (session->handshake);
+        session->slot = metrics_worker_open (stats, identity_.data (), identity_.size ());
+        if (!session->slot) {
+            //  Beyond the slots, a worker is in the totals only
+            session->slot = &spare_slot;
+            metrics_add (&stats->workers_unslotted, 1);
+        }
+        workers [identity_] = session;
+        if (config.uplink)
+            ;   //  Paired at once with an uplink of its own, below
+        else
+        if (plane)
+            plane->post (plane_event_t::worker_joined, identity_, session->worker_key);
+        else
+        {
+            session->idle_it = idle.insert (idle.end (), session);
+            idle_keys.add (session, false);
+            loads.idle_in (&session->load, session);
+        }
+        metrics_add (&stats->workers, 1);
+        if (is_verbose ()) printf ("proxy: worker %s has registered\n", hex (identity_));
+        if (config.uplink && open_uplink (session) < 0) {
+            zmq_msg_close (msg_);
+            return;
+        }
+        it = workers.find (identity_);
+    }
+    else if (size == 0) {
+        //  The worker connection is gone; so is its client, if any
+        session_t *session = it->second;
+        if (is_verbose ()) printf ("proxy: worker %s has left\n", hex (identity_));
+        if (session->state != session_t::waiting_client)
+            close_peer (frontend, session->client);
+        close_session (session);
+        zmq_msg_close (msg_);
+        return;
+    }
+
+    session_t *session = it->second;
+    if (size)
+        PROXY_PROBE3 (chunk_received, probe_w2c, (uintptr_t) session, size);
+    if (config.tcp_sample && size && session->tcp [metrics_leg_worker].fd < 0)
+        tcp_conn_open (&session->tcp [metrics_leg_worker], msg_);
+    //  The connect notification does not tell the descriptor, the greeting does
+    if (pool && size && !session->peer_key) {
+        session->peer_key = worker_pool_t::peer_key (msg_);
+        if (session->peer_key)
+            pool->join (session->peer_key);
+    }
+    if (session->state == session_t::waiting_client) {
+        //  Store the beginning of the greeting until there is a client
+        if (size) {
+            session->greeting.append ((const char *) zmq_msg_data (msg_), size);
+            metrics_add (&stats->queue_depth, 1);
+            metrics_add (&stats->queue_bytes, size);
+        }
+        zmq_msg_close (msg_);
+        //  Clients only wait while no worker is idle: this new one is
+        //  for the client that has waited longest
+        if (!plane && !room.empty ())
+            admit ();
+        return;
+    }
+    to_client (session, msg_);
+}
+
+//  Pair a new client with an idle connection of the worker host it had
+//  last time, or else with the one the policy picks; since_ is when the
+//  client sent its first chunk. Returns NULL if no worker.
+template <class HandshakePolicy, class TracePolicy, class BalancePolicy>
+inline typename basic_proxy <HandshakePolicy, TracePolicy, BalancePolicy>::session_t *
+basic_proxy <HandshakePolicy, TracePolicy, BalancePolicy>::pair (const std::string &client_, uint64_t key_, uint64_t since_)
+{
+    if (idle.empty ())
+        return NULL;
+    session_t *session = NULL;
+    if (key_) {
+        uint64_t worker_key = affinity.find (key_);
+        if (worker_key)
+            session = idle_keys.pick (idle, worker_key);
+        metrics_add (session ? &stats->affinity_hits : &stats->affinity_misses, 1);
+    }
+    if (!session) {
+        switch (balance ()) {
+            case balance_least_sessions:
+                session = loads.pick_least_sessions (idle);
+                break;
+            case balance_two_choices:
+                session = loads.pick_two_choices (idle, now_usec ());
+                break;
+            default:
+                session = BalancePolicy::pick (idle);
+        }
+        idle_keys.remove (session);
+    }
+    loads.idle_out (&session->load);
+    if (key_ && session->worker_key)
+        affinity.update (key_, session->worker_key);
+    open_session (session, client_, since_);
+    return session;
+}
+
+//  Pair a client with an idle worker connection, and relay the greeting
+//  that worker has sent so far; since_ is when the client sent its first
+//  chunk
+template <class HandshakePolicy, class TracePolicy, class BalancePolicy>
+inline void basic_proxy <HandshakePolicy, TracePolicy, BalancePolicy>::open_session (session_t *session_, const std::string &client_, uint64_t since_)
+{
+    session_->is_replied = false;
+    zmtp_frames_init (&session_->reply);
+    //  Behind an uplink, the handshake is timed by the upstream proxy
+    if (HandshakePolicy::is_watching && !config.uplink) {
+        session_->is_timed = true;
+        session_->client_greeting = 0;
+        session_->started = since_;
+        session_->last = since_;
+        memset (session_->phases, 0, sizeof session_->phases);
+        phase (session_, metrics_phase_paired, now_usec ());
+    }
+
+    session_->client = client_;
+    session_->state = HandshakePolicy::is_watching ? session_t::handcheck : session_t::ready;
+    clients [client_] = session_;
+    session_->record_id = is_recording ? recorder.begin (now_usec ()) : 0;
+    if (is_scheduled ())
+        scheduler.open (&session_->queue, session_, 0, now_usec ());
+    if (config.tcp_sample) {
+        if (sampled.empty ())
+            next_sample = now_usec () + config.tcp_sample;
+        session_->sample_it = sampled.insert (sampled.end (), session_);
+    }
+    loads.paired (&session_->load);
+
+    metrics_add (&stats->sessions, 1);
+    metrics_add (&stats->sessions_total, 1);
+    if (HandshakePolicy::is_watching) {
+        metrics_add (&stats->handshakes, 1);
+        metrics_add (&stats->handshakes_total, 1);
+    }
+    metrics_add (&session_->slot->sessions, 1);
+    metrics_add (&session_->slot->sessions_total, 1);
+    PROXY_PROBE2 (pair_created, (uintptr_t) session_, now_usec () - since_);
+    if (is_verbose ()) {
+        printf ("proxy: client %s", hex (client_));
+        printf (" paired with worker %s\n", hex (session_->worker));
+    }
+
+    if (!session_->greeting.empty ()) {
+        metrics_sub (&stats->queue_depth, 1);
+        metrics_sub (&stats->queue_bytes, session_->greeting.size ());
+        zmq_msg_t msg;
+        int rc = zmq_msg_init_size (&msg, session_->greeting.size ());
+        assert (rc == 0);
+        memcpy (zmq_msg_data (&msg), session_->greeting.data (), session_->greeting.size ());
+        std::string ().swap (session_->greeting);
+        to_client (session_, &msg);
+    }
+}
+
+//  Send the queued requests in deficit round robin order, up to the budget
+template <class HandshakePolicy, class TracePolicy, class BalancePolicy>
+inline void basic_proxy <HandshakePolicy, TracePolicy, BalancePolicy>::dispatch ()
+{
+    uint64_t now = now_usec ();
+    uint64_t budget = config.dispatch_budget;
+    zmq_msg_t msg;
+    int rc = zmq_msg_init (&msg);
+    assert (rc == 0);
+    while (budget > 0) {
+        sched_queue_t *queue = scheduler.pop (now, &msg);
+        if (!queue)
+            break;
+        size_t size = zmq_msg_size (&msg);
+        metrics_sub (&stats->queue_depth, 1);
+        metrics_sub (&stats->queue_bytes, size);
+        budget = size < budget ? budget - size : 0;
+        session_t *session = (session_t *) queue->owner;
+        if (session->load.host)
+            session->load.host->queued--;
+        to_worker (session, &msg);
+        rc = zmq_msg_init (&msg);
+        assert (rc == 0);
+    }
+    zmq_msg_close (&msg);
+}
+
+template <class HandshakePolicy, class TracePolicy, class BalancePolicy>
+inline void basic_proxy <HandshakePolicy, TracePolicy, BalancePolicy>::to_worker (session_t *session_, zmq_msg_t *msg_)
+{
+    size_t size = zmq_msg_size (msg_);
+    if (is_dumping ()) dump ("C", zmq_msg_data (msg_), size);
+    if (HandshakePolicy::is_watching && session_->is_timed)
+        watch_client (session_, (const byte *) zmq_msg_data (msg_), size);
+    if (session_->record_id
+    &&  !recorder.chunk (session_->record_id, RECORD_CLIENT, zmq_msg_data (msg_), size, now_usec ()))
+        session_->record_id = 0;
+
+    //  Never wait for a peer: with libzmq 4.3, a send to a ZMQ_STREAM peer
+    //  whose pipe is full waits until it is not, and the whole proxy with
+    //  it. The chunk is dropped instead; its peer, whose stream is broken
+    //  then, drops the connection.
+    int rc = zmq_send (backend, session_->worker.data (), session_->worker.size (), ZMQ_SNDMORE | ZMQ_DONTWAIT);
+    if (rc >= 0)
+        rc = zmq_msg_send (msg_, backend, ZMQ_DONTWAIT);
+    if (rc < 0) {
+        metrics_add (&stats->drops, 1);
+        zmq_msg_close (msg_);
+        if (PROXY_PROBES)
+            stall (session_, probe_c2w, true);
+        return;
+    }
+    if (PROXY_PROBES && session_->stalled [probe_c2w])
+        stall (session_, probe_c2w, false);
+    PROXY_PROBE3 (chunk_forwarded, probe_c2w, (uintptr_t) session_, size);
+    metrics_add (&stats->msgs_c2w, 1);
+    metrics_add (&stats->bytes_c2w, size);
+    metrics_add (&session_->slot->msgs_out, 1);
+    metrics_add (&session_->slot->bytes_out, size);
+    account (session_, size);
+    session_->is_replied = false;
+    //  Once the handshake is over, which is timed on its own
+    if (session_->load.host && session_->state == session_t::ready) {
+        if (!session_->load.since)
+            load_table_t::request (&session_->load, now_usec ());
+        load_table_t::sent (&session_->load, size);
+    }
+}
+
+template <class HandshakePolicy, class TracePolicy, class BalancePolicy>
+inline void basic_proxy <HandshakePolicy, TracePolicy, BalancePolicy>::to_client (session_t *session_, zmq_msg_t *msg_)
+{
+    size_t size = zmq_msg_size (msg_);
+    if (is_dumping ()) dump ("\t\tS", zmq_msg_data (msg_), size);
+    if (HandshakePolicy::is_watching && session_->state != session_t::ready)
+        watch_handshake (session_, (const byte *) zmq_msg_data (msg_), size);
+    if (session_->record_id
+    &&  !recorder.chunk (session_->record_id, RECORD_WORKER, zmq_msg_data (msg_), size, now_usec ()))
+        session_->record_id = 0;
+    zmtp_frames_feed (&session_->reply, (const byte *) zmq_msg_data (msg_), size);
+
+    //  As in to_worker (), without waiting
+    int rc = zmq_send (frontend, session_->client.data (), session_->client.size (), ZMQ_SNDMORE | ZMQ_DONTWAIT);
+    if (rc >= 0)
+        rc = zmq_msg_send (msg_, frontend, ZMQ_DONTWAIT);
+    if (rc < 0) {
+        metrics_add (&stats->drops, 1);
+        zmq_msg_close (msg_);
+        if (PROXY_PROBES)
+            stall (session_, probe_w2c, true);
+        return;
+    }
+    if (PROXY_PROBES && session_->stalled [probe_w2c])
+        stall (session_, probe_w2c, false);
+    PROXY_PROBE3 (chunk_forwarded, probe_w2c, (uintptr_t) session_, size);
+    metrics_add (&stats->msgs_w2c, 1);
+    metrics_add (&stats->bytes_w2c, size);
+    metrics_add (&session_->slot->msgs_in, 1);
+    metrics_add (&session_->slot->bytes_in, size);
+    account (session_, size);
+    session_->is_replied = zmtp_frames_is_whole (&session_->reply);
+    if (session_->load.host && session_->load.since)
+        load_table_t::replied (&session_->load, now_usec ());
+    //  Its whole reply is out: a draining session is done
+    if (control_state == drain && session_->is_replied
+    &&  (!is_scheduled () || !session_->queue.count))
+        drain_session (session_, false);
+}
+
+template <class HandshakePolicy, class TracePolicy, class BalancePolicy>
+inline void basic_proxy <HandshakePolicy, TracePolicy, BalancePolicy>::account (session_t *session_, size_t size_)
+{
+    if (plane)
+        plane->account (session_->client, session_->worker, size_);
+    else
+        rankings.add (session_->client.data (), session_->client.size (),
+            session_->worker.data (), session_->worker.size (), size_);
+}
+
+//  Follow the worker side of the handshake: the mechanism from its greeting,
+//  then its READY command.
+template <class HandshakePolicy, class TracePolicy, class BalancePolicy>
+inline void basic_proxy <HandshakePolicy, TracePolicy, BalancePolicy>::watch_handshake (session_t *session_, const byte *data_, size_t size_)
+{
+    uint64_t now = now_usec ();
+    if (session_->is_timed && session_->phases [metrics_phase_greeting]
+    &&  zmtp_command_is (data_, size_, "WELCOME"))
+        phase (session_, metrics_phase_welcome, now);
+    int events = HandshakePolicy::watch (session_->handshake, data_, size_);
+    if (events & handshake_mechanism) {
+        if (session_->is_timed)
+            phase (session_, metrics_phase_greeting, now);
+        const char *mechanism = HandshakePolicy::mechanism (session_->handshake);
+        if (is_verbose ())
+            printf ("proxy: worker %s uses %s\n", hex (session_->worker), mechanism);
+    }
+    if (events & handshake_ready) {
+        if (is_verbose ()) printf ("proxy: worker %s is ready\n", hex (session_->worker));
+        session_->state = session_t::ready;
+        metrics_sub (&stats->handshakes, 1);
+        if (session_->is_timed)
+            phase (session_, metrics_phase_ready, now);
+    }
+}
+
+//  Follow the client side of the handshake: its greeting, its HELLO and
+//  INITIATE commands, then its first message, which ends the timing
+template <class HandshakePolicy, class TracePolicy, class BalancePolicy>
+inline void basic_proxy <HandshakePolicy, TracePolicy, BalancePolicy>::watch_client (session_t *session_, const byte *data_, size_t size_)
+{
+    if (session_->client_greeting < sizeof (zmtp_greeting_t)) {
+        size_t used = sizeof (zmtp_greeting_t) - session_->client_greeting;
+        if (used > size_)
+            used = size_;
+        session_->client_greeting += (uint32_t) used;
+        data_ += used;
+        size_ -= used;
+        if (!size_)
+            return;
+    }
+    uint64_t now = now_usec ();
+    if (zmtp_command_is (data_, size_, "HELLO"))
+        phase (session_, metrics_phase_hello, now);
+    else
+    if (zmtp_command_is (data_, size_, "INITIATE"))
+        phase (session_, metrics_phase_initiate, now);
+    else
+    if (session_->state == session_t::ready && !(data_ [0] & 0x04)) {
+        //  Not a command: with CURVE, MESSAGE is sent as a plain frame
+        phase (session_, metrics_phase_message, now);
+        metrics_record (&stats->handshake [metrics_phase_total], now - session_->started);
+        session_->is_timed = false;
+        if (config.slow_handshake && now - session_->started > config.slow_handshake)
+            log_handshake (session_, now, true);
+    }
+}
+
+//  Time a phase from the last one seen, once
+template <class HandshakePolicy, class TracePolicy, class BalancePolicy>
+inline void basic_proxy <HandshakePolicy, TracePolicy, BalancePolicy>::phase (session_t *session_, int phase_, uint64_t now_)
+{
+    if (session_->phases [phase_])
+        return;
+    session_->phases [phase_] = now_;
+    metrics_record (&stats->handshake [phase_], now_ - session_->last);
+    PROXY_PROBE3 (handshake_phase, (uintptr_t) session_, phase_, now_ - session_->last);
+    session_->last = now_;
+}
+
+//  One line per slow handshake, with the time each phase took, so that
+//  the proxy (paired), the network and the client (greeting, hello,
+//  initiate, message) and the crypto of the worker (welcome, ready) can be
+//  told apart
+template <class HandshakePolicy, class TracePolicy, class BalancePolicy>
+inline void basic_proxy <HandshakePolicy, TracePolicy, BalancePolicy>::log_handshake (session_t *session_, uint64_t now_, bool is_complete_)
+{
+    fprintf (stderr, "Warning : %s handshake of %llu usec, client %s",
+        is_complete_ ? "slow" : "unfinished",
+        (unsigned long long) (now_ - session_->started), hex (session_->client));
+    fprintf (stderr, " worker %s (%s):", hex (session_->worker),
+        HandshakePolicy::mechanism (session_->handshake));
+    uint64_t last = session_->started;
+    for (int i = 0; i < metrics_phase_total; i++)
+        if (session_->phases [i]) {
+            fprintf (stderr, " %s %llu", metrics_phase_names [i],
+                (unsigned long long) (session_->phases [i] - last));
+            last = session_->phases [i];
+        }
+    fprintf (stderr, "\n");
+}
+
+//  A send to that direction failed, or went through after failures
+template <class HandshakePolicy, class TracePolicy, class BalancePolicy>
+inline void basic_proxy <HandshakePolicy, TracePolicy, BalancePolicy>::stall (session_t *session_, int direction_, bool is_failed_)
+{
+    uint64_t &since = session_->stalled [direction_];
+    if (is_failed_) {
+        if (!since) {
+            since = now_usec ();
+            PROXY_PROBE2 (stall_begin, direction_, (uintptr_t) session_);
+        }
+    }
+    else {
+        PROXY_PROBE3 (stall_end, direction_, (uintptr_t) session_, now_usec () - since);
+        since = 0;
+    }
+}
+
+//  A zero-length frame closes the connection of that identity. Without
+//  waiting: the pipe of a peer that is going away, a retired thread of
+//  the pool for one, may never take it.
+template <class HandshakePolicy, class TracePolicy, class BalancePolicy>
+inline void basic_proxy <HandshakePolicy, TracePolicy, BalancePolicy>::close_peer (void *socket_, const std::string &identity_)
+{
+    int rc = zmq_send (socket_, identity_.data (), identity_.size (), ZMQ_SNDMORE | ZMQ_DONTWAIT);
+    if (rc >= 0)
+        zmq_send (socket_, "", 0, ZMQ_DONTWAIT);
+}
+
+//  Forget a session; the caller has closed the remaining peer if needed
+template <class HandshakePolicy, class TracePolicy, class BalancePolicy>
+inline void basic_proxy <HandshakePolicy, TracePolicy, BalancePolicy>::close_session (session_t *session_)
+{
+    if (session_->state == session_t::waiting_client) {
+        if (plane)
+            plane->post (plane_event_t::worker_left, session_->worker, 0);
+        else {
+            idle.erase (session_->idle_it);
+            idle_keys.remove (session_);
+            loads.idle_out (&session_->load);
+        }
+        if (!session_->greeting.empty ()) {
+            metrics_sub (&stats->queue_depth, 1);
+            metrics_sub (&stats->queue_bytes, session_->greeting.size ());
+        }
+    }
+    else {
+        if (config.uplink) {
+            if (!session_->is_uplinked)
+                uplinking.erase (session_->uplink_it);
+            metrics_sub (&stats->uplinks, 1);
+        }
+        if (is_scheduled ()) {
+            if (session_->load.host)
+                session_->load.host->queued -= session_->queue.count;
+            uint64_t bytes = session_->queue.bytes;
+            uint32_t dropped = scheduler.close (&session_->queue);
+            if (dropped) {
+                metrics_sub (&stats->queue_depth, dropped);
+                metrics_sub (&stats->queue_bytes, bytes);
+                metrics_add (&stats->drops, dropped);
+            }
+        }
+        if (session_->record_id)
+            recorder.end (session_->record_id, now_usec ());
+        if (HandshakePolicy::is_watching && session_->is_timed && config.slow_handshake) {
+            uint64_t now = now_usec ();
+            if (now - session_->started > config.slow_handshake)
+                log_handshake (session_, now, false);
+        }
+        if (config.tcp_sample)
+            sampled.erase (session_->sample_it);
+        clients.erase (session_->client);
+        PROXY_PROBE2 (pair_destroyed, (uintptr_t) session_, session_->state == session_t::ready);
+        metrics_sub (&stats->sessions, 1);
+        if (session_->state != session_t::ready)
+            metrics_sub (&stats->handshakes, 1);
+    }
+    if (session_->load.host)
+        loads.leave (&session_->load, session_->state != session_t::waiting_client);
+    if (pool && session_->peer_key)
+        pool->leave (session_->peer_key);
+    metrics_sub (&stats->workers, 1);
+    if (session_->slot == &spare_slot)
+        metrics_sub (&stats->workers_unslotted, 1);
+    else
+        metrics_worker_close (session_->slot);
+    workers.erase (session_->worker);
+    delete session_;
+}
+
+template <class HandshakePolicy, class TracePolicy, class BalancePolicy>
+inline void basic_proxy <HandshakePolicy, TracePolicy, BalancePolicy>::dump (const char *prefix_, const void *data_, size_t size_)
+{
+    const char *content = (const char *) data_;
+    printf ("%s (%d): ", prefix_, (int) size_);
+    for (size_t i = 0; i < size_; i++)
+        printf ("%u '%c'  ", (uint8_t) content [i], printc (content [i]));
+    printf ("\n");
+}
+
+//  ZMQ_STREAM identities are binary, print them in hexadecimal
+template <class HandshakePolicy, class TracePolicy, class BalancePolicy>
+inline const char *basic_proxy <HandshakePolicy, TracePolicy, BalancePolicy>::hex (const std::string &identity_)
+{
+    size_t size = identity_.size () < PROXY_ID_SIZE_MAX ? identity_.size () : PROXY_ID_SIZE_MAX;
+    for (size_t i = 0; i < size; i++)
+        sprintf (hex_buffer + 2 * i, "%02x", (uint8_t) identity_ [i]);
+    hex_buffer [2 * size] = '\0';
+    return hex_buffer;
+}
+
+#endif
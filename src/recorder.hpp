@@ -0,0 +1,262 @@
+/*
+    Copyright (c) 2013 Contributors as noted in the AUTHORS file
+
+    This file is part of StreamQ-Proxy.
+
+    StreamQ-Proxy is free software; you can redistribute it and/or modify it
+    under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    StreamQ-Proxy is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __STREAMQ_RECORDER_HPP_INCLUDED__
+#define __STREAMQ_RECORDER_HPP_INCLUDED__
+
+//  Recording of the byte streams relayed by the proxy, to replay them
+//  later (perf/replay). Only NULL mechanism sessions are kept: the others
+//  are encrypted with per connection keys, and could not be replayed.
+//
+//  The file is the 8 bytes RECORD_MAGIC, then one record per event:
+//
+//      varint  session id, from 1
+//      byte    RECORD_OPEN, RECORD_CLIENT, RECORD_WORKER or RECORD_CLOSE
+//      varint  usec since the recording started
+//      varint  size, then the bytes of the chunk (RECORD_CLIENT, RECORD_WORKER)
+//
+//  Varints are little endian base 128, as in protobuf. The records of a
+//  session are in order, but the sessions are interleaved, and not sorted
+//  by time: the records of a session are held back until the greeting of
+//  its worker tells its mechanism. The recorder reads that greeting itself,
+//  whatever the handshake policy of the proxy. A session that holds back
+//  more than RECORD_HELD_MAX bytes, or that would take the recorder over
+//  RECORD_HELD_TOTAL_MAX, is dropped from the recording.
+
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <unordered_map>
+
+#include "policies.hpp"
+
+#define RECORD_MAGIC "SQREC\0\1"    //  with its terminating zero, 8 bytes
+#define RECORD_MAGIC_SIZE 8
+#define RECORD_BUFFER_SIZE (1024 * 1024)
+#define RECORD_HELD_MAX (64 * 1024)                 //  per session
+#define RECORD_HELD_TOTAL_MAX (16 * 1024 * 1024)
+
+enum {
+    RECORD_OPEN = 0,
+    RECORD_CLIENT = 1,              //  chunk from the client to the worker
+    RECORD_WORKER = 2,              //  chunk from the worker to the client
+    RECORD_CLOSE = 3
+};
+
+typedef struct {
+    uint32_t session;
+    int type;
+    uint64_t usec;
+    const unsigned char *data;
+    size_t size;
+} record_t;
+
+class recorder_t
+{
+public:
+
+    recorder_t () :
+        file (NULL),
+        start (0),
+        last_id (0),
+        held_total (0)
+    {
+    }
+
+    ~recorder_t ()
+    {
+        close ();
+    }
+
+    //  Returns -1 with errno set if the file cannot be created
+    int open (const char *path_, uint64_t now_)
+    {
+        assert (!file);
+        file = fopen (path_, "wb");
+        if (!file)
+            return -1;
+        setvbuf (file, NULL, _IOFBF, RECORD_BUFFER_SIZE);
+        if (fwrite (RECORD_MAGIC, 1, RECORD_MAGIC_SIZE, file) != RECORD_MAGIC_SIZE) {
+            int err = errno;
+            fclose (file);
+            file = NULL;
+            errno = err;
+            return -1;
+        }
+        start = now_;
+        return 0;
+    }
+
+    void close ()
+    {
+        if (!file)
+            return;
+        fclose (file);
+        file = NULL;
+        pending.clear ();
+        held_total = 0;
+    }
+
+    //  A session starts, held back until its mechanism is known. Returns
+    //  its id.
+    uint32_t begin (uint64_t now_)
+    {
+        uint32_t id = ++last_id;
+        held_t &held = pending [id];
+        zmtp_handshake_t::init (held.handshake);
+        encode (held.records, id, RECORD_OPEN, now_, NULL, 0);
+        held_total += held.records.size ();
+        return id;
+    }
+
+    //  Returns false once the session is not recorded: its mechanism is not
+    //  NULL, or it held back too much. The session must not be given to the
+    //  recorder anymore then.
+    bool chunk (uint32_t id_, int type_, const void *data_, size_t size_, uint64_t now_)
+    {
+        pending_t::iterator it = pending.find (id_);
+        if (it == pending.end ()) {
+            encode (scratch, id_, type_, now_, data_, size_);
+            fwrite (scratch.data (), 1, scratch.size (), file);
+            scratch.clear ();
+            return true;
+        }
+        held_t &held = it->second;
+        size_t before = held.records.size ();
+        encode (held.records, id_, type_, now_, data_, size_);
+        held_total += held.records.size () - before;
+        if (type_ == RECORD_WORKER
+        &&  zmtp_handshake_t::watch (held.handshake, (const byte *) data_, size_) & handshake_mechanism) {
+            //  Only the NULL sessions can be replayed
+            bool is_null = !strcmp (zmtp_handshake_t::mechanism (held.handshake), "NULL");
+            if (is_null)
+                fwrite (held.records.data (), 1, held.records.size (), file);
+            drop (it);
+            return is_null;
+        }
+        if (held.records.size () > RECORD_HELD_MAX || held_total > RECORD_HELD_TOTAL_MAX) {
+            drop (it);
+            return false;
+        }
+        return true;
+    }
+
+    //  The session is over; if it was still held back, it is dropped
+    void end (uint32_t id_, uint64_t now_)
+    {
+        pending_t::iterator it = pending.find (id_);
+        if (it != pending.end ()) {
+            drop (it);
+            return;
+        }
+        chunk (id_, RECORD_CLOSE, NULL, 0, now_);
+    }
+
+private:
+
+    struct held_t {
+        zmtp_handshake_t::state_t handshake;    //  of the worker greeting
+        std::string records;
+    };
+    typedef std::unordered_map <uint32_t, held_t> pending_t;
+
+    void drop (pending_t::iterator it_)
+    {
+        held_total -= it_->second.records.size ();
+        pending.erase (it_);
+    }
+
+    static void encode_varint (std::string &out_, uint64_t value_)
+    {
+        while (value_ >= 0x80) {
+            out_.push_back ((char) (value_ | 0x80));
+            value_ >>= 7;
+        }
+        out_.push_back ((char) value_);
+    }
+
+    void encode (std::string &out_, uint32_t id_, int type_, uint64_t now_,
+        const void *data_, size_t size_)
+    {
+        encode_varint (out_, id_);
+        out_.push_back ((char) type_);
+        encode_varint (out_, now_ > start ? now_ - start : 0);
+        if (type_ == RECORD_CLIENT || type_ == RECORD_WORKER) {
+            encode_varint (out_, size_);
+            out_.append ((const char *) data_, size_);
+        }
+    }
+
+    FILE *file;
+    uint64_t start;                 //  usec
+    uint32_t last_id;
+    pending_t pending;
+    size_t held_total;              //  bytes held back in pending
+    std::string scratch;
+
+    recorder_t (const recorder_t&);
+    const recorder_t &operator = (const recorder_t&);
+};
+
+static inline int
+record_decode_varint (const unsigned char *&at_, const unsigned char *end_, uint64_t *value_)
+{
+    uint64_t value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        if (at_ == end_)
+            return -1;
+        unsigned char c = *at_++;
+        value |= (uint64_t) (c & 0x7f) << shift;
+        if (!(c & 0x80)) {
+            *value_ = value;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+//  Decode the record at at_, past the magic, and move at_ after it.
+//  Returns 1, 0 at the end of the recording, or -1 if it is corrupted.
+static inline int
+record_next (const unsigned char *&at_, const unsigned char *end_, record_t *record_)
+{
+    if (at_ == end_)
+        return 0;
+    uint64_t session, usec, size = 0;
+    if (record_decode_varint (at_, end_, &session) < 0 || at_ == end_)
+        return -1;
+    record_->type = *at_++;
+    if (record_->type > RECORD_CLOSE || record_decode_varint (at_, end_, &usec) < 0)
+        return -1;
+    if (record_->type == RECORD_CLIENT || record_->type == RECORD_WORKER) {
+        if (record_decode_varint (at_, end_, &size) < 0 || size > (uint64_t) (end_ - at_))
+            return -1;
+    }
+    record_->session = (uint32_t) session;
+    record_->usec = usec;
+    record_->data = at_;
+    record_->size = (size_t) size;
+    at_ += size;
+    return 1;
+}
+
+#endif
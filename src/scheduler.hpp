@@ -0,0 +1,335 @@
+/*
+    Copyright (c) 2013 Contributors as noted in the AUTHORS file
+
+    This file is part of StreamQ-Proxy.
+
+    StreamQ-Proxy is free software; you can redistribute it and/or modify it
+    under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    StreamQ-Proxy is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __STREAMQ_SCHEDULER_HPP_INCLUDED__
+#define __STREAMQ_SCHEDULER_HPP_INCLUDED__
+
+//  Deficit round robin over per-session queues of chunks.
+//
+//  Each queue belongs to a class, which gives it a weight and, optionally,
+//  a byte rate cap enforced by a token bucket. In each round a queue may
+//  send up to quantum * weight bytes, so a client sending big chunks
+//  back to back gets its share, not the whole link, and a client sending
+//  a small request waits at most one round.
+//
+//  Queues are rings of zmq_msg_t that grow by doubling up to a capacity:
+//  a session that never queues more than one chunk keeps a tiny ring, and
+//  the steady state does not allocate.
+
+#include "../include/zmq.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#define SCHED_CLASSES_MAX 8
+#define SCHED_QUANTUM 8192          //  one full TCP chunk per unit of weight
+#define SCHED_RING_MIN 4
+
+typedef struct {
+    uint32_t weight;                //  at least 1
+    uint64_t rate;                  //  bytes per second, 0 for no cap
+    uint64_t burst;                 //  bytes sent at once above the rate
+} sched_class_t;
+
+struct sched_queue_t {
+    void *owner;
+    zmq_msg_t *ring;
+    uint32_t capacity;
+    uint32_t head;
+    uint32_t count;
+    uint64_t bytes;
+    int64_t deficit;
+    bool granted;                   //  quantum given for the current turn
+    int64_t tokens;                 //  bytes, negative when in debt
+    uint64_t refilled;              //  usec
+    int cls;
+    bool active;
+    sched_queue_t *next;
+};
+
+class scheduler_t
+{
+public:
+
+    scheduler_t () :
+        qt_classes (1),
+        ring_max (256),
+        queue_bytes_max (1024 * 1024),
+        active_head (NULL),
+        active_tail (NULL),
+        qt_active (0),
+        depth (0),
+        bytes (0)
+    {
+        classes [0].weight = 1;
+        classes [0].rate = 0;
+        classes [0].burst = 0;
+    }
+
+    //  Set the classes (class 0 is the default one) and the queue limits;
+    //  with no class, the single default one stays
+    void configure (const sched_class_t *classes_, int qt_classes_,
+        uint32_t ring_max_, uint64_t queue_bytes_max_)
+    {
+        assert (qt_classes_ >= 0 && qt_classes_ <= SCHED_CLASSES_MAX);
+        assert (classes_ || qt_classes_ == 0);
+        for (int i = 0; i < qt_classes_; i++) {
+            classes [i] = classes_ [i];
+            if (classes [i].weight < 1)
+                classes [i].weight = 1;
+            //  A capped queue must be able to send a full chunk at once
+            if (classes [i].rate && classes [i].burst < SCHED_QUANTUM)
+                classes [i].burst = SCHED_QUANTUM;
+        }
+        if (qt_classes_ > 0)
+            qt_classes = qt_classes_;
+        ring_max = ring_max_ < SCHED_RING_MIN ? SCHED_RING_MIN : ring_max_;
+        queue_bytes_max = queue_bytes_max_;
+    }
+
+    void open (sched_queue_t *queue_, void *owner_, int cls_, uint64_t now_)
+    {
+        queue_->owner = owner_;
+        queue_->ring = NULL;
+        queue_->capacity = 0;
+        queue_->head = 0;
+        queue_->count = 0;
+        queue_->bytes = 0;
+        queue_->deficit = 0;
+        queue_->granted = false;
+        queue_->cls = cls_ < qt_classes ? cls_ : 0;
+        queue_->tokens = classes [queue_->cls].burst;
+        queue_->refilled = now_;
+        queue_->active = false;
+        queue_->next = NULL;
+    }
+
+    //  Drop the pending chunks, returns how many were dropped
+    uint32_t close (sched_queue_t *queue_)
+    {
+        uint32_t dropped = queue_->count;
+        while (queue_->count) {
+            zmq_msg_t *msg = &queue_->ring [queue_->head];
+            depth--;
+            bytes -= zmq_msg_size (msg);
+            zmq_msg_close (msg);
+            queue_->head = (queue_->head + 1) % queue_->capacity;
+            queue_->count--;
+        }
+        if (queue_->active)
+            unlink (queue_);
+        free (queue_->ring);
+        queue_->ring = NULL;
+        return dropped;
+    }
+
+    void set_class (sched_queue_t *queue_, int cls_)
+    {
+        queue_->cls = cls_ < qt_classes ? cls_ : 0;
+    }
+
+    //  Queue a chunk; the message is moved into the queue. The caller
+    //  does not push to a full queue, which is_full () tells.
+    void push (sched_queue_t *queue_, zmq_msg_t *msg_)
+    {
+        if (queue_->count == queue_->capacity)
+            grow (queue_);
+        zmq_msg_t *slot = &queue_->ring [(queue_->head + queue_->count) % queue_->capacity];
+        int rc = zmq_msg_init (slot);
+        assert (rc == 0);
+        rc = zmq_msg_move (slot, msg_);
+        assert (rc == 0);
+        size_t size = zmq_msg_size (slot);
+        queue_->count++;
+        queue_->bytes += size;
+        depth++;
+        bytes += size;
+        if (!queue_->active)
+            append (queue_);
+    }
+
+    //  Next chunk in DRR order, moved into msg_ (initialized by the caller).
+    //  Returns its queue, or NULL if nothing may be sent now.
+    sched_queue_t *pop (uint64_t now_, zmq_msg_t *msg_)
+    {
+        uint32_t blocked = 0;
+        while (active_head && blocked < qt_active) {
+            sched_queue_t *queue = active_head;
+            const sched_class_t &cls = classes [queue->cls];
+            if (cls.rate) {
+                refill (queue, cls, now_);
+                if (queue->tokens <= 0) {
+                    rotate ();
+                    blocked++;
+                    continue;
+                }
+            }
+            blocked = 0;
+            if (!queue->granted) {
+                queue->deficit += (int64_t) SCHED_QUANTUM * cls.weight;
+                queue->granted = true;
+            }
+            zmq_msg_t *chunk = &queue->ring [queue->head];
+            int64_t size = (int64_t) zmq_msg_size (chunk);
+            if (queue->deficit < size) {
+                //  End of its turn, the deficit is kept for the next one
+                queue->granted = false;
+                rotate ();
+                continue;
+            }
+
+            int rc = zmq_msg_move (msg_, chunk);
+            assert (rc == 0);
+            zmq_msg_close (chunk);
+            queue->head = (queue->head + 1) % queue->capacity;
+            queue->count--;
+            queue->bytes -= size;
+            queue->deficit -= size;
+            if (cls.rate)
+                queue->tokens -= size;
+            depth--;
+            bytes -= size;
+            if (!queue->count) {
+                queue->deficit = 0;
+                queue->granted = false;
+                unlink (queue);
+            }
+            return queue;
+        }
+        return NULL;
+    }
+
+    //  Poll timeout in msec: -1 if nothing is queued, 0 if a chunk may be
+    //  sent now, else the time until a rate capped queue gets tokens.
+    long timeout (uint64_t now_)
+    {
+        if (!active_head)
+            return -1;
+        uint64_t wait = UINT64_MAX;
+        for (sched_queue_t *queue = active_head; queue; queue = queue->next) {
+            const sched_class_t &cls = classes [queue->cls];
+            if (!cls.rate)
+                return 0;
+            refill (queue, cls, now_);
+            if (queue->tokens > 0)
+                return 0;
+            uint64_t usec = (uint64_t) (-queue->tokens + 1) * 1000000 / cls.rate;
+            if (usec < wait)
+                wait = usec;
+        }
+        return (long) (wait / 1000) + 1;
+    }
+
+    //  True when a queue is at its limit
+    bool is_full (const sched_queue_t *queue_) const
+    {
+        return queue_->count >= ring_max || queue_->bytes >= queue_bytes_max;
+    }
+
+    uint64_t queued () const { return depth; }
+    uint64_t queued_bytes () const { return bytes; }
+
+private:
+
+    void refill (sched_queue_t *queue_, const sched_class_t &cls_, uint64_t now_)
+    {
+        if (now_ <= queue_->refilled)
+            return;
+        int64_t tokens = queue_->tokens
+            + (int64_t) ((now_ - queue_->refilled) * cls_.rate / 1000000);
+        queue_->tokens = tokens > (int64_t) cls_.burst ? (int64_t) cls_.burst : tokens;
+        queue_->refilled = now_;
+    }
+
+    void grow (sched_queue_t *queue_)
+    {
+        uint32_t capacity = queue_->capacity ? queue_->capacity * 2 : SCHED_RING_MIN;
+        zmq_msg_t *ring = (zmq_msg_t *) malloc (capacity * sizeof (zmq_msg_t));
+        assert (ring);
+        for (uint32_t i = 0; i < queue_->count; i++) {
+            zmq_msg_t *from = &queue_->ring [(queue_->head + i) % queue_->capacity];
+            int rc = zmq_msg_init (&ring [i]);
+            assert (rc == 0);
+            rc = zmq_msg_move (&ring [i], from);
+            assert (rc == 0);
+            zmq_msg_close (from);
+        }
+        free (queue_->ring);
+        queue_->ring = ring;
+        queue_->capacity = capacity;
+        queue_->head = 0;
+    }
+
+    void append (sched_queue_t *queue_)
+    {
+        queue_->next = NULL;
+        queue_->active = true;
+        if (active_tail)
+            active_tail->next = queue_;
+        else
+            active_head = queue_;
+        active_tail = queue_;
+        qt_active++;
+    }
+
+    void unlink (sched_queue_t *queue_)
+    {
+        sched_queue_t *prev = NULL;
+        for (sched_queue_t *it = active_head; it != queue_; it = it->next)
+            prev = it;
+        if (prev)
+            prev->next = queue_->next;
+        else
+            active_head = queue_->next;
+        if (active_tail == queue_)
+            active_tail = prev;
+        queue_->next = NULL;
+        queue_->active = false;
+        qt_active--;
+    }
+
+    //  Move the head of the active list to its tail
+    void rotate ()
+    {
+        if (active_head == active_tail)
+            return;
+        sched_queue_t *queue = active_head;
+        active_head = queue->next;
+        queue->next = NULL;
+        active_tail->next = queue;
+        active_tail = queue;
+    }
+
+    sched_class_t classes [SCHED_CLASSES_MAX];
+    int qt_classes;
+    uint32_t ring_max;
+    uint64_t queue_bytes_max;
+
+    sched_queue_t *active_head;
+    sched_queue_t *active_tail;
+    uint32_t qt_active;
+    uint64_t depth;
+    uint64_t bytes;
+
+    scheduler_t (const scheduler_t&);
+    const scheduler_t &operator = (const scheduler_t&);
+};
+
+#endif
@@ -0,0 +1,99 @@
+/*
+    Copyright (c) 2013 Contributors as noted in the AUTHORS file
+
+    This file is part of StreamQ-Proxy.
+
+    StreamQ-Proxy is free software; you can redistribute it and/or modify it
+    under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    StreamQ-Proxy is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __STREAMQ_SPSC_HPP_INCLUDED__
+#define __STREAMQ_SPSC_HPP_INCLUDED__
+
+//  Bounded ring between one producer thread and one consumer thread, with
+//  no lock: each side owns its index and publishes it with a release
+//  store, and reads the index of the other side with an acquire load only
+//  when its cached copy says the ring is full, or empty. The indexes are
+//  on their own cache lines so that the two sides do not bounce a line on
+//  every item.
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define SPSC_CACHE_LINE 64
+
+template <class T, size_t N>
+class spsc_ring_t
+{
+public:
+
+    spsc_ring_t () :
+        tail (0),
+        head_seen (0),
+        head (0),
+        tail_seen (0)
+    {
+        assert (N && (N & (N - 1)) == 0);
+    }
+
+    //  Producer side. Returns false if the ring is full.
+    bool push (const T &item_)
+    {
+        if (tail - head_seen == N) {
+            head_seen = __atomic_load_n (&head, __ATOMIC_ACQUIRE);
+            if (tail - head_seen == N)
+                return false;
+        }
+        items [tail & (N - 1)] = item_;
+        __atomic_store_n (&tail, tail + 1, __ATOMIC_RELEASE);
+        return true;
+    }
+
+    //  Producer side: items that may be pushed without failing
+    size_t room ()
+    {
+        head_seen = __atomic_load_n (&head, __ATOMIC_ACQUIRE);
+        return N - (tail - head_seen);
+    }
+
+    //  Consumer side. Returns false if the ring is empty.
+    bool pop (T *item_)
+    {
+        if (head == tail_seen) {
+            tail_seen = __atomic_load_n (&tail, __ATOMIC_ACQUIRE);
+            if (head == tail_seen)
+                return false;
+        }
+        *item_ = items [head & (N - 1)];
+        __atomic_store_n (&head, head + 1, __ATOMIC_RELEASE);
+        return true;
+    }
+
+private:
+
+    //  Written by the producer
+    alignas (SPSC_CACHE_LINE) uint64_t tail;
+    uint64_t head_seen;
+
+    //  Written by the consumer
+    alignas (SPSC_CACHE_LINE) uint64_t head;
+    uint64_t tail_seen;
+
+    alignas (SPSC_CACHE_LINE) T items [N];
+
+    spsc_ring_t (const spsc_ring_t&);
+    const spsc_ring_t &operator = (const spsc_ring_t&);
+};
+
+#endif
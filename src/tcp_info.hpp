@@ -0,0 +1,119 @@
+/*
+    Copyright (c) 2013 Contributors as noted in the AUTHORS file
+
+    This file is part of StreamQ-Proxy.
+
+    StreamQ-Proxy is free software; you can redistribute it and/or modify it
+    under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    StreamQ-Proxy is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __STREAMQ_TCP_INFO_HPP_INCLUDED__
+#define __STREAMQ_TCP_INFO_HPP_INCLUDED__
+
+//  The kernel view of the TCP connections under the ZMQ_STREAM sockets:
+//  round trip time, retransmits and what is queued in the send buffer.
+//
+//  libzmq tells the descriptor a message came from (ZMQ_SRCFD), but the
+//  descriptor stays libzmq's: it closes it when the peer goes, maybe
+//  before the proxy hears of it, and the number may then be reused. So a
+//  connection is remembered with the inode of its socket, and a sample is
+//  only taken while the descriptor still refers to that socket.
+
+#include "../include/zmq.h"
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+//  libzmq 4.1 has it, the zmq.h copied here predates it
+#ifndef ZMQ_SRCFD
+#define ZMQ_SRCFD 2
+#endif
+
+//  The glibc struct tcp_info stops at tcpi_total_retrans; the kernel has
+//  appended fields since, that it fills in if the buffer is large enough
+typedef struct {
+    struct tcp_info info;
+    uint64_t pacing_rate;
+    uint64_t max_pacing_rate;
+    uint64_t bytes_acked;
+    uint64_t bytes_received;
+    uint32_t segs_out;
+    uint32_t segs_in;
+    uint32_t notsent_bytes;         //  Linux 4.6
+} tcp_info_ext_t;
+
+typedef struct {
+    int fd;                         //  -1 until known
+    ino_t ino;                      //  of the socket fd was when known
+    uint32_t retrans;               //  total retransmits at the last sample
+} tcp_conn_t;
+
+typedef struct {
+    uint32_t rtt;                   //  usec, smoothed
+    uint32_t rttvar;                //  usec
+    uint32_t unacked;               //  segments sent and not acknowledged yet
+    uint32_t notsent;               //  bytes not sent yet, 0 if not told
+    uint32_t total_retrans;         //  segments retransmitted so far
+} tcp_sample_t;
+
+static inline void
+tcp_conn_init (tcp_conn_t *conn_)
+{
+    conn_->fd = -1;
+    conn_->ino = 0;
+    conn_->retrans = 0;
+}
+
+//  Learn the connection of a received message. Returns -1 if libzmq does
+//  not tell its descriptor, as with the connect notifications.
+static inline int
+tcp_conn_open (tcp_conn_t *conn_, zmq_msg_t *msg_)
+{
+    int fd = zmq_msg_get (msg_, ZMQ_SRCFD);
+    struct stat st;
+    if (fd < 0 || fstat (fd, &st) < 0 || !S_ISSOCK (st.st_mode))
+        return -1;
+    conn_->fd = fd;
+    conn_->ino = st.st_ino;
+    return 0;
+}
+
+//  Two system calls. Returns -1 if the connection is gone, or if its
+//  descriptor now refers to another socket.
+static inline int
+tcp_conn_sample (const tcp_conn_t *conn_, tcp_sample_t *sample_)
+{
+    struct stat st;
+    if (conn_->fd < 0 || fstat (conn_->fd, &st) < 0 || st.st_ino != conn_->ino)
+        return -1;
+    tcp_info_ext_t ext;
+    socklen_t size = sizeof ext;
+    memset (&ext, 0, sizeof ext);
+    if (getsockopt (conn_->fd, IPPROTO_TCP, TCP_INFO, &ext, &size) < 0
+    ||  size < sizeof ext.info)
+        return -1;
+    sample_->rtt = ext.info.tcpi_rtt;
+    sample_->rttvar = ext.info.tcpi_rttvar;
+    sample_->unacked = ext.info.tcpi_unacked;
+    sample_->notsent = size >= offsetof (tcp_info_ext_t, notsent_bytes) + sizeof ext.notsent_bytes
+        ? ext.notsent_bytes : 0;
+    sample_->total_retrans = ext.info.tcpi_total_retrans;
+    return 0;
+}
+
+#endif
@@ -0,0 +1,224 @@
+/*
+    Copyright (c) 2013 Contributors as noted in the AUTHORS file
+
+    This file is part of StreamQ-Proxy.
+
+    StreamQ-Proxy is free software; you can redistribute it and/or modify it
+    under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    StreamQ-Proxy is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __STREAMQ_TOPK_HPP_INCLUDED__
+#define __STREAMQ_TOPK_HPP_INCLUDED__
+
+//  Heavy hitters of a stream of weighted identities, with the Space-Saving
+//  algorithm (Metwally et al.): a fixed number of counters, and an identity
+//  that is not counted takes over the smallest counter, inheriting its
+//  count as its error. Any identity with more than total / capacity of the
+//  weight is in the list, and its count is over by at most its error.
+//
+//  All the memory is in the object. The counters are found by an open
+//  addressing hash table and kept in a min-heap, so that an update costs
+//  a probe and at most log2 (capacity) swaps.
+
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+
+#define TOPK_MAX 256
+#define TOPK_ID_SIZE_MAX 32
+#define TOPK_TABLE_SIZE (TOPK_MAX * 2)  //  a power of 2, load factor <= 0.5
+
+typedef struct {
+    unsigned char id [TOPK_ID_SIZE_MAX];
+    uint8_t id_size;
+    uint64_t count;                 //  over by at most error
+    uint64_t error;
+} topk_item_t;
+
+class topk_t
+{
+public:
+
+    topk_t () :
+        capacity (0),
+        size (0)
+    {
+        memset (table, 0, sizeof table);
+    }
+
+    //  0 disables the tracking
+    void configure (int capacity_)
+    {
+        assert (capacity_ >= 0 && capacity_ <= TOPK_MAX);
+        capacity = capacity_;
+        reset ();
+    }
+
+    void reset ()
+    {
+        size = 0;
+        memset (table, 0, sizeof table);
+    }
+
+    void add (const void *id_, size_t id_size_, uint64_t weight_)
+    {
+        if (!capacity)
+            return;
+        if (id_size_ > TOPK_ID_SIZE_MAX)
+            id_size_ = TOPK_ID_SIZE_MAX;
+        uint32_t hash = fnv1a (id_, id_size_);
+        uint32_t pos = find (id_, id_size_, hash);
+        if (table [pos]) {
+            int index = table [pos] - 1;
+            items [index].count += weight_;
+            sift_down (heap_at [index]);
+            return;
+        }
+
+        int index;
+        if (size < capacity) {
+            index = size++;
+            items [index].count = 0;
+            items [index].error = 0;
+            heap [index] = index;
+            heap_at [index] = index;
+        }
+        else {
+            //  Take over the smallest counter
+            index = heap [0];
+            erase (find (items [index].id, items [index].id_size, hashes [index]));
+            items [index].error = items [index].count;
+            pos = find (id_, id_size_, hash);
+        }
+        memcpy (items [index].id, id_, id_size_);
+        items [index].id_size = (uint8_t) id_size_;
+        items [index].count += weight_;
+        hashes [index] = hash;
+        table [pos] = index + 1;
+        sift_up (heap_at [index]);
+        sift_down (heap_at [index]);
+    }
+
+    //  The largest n_ counters, largest first. Returns how many there are.
+    int top (topk_item_t *items_, int n_) const
+    {
+        int order [TOPK_MAX];
+        for (int i = 0; i < size; i++)
+            order [i] = i;
+        int qt_items = n_ < size ? n_ : size;
+        std::partial_sort (order, order + qt_items, order + size, by_count (items));
+        for (int i = 0; i < qt_items; i++)
+            items_ [i] = items [order [i]];
+        return qt_items;
+    }
+
+private:
+
+    struct by_count {
+        const topk_item_t *items;
+        by_count (const topk_item_t *items_) : items (items_) {}
+        bool operator () (int a_, int b_) const { return items [a_].count > items [b_].count; }
+    };
+
+    static uint32_t fnv1a (const void *data_, size_t size_)
+    {
+        const unsigned char *data = (const unsigned char *) data_;
+        uint32_t hash = 2166136261u;
+        for (size_t i = 0; i < size_; i++) {
+            hash ^= data [i];
+            hash *= 16777619u;
+        }
+        return hash;
+    }
+
+    //  The slot of the identity, or the empty slot where it would go
+    uint32_t find (const void *id_, size_t id_size_, uint32_t hash_) const
+    {
+        uint32_t pos = hash_ & (TOPK_TABLE_SIZE - 1);
+        while (table [pos]) {
+            const topk_item_t &item = items [table [pos] - 1];
+            if (item.id_size == id_size_ && !memcmp (item.id, id_, id_size_))
+                break;
+            pos = (pos + 1) & (TOPK_TABLE_SIZE - 1);
+        }
+        return pos;
+    }
+
+    //  Linear probing deletion: move back the entries that the hole would
+    //  make unreachable
+    void erase (uint32_t pos_)
+    {
+        uint32_t next = (pos_ + 1) & (TOPK_TABLE_SIZE - 1);
+        while (table [next]) {
+            uint32_t home = hashes [table [next] - 1] & (TOPK_TABLE_SIZE - 1);
+            bool is_reachable = pos_ <= next
+                ? home > pos_ && home <= next
+                : home > pos_ || home <= next;
+            if (!is_reachable) {
+                table [pos_] = table [next];
+                pos_ = next;
+            }
+            next = (next + 1) & (TOPK_TABLE_SIZE - 1);
+        }
+        table [pos_] = 0;
+    }
+
+    void swap (int a_, int b_)
+    {
+        std::swap (heap [a_], heap [b_]);
+        heap_at [heap [a_]] = a_;
+        heap_at [heap [b_]] = b_;
+    }
+
+    void sift_up (int at_)
+    {
+        while (at_ > 0) {
+            int parent = (at_ - 1) / 2;
+            if (items [heap [parent]].count <= items [heap [at_]].count)
+                break;
+            swap (parent, at_);
+            at_ = parent;
+        }
+    }
+
+    void sift_down (int at_)
+    {
+        while (true) {
+            int smallest = at_;
+            int left = 2 * at_ + 1;
+            int right = left + 1;
+            if (left < size && items [heap [left]].count < items [heap [smallest]].count)
+                smallest = left;
+            if (right < size && items [heap [right]].count < items [heap [smallest]].count)
+                smallest = right;
+            if (smallest == at_)
+                break;
+            swap (smallest, at_);
+            at_ = smallest;
+        }
+    }
+
+    int capacity;
+    int size;
+    topk_item_t items [TOPK_MAX];
+    uint32_t hashes [TOPK_MAX];
+    uint16_t heap [TOPK_MAX];       //  item indexes, smallest count first
+    uint16_t heap_at [TOPK_MAX];    //  position of each item in the heap
+    uint16_t table [TOPK_TABLE_SIZE];   //  item index + 1, 0 when empty
+
+    topk_t (const topk_t&);
+    const topk_t &operator = (const topk_t&);
+};
+
+#endif
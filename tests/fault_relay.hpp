@@ -0,0 +1,467 @@
+/*
+    Copyright (c) 2013 Contributors as noted in the AUTHORS file
+
+    This file is part of StreamQ-Proxy.
+
+    StreamQ-Proxy is free software; you can redistribute it and/or modify it
+    under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    StreamQ-Proxy is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __STREAMQ_FAULT_RELAY_HPP_INCLUDED__
+#define __STREAMQ_FAULT_RELAY_HPP_INCLUDED__
+
+//  A TCP relay in a thread of the test, to put between the clients and
+//  the proxy, or between the proxy and the workers, and break the network
+//  on purpose: no root, no netem. It listens on a loopback port and opens
+//  a connection to the target port for each connection it accepts.
+//
+//  The faults apply to what it reads from then on, in both directions:
+//  delay and jitter, bandwidth, reads stalled (the peers fill their
+//  buffers and block), and on the connections of the moment, a reset of
+//  both sides, or a half-close: FIN to the target, whose replies still
+//  go through. The relay thread polls every millisecond while it holds
+//  bytes, which is the resolution of the delays.
+
+#include "../src/clock.hpp"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <string.h>
+#include <deque>
+#include <list>
+#include <string>
+#include <vector>
+#include <pthread.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+#define FAULT_CHUNK 16384           //  bytes read at once
+#define FAULT_QUEUE_MAX (1 << 20)   //  bytes held per direction before reading stops
+
+enum {
+    fault_up,                       //  from the peer that connected, to the target
+    fault_down                      //  back
+};
+
+class fault_relay_t
+{
+public:
+
+    fault_relay_t (int port_, int target_port_) :
+        target_port (target_port_),
+        delay_usec (0),
+        jitter_usec (0),
+        rate (0),
+        is_stalled (0),
+        cuts (0),
+        half_closes (0),
+        cuts_done (0),
+        half_closes_done (0),
+        qt_links (0),
+        is_stopping (0),
+        seed (0x9e3779b97f4a7c15ull)
+    {
+        relayed [fault_up] = relayed [fault_down] = 0;
+        listener = socket (AF_INET, SOCK_STREAM, 0);
+        assert (listener >= 0);
+        int on = 1;
+        int rc = setsockopt (listener, SOL_SOCKET, SO_REUSEADDR, &on, sizeof on);
+        assert (rc == 0);
+        struct sockaddr_in address = loopback (port_);
+        rc = bind (listener, (struct sockaddr *) &address, sizeof address);
+        assert (rc == 0);
+        rc = listen (listener, 128);
+        assert (rc == 0);
+        set_nonblocking (listener);
+        wake_fd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+        assert (wake_fd >= 0);
+        rc = pthread_create (&thread, NULL, main, this);
+        assert (rc == 0);
+    }
+
+    ~fault_relay_t ()
+    {
+        __atomic_store_n (&is_stopping, 1, __ATOMIC_RELEASE);
+        wake ();
+        int rc = pthread_join (thread, NULL);
+        assert (rc == 0);
+        for (std::list <link_t *>::iterator it = links.begin (); it != links.end (); ++it) {
+            close ((*it)->fds [0]);
+            close ((*it)->fds [1]);
+            delete *it;
+        }
+        close (listener);
+        close (wake_fd);
+    }
+
+    //  usec added to each chunk, plus up to jitter_, in order
+    void delay (uint32_t usec_, uint32_t jitter_)
+    {
+        __atomic_store_n (&delay_usec, usec_, __ATOMIC_RELAXED);
+        __atomic_store_n (&jitter_usec, jitter_, __ATOMIC_RELAXED);
+        wake ();
+    }
+
+    //  Bytes/s per direction of each connection, 0 for no limit
+    void throttle (uint64_t rate_)
+    {
+        __atomic_store_n (&rate, rate_, __ATOMIC_RELAXED);
+        wake ();
+    }
+
+    void stall (bool is_stalled_)
+    {
+        __atomic_store_n (&is_stalled, is_stalled_ ? 1 : 0, __ATOMIC_RELAXED);
+        wake ();
+    }
+
+    //  Resets both sides of every connection; returns once done
+    void cut ()
+    {
+        request (&cuts, &cuts_done);
+    }
+
+    //  Ends the bytes to the target of every connection with a FIN, and
+    //  drops what the peer sends after; returns once done
+    void half_close ()
+    {
+        request (&half_closes, &half_closes_done);
+    }
+
+    int connections () const { return __atomic_load_n (&qt_links, __ATOMIC_ACQUIRE); }
+    uint64_t bytes (int direction_) const { return __atomic_load_n (&relayed [direction_], __ATOMIC_RELAXED); }
+
+private:
+
+    struct chunk_t {
+        uint64_t due;               //  usec
+        std::string bytes;
+        size_t sent;
+    };
+
+    struct flow_t {
+        std::deque <chunk_t> queue;
+        size_t held;                //  bytes in the queue
+        uint64_t last_due;          //  usec, keeps the chunks in order
+        double tokens;              //  bytes it may write, when throttled
+        uint64_t refilled;          //  usec
+        bool is_eof;                //  read the end of its source
+        bool is_shut;               //  sent the end to its destination
+        bool is_dropping;           //  half-closed: what its source sends is dropped
+    };
+
+    struct link_t {
+        int fds [2];                //  the peer that connected, the target
+        flow_t flows [2];           //  by fault_up, fault_down
+    };
+
+    static struct sockaddr_in loopback (int port_)
+    {
+        struct sockaddr_in address;
+        memset (&address, 0, sizeof address);
+        address.sin_family = AF_INET;
+        address.sin_port = htons ((uint16_t) port_);
+        address.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+        return address;
+    }
+
+    static void set_nonblocking (int fd_)
+    {
+        int flags = fcntl (fd_, F_GETFL, 0);
+        int rc = fcntl (fd_, F_SETFL, flags | O_NONBLOCK);
+        assert (rc == 0);
+    }
+
+    void wake ()
+    {
+        uint64_t one = 1;
+        ssize_t rc = write (wake_fd, &one, sizeof one);
+        assert (rc == sizeof one);
+    }
+
+    //  Counts a request for the relay thread, and waits until it has
+    //  carried it out
+    void request (int *requests_, int *done_)
+    {
+        int ticket = __atomic_add_fetch (requests_, 1, __ATOMIC_ACQ_REL);
+        wake ();
+        while (__atomic_load_n (done_, __ATOMIC_ACQUIRE) < ticket)
+            usleep (1000);
+    }
+
+    static void *main (void *self_)
+    {
+        ((fault_relay_t *) self_)->loop ();
+        return NULL;
+    }
+
+    void loop ()
+    {
+        std::vector <struct pollfd> items;
+        std::vector <link_t *> polled;
+        while (!__atomic_load_n (&is_stopping, __ATOMIC_ACQUIRE)) {
+            int wanted_cuts = __atomic_load_n (&cuts, __ATOMIC_ACQUIRE);
+            int wanted_half_closes = __atomic_load_n (&half_closes, __ATOMIC_ACQUIRE);
+            bool is_cutting = wanted_cuts > cuts_done;
+            if (is_cutting || wanted_half_closes > half_closes_done) {
+                for (std::list <link_t *>::iterator it = links.begin (); it != links.end (); ) {
+                    if (is_cutting) {
+                        reset (*it);
+                        it = links.erase (it);
+                        continue;
+                    }
+                    flow_t &up = (*it)->flows [fault_up];
+                    up.queue.clear ();
+                    up.held = 0;
+                    up.is_dropping = true;
+                    if (!up.is_shut) {
+                        shutdown ((*it)->fds [1], SHUT_WR);
+                        up.is_shut = true;
+                    }
+                    ++it;
+                }
+                __atomic_store_n (&qt_links, (int) links.size (), __ATOMIC_RELEASE);
+                __atomic_store_n (&cuts_done, wanted_cuts, __ATOMIC_RELEASE);
+                __atomic_store_n (&half_closes_done, wanted_half_closes, __ATOMIC_RELEASE);
+            }
+
+            //  Write what is due, and close what is over
+            uint64_t time = now_usec ();
+            bool is_holding = false;
+            for (std::list <link_t *>::iterator it = links.begin (); it != links.end (); ) {
+                link_t *link = *it;
+                if (!flush (link, fault_up, time) || !flush (link, fault_down, time)) {
+                    reset (link);
+                    it = links.erase (it);
+                    continue;
+                }
+                if (link->flows [fault_up].is_shut && link->flows [fault_down].is_shut) {
+                    close (link->fds [0]);
+                    close (link->fds [1]);
+                    delete link;
+                    it = links.erase (it);
+                    continue;
+                }
+                if (link->flows [fault_up].held || link->flows [fault_down].held)
+                    is_holding = true;
+                ++it;
+            }
+            __atomic_store_n (&qt_links, (int) links.size (), __ATOMIC_RELEASE);
+
+            //  Read while not stalled and not holding too much
+            bool is_reading = !__atomic_load_n (&is_stalled, __ATOMIC_RELAXED);
+            items.clear ();
+            polled.clear ();
+            struct pollfd item = { wake_fd, POLLIN, 0 };
+            items.push_back (item);
+            item.fd = listener;
+            items.push_back (item);
+            for (std::list <link_t *>::iterator it = links.begin (); it != links.end (); ++it)
+                for (int direction = fault_up; direction <= fault_down; direction++) {
+                    flow_t &flow = (*it)->flows [direction];
+                    item.fd = (*it)->fds [direction];
+                    item.events = is_reading && !flow.is_eof && flow.held < FAULT_QUEUE_MAX ? POLLIN : 0;
+                    items.push_back (item);
+                    polled.push_back (*it);
+                }
+            int rc = poll (&items [0], items.size (), is_holding ? 1 : 100);
+            if (rc < 0 && errno == EINTR)
+                continue;
+            assert (rc >= 0);
+            if (items [0].revents & POLLIN) {
+                uint64_t count;
+                ssize_t size = read (wake_fd, &count, sizeof count);
+                assert (size == sizeof count || errno == EAGAIN);
+            }
+            if (items [1].revents & POLLIN)
+                accept_links ();
+            for (size_t i = 2; i < items.size (); i++)
+                if (items [i].events && items [i].revents & (POLLIN | POLLHUP | POLLERR))
+                    if (!read_chunk (polled [i - 2], (int) (i - 2) % 2)) {
+                        //  Reset: the other side learns it the same way
+                        link_t *link = polled [i - 2];
+                        for (size_t j = i + 1; j < items.size (); j++)
+                            if (polled [j - 2] == link)
+                                items [j].revents = 0;
+                        links.remove (link);
+                        reset (link);
+                    }
+        }
+    }
+
+    void accept_links ()
+    {
+        while (true) {
+            int fd = accept (listener, NULL, NULL);
+            if (fd < 0)
+                return;
+            int target = socket (AF_INET, SOCK_STREAM, 0);
+            assert (target >= 0);
+            struct sockaddr_in address = loopback (target_port);
+            if (connect (target, (struct sockaddr *) &address, sizeof address) < 0) {
+                close (target);
+                struct linger linger = { 1, 0 };
+                setsockopt (fd, SOL_SOCKET, SO_LINGER, &linger, sizeof linger);
+                close (fd);
+                continue;
+            }
+            int on = 1;
+            setsockopt (fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof on);
+            setsockopt (target, IPPROTO_TCP, TCP_NODELAY, &on, sizeof on);
+            set_nonblocking (fd);
+            set_nonblocking (target);
+            link_t *link = new link_t;
+            link->fds [0] = fd;
+            link->fds [1] = target;
+            for (int direction = fault_up; direction <= fault_down; direction++) {
+                flow_t &flow = link->flows [direction];
+                flow.held = 0;
+                flow.last_due = 0;
+                flow.tokens = 0;
+                flow.refilled = now_usec ();
+                flow.is_eof = false;
+                flow.is_shut = false;
+                flow.is_dropping = false;
+            }
+            links.push_back (link);
+        }
+    }
+
+    //  Reads from the source of the direction; false if the link is to be
+    //  reset
+    bool read_chunk (link_t *link_, int direction_)
+    {
+        flow_t &flow = link_->flows [direction_];
+        char buffer [FAULT_CHUNK];
+        ssize_t size = read (link_->fds [direction_], buffer, sizeof buffer);
+        if (size < 0)
+            return errno == EAGAIN || errno == EINTR;
+        if (size == 0) {
+            flow.is_eof = true;
+            return true;
+        }
+        if (flow.is_dropping)
+            return true;
+        chunk_t chunk;
+        uint64_t jitter = __atomic_load_n (&jitter_usec, __ATOMIC_RELAXED);
+        chunk.due = now_usec () + __atomic_load_n (&delay_usec, __ATOMIC_RELAXED)
+            + (jitter ? random () % (jitter + 1) : 0);
+        if (chunk.due < flow.last_due)
+            chunk.due = flow.last_due;
+        flow.last_due = chunk.due;
+        chunk.bytes.assign (buffer, size);
+        chunk.sent = 0;
+        flow.queue.push_back (chunk);
+        flow.held += size;
+        return true;
+    }
+
+    //  Writes the chunks that are due, as the bandwidth allows; false if
+    //  the link is to be reset
+    bool flush (link_t *link_, int direction_, uint64_t now_)
+    {
+        flow_t &flow = link_->flows [direction_];
+        int to = link_->fds [1 - direction_];
+        uint64_t limit = __atomic_load_n (&rate, __ATOMIC_RELAXED);
+        if (limit) {
+            //  A burst of 10 msec at most
+            flow.tokens += (double) (now_ - flow.refilled) * limit / 1000000;
+            double burst = limit / 100.0 > FAULT_CHUNK ? limit / 100.0 : FAULT_CHUNK;
+            if (flow.tokens > burst)
+                flow.tokens = burst;
+        }
+        flow.refilled = now_;
+        while (!flow.queue.empty () && flow.queue.front ().due <= now_) {
+            chunk_t &chunk = flow.queue.front ();
+            size_t size = chunk.bytes.size () - chunk.sent;
+            if (limit) {
+                if (flow.tokens < 1)
+                    break;
+                if (size > (size_t) flow.tokens)
+                    size = (size_t) flow.tokens;
+            }
+            ssize_t rc = write (to, chunk.bytes.data () + chunk.sent, size);
+            if (rc < 0)
+                return errno == EAGAIN || errno == EINTR;
+            if (limit)
+                flow.tokens -= rc;
+            chunk.sent += rc;
+            flow.held -= rc;
+            __atomic_add_fetch (&relayed [direction_], (uint64_t) rc, __ATOMIC_RELAXED);
+            if (chunk.sent < chunk.bytes.size ())
+                break;
+            flow.queue.pop_front ();
+        }
+        //  Its source has ended, and everything is through
+        if (flow.is_eof && flow.queue.empty () && !flow.is_shut) {
+            shutdown (to, SHUT_WR);
+            flow.is_shut = true;
+        }
+        return true;
+    }
+
+    static void reset (link_t *link_)
+    {
+        struct linger linger = { 1, 0 };
+        for (int i = 0; i < 2; i++) {
+            setsockopt (link_->fds [i], SOL_SOCKET, SO_LINGER, &linger, sizeof linger);
+            close (link_->fds [i]);
+        }
+        delete link_;
+    }
+
+    //  xorshift64*
+    uint64_t random ()
+    {
+        seed ^= seed >> 12;
+        seed ^= seed << 25;
+        seed ^= seed >> 27;
+        return seed * 0x2545f4914f6cdd1dull;
+    }
+
+    int target_port;
+    int listener;
+    int wake_fd;
+    pthread_t thread;
+
+    //  Set from the test
+    uint32_t delay_usec;
+    uint32_t jitter_usec;
+    uint64_t rate;
+    int is_stalled;
+    int cuts;
+    int half_closes;
+
+    //  Set by the relay thread
+    int cuts_done;
+    int half_closes_done;
+    int qt_links;
+    uint64_t relayed [2];
+    int is_stopping;
+
+    //  Owned by the relay thread
+    std::list <link_t *> links;
+    uint64_t seed;
+
+    fault_relay_t (const fault_relay_t&);
+    const fault_relay_t &operator = (const fault_relay_t&);
+};
+
+#endif
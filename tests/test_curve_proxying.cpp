@@ -19,61 +19,24 @@
 
 #include "testutil.hpp"
 #include "../include/zmq_utils.h"
+#include "../src/proxy.hpp"
 #ifdef HAVE_LIBSODIUM
 #include <sodium.h>
 #endif
 
 #define CONTENT_SIZE 13
 #define CONTENT_SIZE_MAX 512
-#define REGISTER_SIZE 9
-#define REGISTER_MSG "REGISTER"
-#define ID_SIZE 10
-#define ID_SIZE_MAX 32
-#define QT_WORKERS    1 // WARNING: this code has been simplified and can accept only one worker
-#define QT_CLIENTS    1 // WARNING: this code has been simplified and can accept only one client
+#define QT_WORKERS    2
+#define QT_CLIENTS    2
 #define QT_REQUESTS 100 // 100
 #define is_verbose 1
 #define is_hc_dump 1
-#define BACKEND 0
-#define CONTROL 1
-#define FRONTEND 2
+#define is_metrics 1 // publish proxy metrics in METRICS_PATH, read them with tools/proxy_stat
 #define KEY_SIZE_0 41
 #define KEY_SIZE 40
 
-//  ZMTP protocol null_greeting structure
-typedef unsigned char byte;
-typedef struct {
-    byte signature [10];    //  0xFF 8*0x00 0x7F
-    byte version [2];       //  0x03 0x00 for ZMTP/3.0
-    byte mechanism [20];    //  "NULL"
-    byte as_server;
-    byte filler [31];
-} zmtp_greeting_t;
-
-typedef struct {
-    byte signature [10];
-    byte version_major [1];
-} zmtp_greeting_1_t;
-
-typedef struct {
-    byte version_minor [1];
-    byte mechanism [20];    //  "NULL"
-    byte as_server;
-    byte filler [31];
-} zmtp_greeting_2_t;
-
 static char client_pub[KEY_SIZE_0], client_sec[KEY_SIZE_0],worker_pub[KEY_SIZE_0], worker_sec[KEY_SIZE_0];
 
-static     char client_identity[ID_SIZE_MAX]; static size_t client_id_size = 0;
-static     char worker_identity[ID_SIZE_MAX]; static size_t worker_id_size = 0;
-
-static char
-printc(char c)
-{
-    if (c < 32 || c == 127) return 254;
-    return c;
-}
-
 static void
 client_task (void *ctx)
 {
@@ -170,232 +133,38 @@ client_task (void *ctx)
 
 static void server_worker (void *ctx);
 
-void
+static void
 server_proxy (void *ctx)
 {
-    // Frontend socket talks to clients over TCP
-    void *frontend = zmq_socket (ctx, ZMQ_STREAM);
-    assert (frontend);
-    int rc = zmq_bind (frontend, "tcp://127.0.0.1:9999");
-    assert (rc == 0);
-
-    // Backend socket talks to workers over inproc
-    void *backend = zmq_socket (ctx, ZMQ_STREAM);
-    assert (backend);
-    rc = zmq_bind (backend, "tcp://127.0.0.1:9998");
-    assert (rc == 0);
-
-    // Control socket receives terminate command from main over inproc
-    void *control = zmq_socket (ctx, ZMQ_SUB);
-    assert (control);
-    rc = zmq_setsockopt (control, ZMQ_SUBSCRIBE, "", 0);
-    assert (rc == 0);
-    rc = zmq_connect (control, "inproc://control");
-    assert (rc == 0);
-
-    // Launch pool of worker threads, precise number is not critical
+    proxy_config_t config;
+    proxy_config_init (&config);
+    config.metrics_path = is_metrics ? METRICS_PATH : NULL;
+    config.verbose = is_verbose;
+    config.hc_dump = is_hc_dump;
+    proxy_t *proxy = new proxy_t (ctx, config);
+
+    // Launch pool of worker threads, one connection each
     int thread_nbr;
     void* threads [QT_WORKERS];
     for (thread_nbr = 0; thread_nbr < QT_WORKERS; thread_nbr++) {
         threads[thread_nbr] = zmq_threadstart (&server_worker, ctx);
     }
 
-    // variables
-    char content [CONTENT_SIZE_MAX]; //    bigger than what we need to check we receive the expected size
-    int size;
-
-    int more;
-    size_t moresz = sizeof more;
-    zmq_pollitem_t items [] = {
-        { backend, 0, ZMQ_POLLIN, 0 }, // BACKEND = 0
-        { control, 0, ZMQ_POLLIN, 0 }, // CONTROL = 1
-        { frontend, 0, ZMQ_POLLIN, 0 } // FRONTEND = 2
-    };
-    int qt_poll_items = 2;
-    enum {suspend, resume, terminate} control_state = resume;
-    enum {waiting_worker, waiting_client, check_mechanism, curve_handcheck, curve_ready} backend_state = waiting_worker;
-    enum {no_client, client_is_here} frontend_state = no_client;
-    int qtWorkers = 0;
-
-    while (control_state != terminate) {
-        //  Wait while there are either requests or replies to process.
-        qt_poll_items = (qtWorkers > 0 ? 3 : 2); // if no worker is available, don't pool the clients
-        rc = zmq_poll (&items [0], qt_poll_items, -1);
-        if (rc < 0)
-            break;
-
-        //  Process a control command if any
-        if (control && items [CONTROL].revents & ZMQ_POLLIN) {
-            size = zmq_recv (control, content, CONTENT_SIZE_MAX, 0);
-            if (size < 0)
-                break;
-
-            moresz = sizeof more;
-            rc = zmq_getsockopt (control, ZMQ_RCVMORE, &more, &moresz);
-            if (rc < 0 || more)
-                break;
-
-            // process control command
-            content[size] = '\0';
-            if (size == 8 && !memcmp(content, "SUSPEND", 8))
-                control_state = suspend;
-            else if (size == 7 && !memcmp(content, "RESUME", 7))
-                control_state = resume;
-            else if (size == 10 && !memcmp(content, "TERMINATE", 10))
-                control_state = terminate;
-            else
-                fprintf(stderr, "Warning : \"%s\" bad command received by proxy\n", content); // prefered compared to "return -1"
-        }
-        //  Process a request
-        if (control_state == resume && items [FRONTEND].revents & ZMQ_POLLIN) {
-            bool hasToSendIdentityToWorker = true;
-            frontend_state = client_is_here;
-
-            //  First frame is identity
-            char identity[ID_SIZE_MAX];
-            size = zmq_recv (frontend, identity, ID_SIZE_MAX, 0);
-            assert (size > 0);
-            rc = zmq_getsockopt (frontend, ZMQ_RCVMORE, &more, &moresz);
-            assert (rc >= 0);
-            assert (more != 0); // we expect at least one message after the identifier
-            if (!client_id_size) { // first time store the identity
-                client_id_size = size;
-                memcpy(client_identity, identity, size);
-            }
-            else { // other times, check it is the same
-                assert (client_id_size == (size_t) size);
-                assert (!memcmp(client_identity, identity, client_id_size));
-            }
-
-            while (true) {
-                // receive content
-                size = zmq_recv (frontend, content, CONTENT_SIZE_MAX, 0);
-                if (size < 0)
-                    break;
-
-                // dump
-                if (is_hc_dump) {printf("C (%d): ", size); for (int i = 0; i < size; i++) printf("%u '%c'  ", (uint8_t) content[i], printc(content[i])); printf("\n");}
-
-                // is there more message ?
-                rc = zmq_getsockopt (frontend, ZMQ_RCVMORE, &more, &moresz);
-                if (rc < 0)
-                    break;
-
-                // send (request) to worker
-                if (hasToSendIdentityToWorker) {
-                    rc = zmq_send (backend, worker_identity, worker_id_size, ZMQ_SNDMORE);
-                    assert (rc == (int) worker_id_size);
-                    hasToSendIdentityToWorker = false;
-                }
-                rc = zmq_send (backend, content, size, more? ZMQ_SNDMORE: 0);
-                assert (rc == size);
-                if (more == 0)
-                    break;
-            }
-        }
-        //  Process a reply
-        if (control_state == resume && items [BACKEND].revents & ZMQ_POLLIN) {
-
-            char identity[ID_SIZE_MAX];
-
-            if (backend_state != waiting_client) {
-                //  First frame is identity
-                size = zmq_recv (backend, identity, ID_SIZE_MAX, 0);
-                assert (size > 0);
-                rc = zmq_getsockopt (backend, ZMQ_RCVMORE, &more, &moresz);
-                assert (rc >= 0);
-                assert (more != 0); // we expect at least one message after the identifier
-                if (!worker_id_size) { // first time store the identity
-                    worker_id_size = size;
-                    memcpy(worker_identity, identity, size);
-                }
-                else { // other times, check it is the same
-                    assert (worker_id_size == (size_t) size);
-                    assert (!memcmp(worker_identity, identity, worker_id_size));
-                }
-
-                if (backend_state == waiting_worker) {
-                    qtWorkers++; // unconditionally so that the exchange of greetings can occur: we have to ear for the client now
-                    backend_state = waiting_client;
-                    if (is_verbose) printf("proxy: worker %s has registered\n", worker_identity);
-                }
-            }
-
-            if (frontend_state == client_is_here) {
-
-                if (backend_state == waiting_client) backend_state = check_mechanism;
-
-                // Second frame depends on the backend_state
-                size = zmq_recv (backend, content, CONTENT_SIZE_MAX, 0);
-                if (size < 0)
-                    break;
-
-                // more frames ?
-                rc = zmq_getsockopt (backend, ZMQ_RCVMORE, &more, &moresz);
-                if (rc < 0)
-                    break;
+    int rc = proxy->run ();
+    assert (rc == 0);
 
-                // dump
-                if (is_hc_dump) {printf("\t\tS (%d): ", size); for (int i = 0; i < size; i++) printf("%u '%c'  ", (uint8_t) content[i], printc(content[i])); printf("\n");}
-
-                if (backend_state == check_mechanism && !more) {
-                    if (size >= sizeof(zmtp_greeting_t)) { // size == sizeof(zmtp_greeting_t)
-                        zmtp_greeting_t* g = (zmtp_greeting_t*) content;
-                        if (!memcmp(g->mechanism, "CURVE", 5)) { // CURVE
-                            backend_state = curve_handcheck;
-                        }
-                    }
-                    if (size >= sizeof(zmtp_greeting_2_t)) { // size == sizeof(zmtp_greeting_2_t)
-                        zmtp_greeting_2_t* g = (zmtp_greeting_2_t*) content;
-                        if (!memcmp(g->mechanism, "CURVE", 5)) { // CURVE
-                            backend_state = curve_handcheck;
-                        }
-                    }
-                }
-                if (backend_state == curve_handcheck && !more && size >= 5 && !memcmp(content + 3, "READY", 5)) { // From the RFC, SHOULD be content + 1
-                    if (is_verbose) printf("proxy: worker %s is ready\n", worker_identity);
-                    backend_state = curve_ready;
-                }
-                if (backend_state == check_mechanism || backend_state == curve_handcheck || backend_state ==  curve_ready) {
-                        // send identity and greeting to client
-                        rc = zmq_send (frontend, client_identity, client_id_size, ZMQ_SNDMORE);
-                        assert (rc == (int) client_id_size);
-                        rc = zmq_send (frontend, content, size, more? ZMQ_SNDMORE: 0);
-                        assert (rc == size);
-                        while (more) {
-                            // receive content
-                            size = zmq_recv (backend, content, CONTENT_SIZE_MAX, 0);
-                            if (size < 0)
-                                break;
-
-                            // dump
-                            if (is_hc_dump) {printf("\t\tS (%d): ", size); for (int i = 0; i < size; i++) printf("%u '%c'  ", (uint8_t) content[i], printc(content[i])); printf("\n");}
-
-                            // is there more message ?
-                            rc = zmq_getsockopt (backend, ZMQ_RCVMORE, &more, &moresz);
-                            if (rc < 0)
-                                break;
-
-                            // send (answer) to client
-                            rc = zmq_send (frontend, content, size, more? ZMQ_SNDMORE: 0);
-                            assert (rc == size);
-                        }
-                    }
-            } // if (frontend_state != no_client)
-        } // if (control_state == resume && items [BACKEND].revents & ZMQ_POLLIN)
-    } // while (control_state != terminate)
+    // Every session went through all the phases of the CURVE handshake
+    const metrics_t *metrics = proxy->metrics ();
+    for (int phase = 0; phase < METRICS_PHASES; phase++)
+        assert (metrics_get (&metrics->handshake [phase].count)
+            == metrics_get (&metrics->sessions_total));
 
     msleep(100);
 
     for (thread_nbr = 0; thread_nbr < QT_WORKERS; thread_nbr++)
         zmq_threadclose (threads[thread_nbr]);
 
-    rc = zmq_close (frontend);
-    assert (rc == 0);
-    rc = zmq_close (backend);
-    assert (rc == 0);
-    rc = zmq_close (control);
-    assert (rc == 0);
+    delete proxy;
 }
 
 static void
@@ -430,7 +199,7 @@ server_worker (void *ctx)
     while (run) {
         rc = zmq_recv (control, content, CONTENT_SIZE_MAX, ZMQ_DONTWAIT); // usually, rc == -1 (no message)
         if (rc > 0) {
-            if (is_verbose) printf("worker %s receives command = %s\n", worker_identity, content);
+            if (is_verbose) printf("worker receives command = %s\n", content);
             if (memcmp (content, "TERMINATE", 10) == 0)
                 run = false;
         }
@@ -441,7 +210,7 @@ server_worker (void *ctx)
         if (size > 0) {
             if (memcmp(content, "request #", 9) == 0) assert (size == CONTENT_SIZE);
             else assert (size == 18);
-            if (is_verbose) printf("worker %s has received from client content = %s\n", worker_identity, content);
+            if (is_verbose) printf("worker has received from client content = %s\n", content);
             rc = zmq_getsockopt (worker, ZMQ_RCVMORE, &rcvmore, &sz);
             assert (rc == 0);
             //assert (!rcvmore);
@@ -459,10 +228,10 @@ server_worker (void *ctx)
     assert (rc == 0);
     rc = zmq_close (control);
     assert (rc == 0);
-    if (is_verbose) printf("Destroy worker %s\n", worker_identity);
+    if (is_verbose) printf("Destroy worker\n");
 }
 
-// The main thread simply starts one client and the proxy, and then
+// The main thread simply starts the clients and the proxy, and then
 // waits for the server to finish.
 
 int main (void)
@@ -477,7 +246,7 @@ int main (void)
     int rc = zmq_bind (control, "inproc://control");
     assert (rc == 0);
 
-    void* threads [1];
+    void* threads [QT_CLIENTS + 1];
 
     // generate keys
     rc = zmq_curve_keypair (client_pub, client_sec);
@@ -485,17 +254,19 @@ int main (void)
     rc = zmq_curve_keypair (worker_pub, worker_sec);
     assert (rc == 0);
 
-    // start client thread with id
-    threads[0] = zmq_threadstart  (&client_task, ctx);
-    threads[1] = zmq_threadstart  (&server_proxy, ctx);
+    // start the proxy, then the clients
+    threads[QT_CLIENTS] = zmq_threadstart  (&server_proxy, ctx);
+    for (int i = 0; i < QT_CLIENTS; i++)
+        threads[i] = zmq_threadstart  (&client_task, ctx);
 
-    zmq_threadclose (threads[0]); // after that, all clients have finished
+    for (int i = 0; i < QT_CLIENTS; i++)
+        zmq_threadclose (threads[i]); // after that, all clients have finished
 
     // clean everything
 
     rc = zmq_send (control, "TERMINATE", 10, 0); // makes the workers finish, and then the server task
     assert (rc == 10);
-    zmq_threadclose (threads[1]); // wait for the server task to have finished
+    zmq_threadclose (threads[QT_CLIENTS]); // wait for the server task to have finished
 
     rc = zmq_close (control);
     assert (rc == 0);
@@ -0,0 +1,85 @@
+/*
+    Copyright (c) 2007-2013 Contributors as noted in the AUTHORS file
+
+    This file is part of 0MQ.
+
+    0MQ is free software; you can redistribute it and/or modify it under
+    the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    0MQ is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+//  The proxy as proxy_config_init leaves it: no scheduler, no class, and
+//  yet a request goes to the worker and its reply back to the client.
+
+#include "testutil.hpp"
+#include "../include/zmq_utils.h"
+#include "../src/proxy.hpp"
+
+#define CONTENT_SIZE_MAX 512
+
+int main (void)
+{
+    setup_test_environment ();
+
+    void *ctx = zmq_ctx_new ();
+    assert (ctx);
+    void *control = zmq_socket (ctx, ZMQ_PUB);
+    assert (control);
+    int rc = zmq_bind (control, "inproc://control");
+    assert (rc == 0);
+
+    proxy_config_t config;
+    proxy_config_init (&config);
+    proxy_t *proxy = new proxy_t (ctx, config);
+    const metrics_t *metrics = proxy->metrics ();
+    void *proxy_thread = zmq_threadstart (&test_proxy, proxy);
+
+    void *worker = zmq_socket (ctx, ZMQ_DEALER);
+    assert (worker);
+    rc = zmq_connect (worker, config.backend);
+    assert (rc == 0);
+    test_wait_for (&metrics->workers, 1);
+
+    void *client = zmq_socket (ctx, ZMQ_DEALER);
+    assert (client);
+    int timeout = 5000;
+    rc = zmq_setsockopt (client, ZMQ_RCVTIMEO, &timeout, sizeof (int));
+    assert (rc == 0);
+    rc = zmq_setsockopt (worker, ZMQ_RCVTIMEO, &timeout, sizeof (int));
+    assert (rc == 0);
+    rc = zmq_connect (client, config.frontend);
+    assert (rc == 0);
+
+    char content [CONTENT_SIZE_MAX];
+    rc = zmq_send (client, "hello", 5, 0);
+    assert (rc == 5);
+    rc = zmq_recv (worker, content, sizeof content, 0);
+    assert (rc == 5 && memcmp (content, "hello", 5) == 0);
+    rc = zmq_send (worker, "world", 5, 0);
+    assert (rc == 5);
+    rc = zmq_recv (client, content, sizeof content, 0);
+    assert (rc == 5 && memcmp (content, "world", 5) == 0);
+    assert (metrics_get (&metrics->sessions) == 1);
+
+    rc = zmq_send (control, "TERMINATE", 10, 0);
+    assert (rc == 10);
+    zmq_threadclose (proxy_thread);
+    assert (proxy->is_terminated ());
+    close_zero_linger (client);
+    close_zero_linger (worker);
+    delete proxy;
+    rc = zmq_close (control);
+    assert (rc == 0);
+    rc = zmq_ctx_term (ctx);
+    assert (rc == 0);
+    return 0;
+}
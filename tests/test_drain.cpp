@@ -0,0 +1,124 @@
+/*
+    Copyright (c) 2007-2013 Contributors as noted in the AUTHORS file
+
+    This file is part of 0MQ.
+
+    0MQ is free software; you can redistribute it and/or modify it under
+    the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    0MQ is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+//  DRAIN: three clients have a request in flight when the proxy is told to
+//  drain. The worker of the first one answers late, and that reply still
+//  reaches its client; so does the late reply of the second one, which
+//  takes many STREAM chunks; the worker of the third one never answers, and
+//  that pair is cut at the deadline. The proxy stops then, not later.
+
+#include "testutil.hpp"
+#include "../include/zmq_utils.h"
+#include "../src/proxy.hpp"
+#include "../src/clock.hpp"
+
+#define CONTENT_SIZE_MAX 512
+#define QT_WORKERS 3
+#define LARGE_SIZE 100000           //  bytes, a dozen STREAM chunks
+#define REPLY_DELAY 200             //  msec
+#define DEADLINE 1000               //  msec
+#define FRONTEND_ENDPOINT "tcp://127.0.0.1:9982"
+#define BACKEND_ENDPOINT "tcp://127.0.0.1:9983"
+#define is_verbose 0
+
+int main (void)
+{
+    setup_test_environment ();
+
+    void *ctx = zmq_ctx_new ();
+    assert (ctx);
+    void *control = zmq_socket (ctx, ZMQ_PUB);
+    assert (control);
+    int rc = zmq_bind (control, "inproc://control");
+    assert (rc == 0);
+
+    proxy_config_t config;
+    proxy_config_init (&config);
+    config.frontend = FRONTEND_ENDPOINT;
+    config.backend = BACKEND_ENDPOINT;
+    config.verbose = is_verbose;
+    proxy_t *proxy = new proxy_t (ctx, config);
+    const metrics_t *metrics = proxy->metrics ();
+    void *proxy_thread = zmq_threadstart (&test_proxy, proxy);
+    //  They answer "echo" and "large" after REPLY_DELAY, and never "mute"
+    test_worker_t args [QT_WORKERS];
+    void *workers [QT_WORKERS];
+    for (int i = 0; i < QT_WORKERS; i++) {
+        test_worker_init (&args [i], ctx, BACKEND_ENDPOINT, (char) ('0' + i));
+        args [i].reply_delay = REPLY_DELAY;
+        args [i].mute = "mute";
+        args [i].large = "large";
+        args [i].large_size = LARGE_SIZE;
+        workers [i] = zmq_threadstart (&test_worker, &args [i]);
+    }
+    test_wait_for (&metrics->workers, QT_WORKERS);
+
+    //  The requests have reached their worker
+    void *echo = test_client (ctx, FRONTEND_ENDPOINT, "echo");
+    void *large = test_client (ctx, FRONTEND_ENDPOINT, "large");
+    void *mute = test_client (ctx, FRONTEND_ENDPOINT, "mute");
+    int received = 0;
+    for (int i = 0; i < 500 && received < QT_WORKERS; i++) {
+        msleep (10);
+        received = 0;
+        for (int j = 0; j < QT_WORKERS; j++)
+            received += __atomic_load_n (&args [j].received, __ATOMIC_RELAXED);
+    }
+    assert (received == QT_WORKERS);
+
+    char command [32];
+    int size = sprintf (command, "DRAIN %d", DEADLINE) + 1;
+    uint64_t start = now_usec ();
+    rc = zmq_send (control, command, size, 0);
+    assert (rc == size);
+
+    //  The replies that were on their way come through the drain, whole
+    char reply [CONTENT_SIZE_MAX];
+    rc = zmq_recv (echo, reply, sizeof reply, 0);
+    assert (rc == 4 && memcmp (reply, "echo", 4) == 0);
+    static char large_reply [LARGE_SIZE];
+    rc = zmq_recv (large, large_reply, sizeof large_reply, 0);
+    assert (rc == LARGE_SIZE && memcmp (large_reply, "large", 5) == 0);
+
+    //  The proxy stops at the deadline, when the mute pair is cut; a pair
+    //  is only cut once the deadline is over, so drain_cut tells it was,
+    //  and the time only has to show that the proxy did not linger on
+    zmq_threadclose (proxy_thread);
+    uint64_t elapsed = (now_usec () - start) / 1000;
+    assert (elapsed < 3 * DEADLINE);
+    assert (proxy->is_terminated ());
+    assert (metrics_get (&metrics->drain_closed) == 2);
+    assert (metrics_get (&metrics->drain_cut) == 1);
+    assert (metrics_get (&metrics->sessions) == 0);
+    assert (metrics_get (&metrics->workers) == 0);
+
+    rc = zmq_send (control, "TERMINATE", 10, 0);
+    assert (rc == 10);
+    for (int i = 0; i < QT_WORKERS; i++)
+        zmq_threadclose (workers [i]);
+    zmq_close (echo);
+    zmq_close (large);
+    zmq_close (mute);
+    delete proxy;
+    rc = zmq_close (control);
+    assert (rc == 0);
+    rc = zmq_ctx_term (ctx);
+    assert (rc == 0);
+    return 0;
+}
@@ -0,0 +1,196 @@
+/*
+    Copyright (c) 2007-2013 Contributors as noted in the AUTHORS file
+
+    This file is part of 0MQ.
+
+    0MQ is free software; you can redistribute it and/or modify it under
+    the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    0MQ is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+//  The proxy embedded in the epoll loop of the application: no proxy
+//  thread, the main thread waits on the proxy descriptor beside its own
+//  eventfd, which the clients signal when they are done.
+
+#include "testutil.hpp"
+#include "../include/zmq_utils.h"
+#include "../src/proxy.hpp"
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#define CONTENT_SIZE_MAX 512
+#define QT_WORKERS    3
+#define QT_CLIENTS    3
+#define QT_REQUESTS 100
+#define BUDGET       16
+#define is_verbose 0
+
+static int done_fd;
+
+static void
+client_task (void *ctx)
+{
+    void *client = zmq_socket (ctx, ZMQ_DEALER);
+    assert (client);
+    int timeout = 5000;
+    int rc = zmq_setsockopt (client, ZMQ_RCVTIMEO, &timeout, sizeof (int));
+    assert (rc == 0);
+    rc = zmq_connect (client, "tcp://127.0.0.1:9999");
+    assert (rc == 0);
+
+    char request [CONTENT_SIZE_MAX], reply [CONTENT_SIZE_MAX];
+    for (int i = 0; i < QT_REQUESTS; i++) {
+        int size = sprintf (request, "request #%03d", i);
+        rc = zmq_send (client, request, size, 0);
+        assert (rc == size);
+        rc = zmq_recv (client, reply, CONTENT_SIZE_MAX, 0);
+        assert (rc == size);
+        assert (memcmp (request, reply, size) == 0);
+    }
+    if (is_verbose) printf ("client has received its %d replies\n", QT_REQUESTS);
+
+    rc = zmq_close (client);
+    assert (rc == 0);
+    uint64_t one = 1;
+    rc = (int) write (done_fd, &one, sizeof one);
+    assert (rc == sizeof one);
+}
+
+static void
+worker_task (void *ctx)
+{
+    void *worker = zmq_socket (ctx, ZMQ_DEALER);
+    assert (worker);
+    int rc = zmq_connect (worker, "tcp://127.0.0.1:9998");
+    assert (rc == 0);
+
+    // Control socket receives terminate command from main over inproc
+    void *control = zmq_socket (ctx, ZMQ_SUB);
+    assert (control);
+    rc = zmq_setsockopt (control, ZMQ_SUBSCRIBE, "", 0);
+    assert (rc == 0);
+    rc = zmq_connect (control, "inproc://control");
+    assert (rc == 0);
+
+    zmq_pollitem_t items [] = { { worker, 0, ZMQ_POLLIN, 0 }, { control, 0, ZMQ_POLLIN, 0 } };
+    char content [CONTENT_SIZE_MAX];
+    bool run = true;
+    while (run) {
+        rc = zmq_poll (items, 2, -1);
+        assert (rc > 0);
+        if (items [1].revents & ZMQ_POLLIN) {
+            rc = zmq_recv (control, content, CONTENT_SIZE_MAX, 0);
+            if (rc == 10 && memcmp (content, "TERMINATE", 10) == 0)
+                run = false;
+        }
+        if (items [0].revents & ZMQ_POLLIN) {
+            int size = zmq_recv (worker, content, CONTENT_SIZE_MAX, 0);
+            assert (size > 0);
+            rc = zmq_send (worker, content, size, 0);
+            assert (rc == size);
+        }
+    }
+    rc = zmq_close (worker);
+    assert (rc == 0);
+    rc = zmq_close (control);
+    assert (rc == 0);
+}
+
+int main (void)
+{
+    setup_test_environment ();
+
+    void *ctx = zmq_ctx_new ();
+    assert (ctx);
+    void *control = zmq_socket (ctx, ZMQ_PUB);
+    assert (control);
+    int rc = zmq_bind (control, "inproc://control");
+    assert (rc == 0);
+
+    proxy_config_t config;
+    proxy_config_init (&config);
+    config.verbose = is_verbose;
+    proxy_t *proxy = new proxy_t (ctx, config);
+
+    //  The loop of the application: the proxy and an eventfd
+    done_fd = eventfd (0, EFD_NONBLOCK);
+    assert (done_fd >= 0);
+    int loop = epoll_create1 (0);
+    assert (loop >= 0);
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.fd = proxy->fd ();
+    rc = epoll_ctl (loop, EPOLL_CTL_ADD, proxy->fd (), &event);
+    assert (rc == 0);
+    event.data.fd = done_fd;
+    rc = epoll_ctl (loop, EPOLL_CTL_ADD, done_fd, &event);
+    assert (rc == 0);
+
+    void *workers [QT_WORKERS];
+    for (int i = 0; i < QT_WORKERS; i++)
+        workers [i] = zmq_threadstart (&worker_task, ctx);
+    void *clients [QT_CLIENTS];
+    bool is_started = false;
+    int qt_done = 0;
+    int qt_wakeups = 0;
+
+    while (!proxy->is_terminated ()) {
+        struct epoll_event events [2];
+        int qt_events = epoll_wait (loop, events, 2, 1000);
+        assert (qt_events >= 0);
+        for (int i = 0; i < qt_events; i++) {
+            if (events [i].data.fd == proxy->fd ()) {
+                qt_wakeups++;
+                //  Edge triggered: drain before waiting again
+                while ((rc = proxy->process_events (BUDGET)) == BUDGET)
+                    ;
+                assert (rc >= 0);
+            }
+            else {
+                uint64_t count;
+                rc = (int) read (done_fd, &count, sizeof count);
+                assert (rc == sizeof count);
+                qt_done += (int) count;
+                if (qt_done == QT_CLIENTS) {
+                    rc = zmq_send (control, "TERMINATE", 10, 0);
+                    assert (rc == 10);
+                }
+            }
+        }
+        //  The clients come once all the workers are there
+        if (!is_started && metrics_get (&proxy->metrics ()->workers) == QT_WORKERS) {
+            for (int i = 0; i < QT_CLIENTS; i++)
+                clients [i] = zmq_threadstart (&client_task, ctx);
+            is_started = true;
+        }
+    }
+
+    const metrics_t *metrics = proxy->metrics ();
+    assert (metrics_get (&metrics->sessions_total) == QT_CLIENTS);
+    assert (metrics_get (&metrics->handshakes) == 0);
+    assert (metrics_get (&metrics->msgs_c2w) >= QT_CLIENTS);
+    if (is_verbose) printf ("%d wakeups of the proxy descriptor\n", qt_wakeups);
+
+    for (int i = 0; i < QT_CLIENTS; i++)
+        zmq_threadclose (clients [i]);
+    for (int i = 0; i < QT_WORKERS; i++)
+        zmq_threadclose (workers [i]);
+    delete proxy;
+    close (loop);
+    close (done_fd);
+    rc = zmq_close (control);
+    assert (rc == 0);
+    rc = zmq_ctx_term (ctx);
+    assert (rc == 0);
+    return 0;
+}
@@ -0,0 +1,386 @@
+/*
+    Copyright (c) 2007-2013 Contributors as noted in the AUTHORS file
+
+    This file is part of 0MQ.
+
+    0MQ is free software; you can redistribute it and/or modify it under
+    the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    0MQ is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+//  Faults of the network, from fault relays: one between a client and the
+//  frontend, one between its worker and the backend. Another client and
+//  its worker connect straight. Through delay, throttling and stalled
+//  reads, the client behind the relays gets every reply, late; through a
+//  reset of its worker connection, and a half-close of its own, it
+//  reconnects and is served again. Each scenario prints how long the
+//  recovery took, how many requests got no reply, and the worst round
+//  trip of the other client meanwhile, which must not fail.
+
+#include "testutil.hpp"
+#include "fault_relay.hpp"
+#include "../include/zmq_utils.h"
+#include "../src/proxy.hpp"
+#include "../src/histogram.hpp"
+
+#define CONTENT_SIZE_MAX 65536
+#define QT_WORKERS 4                //  one behind the relay, spares for the reconnections
+#define CLIENTS_RELAY 9989          //  to the frontend
+#define WORKERS_RELAY 9988          //  to the backend
+#define DELAY 20000                 //  usec, each way
+#define JITTER 5000
+#define RATE 200000                 //  bytes/s
+#define STALL 300                   //  msec
+#define TIMEOUT 100                 //  msec before a request is counted lost
+#define RECOVERY_MAX 2000000        //  usec, only there to catch no recovery at all
+#define BASELINE_TRIPS 200          //  round trips without fault
+#define UNAFFECTED_RTT_FACTOR 10    //  times their median
+#define UNAFFECTED_TRIPS 5          //  per recovery attempt
+#define is_verbose 0
+
+static char request [CONTENT_SIZE_MAX];
+static char reply [CONTENT_SIZE_MAX];
+
+typedef struct {
+    void *ctx;
+    const char *endpoint;           //  the backend, or the relay in front of it
+} worker_args_t;
+
+//  Echoes frames of any size until TERMINATE
+static void
+worker_task (void *arg)
+{
+    worker_args_t *args = (worker_args_t *) arg;
+    void *worker = zmq_socket (args->ctx, ZMQ_DEALER);
+    assert (worker);
+    int linger = 0;
+    int rc = zmq_setsockopt (worker, ZMQ_LINGER, &linger, sizeof (int));
+    assert (rc == 0);
+    int reconnect = 10;
+    rc = zmq_setsockopt (worker, ZMQ_RECONNECT_IVL, &reconnect, sizeof (int));
+    assert (rc == 0);
+    rc = zmq_connect (worker, args->endpoint);
+    assert (rc == 0);
+
+    void *control = zmq_socket (args->ctx, ZMQ_SUB);
+    assert (control);
+    rc = zmq_setsockopt (control, ZMQ_SUBSCRIBE, "", 0);
+    assert (rc == 0);
+    rc = zmq_connect (control, "inproc://control");
+    assert (rc == 0);
+
+    zmq_pollitem_t items [] = { { worker, 0, ZMQ_POLLIN, 0 }, { control, 0, ZMQ_POLLIN, 0 } };
+    zmq_msg_t msg;
+    rc = zmq_msg_init (&msg);
+    assert (rc == 0);
+    bool run = true;
+    while (run) {
+        rc = zmq_poll (items, 2, -1);
+        assert (rc > 0);
+        if (items [1].revents & ZMQ_POLLIN) {
+            char command [16];
+            rc = zmq_recv (control, command, sizeof command, 0);
+            if (rc == 10 && memcmp (command, "TERMINATE", 10) == 0)
+                run = false;
+        }
+        if (run && items [0].revents & ZMQ_POLLIN)
+            while (zmq_msg_recv (&msg, worker, ZMQ_DONTWAIT) >= 0) {
+                //  A reply lost on a reset connection is what is measured
+                rc = zmq_msg_send (&msg, worker, ZMQ_DONTWAIT);
+                assert (rc >= 0 || zmq_errno () == EAGAIN);
+            }
+    }
+    zmq_msg_close (&msg);
+    rc = zmq_close (worker);
+    assert (rc == 0);
+    rc = zmq_close (control);
+    assert (rc == 0);
+}
+
+//  A client that comes back at once when closed
+static void *
+client (void *ctx, const char *endpoint)
+{
+    void *client = zmq_socket (ctx, ZMQ_DEALER);
+    assert (client);
+    int linger = 0;
+    int rc = zmq_setsockopt (client, ZMQ_LINGER, &linger, sizeof (int));
+    assert (rc == 0);
+    int reconnect = 10;
+    rc = zmq_setsockopt (client, ZMQ_RECONNECT_IVL, &reconnect, sizeof (int));
+    assert (rc == 0);
+    rc = zmq_connect (client, endpoint);
+    assert (rc == 0);
+    return client;
+}
+
+//  Sends request seq_, size_ bytes
+static void
+send_request (void *client, uint32_t seq_, size_t size_)
+{
+    memset (request, 'x', size_);
+    memcpy (request, &seq_, sizeof seq_);
+    int rc = zmq_send (client, request, size_, 0);
+    assert (rc == (int) size_);
+}
+
+//  Waits timeout_ msec at most for the echo of request seq_, dropping the
+//  late echoes of the former ones; false if it did not come
+static bool
+await_reply (void *client, uint32_t seq_, int timeout_)
+{
+    zmq_pollitem_t item = { client, 0, ZMQ_POLLIN, 0 };
+    uint64_t deadline = now_usec () + timeout_ * 1000;
+    for (uint64_t now = now_usec (); now < deadline; now = now_usec ()) {
+        int rc = zmq_poll (&item, 1, (long) ((deadline - now) / 1000 + 1));
+        assert (rc >= 0);
+        int size = zmq_recv (client, reply, sizeof reply, ZMQ_DONTWAIT);
+        if (size >= (int) sizeof seq_ && memcmp (reply, &seq_, sizeof seq_) == 0)
+            return true;
+    }
+    return false;
+}
+
+//  Round trip in usec, -1 if the request got no reply in time
+static int64_t
+round_trip (void *client, uint32_t seq_, size_t size_, int timeout_)
+{
+    uint64_t start = now_usec ();
+    send_request (client, seq_, size_);
+    if (!await_reply (client, seq_, timeout_))
+        return -1;
+    return (int64_t) (now_usec () - start);
+}
+
+//  The round trips of the client the faults do not touch. Its median is
+//  what tells if the faults slow it down: the slowest one of a few dozens
+//  is whatever the scheduler did meanwhile, with or without faults.
+typedef struct {
+    uint32_t seq;
+    int failures;
+    histogram_t rtt;                //  usec, of the echoed requests
+    uint64_t rtt_bound;             //  usec, for the median, from the round trips without fault
+} unaffected_t;
+
+static void
+unaffected_trip (void *client, unaffected_t *stats)
+{
+    int64_t rtt = round_trip (client, ++stats->seq, 64, 1000);
+    if (rtt < 0)
+        stats->failures++;
+    else
+        histogram_record (&stats->rtt, (uint64_t) rtt);
+}
+
+static void
+unaffected_reset (unaffected_t *stats)
+{
+    stats->failures = 0;
+    histogram_init (&stats->rtt);
+}
+
+static void
+unaffected_check (const char *scenario, const unaffected_t *stats)
+{
+    uint64_t median = histogram_percentile (&stats->rtt, 50);
+    printf ("faults: %s: unaffected client: %llu round trips, %d failed, median %llu usec, max %llu usec\n",
+        scenario, (unsigned long long) stats->rtt.count, stats->failures,
+        (unsigned long long) median, (unsigned long long) stats->rtt.max);
+    assert (stats->rtt.count > 0);
+    assert (stats->failures == 0);
+    assert (median < stats->rtt_bound);
+}
+
+//  Requests every TIMEOUT msec until one is echoed, the other client
+//  making a few round trips before each; the usec from start_ to that echo,
+//  and the requests lost before
+static uint64_t
+recover (void *client, uint32_t *seq_, uint64_t start_, int *lost_, void *other, unaffected_t *stats)
+{
+    *lost_ = 0;
+    while (true) {
+        for (int i = 0; i < UNAFFECTED_TRIPS; i++)
+            unaffected_trip (other, stats);
+        if (round_trip (client, ++*seq_, 64, TIMEOUT) >= 0)
+            break;
+        ++*lost_;
+        assert (now_usec () - start_ < RECOVERY_MAX);
+    }
+    return now_usec () - start_;
+}
+
+int main (void)
+{
+    setup_test_environment ();
+
+    void *ctx = zmq_ctx_new ();
+    assert (ctx);
+    void *control = zmq_socket (ctx, ZMQ_PUB);
+    assert (control);
+    int rc = zmq_bind (control, "inproc://control");
+    assert (rc == 0);
+
+    //  The clients that reconnect wait for the worker that does
+    proxy_config_t config;
+    proxy_config_init (&config);
+    config.verbose = is_verbose;
+    config.waiting_room = 8;
+    proxy_t *proxy = new proxy_t (ctx, config);
+    const metrics_t *metrics = proxy->metrics ();
+    void *proxy_thread = zmq_threadstart (&test_proxy, proxy);
+
+    fault_relay_t *clients_relay = new fault_relay_t (CLIENTS_RELAY, 9999);
+    fault_relay_t *workers_relay = new fault_relay_t (WORKERS_RELAY, 9998);
+
+    //  The first worker, behind its relay, is the one of the first client,
+    //  behind the other relay
+    worker_args_t args [QT_WORKERS];
+    void *worker_threads [QT_WORKERS];
+    args [0].ctx = ctx;
+    args [0].endpoint = "tcp://127.0.0.1:9988";
+    worker_threads [0] = zmq_threadstart (&worker_task, &args [0]);
+    test_wait_for (&metrics->workers, 1);
+    void *affected = client (ctx, "tcp://127.0.0.1:9989");
+    uint32_t seq = 0;
+    assert (round_trip (affected, ++seq, 64, 5000) >= 0);
+    assert (metrics_get (&metrics->sessions) == 1);
+    assert (clients_relay->connections () == 1 && workers_relay->connections () == 1);
+
+    for (int i = 1; i < QT_WORKERS; i++) {
+        args [i].ctx = ctx;
+        args [i].endpoint = "tcp://127.0.0.1:9998";
+        worker_threads [i] = zmq_threadstart (&worker_task, &args [i]);
+    }
+    test_wait_for (&metrics->workers, QT_WORKERS);
+    void *other = client (ctx, "tcp://127.0.0.1:9999");
+    unaffected_t stats;
+    stats.seq = 0;
+    unaffected_reset (&stats);
+    unaffected_trip (other, &stats);
+    assert (stats.failures == 0);
+    test_wait_for (&metrics->sessions, 2);
+
+    //  The round trips of the other client are bounded by what they take
+    //  here, on this machine, before any fault
+    unaffected_reset (&stats);
+    for (int i = 0; i < BASELINE_TRIPS; i++)
+        unaffected_trip (other, &stats);
+    assert (stats.failures == 0);
+    stats.rtt_bound = UNAFFECTED_RTT_FACTOR * histogram_percentile (&stats.rtt, 50);
+    printf ("faults: baseline: %llu round trips, median %llu usec, max %llu usec, bound %llu usec\n",
+        (unsigned long long) stats.rtt.count,
+        (unsigned long long) histogram_percentile (&stats.rtt, 50),
+        (unsigned long long) stats.rtt.max, (unsigned long long) stats.rtt_bound);
+
+    //  Delay and jitter: every round trip takes both ways of it
+    clients_relay->delay (DELAY, JITTER);
+    unaffected_reset (&stats);
+    uint64_t min_rtt = (uint64_t) -1, max_rtt = 0;
+    for (int i = 0; i < 10; i++) {
+        uint64_t start = now_usec ();
+        send_request (affected, ++seq, 64);
+        unaffected_trip (other, &stats);
+        assert (await_reply (affected, seq, 1000));
+        uint64_t rtt = now_usec () - start;
+        min_rtt = rtt < min_rtt ? rtt : min_rtt;
+        max_rtt = rtt > max_rtt ? rtt : max_rtt;
+    }
+    clients_relay->delay (0, 0);
+    printf ("faults: delay %d+%d usec: affected client: round trips %llu to %llu usec\n",
+        DELAY, JITTER, (unsigned long long) min_rtt, (unsigned long long) max_rtt);
+    assert (min_rtt >= 2 * DELAY);
+    unaffected_check ("delay", &stats);
+
+    //  Throttling: a large request and its echo, at the rate each way
+    clients_relay->throttle (RATE);
+    unaffected_reset (&stats);
+    uint64_t start = now_usec ();
+    send_request (affected, ++seq, CONTENT_SIZE_MAX);
+    zmq_pollitem_t item = { affected, 0, ZMQ_POLLIN, 0 };
+    do {
+        unaffected_trip (other, &stats);
+        rc = zmq_poll (&item, 1, 10);
+        assert (rc >= 0);
+        assert (now_usec () - start < 10 * RECOVERY_MAX);
+    } while (!(item.revents & ZMQ_POLLIN));
+    assert (await_reply (affected, seq, 1000));
+    uint64_t elapsed = now_usec () - start;
+    clients_relay->throttle (0);
+    printf ("faults: throttle %d bytes/s: %d bytes echoed in %llu usec\n",
+        RATE, CONTENT_SIZE_MAX, (unsigned long long) elapsed);
+    //  Each way but its first burst of FAULT_CHUNK bytes at the rate
+    assert (elapsed >= (uint64_t) 2 * (CONTENT_SIZE_MAX - FAULT_CHUNK) * 1000000 / RATE);
+    unaffected_check ("throttle", &stats);
+
+    //  Stalled reads: the request waits in the buffers, and is through
+    //  once the reads resume
+    clients_relay->stall (true);
+    unaffected_reset (&stats);
+    send_request (affected, ++seq, 64);
+    start = now_usec ();
+    while (now_usec () - start < STALL * 1000)
+        unaffected_trip (other, &stats);
+    clients_relay->stall (false);
+    start = now_usec ();
+    assert (await_reply (affected, seq, 1000));
+    printf ("faults: stall %d msec: recovery %llu usec, none lost\n",
+        STALL, (unsigned long long) (now_usec () - start));
+    unaffected_check ("stall", &stats);
+
+    //  A reset of the worker connection: the proxy closes its client, who
+    //  comes back and gets another worker
+    uint64_t sessions_total = metrics_get (&metrics->sessions_total);
+    unaffected_reset (&stats);
+    start = now_usec ();
+    workers_relay->cut ();
+    int lost;
+    uint64_t recovery = recover (affected, &seq, start, &lost, other, &stats);
+    printf ("faults: worker reset: recovery %llu usec, %d requests lost\n",
+        (unsigned long long) recovery, lost);
+    assert (metrics_get (&metrics->sessions_total) > sessions_total);
+    test_wait_for (&metrics->workers, QT_WORKERS);
+    printf ("faults: worker reset: worker back after %llu usec\n",
+        (unsigned long long) (now_usec () - start));
+    unaffected_check ("worker reset", &stats);
+
+    //  A half-close of the client connection: to the proxy, the client has
+    //  left; its worker is free again, and it comes back as a new client
+    sessions_total = metrics_get (&metrics->sessions_total);
+    unaffected_reset (&stats);
+    start = now_usec ();
+    clients_relay->half_close ();
+    recovery = recover (affected, &seq, start, &lost, other, &stats);
+    printf ("faults: client half-close: recovery %llu usec, %d requests lost\n",
+        (unsigned long long) recovery, lost);
+    assert (metrics_get (&metrics->sessions_total) > sessions_total);
+    test_wait_for (&metrics->workers, QT_WORKERS);
+    test_wait_for (&metrics->sessions, 2);
+    unaffected_check ("client half-close", &stats);
+
+    rc = zmq_close (affected);
+    assert (rc == 0);
+    rc = zmq_close (other);
+    assert (rc == 0);
+    rc = zmq_send (control, "TERMINATE", 10, 0);
+    assert (rc == 10);
+    zmq_threadclose (proxy_thread);
+    for (int i = 0; i < QT_WORKERS; i++)
+        zmq_threadclose (worker_threads [i]);
+    delete proxy;
+    delete clients_relay;
+    delete workers_relay;
+    rc = zmq_close (control);
+    assert (rc == 0);
+    rc = zmq_ctx_term (ctx);
+    assert (rc == 0);
+    return 0;
+}
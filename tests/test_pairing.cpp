@@ -0,0 +1,159 @@
+/*
+    Copyright (c) 2007-2013 Contributors as noted in the AUTHORS file
+
+    This file is part of 0MQ.
+
+    0MQ is free software; you can redistribute it and/or modify it under
+    the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    0MQ is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+//  The pairing core of the proxy, with the workers driven from the main
+//  thread: a client that comes before any worker is held until one has
+//  registered, each client keeps the worker it was paired with, and the
+//  multipart messages go through both ways.
+
+#include "testutil.hpp"
+#include "../include/zmq_utils.h"
+#include "../src/proxy.hpp"
+
+#define CONTENT_SIZE_MAX 512
+#define QT_ROUNDS 10
+#define FRONTEND_ENDPOINT "tcp://127.0.0.1:9970"
+#define BACKEND_ENDPOINT "tcp://127.0.0.1:9971"
+
+static void *
+peer (void *ctx, const char *endpoint)
+{
+    void *socket = zmq_socket (ctx, ZMQ_DEALER);
+    assert (socket);
+    int timeout = 5000;
+    int rc = zmq_setsockopt (socket, ZMQ_RCVTIMEO, &timeout, sizeof (int));
+    assert (rc == 0);
+    rc = zmq_connect (socket, endpoint);
+    assert (rc == 0);
+    return socket;
+}
+
+//  One frame, which has to be the last one unless more_
+static void
+expect (void *socket, const char *content, bool more_ = false)
+{
+    char frame [CONTENT_SIZE_MAX];
+    int size = zmq_recv (socket, frame, sizeof frame, 0);
+    assert (size == (int) strlen (content) && memcmp (frame, content, size) == 0);
+    int more;
+    size_t more_size = sizeof more;
+    int rc = zmq_getsockopt (socket, ZMQ_RCVMORE, &more, &more_size);
+    assert (rc == 0 && more == (more_ ? 1 : 0));
+}
+
+//  Nothing for that socket, within a while
+static void
+expect_nothing (void *socket)
+{
+    zmq_pollitem_t item = { socket, 0, ZMQ_POLLIN, 0 };
+    int rc = zmq_poll (&item, 1, 100);
+    assert (rc == 0);
+}
+
+int main (void)
+{
+    setup_test_environment ();
+
+    void *ctx = zmq_ctx_new ();
+    assert (ctx);
+    void *control = zmq_socket (ctx, ZMQ_PUB);
+    assert (control);
+    int rc = zmq_bind (control, "inproc://control");
+    assert (rc == 0);
+
+    proxy_config_t config;
+    proxy_config_init (&config);
+    config.frontend = FRONTEND_ENDPOINT;
+    config.backend = BACKEND_ENDPOINT;
+    proxy_t *proxy = new proxy_t (ctx, config);
+    const metrics_t *metrics = proxy->metrics ();
+    void *proxy_thread = zmq_threadstart (&test_proxy, proxy);
+
+    //  No worker: the frontend is not read, and the request waits in TCP
+    void *first = peer (ctx, FRONTEND_ENDPOINT);
+    rc = zmq_send (first, "first", 5, 0);
+    assert (rc == 5);
+    msleep (100);
+    assert (metrics_get (&metrics->sessions) == 0);
+
+    //  The first worker has sent its greeting, which goes to the client
+    //  once paired, and the request follows
+    void *one = peer (ctx, BACKEND_ENDPOINT);
+    expect (one, "first");
+    test_wait_for (&metrics->sessions, 1);
+    test_wait_for (&metrics->workers, 1);
+
+    //  The second client gets the second worker, the only idle one
+    void *two = peer (ctx, BACKEND_ENDPOINT);
+    test_wait_for (&metrics->workers, 2);
+    void *second = peer (ctx, FRONTEND_ENDPOINT);
+    rc = zmq_send (second, "second", 6, 0);
+    assert (rc == 6);
+    expect (two, "second");
+    test_wait_for (&metrics->sessions, 2);
+
+    //  Each client keeps its worker, and every frame of a message goes
+    //  through, in both ways
+    for (int i = 0; i < QT_ROUNDS; i++) {
+        rc = zmq_send (second, "to", 2, ZMQ_SNDMORE);
+        assert (rc == 2);
+        rc = zmq_send (second, "two", 3, 0);
+        assert (rc == 3);
+        rc = zmq_send (first, "to", 2, ZMQ_SNDMORE);
+        assert (rc == 2);
+        rc = zmq_send (first, "one", 3, 0);
+        assert (rc == 3);
+        expect (one, "to", true);
+        expect (one, "one");
+        expect (two, "to", true);
+        expect (two, "two");
+        rc = zmq_send (one, "from", 4, ZMQ_SNDMORE);
+        assert (rc == 4);
+        rc = zmq_send (one, "one", 3, 0);
+        assert (rc == 3);
+        rc = zmq_send (two, "from", 4, ZMQ_SNDMORE);
+        assert (rc == 4);
+        rc = zmq_send (two, "two", 3, 0);
+        assert (rc == 3);
+        expect (first, "from", true);
+        expect (first, "one");
+        expect (second, "from", true);
+        expect (second, "two");
+    }
+    expect_nothing (one);
+    expect_nothing (two);
+    expect_nothing (first);
+    expect_nothing (second);
+    assert (metrics_get (&metrics->sessions) == 2);
+    assert (metrics_get (&metrics->sessions_total) == 2);
+
+    rc = zmq_send (control, "TERMINATE", 10, 0);
+    assert (rc == 10);
+    zmq_threadclose (proxy_thread);
+    close_zero_linger (first);
+    close_zero_linger (second);
+    close_zero_linger (one);
+    close_zero_linger (two);
+    delete proxy;
+    rc = zmq_close (control);
+    assert (rc == 0);
+    rc = zmq_ctx_term (ctx);
+    assert (rc == 0);
+    return 0;
+}
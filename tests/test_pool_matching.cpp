@@ -0,0 +1,165 @@
+/*
+    Copyright (c) 2007-2013 Contributors as noted in the AUTHORS file
+
+    This file is part of 0MQ.
+
+    0MQ is free software; you can redistribute it and/or modify it under
+    the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    0MQ is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+//  Two threads of the worker pool connect at the same time, and each one
+//  is known by its own connection: retiring the key the backend sees on
+//  a connection stops the thread behind it, and that one only. The thread
+//  learns its key from a monitor event, which may come after the chunk
+//  the backend takes the key from; retire () tells when it does not know
+//  the key yet, and is tried again.
+
+#include "testutil.hpp"
+#include "../src/pool.hpp"
+
+#define ENDPOINT "tcp://127.0.0.1:9972"
+#define QT_ROUNDS 20
+#define IDENTITY_SIZE_MAX 256
+
+typedef struct {
+    char identity [IDENTITY_SIZE_MAX];
+    int identity_size;
+    uint64_t key;
+} connection_t;
+
+static void
+serve (void *, zmq_msg_t *, void *)
+{
+    assert (false);
+}
+
+//  The next chunk of the backend and the identity of its connection;
+//  false if none came within timeout msec
+static bool
+next_chunk (void *backend, connection_t *connection, zmq_msg_t *msg, int timeout)
+{
+    zmq_pollitem_t item = { backend, 0, ZMQ_POLLIN, 0 };
+    if (zmq_poll (&item, 1, timeout) <= 0)
+        return false;
+    connection->identity_size = zmq_recv (backend, connection->identity, IDENTITY_SIZE_MAX, 0);
+    assert (connection->identity_size > 0);
+    int rc = zmq_msg_recv (msg, backend, 0);
+    assert (rc >= 0);
+    return true;
+}
+
+//  The greeting of each of the two connections, and their keys
+static void
+accept_two (void *backend, connection_t *connections)
+{
+    zmq_msg_t msg;
+    int rc = zmq_msg_init (&msg);
+    assert (rc == 0);
+    int qt_connections = 0;
+    while (qt_connections < 2) {
+        connection_t chunk;
+        bool is_chunk = next_chunk (backend, &chunk, &msg, 5000);
+        assert (is_chunk);
+        if (zmq_msg_size (&msg) == 0)
+            continue;               //  a connect notification
+        bool is_known = false;
+        for (int i = 0; i < qt_connections; i++)
+            if (connections [i].identity_size == chunk.identity_size
+            &&  memcmp (connections [i].identity, chunk.identity, chunk.identity_size) == 0)
+                is_known = true;
+        if (is_known)
+            continue;
+        chunk.key = worker_pool_t::peer_key (&msg);
+        assert (chunk.key);
+        connections [qt_connections++] = chunk;
+    }
+    assert (connections [0].key != connections [1].key);
+    zmq_msg_close (&msg);
+}
+
+//  Retires the thread of connection_, once the pool knows its key, and
+//  checks that this connection is the one to go
+static void
+retire (void *backend, worker_pool_t *pool, const connection_t *connection)
+{
+    bool is_retired = false;
+    for (int i = 0; i < 500 && !is_retired; i++) {
+        is_retired = pool->retire (connection->key);
+        if (!is_retired)
+            msleep (10);
+    }
+    assert (is_retired);
+
+    zmq_msg_t msg;
+    int rc = zmq_msg_init (&msg);
+    assert (rc == 0);
+    connection_t closed;
+    bool is_chunk = next_chunk (backend, &closed, &msg, 5000);
+    assert (is_chunk);
+    assert (zmq_msg_size (&msg) == 0);
+    assert (closed.identity_size == connection->identity_size
+        &&  memcmp (closed.identity, connection->identity, closed.identity_size) == 0);
+    zmq_msg_close (&msg);
+}
+
+int main (void)
+{
+    setup_test_environment ();
+
+    void *ctx = zmq_ctx_new ();
+    assert (ctx);
+    void *backend = zmq_socket (ctx, ZMQ_STREAM);
+    assert (backend);
+    int rc = zmq_bind (backend, ENDPOINT);
+    assert (rc == 0);
+
+    pool_config_t config;
+    pool_config_init (&config);
+    config.endpoint = ENDPOINT;
+    config.min = 0;
+    config.max = 2;
+    config.target_idle = 0;
+    config.serve = serve;
+
+    for (int round = 0; round < QT_ROUNDS; round++) {
+        //  Both threads are started at once, for two clients
+        worker_pool_t *pool = new worker_pool_t (ctx, config);
+        int surplus = pool->adjust (0, 2, 0);
+        assert (surplus == 0);
+        assert (pool->size () == 2);
+        connection_t connections [2];
+        accept_two (backend, connections);
+
+        //  Either one first: the other is still there after
+        const connection_t *first = &connections [round % 2];
+        const connection_t *second = &connections [1 - round % 2];
+        retire (backend, pool, first);
+        assert (pool->size () == 1);
+        zmq_msg_t msg;
+        rc = zmq_msg_init (&msg);
+        assert (rc == 0);
+        connection_t other;
+        assert (!next_chunk (backend, &other, &msg, 100));
+        zmq_msg_close (&msg);
+        retire (backend, pool, second);
+        assert (pool->size () == 0);
+        assert (pool->retired_total () == 2);
+        delete pool;
+    }
+
+    rc = zmq_close (backend);
+    assert (rc == 0);
+    rc = zmq_ctx_term (ctx);
+    assert (rc == 0);
+    return 0;
+}
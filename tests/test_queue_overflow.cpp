@@ -0,0 +1,116 @@
+/*
+    Copyright (c) 2007-2013 Contributors as noted in the AUTHORS file
+
+    This file is part of 0MQ.
+
+    0MQ is free software; you can redistribute it and/or modify it under
+    the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    0MQ is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+//  A rate capped client floods its queue beside an interactive client:
+//  the proxy closes the flooding client, and keeps serving the other one
+//  at once rather than waiting for the cap to let the flood through.
+
+#include "testutil.hpp"
+#include "../src/proxy.hpp"
+#include "../src/clock.hpp"
+
+#define CONTENT_SIZE_MAX 512
+#define RATE 16384                  //  bytes per second, of every client
+#define QUEUE_BYTES 65536           //  per client
+#define BULK_SIZE 16384             //  bytes per bulk message
+#define QT_BULK 64                  //  a megabyte, a minute at RATE
+#define QT_ROUND_TRIPS 10
+#define ROUND_TRIP_MAX 250          //  msec, far below the time of a capped chunk
+#define FRONTEND_ENDPOINT "tcp://127.0.0.1:9977"
+#define BACKEND_ENDPOINT "tcp://127.0.0.1:9978"
+
+int main (void)
+{
+    setup_test_environment ();
+
+    void *ctx = zmq_ctx_new ();
+    assert (ctx);
+    void *control = zmq_socket (ctx, ZMQ_PUB);
+    assert (control);
+    int rc = zmq_bind (control, "inproc://control");
+    assert (rc == 0);
+
+    sched_class_t classes [1];
+    classes [0].weight = 1;
+    classes [0].rate = RATE;
+    classes [0].burst = 0;
+    proxy_config_t config;
+    proxy_config_init (&config);
+    config.frontend = FRONTEND_ENDPOINT;
+    config.backend = BACKEND_ENDPOINT;
+    config.scheduler = true;
+    config.classes = classes;
+    config.qt_classes = 1;
+    config.queue_bytes = QUEUE_BYTES;
+    proxy_t *proxy = new proxy_t (ctx, config);
+    const metrics_t *metrics = proxy->metrics ();
+    void *proxy_thread = zmq_threadstart (&test_proxy, proxy);
+
+    //  The worker of the bulk client swallows what it gets, it is the
+    //  oldest idle one when the bulk client comes
+    void *sink = zmq_socket (ctx, ZMQ_DEALER);
+    assert (sink);
+    rc = zmq_connect (sink, BACKEND_ENDPOINT);
+    assert (rc == 0);
+    test_wait_for (&metrics->workers, 1);
+    void *bulk = test_client (ctx, FRONTEND_ENDPOINT, "bulk");
+    test_wait_for (&metrics->sessions, 1);
+
+    test_worker_t args;
+    test_worker_init (&args, ctx, BACKEND_ENDPOINT);
+    void *worker = zmq_threadstart (&test_worker, &args);
+    test_wait_for (&metrics->workers, 2);
+    void *client = test_client (ctx, FRONTEND_ENDPOINT, "ping");
+    char reply [CONTENT_SIZE_MAX];
+    rc = zmq_recv (client, reply, sizeof reply, 0);
+    assert (rc == 4 && memcmp (reply, "ping", 4) == 0);
+
+    //  The flood fills the bulk queue in no time, while the cap lets a
+    //  chunk through every half second
+    char *content = (char *) calloc (1, BULK_SIZE);
+    assert (content);
+    for (int i = 0; i < QT_BULK; i++)
+        zmq_send (bulk, content, BULK_SIZE, ZMQ_DONTWAIT);
+    free (content);
+    for (int i = 0; i < QT_ROUND_TRIPS; i++) {
+        uint64_t start = now_usec ();
+        rc = zmq_send (client, "ping", 4, 0);
+        assert (rc == 4);
+        rc = zmq_recv (client, reply, sizeof reply, 0);
+        assert (rc == 4 && memcmp (reply, "ping", 4) == 0);
+        assert ((now_usec () - start) / 1000 < ROUND_TRIP_MAX);
+    }
+    test_wait_for (&metrics->queue_overflows, 1);
+    test_wait_for (&metrics->sessions, 1);
+    test_wait_for (&metrics->workers, 1);
+
+    rc = zmq_send (control, "TERMINATE", 10, 0);
+    assert (rc == 10);
+    zmq_threadclose (worker);
+    zmq_threadclose (proxy_thread);
+    close_zero_linger (bulk);
+    close_zero_linger (client);
+    close_zero_linger (sink);
+    delete proxy;
+    rc = zmq_close (control);
+    assert (rc == 0);
+    rc = zmq_ctx_term (ctx);
+    assert (rc == 0);
+    return 0;
+}
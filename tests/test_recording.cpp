@@ -0,0 +1,107 @@
+/*
+    Copyright (c) 2007-2013 Contributors as noted in the AUTHORS file
+
+    This file is part of 0MQ.
+
+    0MQ is free software; you can redistribute it and/or modify it under
+    the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    0MQ is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+//  The recorder reads the mechanism from the greeting of the worker by
+//  itself: a NULL session is written, a CURVE one is not, and a session
+//  whose worker never greets is dropped once it holds back too much,
+//  rather than held until it ends.
+
+#include "testutil.hpp"
+#include "../src/recorder.hpp"
+
+#define RECORD_PATH "test_recording.rec"
+#define FLOOD_SIZE 4096
+
+//  The greeting of a worker using mechanism_
+static void
+greeting (zmtp_greeting_t *greeting_, const char *mechanism_)
+{
+    memset (greeting_, 0, sizeof *greeting_);
+    greeting_->signature [0] = 0xff;
+    greeting_->signature [9] = 0x7f;
+    greeting_->version [0] = 3;
+    memcpy (greeting_->mechanism, mechanism_, strlen (mechanism_));
+}
+
+int main (void)
+{
+    setup_test_environment ();
+
+    recorder_t recorder;
+    int rc = recorder.open (RECORD_PATH, 1000);
+    assert (rc == 0);
+
+    zmtp_greeting_t null_greeting, curve_greeting;
+    greeting (&null_greeting, "NULL");
+    greeting (&curve_greeting, "CURVE");
+    const size_t half = sizeof null_greeting / 2;
+
+    uint32_t null_id = recorder.begin (1001);
+    uint32_t curve_id = recorder.begin (1002);
+    uint32_t silent_id = recorder.begin (1003);
+
+    //  The NULL greeting comes in two chunks
+    bool is_recorded = recorder.chunk (null_id, RECORD_CLIENT, &null_greeting, sizeof null_greeting, 1010);
+    assert (is_recorded);
+    is_recorded = recorder.chunk (null_id, RECORD_WORKER, &null_greeting, half, 1020);
+    assert (is_recorded);
+    is_recorded = recorder.chunk (null_id, RECORD_WORKER, (byte *) &null_greeting + half,
+        sizeof null_greeting - half, 1030);
+    assert (is_recorded);
+
+    is_recorded = recorder.chunk (curve_id, RECORD_CLIENT, &curve_greeting, sizeof curve_greeting, 1010);
+    assert (is_recorded);
+    is_recorded = recorder.chunk (curve_id, RECORD_WORKER, &curve_greeting, sizeof curve_greeting, 1020);
+    assert (!is_recorded);
+
+    //  The client of the silent session floods until it is left out
+    static char flood [FLOOD_SIZE];
+    int qt_chunks = 0;
+    while (recorder.chunk (silent_id, RECORD_CLIENT, flood, sizeof flood, 1040))
+        qt_chunks++;
+    assert (qt_chunks < RECORD_HELD_MAX / FLOOD_SIZE);
+
+    recorder.end (null_id, 1050);
+    recorder.close ();
+
+    FILE *file = fopen (RECORD_PATH, "rb");
+    assert (file);
+    static unsigned char recording [1024];
+    size_t size = fread (recording, 1, sizeof recording, file);
+    fclose (file);
+    rc = remove (RECORD_PATH);
+    assert (rc == 0);
+    assert (size > RECORD_MAGIC_SIZE && size < sizeof recording);
+    assert (memcmp (recording, RECORD_MAGIC, RECORD_MAGIC_SIZE) == 0);
+
+    //  Only the NULL session, whole and in order
+    const int types [] = { RECORD_OPEN, RECORD_CLIENT, RECORD_WORKER, RECORD_WORKER, RECORD_CLOSE };
+    const unsigned char *at = recording + RECORD_MAGIC_SIZE;
+    record_t record;
+    int qt_records = 0;
+    while ((rc = record_next (at, recording + size, &record)) > 0) {
+        assert (qt_records < 5);
+        assert (record.session == null_id);
+        assert (record.type == types [qt_records]);
+        qt_records++;
+    }
+    assert (rc == 0);
+    assert (qt_records == 5);
+    return 0;
+}
@@ -0,0 +1,138 @@
+/*
+    Copyright (c) 2007-2013 Contributors as noted in the AUTHORS file
+
+    This file is part of 0MQ.
+
+    0MQ is free software; you can redistribute it and/or modify it under
+    the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    0MQ is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+//  Two tiers: the workers connect to a regional proxy, whose uplinks make
+//  them workers of the edge proxy. A CURVE client goes through both, end
+//  to end; when it leaves, its worker connection comes back to the edge,
+//  and when a worker leaves, the edge loses it too.
+
+#include "testutil.hpp"
+#include "../include/zmq_utils.h"
+#include "../src/proxy.hpp"
+
+#define KEY_SIZE 40
+#define CONTENT_SIZE_MAX 512
+#define QT_WORKERS 2
+#define QT_REQUESTS 10
+#define EDGE_FRONTEND "tcp://127.0.0.1:9984"
+#define EDGE_BACKEND "tcp://127.0.0.1:9985"
+#define REGIONAL_BACKEND "tcp://127.0.0.1:9986"
+#define is_verbose 0
+
+static char client_pub [KEY_SIZE + 1], client_sec [KEY_SIZE + 1];
+static char worker_pub [KEY_SIZE + 1], worker_sec [KEY_SIZE + 1];
+
+int main (void)
+{
+    setup_test_environment ();
+
+    void *ctx = zmq_ctx_new ();
+    assert (ctx);
+    void *control = zmq_socket (ctx, ZMQ_PUB);
+    assert (control);
+    int rc = zmq_bind (control, "inproc://control");
+    assert (rc == 0);
+    void *workers_control = zmq_socket (ctx, ZMQ_PUB);
+    assert (workers_control);
+    rc = zmq_bind (workers_control, "inproc://workers");
+    assert (rc == 0);
+    rc = zmq_curve_keypair (client_pub, client_sec);
+    assert (rc == 0);
+    rc = zmq_curve_keypair (worker_pub, worker_sec);
+    assert (rc == 0);
+
+    //  The edge proxy, where the clients connect
+    proxy_config_t config;
+    proxy_config_init (&config);
+    config.frontend = EDGE_FRONTEND;
+    config.backend = EDGE_BACKEND;
+    config.verbose = is_verbose;
+    proxy_t *edge = new proxy_t (ctx, config);
+    const metrics_t *edge_metrics = edge->metrics ();
+    void *edge_thread = zmq_threadstart (&test_proxy, edge);
+
+    //  The regional proxy, where the workers connect
+    config.backend = REGIONAL_BACKEND;
+    config.uplink = EDGE_BACKEND;
+    proxy_t *regional = new proxy_t (ctx, config);
+    const metrics_t *regional_metrics = regional->metrics ();
+    void *regional_thread = zmq_threadstart (&test_proxy, regional);
+
+    //  Each worker connection is a worker of the edge
+    test_worker_t args [QT_WORKERS];
+    void *worker_threads [QT_WORKERS];
+    for (int i = 0; i < QT_WORKERS; i++) {
+        test_worker_init (&args [i], ctx, REGIONAL_BACKEND, (char) ('0' + i));
+        args [i].commands = "inproc://workers";
+        args [i].secret_key = worker_sec;
+        worker_threads [i] = zmq_threadstart (&test_worker, &args [i]);
+    }
+    test_wait_for (&regional_metrics->uplinks, QT_WORKERS);
+    test_wait_for (&edge_metrics->workers, QT_WORKERS);
+
+    //  CURVE end to end, through both
+    void *client = test_client (ctx, EDGE_FRONTEND, NULL, worker_pub, client_pub, client_sec);
+    char content [CONTENT_SIZE_MAX];
+    for (int i = 0; i < QT_REQUESTS; i++) {
+        int size = sprintf (content, "request #%d", i);
+        rc = zmq_send (client, content, size, 0);
+        assert (rc == size);
+        char reply [CONTENT_SIZE_MAX];
+        rc = zmq_recv (client, reply, sizeof reply, 0);
+        assert (rc == size && memcmp (reply, content, size) == 0);
+    }
+    //  The edge followed the handshake, the regional proxy only relayed it
+    assert (metrics_get (&edge_metrics->handshake [metrics_phase_total].count) == 1);
+    assert (metrics_get (&regional_metrics->handshake [metrics_phase_total].count) == 0);
+    assert (metrics_get (&edge_metrics->sessions) == 1);
+
+    //  Once the client has left, its worker reconnects, and is back at the
+    //  edge through a new uplink
+    rc = zmq_close (client);
+    assert (rc == 0);
+    test_wait_for (&edge_metrics->sessions, 0);
+    test_wait_for (&regional_metrics->sessions_total, QT_WORKERS + 1);
+    test_wait_for (&edge_metrics->workers, QT_WORKERS);
+
+    //  A worker that leaves is gone from the edge too
+    rc = zmq_send (workers_control, "LEAVE0", 6, 0);
+    assert (rc == 6);
+    zmq_threadclose (worker_threads [0]);
+    test_wait_for (&regional_metrics->uplinks, QT_WORKERS - 1);
+    test_wait_for (&edge_metrics->workers, QT_WORKERS - 1);
+    assert (metrics_get (&regional_metrics->uplinks_expired) == 0);
+
+    rc = zmq_send (control, "TERMINATE", 10, 0);
+    assert (rc == 10);
+    zmq_threadclose (edge_thread);
+    zmq_threadclose (regional_thread);
+    rc = zmq_send (workers_control, "TERMINATE", 10, 0);
+    assert (rc == 10);
+    for (int i = 1; i < QT_WORKERS; i++)
+        zmq_threadclose (worker_threads [i]);
+    delete regional;
+    delete edge;
+    rc = zmq_close (workers_control);
+    assert (rc == 0);
+    rc = zmq_close (control);
+    assert (rc == 0);
+    rc = zmq_ctx_term (ctx);
+    assert (rc == 0);
+    return 0;
+}
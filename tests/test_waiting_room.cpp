@@ -0,0 +1,94 @@
+/*
+    Copyright (c) 2007-2013 Contributors as noted in the AUTHORS file
+
+    This file is part of 0MQ.
+
+    0MQ is free software; you can redistribute it and/or modify it under
+    the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    0MQ is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+//  The waiting room: with no worker, two clients wait and the third one is
+//  closed at once; then a worker comes and goes to the first client, and
+//  the second one is closed at its deadline.
+
+#include "testutil.hpp"
+#include "../include/zmq_utils.h"
+#include "../src/proxy.hpp"
+
+#define CONTENT_SIZE_MAX 512
+#define WAITING_ROOM 2
+#define DEADLINE 1000               //  msec
+#define FRONTEND_ENDPOINT "tcp://127.0.0.1:9980"
+#define BACKEND_ENDPOINT "tcp://127.0.0.1:9981"
+#define is_verbose 0
+
+int main (void)
+{
+    setup_test_environment ();
+
+    void *ctx = zmq_ctx_new ();
+    assert (ctx);
+    void *control = zmq_socket (ctx, ZMQ_PUB);
+    assert (control);
+    int rc = zmq_bind (control, "inproc://control");
+    assert (rc == 0);
+
+    proxy_config_t config;
+    proxy_config_init (&config);
+    config.frontend = FRONTEND_ENDPOINT;
+    config.backend = BACKEND_ENDPOINT;
+    config.verbose = is_verbose;
+    config.waiting_room = WAITING_ROOM;
+    config.waiting_deadline = DEADLINE * 1000;
+    proxy_t *proxy = new proxy_t (ctx, config);
+    const metrics_t *metrics = proxy->metrics ();
+    void *proxy_thread = zmq_threadstart (&test_proxy, proxy);
+
+    //  No worker yet: the first two clients wait, the third one is closed
+    void *first = test_client (ctx, FRONTEND_ENDPOINT, "first");
+    test_wait_for (&metrics->waiting, 1);
+    void *second = test_client (ctx, FRONTEND_ENDPOINT, "second");
+    test_wait_for (&metrics->waiting, 2);
+    void *third = test_client (ctx, FRONTEND_ENDPOINT, "third");
+    test_wait_for (&metrics->waiting_refused, 1);
+
+    //  The worker goes to the client that has waited longest
+    test_worker_t worker;
+    test_worker_init (&worker, ctx, BACKEND_ENDPOINT);
+    void *worker_thread = zmq_threadstart (&test_worker, &worker);
+    char reply [CONTENT_SIZE_MAX];
+    rc = zmq_recv (first, reply, sizeof reply, 0);
+    assert (rc == 5 && memcmp (reply, "first", 5) == 0);
+    assert (metrics_get (&metrics->wait.count) == 1);
+    assert (metrics_get (&metrics->sessions_total) == 1);
+
+    //  The other one is closed at its deadline
+    test_wait_for (&metrics->waiting_expired, 1);
+    assert (metrics_get (&metrics->waiting) == 0);
+    assert (metrics_get (&metrics->waiting_total) == 2);
+    assert (metrics_get (&metrics->queue_depth) == 0);
+
+    rc = zmq_send (control, "TERMINATE", 10, 0);
+    assert (rc == 10);
+    zmq_threadclose (proxy_thread);
+    zmq_threadclose (worker_thread);
+    zmq_close (first);
+    zmq_close (second);
+    zmq_close (third);
+    delete proxy;
+    rc = zmq_close (control);
+    assert (rc == 0);
+    rc = zmq_ctx_term (ctx);
+    assert (rc == 0);
+    return 0;
+}
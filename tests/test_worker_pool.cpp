@@ -0,0 +1,160 @@
+/*
+    Copyright (c) 2007-2013 Contributors as noted in the AUTHORS file
+
+    This file is part of 0MQ.
+
+    0MQ is free software; you can redistribute it and/or modify it under
+    the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    0MQ is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+//  The elastic worker pool: the proxy starts with its minimum, grows as
+//  CURVE clients come, up to its maximum, and retires the threads it does
+//  not need once the clients are gone and the cooldown is over.
+
+#include "testutil.hpp"
+#include "../include/zmq_utils.h"
+#include "../src/proxy.hpp"
+
+#define KEY_SIZE 40
+#define CONTENT_SIZE_MAX 512
+#define QT_CLIENTS 3
+#define POOL_MIN 1
+#define POOL_MAX 4
+#define COOLDOWN 200000             //  usec
+#define FRONTEND_ENDPOINT "tcp://127.0.0.1:9973"
+#define BACKEND_ENDPOINT "tcp://127.0.0.1:9974"
+#define is_verbose 0
+
+static char client_pub [KEY_SIZE + 1], client_sec [KEY_SIZE + 1];
+static char worker_pub [KEY_SIZE + 1], worker_sec [KEY_SIZE + 1];
+
+static void
+echo (void *socket_, zmq_msg_t *msg_, void *)
+{
+    int rc = zmq_msg_send (msg_, socket_, zmq_msg_more (msg_) ? ZMQ_SNDMORE : 0);
+    assert (rc >= 0);
+}
+
+static void *
+client_socket (void *ctx)
+{
+    void *client = zmq_socket (ctx, ZMQ_DEALER);
+    assert (client);
+    int rc = zmq_setsockopt (client, ZMQ_CURVE_SERVERKEY, worker_pub, KEY_SIZE);
+    assert (rc == 0);
+    rc = zmq_setsockopt (client, ZMQ_CURVE_PUBLICKEY, client_pub, KEY_SIZE);
+    assert (rc == 0);
+    rc = zmq_setsockopt (client, ZMQ_CURVE_SECRETKEY, client_sec, KEY_SIZE);
+    assert (rc == 0);
+    int linger = 0;
+    rc = zmq_setsockopt (client, ZMQ_LINGER, &linger, sizeof (int));
+    assert (rc == 0);
+    int timeout = 5000;
+    rc = zmq_setsockopt (client, ZMQ_RCVTIMEO, &timeout, sizeof (int));
+    assert (rc == 0);
+    rc = zmq_connect (client, FRONTEND_ENDPOINT);
+    assert (rc == 0);
+    return client;
+}
+
+int main (void)
+{
+    setup_test_environment ();
+
+    void *ctx = zmq_ctx_new ();
+    assert (ctx);
+    void *control = zmq_socket (ctx, ZMQ_PUB);
+    assert (control);
+    int rc = zmq_bind (control, "inproc://control");
+    assert (rc == 0);
+    rc = zmq_curve_keypair (client_pub, client_sec);
+    assert (rc == 0);
+    rc = zmq_curve_keypair (worker_pub, worker_sec);
+    assert (rc == 0);
+
+    pool_config_t pool;
+    pool_config_init (&pool);
+    pool.endpoint = BACKEND_ENDPOINT;
+    pool.secret_key = worker_sec;
+    pool.min = POOL_MIN;
+    pool.max = POOL_MAX;
+    pool.target_idle = 1;
+    pool.cooldown = COOLDOWN;
+    pool.serve = echo;
+    proxy_config_t config;
+    proxy_config_init (&config);
+    config.frontend = FRONTEND_ENDPOINT;
+    config.backend = BACKEND_ENDPOINT;
+    config.verbose = is_verbose;
+    config.waiting_room = QT_CLIENTS;
+    config.pool = &pool;
+    proxy_t *proxy = new proxy_t (ctx, config);
+    const metrics_t *metrics = proxy->metrics ();
+    void *proxy_thread = zmq_threadstart (&test_proxy, proxy);
+
+    //  One idle worker to begin with
+    test_wait_for (&metrics->workers, POOL_MIN);
+    assert (metrics_get (&metrics->pool_threads) == POOL_MIN);
+
+    //  The clients come together: each of them is served, the first one
+    //  at once, the others as the pool grows
+    void *clients [QT_CLIENTS];
+    for (int i = 0; i < QT_CLIENTS; i++) {
+        clients [i] = client_socket (ctx);
+        rc = zmq_send (clients [i], "hello", 5, 0);
+        assert (rc == 5);
+    }
+    for (int i = 0; i < QT_CLIENTS; i++) {
+        char reply [CONTENT_SIZE_MAX];
+        rc = zmq_recv (clients [i], reply, sizeof reply, 0);
+        assert (rc == 5 && memcmp (reply, "hello", 5) == 0);
+    }
+    assert (metrics_get (&metrics->sessions) == QT_CLIENTS);
+
+    //  One more idle beside the sessions, and no more than the maximum
+    test_wait_for (&metrics->workers, POOL_MAX);
+    assert (metrics_get (&metrics->pool_threads) == POOL_MAX);
+    assert (metrics_get (&metrics->pool_started) == POOL_MAX);
+    msleep (COOLDOWN / 500);
+    assert (metrics_get (&metrics->pool_threads) == POOL_MAX);
+
+    //  Once the clients have left, the surplus goes after the cooldown
+    for (int i = 0; i < QT_CLIENTS; i++) {
+        rc = zmq_close (clients [i]);
+        assert (rc == 0);
+    }
+    test_wait_for (&metrics->sessions, 0);
+    test_wait_for (&metrics->pool_threads, POOL_MIN);
+    test_wait_for (&metrics->workers, POOL_MIN);
+    assert (metrics_get (&metrics->pool_retired) == POOL_MAX - POOL_MIN);
+
+    //  The one left serves the next client
+    void *client = client_socket (ctx);
+    rc = zmq_send (client, "again", 5, 0);
+    assert (rc == 5);
+    char reply [CONTENT_SIZE_MAX];
+    rc = zmq_recv (client, reply, sizeof reply, 0);
+    assert (rc == 5 && memcmp (reply, "again", 5) == 0);
+    rc = zmq_close (client);
+    assert (rc == 0);
+
+    rc = zmq_send (control, "TERMINATE", 10, 0);
+    assert (rc == 10);
+    zmq_threadclose (proxy_thread);
+    delete proxy;
+    rc = zmq_close (control);
+    assert (rc == 0);
+    rc = zmq_ctx_term (ctx);
+    assert (rc == 0);
+    return 0;
+}
@@ -0,0 +1,79 @@
+/*
+    Copyright (c) 2007-2013 Contributors as noted in the AUTHORS file
+
+    This file is part of 0MQ.
+
+    0MQ is free software; you can redistribute it and/or modify it under
+    the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    0MQ is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+//  More workers than metric slots: each slot is published with the
+//  identity of its worker, and the workers beyond are counted, until
+//  they leave.
+
+#include "testutil.hpp"
+#include "../src/proxy.hpp"
+
+#define QT_EXTRA 2
+#define QT_WORKERS (METRICS_MAX_WORKERS + QT_EXTRA)
+#define FRONTEND_ENDPOINT "tcp://127.0.0.1:9975"
+#define BACKEND_ENDPOINT "tcp://127.0.0.1:9976"
+
+int main (void)
+{
+    setup_test_environment ();
+
+    void *ctx = zmq_ctx_new ();
+    assert (ctx);
+    void *control = zmq_socket (ctx, ZMQ_PUB);
+    assert (control);
+    int rc = zmq_bind (control, "inproc://control");
+    assert (rc == 0);
+
+    proxy_config_t config;
+    proxy_config_init (&config);
+    config.frontend = FRONTEND_ENDPOINT;
+    config.backend = BACKEND_ENDPOINT;
+    proxy_t *proxy = new proxy_t (ctx, config);
+    const metrics_t *metrics = proxy->metrics ();
+    void *proxy_thread = zmq_threadstart (&test_proxy, proxy);
+
+    void *workers [QT_WORKERS];
+    for (int i = 0; i < QT_WORKERS; i++) {
+        workers [i] = zmq_socket (ctx, ZMQ_DEALER);
+        assert (workers [i]);
+        rc = zmq_connect (workers [i], BACKEND_ENDPOINT);
+        assert (rc == 0);
+    }
+    test_wait_for (&metrics->workers, QT_WORKERS);
+    assert (metrics_get (&metrics->workers_unslotted) == QT_EXTRA);
+    for (int i = 0; i < METRICS_MAX_WORKERS; i++) {
+        char identity [METRICS_ID_SIZE_MAX];
+        assert (metrics_worker_identity (&metrics->worker [i], identity) > 0);
+    }
+
+    for (int i = 0; i < QT_WORKERS; i++)
+        close_zero_linger (workers [i]);
+    test_wait_for (&metrics->workers, 0);
+    assert (metrics_get (&metrics->workers_unslotted) == 0);
+
+    rc = zmq_send (control, "TERMINATE", 10, 0);
+    assert (rc == 10);
+    zmq_threadclose (proxy_thread);
+    delete proxy;
+    rc = zmq_close (control);
+    assert (rc == 0);
+    rc = zmq_ctx_term (ctx);
+    assert (rc == 0);
+    return 0;
+}
@@ -0,0 +1,274 @@
+/*
+    Copyright (c) 2007-2013 Contributors as noted in the AUTHORS file
+
+    This file is part of 0MQ.
+
+    0MQ is free software; you can redistribute it and/or modify it under
+    the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    0MQ is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+//  Counts the heap allocations of the proxy thread, with malloc, calloc,
+//  realloc and operator new interposed, while CURVE clients keep doing
+//  round trips through it: the forwarding path of established sessions
+//  must not allocate. The allocations per handshake are reported.
+//
+//  Some allocations belong to libzmq and cannot be avoided:
+//  - the pipes between the proxy and the I/O threads grow by chunks of
+//    256 messages, and keep one spare chunk, so a chunk may be allocated
+//    now and then: PIPE_BOUND per message;
+//  - before 4.2, zmq_poll allocates its pollfd array at each call, hence
+//    up to one more per message when run () blocks in zmq_poll. Busy
+//    polling does not call zmq_poll while the traffic lasts.
+
+#include "testutil.hpp"
+#include "../include/zmq_utils.h"
+#include "../src/proxy.hpp"
+
+#include <new>
+
+#define CONTENT_SIZE 100
+#define QT_WORKERS    4
+#define QT_CLIENTS    4
+#define WARMUP      500             //  msec
+#define MEASURE    1000             //  msec
+#define PIPE_BOUND (1.0 / 256)
+#define KEY_SIZE_0 41
+#define KEY_SIZE 40
+
+extern "C" {
+    void *__libc_malloc (size_t size);
+    void *__libc_calloc (size_t count, size_t size);
+    void *__libc_realloc (void *ptr, size_t size);
+    void __libc_free (void *ptr);
+}
+
+static __thread bool is_counted;    //  set in the proxy thread only
+static uint64_t allocations;
+
+extern "C" void *malloc (size_t size)
+{
+    if (is_counted)
+        __atomic_fetch_add (&allocations, 1, __ATOMIC_RELAXED);
+    return __libc_malloc (size);
+}
+
+extern "C" void *calloc (size_t count, size_t size)
+{
+    if (is_counted)
+        __atomic_fetch_add (&allocations, 1, __ATOMIC_RELAXED);
+    return __libc_calloc (count, size);
+}
+
+extern "C" void *realloc (void *ptr, size_t size)
+{
+    if (is_counted)
+        __atomic_fetch_add (&allocations, 1, __ATOMIC_RELAXED);
+    return __libc_realloc (ptr, size);
+}
+
+extern "C" void free (void *ptr)
+{
+    __libc_free (ptr);
+}
+
+void *operator new (size_t size)
+{
+    void *ptr = malloc (size ? size : 1);
+    if (!ptr)
+        throw std::bad_alloc ();
+    return ptr;
+}
+
+void *operator new [] (size_t size)
+{
+    return operator new (size);
+}
+
+void operator delete (void *ptr) noexcept
+{
+    free (ptr);
+}
+
+void operator delete [] (void *ptr) noexcept
+{
+    free (ptr);
+}
+
+void operator delete (void *ptr, size_t) noexcept
+{
+    free (ptr);
+}
+
+void operator delete [] (void *ptr, size_t) noexcept
+{
+    free (ptr);
+}
+
+static char client_pub [KEY_SIZE_0], client_sec [KEY_SIZE_0], worker_pub [KEY_SIZE_0], worker_sec [KEY_SIZE_0];
+static int qt_ready;                //  clients done with their first round trip
+static int stop;
+
+static void
+proxy_task (void *proxy)
+{
+    is_counted = true;
+    int rc = ((proxy_t *) proxy)->run ();
+    assert (rc == 0);
+    is_counted = false;
+}
+
+static void
+client_task (void *ctx)
+{
+    void *client = zmq_socket (ctx, ZMQ_DEALER);
+    assert (client);
+    int rc = zmq_setsockopt (client, ZMQ_CURVE_SERVERKEY, worker_pub, KEY_SIZE);
+    assert (rc == 0);
+    rc = zmq_setsockopt (client, ZMQ_CURVE_PUBLICKEY, client_pub, KEY_SIZE);
+    assert (rc == 0);
+    rc = zmq_setsockopt (client, ZMQ_CURVE_SECRETKEY, client_sec, KEY_SIZE);
+    assert (rc == 0);
+    int linger = 0;
+    rc = zmq_setsockopt (client, ZMQ_LINGER, &linger, sizeof (int));
+    assert (rc == 0);
+    rc = zmq_connect (client, "tcp://127.0.0.1:9999");
+    assert (rc == 0);
+
+    char content [CONTENT_SIZE];
+    memset (content, 'x', CONTENT_SIZE);
+    for (int i = 0; !__atomic_load_n (&stop, __ATOMIC_RELAXED); i++) {
+        rc = zmq_send (client, content, CONTENT_SIZE, 0);
+        assert (rc == CONTENT_SIZE);
+        rc = zmq_recv (client, content, CONTENT_SIZE, 0);
+        assert (rc == CONTENT_SIZE);
+        if (i == 0)
+            __atomic_fetch_add (&qt_ready, 1, __ATOMIC_RELAXED);
+    }
+    rc = zmq_close (client);
+    assert (rc == 0);
+}
+
+static void
+worker_task (void *ctx)
+{
+    void *worker = zmq_socket (ctx, ZMQ_DEALER);
+    assert (worker);
+    int as_server = 1;
+    int rc = zmq_setsockopt (worker, ZMQ_CURVE_SERVER, &as_server, sizeof (int));
+    assert (rc == 0);
+    rc = zmq_setsockopt (worker, ZMQ_CURVE_SECRETKEY, worker_sec, KEY_SIZE);
+    assert (rc == 0);
+    int linger = 0;
+    rc = zmq_setsockopt (worker, ZMQ_LINGER, &linger, sizeof (int));
+    assert (rc == 0);
+    rc = zmq_connect (worker, "tcp://127.0.0.1:9998");
+    assert (rc == 0);
+
+    zmq_pollitem_t items [] = { { worker, 0, ZMQ_POLLIN, 0 } };
+    char content [CONTENT_SIZE];
+    while (!__atomic_load_n (&stop, __ATOMIC_RELAXED)) {
+        rc = zmq_poll (items, 1, 100);
+        assert (rc >= 0);
+        if (items [0].revents & ZMQ_POLLIN) {
+            int size = zmq_recv (worker, content, CONTENT_SIZE, 0);
+            assert (size > 0);
+            rc = zmq_send (worker, content, size, 0);
+            assert (rc == size);
+        }
+    }
+    rc = zmq_close (worker);
+    assert (rc == 0);
+}
+
+static void
+run_case (const char *name, uint64_t busy_poll, double bound)
+{
+    void *ctx = zmq_ctx_new ();
+    assert (ctx);
+    void *control = zmq_socket (ctx, ZMQ_PUB);
+    assert (control);
+    int rc = zmq_bind (control, "inproc://control");
+    assert (rc == 0);
+
+    proxy_config_t config;
+    proxy_config_init (&config);
+    config.busy_poll = busy_poll;
+    proxy_t *proxy = new proxy_t (ctx, config);
+    const metrics_t *metrics = proxy->metrics ();
+    __atomic_store_n (&stop, 0, __ATOMIC_RELAXED);
+    __atomic_store_n (&qt_ready, 0, __ATOMIC_RELAXED);
+    void *proxy_thread = zmq_threadstart (&proxy_task, proxy);
+
+    void *workers [QT_WORKERS];
+    for (int i = 0; i < QT_WORKERS; i++)
+        workers [i] = zmq_threadstart (&worker_task, ctx);
+    while (metrics_get (&metrics->workers) < QT_WORKERS)
+        msleep (SETTLE_TIME);
+
+    //  Session establishment: pairing, handshake, first round trip
+    uint64_t before = __atomic_load_n (&allocations, __ATOMIC_RELAXED);
+    void *clients [QT_CLIENTS];
+    for (int i = 0; i < QT_CLIENTS; i++)
+        clients [i] = zmq_threadstart (&client_task, ctx);
+    while (__atomic_load_n (&qt_ready, __ATOMIC_RELAXED) < QT_CLIENTS)
+        msleep (SETTLE_TIME);
+    uint64_t per_session = __atomic_load_n (&allocations, __ATOMIC_RELAXED) - before;
+
+    //  Steady state
+    msleep (WARMUP);
+    before = __atomic_load_n (&allocations, __ATOMIC_RELAXED);
+    uint64_t msgs_before = metrics_get (&metrics->msgs_c2w) + metrics_get (&metrics->msgs_w2c);
+    msleep (MEASURE);
+    uint64_t steady = __atomic_load_n (&allocations, __ATOMIC_RELAXED) - before;
+    uint64_t msgs = metrics_get (&metrics->msgs_c2w) + metrics_get (&metrics->msgs_w2c) - msgs_before;
+
+    __atomic_store_n (&stop, 1, __ATOMIC_RELAXED);
+    for (int i = 0; i < QT_CLIENTS; i++)
+        zmq_threadclose (clients [i]);
+    for (int i = 0; i < QT_WORKERS; i++)
+        zmq_threadclose (workers [i]);
+    rc = zmq_send (control, "TERMINATE", 10, 0);
+    assert (rc == 10);
+    zmq_threadclose (proxy_thread);
+    delete proxy;
+    rc = zmq_close (control);
+    assert (rc == 0);
+    rc = zmq_ctx_term (ctx);
+    assert (rc == 0);
+
+    double per_msg = msgs ? (double) steady / msgs : 0;
+    printf ("%s: %.1f allocations per session established, "
+        "%llu in %llu forwarded messages (%.5f per message, bound %.5f)\n",
+        name, (double) per_session / QT_CLIENTS, (unsigned long long) steady,
+        (unsigned long long) msgs, per_msg, bound);
+    assert (msgs > 0);
+    assert (per_msg <= bound);
+}
+
+int main (void)
+{
+    setup_test_environment ();
+
+    int rc = zmq_curve_keypair (client_pub, client_sec);
+    assert (rc == 0);
+    rc = zmq_curve_keypair (worker_pub, worker_sec);
+    assert (rc == 0);
+
+    int major, minor, patch;
+    zmq_version (&major, &minor, &patch);
+    bool is_poll_allocating = major * 100 + minor < 402;
+
+    run_case ("busy polling", 10000, PIPE_BOUND);
+    run_case ("blocking", 0, PIPE_BOUND + (is_poll_allocating ? 1 : 0));
+    return 0;
+}
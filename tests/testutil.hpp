@@ -23,6 +23,7 @@
 #include "../include/zmq.h"
 #include "../include/zmq_utils.h"
 #include "platform.hpp"
+#include "../src/proxy.hpp"
 
 //  This defines the settle time used in tests; raise this if we
 //  get test failures on slower systems due to binds/connects not
@@ -34,6 +35,7 @@
 #include <assert.h>
 #include <stdarg.h>
 #include <string>
+#include <string.h>
 
 #if defined _WIN32
 #   if defined _MSC_VER
@@ -275,5 +277,151 @@ void msleep (int milliseconds)
 #endif
 }
 
+//  The proxy of the tests, run by zmq_threadstart (test_proxy, proxy)
+void test_proxy (void *proxy)
+{
+    int rc = ((proxy_t *) proxy)->run ();
+    assert (rc == 0);
+}
+
+//  Until the metric has the value, for 5 seconds at most
+void test_wait_for (const uint64_t *field, uint64_t value)
+{
+    for (int i = 0; i < 500 && metrics_get (field) != value; i++)
+        msleep (10);
+    assert (metrics_get (field) == value);
+}
+
+//  A worker of the proxy tests, run by zmq_threadstart (test_worker, &args):
+//  a DEALER connected to the backend that answers each request with its
+//  content, reply_delay msec later, unless it is the mute one; the large
+//  one gets its content padded to large_size bytes. It stops on
+//  TERMINATE, or on LEAVE followed by its name, from the commands endpoint.
+typedef struct {
+    void *ctx;
+    const char *endpoint;           //  backend of the proxy
+    const char *commands;           //  PUB endpoint of TERMINATE and LEAVE
+    char name;                      //  '0', '1'...
+    const char *secret_key;         //  as a CURVE server, or NULL
+    int reply_delay;                //  msec
+    const char *mute;               //  a request left unanswered, or NULL
+    const char *large;              //  a request answered with large_size bytes, or NULL
+    size_t large_size;
+    int received;                   //  requests, read with __atomic_load_n
+} test_worker_t;
+
+void test_worker_init (test_worker_t *args, void *ctx, const char *endpoint, char name = '0')
+{
+    memset (args, 0, sizeof (test_worker_t));
+    args->ctx = ctx;
+    args->endpoint = endpoint;
+    args->commands = "inproc://control";
+    args->name = name;
+}
+
+void test_worker (void *arg)
+{
+    test_worker_t *args = (test_worker_t *) arg;
+    void *worker = zmq_socket (args->ctx, ZMQ_DEALER);
+    assert (worker);
+    int rc;
+    if (args->secret_key) {
+        int as_server = 1;
+        rc = zmq_setsockopt (worker, ZMQ_CURVE_SERVER, &as_server, sizeof (int));
+        assert (rc == 0);
+        rc = zmq_setsockopt (worker, ZMQ_CURVE_SECRETKEY, args->secret_key, strlen (args->secret_key));
+        assert (rc == 0);
+    }
+    int linger = 0;
+    rc = zmq_setsockopt (worker, ZMQ_LINGER, &linger, sizeof (int));
+    assert (rc == 0);
+    rc = zmq_connect (worker, args->endpoint);
+    assert (rc == 0);
+
+    void *commands = zmq_socket (args->ctx, ZMQ_SUB);
+    assert (commands);
+    rc = zmq_setsockopt (commands, ZMQ_SUBSCRIBE, "", 0);
+    assert (rc == 0);
+    rc = zmq_connect (commands, args->commands);
+    assert (rc == 0);
+
+    zmq_pollitem_t items [] = { { worker, 0, ZMQ_POLLIN, 0 }, { commands, 0, ZMQ_POLLIN, 0 } };
+    char content [512];
+    bool run = true;
+    while (run) {
+        rc = zmq_poll (items, 2, -1);
+        assert (rc > 0);
+        if (items [1].revents & ZMQ_POLLIN) {
+            rc = zmq_recv (commands, content, sizeof content, 0);
+            if (rc == 10 && memcmp (content, "TERMINATE", 10) == 0)
+                run = false;
+            if (rc == 6 && memcmp (content, "LEAVE", 5) == 0 && content [5] == args->name)
+                run = false;
+        }
+        if (run && items [0].revents & ZMQ_POLLIN) {
+            int size = zmq_recv (worker, content, sizeof content, 0);
+            assert (size > 0 && size <= (int) sizeof content);
+            __atomic_fetch_add (&args->received, 1, __ATOMIC_RELAXED);
+            if (args->mute && size == (int) strlen (args->mute)
+            &&  memcmp (content, args->mute, size) == 0)
+                continue;
+            if (args->reply_delay)
+                msleep (args->reply_delay);
+            if (args->large && size == (int) strlen (args->large)
+            &&  memcmp (content, args->large, size) == 0) {
+                char *reply = (char *) malloc (args->large_size);
+                assert (reply);
+                memset (reply, args->name, args->large_size);
+                memcpy (reply, content, size);
+                rc = zmq_send (worker, reply, args->large_size, 0);
+                assert (rc == (int) args->large_size);
+                free (reply);
+                continue;
+            }
+            rc = zmq_send (worker, content, size, 0);
+            assert (rc == size);
+        }
+    }
+    rc = zmq_close (worker);
+    assert (rc == 0);
+    rc = zmq_close (commands);
+    assert (rc == 0);
+}
+
+//  A DEALER client of the proxy tests, with no linger and 5 seconds to wait
+//  for a reply, which does not come back once closed; a CURVE one with the
+//  keys. It sends its request, if any.
+void *test_client (void *ctx, const char *endpoint, const char *request = NULL,
+    const char *server_key = NULL, const char *public_key = NULL, const char *secret_key = NULL)
+{
+    void *client = zmq_socket (ctx, ZMQ_DEALER);
+    assert (client);
+    int rc;
+    if (server_key) {
+        rc = zmq_setsockopt (client, ZMQ_CURVE_SERVERKEY, server_key, strlen (server_key));
+        assert (rc == 0);
+        rc = zmq_setsockopt (client, ZMQ_CURVE_PUBLICKEY, public_key, strlen (public_key));
+        assert (rc == 0);
+        rc = zmq_setsockopt (client, ZMQ_CURVE_SECRETKEY, secret_key, strlen (secret_key));
+        assert (rc == 0);
+    }
+    int linger = 0;
+    rc = zmq_setsockopt (client, ZMQ_LINGER, &linger, sizeof (int));
+    assert (rc == 0);
+    int reconnect = -1;
+    rc = zmq_setsockopt (client, ZMQ_RECONNECT_IVL, &reconnect, sizeof (int));
+    assert (rc == 0);
+    int timeout = 5000;
+    rc = zmq_setsockopt (client, ZMQ_RCVTIMEO, &timeout, sizeof (int));
+    assert (rc == 0);
+    rc = zmq_connect (client, endpoint);
+    assert (rc == 0);
+    if (request) {
+        rc = zmq_send (client, request, strlen (request), 0);
+        assert (rc == (int) strlen (request));
+    }
+    return client;
+}
+
 
 #endif
@@ -0,0 +1,198 @@
+/*
+    Copyright (c) 2013 Contributors as noted in the AUTHORS file
+
+    This file is part of StreamQ-Proxy.
+
+    StreamQ-Proxy is free software; you can redistribute it and/or modify it
+    under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    StreamQ-Proxy is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+//  Live display of the metrics published by a running proxy.
+//
+//  Usage: proxy_stat [path [interval-ms [count]]]
+//
+//  The segment is only read: the proxy is never contacted, so running any
+//  number of readers has no effect on the forwarding loop.
+
+#include "../src/metrics.hpp"
+#include <stdlib.h>
+#include <signal.h>
+
+static char
+printc (char c)
+{
+    if (c < 32 || c == 127) return '.';
+    return c;
+}
+
+static void
+print_identity (const char *identity, size_t size)
+{
+    //  ZMQ_STREAM identities are binary: print them in hexadecimal
+    for (size_t i = 0; i < size; i++)
+        printf ("%02x", (uint8_t) identity [i]);
+    printf (" ");
+    for (size_t i = 0; i < size; i++)
+        printf ("%c", printc (identity [i]));
+}
+
+static double
+rate (uint64_t now, uint64_t before, double seconds)
+{
+    return seconds > 0 ? (double) (now - before) / seconds : 0;
+}
+
+int main (int argc, char *argv [])
+{
+    const char *path = argc > 1 ? argv [1] : METRICS_PATH;
+    int interval = argc > 2 ? atoi (argv [2]) : 1000;
+    int count = argc > 3 ? atoi (argv [3]) : 0;
+    if (interval <= 0) {
+        fprintf (stderr, "usage: proxy_stat [path [interval-ms [count]]]\n");
+        return 1;
+    }
+
+    const metrics_t *metrics = metrics_attach (path);
+    if (!metrics) {
+        fprintf (stderr, "proxy_stat: cannot map %s: %s\n", path,
+            errno == EPROTO ? "not a metrics segment of version "
+            "compatible with this reader" : strerror (errno));
+        return 1;
+    }
+
+    uint64_t msgs_c2w = metrics_get (&metrics->msgs_c2w);
+    uint64_t bytes_c2w = metrics_get (&metrics->bytes_c2w);
+    uint64_t msgs_w2c = metrics_get (&metrics->msgs_w2c);
+    uint64_t bytes_w2c = metrics_get (&metrics->bytes_w2c);
+    double seconds = (double) interval / 1000;
+
+    for (int i = 0; count == 0 || i < count; i++) {
+        usleep (interval * 1000);
+
+        bool alive = kill ((pid_t) metrics->pid, 0) == 0 || errno == EPERM;
+        printf ("proxy pid %llu%s, up %llus\n",
+            (unsigned long long) metrics->pid, alive ? "" : " (not running)",
+            (unsigned long long) (time (NULL) - metrics->start_time));
+        printf ("  sessions %llu (total %llu), handshakes %llu (total %llu), workers %llu\n",
+            (unsigned long long) metrics_get (&metrics->sessions),
+            (unsigned long long) metrics_get (&metrics->sessions_total),
+            (unsigned long long) metrics_get (&metrics->handshakes),
+            (unsigned long long) metrics_get (&metrics->handshakes_total),
+            (unsigned long long) metrics_get (&metrics->workers));
+        printf ("  queue %llu frames / %llu bytes, drops %llu, commands %llu (bad %llu)\n",
+            (unsigned long long) metrics_get (&metrics->queue_depth),
+            (unsigned long long) metrics_get (&metrics->queue_bytes),
+            (unsigned long long) metrics_get (&metrics->drops),
+            (unsigned long long) metrics_get (&metrics->commands),
+            (unsigned long long) metrics_get (&metrics->bad_commands));
+        if (metrics_get (&metrics->queue_overflows))
+            printf ("  clients closed on a full queue %llu\n",
+                (unsigned long long) metrics_get (&metrics->queue_overflows));
+        printf ("  affinity hits %llu, misses %llu\n",
+            (unsigned long long) metrics_get (&metrics->affinity_hits),
+            (unsigned long long) metrics_get (&metrics->affinity_misses));
+
+        printf ("  waiting %llu (total %llu), expired %llu, refused %llu\n",
+            (unsigned long long) metrics_get (&metrics->waiting),
+            (unsigned long long) metrics_get (&metrics->waiting_total),
+            (unsigned long long) metrics_get (&metrics->waiting_expired),
+            (unsigned long long) metrics_get (&metrics->waiting_refused));
+        if (metrics_get (&metrics->uplinks) || metrics_get (&metrics->uplinks_expired))
+            printf ("  uplinks %llu, expired %llu\n",
+                (unsigned long long) metrics_get (&metrics->uplinks),
+                (unsigned long long) metrics_get (&metrics->uplinks_expired));
+        if (metrics_get (&metrics->pool_started))
+            printf ("  pool %llu threads, started %llu, retired %llu\n",
+                (unsigned long long) metrics_get (&metrics->pool_threads),
+                (unsigned long long) metrics_get (&metrics->pool_started),
+                (unsigned long long) metrics_get (&metrics->pool_retired));
+        if (metrics_get (&metrics->drain_closed) || metrics_get (&metrics->drain_cut))
+            printf ("  drained %llu sessions, cut %llu\n",
+                (unsigned long long) metrics_get (&metrics->drain_closed),
+                (unsigned long long) metrics_get (&metrics->drain_cut));
+        histogram_t wait;
+        metrics_histogram (&metrics->wait, &wait);
+        if (wait.count) {
+            printf ("  ");
+            histogram_print (&wait, "wait", "usec");
+        }
+        for (int p = 0; p < METRICS_PHASES; p++) {
+            histogram_t phase;
+            metrics_histogram (&metrics->handshake [p], &phase);
+            if (!phase.count)
+                continue;
+            printf ("  handshake ");
+            histogram_print (&phase, metrics_phase_names [p], "usec");
+        }
+        for (int leg = 0; leg < METRICS_LEGS; leg++) {
+            histogram_t rtt;
+            metrics_histogram (&metrics->rtt [leg], &rtt);
+            if (!rtt.count)
+                continue;
+            printf ("  tcp rtt ");
+            histogram_print (&rtt, metrics_leg_names [leg], "usec");
+            printf ("  tcp %s retransmits %llu\n", metrics_leg_names [leg],
+                (unsigned long long) metrics_get (&metrics->tcp_retrans [leg]));
+        }
+
+        uint64_t msgs_c2w_now = metrics_get (&metrics->msgs_c2w);
+        uint64_t bytes_c2w_now = metrics_get (&metrics->bytes_c2w);
+        uint64_t msgs_w2c_now = metrics_get (&metrics->msgs_w2c);
+        uint64_t bytes_w2c_now = metrics_get (&metrics->bytes_w2c);
+        printf ("  client->worker %.0f msg/s %.0f B/s, worker->client %.0f msg/s %.0f B/s\n",
+            rate (msgs_c2w_now, msgs_c2w, seconds), rate (bytes_c2w_now, bytes_c2w, seconds),
+            rate (msgs_w2c_now, msgs_w2c, seconds), rate (bytes_w2c_now, bytes_w2c, seconds));
+        msgs_c2w = msgs_c2w_now;
+        bytes_c2w = bytes_c2w_now;
+        msgs_w2c = msgs_w2c_now;
+        bytes_w2c = bytes_w2c_now;
+
+        for (uint32_t w = 0; w < metrics->worker_slots; w++) {
+            const metrics_worker_t *slot = &metrics->worker [w];
+            char identity [METRICS_ID_SIZE_MAX];
+            size_t size = metrics_worker_identity (slot, identity);
+            if (!size)
+                continue;
+            printf ("  worker ");
+            print_identity (identity, size);
+            printf (": sessions %llu (total %llu), in %llu msg %llu B, out %llu msg %llu B\n",
+                (unsigned long long) metrics_get (&slot->sessions),
+                (unsigned long long) metrics_get (&slot->sessions_total),
+                (unsigned long long) metrics_get (&slot->msgs_in),
+                (unsigned long long) metrics_get (&slot->bytes_in),
+                (unsigned long long) metrics_get (&slot->msgs_out),
+                (unsigned long long) metrics_get (&slot->bytes_out));
+            if (!metrics_get (&metrics->tcp_samples))
+                continue;
+            for (int leg = 0; leg < METRICS_LEGS; leg++) {
+                const metrics_tcp_t *tcp = &slot->tcp [leg];
+                printf ("%s %s rtt %llu/%llu usec, unacked %llu, notsent %llu B, retransmits %llu",
+                    leg ? "," : "    tcp", metrics_leg_names [leg],
+                    (unsigned long long) metrics_get (&tcp->rtt),
+                    (unsigned long long) metrics_get (&tcp->rttvar),
+                    (unsigned long long) metrics_get (&tcp->unacked),
+                    (unsigned long long) metrics_get (&tcp->notsent),
+                    (unsigned long long) metrics_get (&tcp->retrans));
+            }
+            printf ("\n");
+        }
+        if (metrics_get (&metrics->workers_unslotted))
+            printf ("  %llu more workers beyond the %u slots, in the totals only\n",
+                (unsigned long long) metrics_get (&metrics->workers_unslotted),
+                (unsigned) metrics->worker_slots);
+        fflush (stdout);
+    }
+
+    metrics_close (metrics);
+    return 0;
+}